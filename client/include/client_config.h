@@ -71,6 +71,11 @@ struct KcpConfig {
   std::uint32_t min_rto{30};
   std::uint32_t request_timeout_ms{5000};
   std::uint32_t session_idle_sec{60};
+  // Ask the server for Reed-Solomon FEC under KCP (lossy links, voice).
+  bool fec{false};
+  std::uint32_t fec_data_shards{8};
+  std::uint32_t fec_parity_shards{3};
+  bool fec_adaptive{true};
 };
 
 struct ClientConfig {
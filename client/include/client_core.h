@@ -121,6 +121,21 @@ class ClientCore {
     std::string sender;
     std::uint8_t media_flags{0};
     std::uint64_t ts_ms{0};
+    // Set on roster events (op 7): net join/leave/update per member.
+    struct RosterChange {
+      std::string username;
+      std::uint8_t op{0};
+      std::uint8_t media_flags{0};
+    };
+    std::vector<RosterChange> roster;
+  };
+
+  struct GroupCallSubscription {
+    std::string sender;
+    bool audio{true};
+    bool video{true};
+    // Preferred simulcast layer of the sender's video, 0 being the lowest.
+    std::uint8_t video_layer{2};
   };
 
   struct OutgoingChatTextMessage {
@@ -329,6 +344,13 @@ class ClientCore {
                      std::uint32_t& out_key_id);
   bool LeaveGroupCall(const std::string& group_id,
                       const std::array<std::uint8_t, 16>& call_id);
+  // Replaces this member's subscriptions in the call. The relay moves each
+  // sender's video to the preferred layer at that layer's next keyframe.
+  bool UpdateGroupCallSubscriptions(
+      const std::string& group_id,
+      const std::array<std::uint8_t, 16>& call_id,
+      bool video,
+      const std::vector<GroupCallSubscription>& subscriptions);
   bool RotateGroupCallKey(const std::string& group_id,
                           const std::array<std::uint8_t, 16>& call_id,
                           std::uint32_t key_id,
@@ -354,6 +376,8 @@ class ClientCore {
                        std::uint32_t key_id,
                        std::array<std::uint8_t, 32>& out_key) const;
 
+  static std::vector<std::uint8_t> EncodeGroupCallSubscriptions(
+      const std::vector<GroupCallSubscription>& subscriptions);
   static std::vector<std::uint8_t> BuildGroupCallKeyDistSigMessage(
       const std::string& group_id,
       const std::array<std::uint8_t, 16>& call_id,
@@ -20,6 +20,9 @@ struct GroupCallSessionConfig {
   std::uint32_t key_id{1};
   bool enable_audio{true};
   bool enable_video{true};
+  // Simulcast layers this member publishes (1 to kMediaMaxLayers); with more
+  // than one, every video packet carries its layer.
+  std::uint8_t video_layers{1};
   std::uint64_t audio_delay_ms{60};
   std::uint64_t video_delay_ms{120};
   std::size_t audio_max_frames{256};
@@ -44,6 +47,16 @@ class GroupCallSession {
   bool SendVideoFrame(const std::vector<std::uint8_t>& payload,
                       std::uint64_t timestamp_ms,
                       std::uint8_t flags = 0);
+  // One simulcast layer (< video_layers) of a video frame, 0 being the
+  // lowest; each subscriber is forwarded the layer it prefers.
+  bool SendVideoLayerFrame(std::uint8_t layer,
+                           const std::vector<std::uint8_t>& payload,
+                           std::uint64_t timestamp_ms,
+                           std::uint8_t flags = 0);
+
+  bool UpdateSubscriptions(
+      const std::vector<mi::client::ClientCore::GroupCallSubscription>& subs,
+      std::string& error);
 
   bool PollIncoming(std::uint32_t max_packets,
                     std::uint32_t wait_ms,
@@ -58,12 +71,14 @@ class GroupCallSession {
   struct SenderState {
     std::uint32_t key_id{0};
     std::unique_ptr<MediaRatchet> audio_recv;
-    std::unique_ptr<MediaRatchet> video_recv;
+    std::array<std::unique_ptr<MediaRatchet>, mi::media::kMediaMaxLayers>
+        video_recv;
     MediaJitterBuffer audio_jitter;
     MediaJitterBuffer video_jitter;
   };
 
   bool SendFrame(mi::media::StreamKind kind,
+                 std::uint8_t layer,
                  const std::vector<std::uint8_t>& payload,
                  std::uint64_t timestamp_ms,
                  std::uint8_t flags);
@@ -78,7 +93,8 @@ class GroupCallSession {
   GroupCallSessionConfig config_;
   std::uint32_t active_key_id_{0};
   std::unique_ptr<MediaRatchet> audio_send_;
-  std::unique_ptr<MediaRatchet> video_send_;
+  std::array<std::unique_ptr<MediaRatchet>, mi::media::kMediaMaxLayers>
+      video_send_;
   std::unordered_map<std::string, SenderState> senders_;
   std::vector<std::uint8_t> audio_packet_buf_;
   std::vector<std::uint8_t> video_packet_buf_;
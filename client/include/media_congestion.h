@@ -0,0 +1,140 @@
+#ifndef MI_E2EE_CLIENT_MEDIA_CONGESTION_H
+#define MI_E2EE_CLIENT_MEDIA_CONGESTION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace mi::client::media {
+
+constexpr std::uint8_t kTransportFeedbackVersion = 1;
+constexpr std::size_t kTransportFeedbackMaxPackets = 1024;
+
+// Receiver report over a run of transport sequence numbers starting at
+// base_seq. Arrival times are on the receiver's clock; only their deltas
+// matter to the sender.
+struct TransportFeedback {
+  struct Packet {
+    bool received{false};
+    std::uint32_t arrival_ms{0};
+  };
+  std::uint16_t base_seq{0};
+  std::vector<Packet> packets;
+};
+
+bool EncodeTransportFeedback(const TransportFeedback& feedback,
+                             std::vector<std::uint8_t>& out);
+bool DecodeTransportFeedback(const std::vector<std::uint8_t>& data,
+                             TransportFeedback& out);
+
+// Receiver side: collects arrivals and emits a report of everything since
+// the previous one. A packet arriving after its slot was reported lost is
+// not reported again.
+class TransportFeedbackBuilder {
+ public:
+  void OnPacket(std::uint16_t transport_seq, std::uint64_t arrival_ms);
+  bool Build(TransportFeedback& out);
+  bool pending() const { return !arrivals_.empty(); }
+
+ private:
+  std::int64_t Unwrap(std::uint16_t seq);
+
+  std::map<std::int64_t, std::uint64_t> arrivals_;
+  std::int64_t next_base_{-1};
+  std::int64_t last_unwrapped_{-1};
+};
+
+enum class BandwidthUsage : std::uint8_t {
+  kNormal = 0,
+  kUnderusing = 1,
+  kOverusing = 2,
+};
+
+struct BandwidthEstimatorConfig {
+  std::uint32_t start_bps{300000};
+  std::uint32_t min_bps{30000};
+  std::uint32_t max_bps{2500000};
+};
+
+// Sender side, GCC-style: a trendline over inter-group delay variation with
+// an adaptive overuse threshold drives an AIMD rate controller, capped by a
+// loss-based controller. Times are in ms on the caller's clock.
+class SendSideBandwidthEstimator {
+ public:
+  explicit SendSideBandwidthEstimator(BandwidthEstimatorConfig config = {});
+
+  void OnPacketSent(std::uint16_t transport_seq,
+                    std::uint64_t send_ms,
+                    std::size_t bytes);
+  void OnFeedback(const TransportFeedback& feedback, std::uint64_t now_ms);
+
+  std::uint32_t target_bps() const { return target_bps_; }
+  std::uint32_t acked_bps() const { return acked_bps_; }
+  double loss_ratio() const { return loss_ratio_; }
+  BandwidthUsage usage() const { return usage_; }
+  bool has_feedback() const { return has_feedback_; }
+
+ private:
+  struct SentPacket {
+    std::uint64_t send_ms{0};
+    std::size_t bytes{0};
+  };
+  struct PacketGroup {
+    std::uint64_t first_send_ms{0};
+    std::uint64_t last_send_ms{0};
+    std::uint64_t arrival_ms{0};
+    bool valid{false};
+  };
+  struct Acked {
+    std::uint64_t arrival_ms{0};
+    std::size_t bytes{0};
+  };
+
+  std::int64_t UnwrapSent(std::uint16_t seq);
+  void OnArrival(const SentPacket& sent, std::uint64_t arrival_ms);
+  void OnGroupDelta(double send_delta_ms,
+                    double arrival_delta_ms,
+                    std::uint64_t arrival_ms);
+  void Detect(double trend, double group_ms, std::uint64_t arrival_ms);
+  void UpdateRate(std::uint64_t now_ms);
+
+  BandwidthEstimatorConfig config_;
+  std::map<std::int64_t, SentPacket> sent_;
+  std::int64_t last_sent_unwrapped_{-1};
+
+  PacketGroup current_;
+  PacketGroup previous_;
+  double accumulated_delay_ms_{0.0};
+  double smoothed_delay_ms_{0.0};
+  std::deque<std::pair<double, double>> trend_window_;
+  std::uint64_t first_arrival_ms_{0};
+  bool has_first_arrival_{false};
+  std::size_t delta_count_{0};
+
+  double threshold_{12.5};
+  double prev_trend_{0.0};
+  std::uint64_t last_threshold_ms_{0};
+  double overuse_ms_{-1.0};
+  int overuse_count_{0};
+  BandwidthUsage usage_{BandwidthUsage::kNormal};
+
+  std::deque<Acked> acked_;
+  std::size_t acked_bytes_{0};
+  std::uint32_t acked_bps_{0};
+
+  double loss_ratio_{0.0};
+  double delay_bps_{0.0};
+  double loss_cap_bps_{0.0};
+  std::uint32_t target_bps_{0};
+  std::uint64_t last_update_ms_{0};
+  std::uint64_t last_decrease_ms_{0};
+  std::uint64_t last_loss_decrease_ms_{0};
+  bool has_feedback_{false};
+};
+
+}  // namespace mi::client::media
+
+#endif  // MI_E2EE_CLIENT_MEDIA_CONGESTION_H
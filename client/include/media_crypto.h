@@ -13,10 +13,23 @@
 namespace mi::client::media {
 
 constexpr std::uint8_t kMediaPacketVersion = 3;
+// v4 adds a cleartext simulcast layer byte after the kind.
+constexpr std::uint8_t kMediaPacketLayeredVersion = 4;
+// v5 adds a transport-wide sequence number and send time after the layer
+// byte, so the receiver can report arrival times back to the sender.
+constexpr std::uint8_t kMediaPacketTransportVersion = 5;
+
+struct MediaTransportInfo {
+  std::uint16_t seq{0};
+  std::uint32_t send_time_ms{0};
+};
 
 struct MediaPacket {
   std::uint8_t version{kMediaPacketVersion};
   mi::media::StreamKind kind{mi::media::StreamKind::kAudio};
+  std::uint8_t layer{0};
+  bool keyframe{false};
+  MediaTransportInfo transport;
   std::uint32_t key_id{1};
   std::uint32_t seq{0};
   std::array<std::uint8_t, 16> tag{};
@@ -38,10 +51,21 @@ bool PeekMediaPacketHeaderWithKeyId(const std::vector<std::uint8_t>& data,
                                     std::uint32_t& out_key_id,
                                     std::uint32_t& out_seq);
 
+bool PeekMediaPacketTransport(const std::vector<std::uint8_t>& data,
+                              MediaTransportInfo& out);
+// Simulcast layer of a v4/v5 packet; older packets are layer 0.
+bool PeekMediaPacketLayer(const std::vector<std::uint8_t>& data,
+                          std::uint8_t& out_layer);
+
 bool DeriveStreamChainKeys(const std::array<std::uint8_t, 32>& media_root,
                            mi::media::StreamKind kind,
                            bool initiator,
                            MediaKeyPair& out_keys);
+// Each simulcast layer has its own chain, so a subscriber that only gets one
+// layer sees no sequence gaps. Layer 0 keeps the stream chain key itself.
+bool DeriveLayerChainKey(const std::array<std::uint8_t, 32>& stream_ck,
+                         std::uint8_t layer,
+                         std::array<std::uint8_t, 32>& out_ck);
 
 class MediaRatchet {
  public:
@@ -53,6 +77,17 @@ class MediaRatchet {
   bool EncryptFrame(const mi::media::MediaFrame& frame,
                     std::vector<std::uint8_t>& out_packet,
                     std::string& error);
+  // Simulcast senders tag each packet with its layer (< kMediaMaxLayers).
+  bool EncryptFrame(const mi::media::MediaFrame& frame,
+                    std::uint8_t layer,
+                    std::vector<std::uint8_t>& out_packet,
+                    std::string& error);
+  // Same, also stamped with the sender's transport-wide sequence and clock.
+  bool EncryptFrame(const mi::media::MediaFrame& frame,
+                    std::uint8_t layer,
+                    const MediaTransportInfo& transport,
+                    std::vector<std::uint8_t>& out_packet,
+                    std::string& error);
 
   bool DecryptFrame(const std::vector<std::uint8_t>& packet,
                     mi::media::MediaFrame& out_frame,
@@ -61,6 +96,10 @@ class MediaRatchet {
   std::uint32_t next_seq() const { return next_seq_; }
 
  private:
+  bool EncryptPacket(const mi::media::MediaFrame& frame,
+                     MediaPacket packet,
+                     std::vector<std::uint8_t>& out_packet,
+                     std::string& error);
   bool DeriveMessageKey(std::uint32_t seq, std::array<std::uint8_t, 32>& out_mk,
                         std::string& error);
   void StoreSkipped(std::uint32_t seq, const std::array<std::uint8_t, 32>& mk);
@@ -5,10 +5,12 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "client_core.h"
+#include "media_congestion.h"
 #include "media_crypto.h"
 #include "media_jitter_buffer.h"
 
@@ -26,6 +28,12 @@ struct MediaSessionStats {
   MediaStreamStats video;
 };
 
+struct MediaBandwidthEstimate {
+  std::uint32_t target_bps{0};  // audio + video
+  std::uint32_t audio_bps{0};   // what audio is currently sending
+  double loss_ratio{0.0};
+};
+
 struct MediaSessionConfig {
   std::string peer_username;
   std::array<std::uint8_t, 16> call_id{};
@@ -36,6 +44,10 @@ struct MediaSessionConfig {
   std::uint64_t video_delay_ms{120};
   std::size_t audio_max_frames{256};
   std::size_t video_max_frames{256};
+  // Stamp v5 transport headers and exchange arrival feedback with the peer.
+  bool transport_feedback{true};
+  std::uint64_t feedback_interval_ms{100};
+  BandwidthEstimatorConfig bandwidth;
 };
 
 class MediaSessionInterface {
@@ -54,6 +66,11 @@ class MediaSessionInterface {
   virtual const MediaSessionStats& stats() const = 0;
   virtual const MediaJitterStats& audio_jitter_stats() const = 0;
   virtual const MediaJitterStats& video_jitter_stats() const = 0;
+  // Send-side estimate from the peer's feedback; false until some arrived.
+  virtual bool GetBandwidthEstimate(MediaBandwidthEstimate& out) const {
+    (void)out;
+    return false;
+  }
 };
 
 class MediaSession : public MediaSessionInterface {
@@ -85,6 +102,7 @@ class MediaSession : public MediaSessionInterface {
   const MediaJitterStats& video_jitter_stats() const override {
     return video_jitter_.stats();
   }
+  bool GetBandwidthEstimate(MediaBandwidthEstimate& out) const override;
 
  private:
   bool SendFrame(mi::media::StreamKind kind,
@@ -95,6 +113,9 @@ class MediaSession : public MediaSessionInterface {
   bool HandleIncomingPacket(const std::string& sender,
                             const std::vector<std::uint8_t>& packet,
                             std::string& error);
+  bool HandleFeedback(const std::vector<std::uint8_t>& packet,
+                      std::string& error);
+  void MaybeSendFeedback(std::uint64_t now_ms);
 
   mi::client::ClientCore& core_;
   MediaSessionConfig config_;
@@ -103,12 +124,25 @@ class MediaSession : public MediaSessionInterface {
   std::unique_ptr<MediaRatchet> audio_recv_;
   std::unique_ptr<MediaRatchet> video_send_;
   std::unique_ptr<MediaRatchet> video_recv_;
+  std::unique_ptr<MediaRatchet> feedback_send_;
+  std::unique_ptr<MediaRatchet> feedback_recv_;
   MediaJitterBuffer audio_jitter_;
   MediaJitterBuffer video_jitter_;
   MediaSessionStats stats_{};
   bool ready_{false};
   std::vector<std::uint8_t> audio_packet_buf_;
   std::vector<std::uint8_t> video_packet_buf_;
+
+  // Receive side of transport feedback, owned by the polling thread.
+  TransportFeedbackBuilder feedback_builder_;
+  std::uint64_t last_feedback_ms_{0};
+  // Send side, shared by the audio and video senders and the poller.
+  mutable std::mutex congestion_mutex_;
+  std::uint16_t transport_seq_{0};
+  SendSideBandwidthEstimator bwe_;
+  std::uint64_t audio_window_ms_{0};
+  std::size_t audio_window_bytes_{0};
+  std::uint32_t audio_send_bps_{0};
 };
 
 }  // namespace mi::client::media
@@ -270,6 +270,14 @@ bool LoadClientConfig(const std::string& path, ClientConfig& out_cfg,
         ParseUint32(val, out_cfg.kcp.request_timeout_ms);
       } else if (key == "session_idle_sec") {
         ParseUint32(val, out_cfg.kcp.session_idle_sec);
+      } else if (key == "fec") {
+        ParseBool(val, out_cfg.kcp.fec);
+      } else if (key == "fec_data_shards") {
+        ParseUint32(val, out_cfg.kcp.fec_data_shards);
+      } else if (key == "fec_parity_shards") {
+        ParseUint32(val, out_cfg.kcp.fec_parity_shards);
+      } else if (key == "fec_adaptive") {
+        ParseBool(val, out_cfg.kcp.fec_adaptive);
       }
     }
   }
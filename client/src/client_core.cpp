@@ -54,6 +54,7 @@
 #include "miniz.h"
 #include "opaque_pake.h"
 #include "ikcp.h"
+#include "kcp_fec.h"
 
 extern "C" {
 int PQCLEAN_MLKEM768_CLEAN_crypto_kem_keypair(std::uint8_t* pk,
@@ -85,6 +86,7 @@ constexpr std::uint8_t kKcpCookieCmd = 0xFF;
 constexpr std::uint8_t kKcpCookieHello = 1;
 constexpr std::uint8_t kKcpCookieChallenge = 2;
 constexpr std::uint8_t kKcpCookieResponse = 3;
+constexpr std::uint8_t kKcpCookieFlagFec = 0x01;
 constexpr std::size_t kKcpCookieBytes = 16;
 constexpr std::size_t kKcpCookiePacketBytes = 24;
 
@@ -1280,6 +1282,12 @@ constexpr std::uint8_t kGroupCallOpLeave = 3;
 constexpr std::uint8_t kGroupCallOpEnd = 4;
 constexpr std::uint8_t kGroupCallOpUpdate = 5;
 constexpr std::uint8_t kGroupCallOpPing = 6;
+constexpr std::uint8_t kGroupCallOpRoster = 7;
+constexpr std::uint8_t kGroupCallMediaAudio = 0x01;
+constexpr std::uint8_t kGroupCallMediaVideo = 0x02;
+// Subscription flags carry (preferred video layer + 1) in bits 4-5.
+constexpr std::uint8_t kGroupCallLayerShift = 4;
+constexpr std::uint8_t kGroupCallMaxLayers = 3;
 
 constexpr std::size_t kChatHeaderSize = sizeof(kChatMagic) + 1 + 1 + 16;
 constexpr std::size_t kChatSeenLimit = 4096;
@@ -4842,6 +4850,28 @@ bool ClientCore::DecodeGroupCallKeyDist(
                                     out_key_id, out_call_key, out_sig);
 }
 
+std::vector<std::uint8_t> ClientCore::EncodeGroupCallSubscriptions(
+    const std::vector<GroupCallSubscription>& subscriptions) {
+  std::vector<std::uint8_t> out;
+  mi::server::proto::WriteUint32(
+      static_cast<std::uint32_t>(subscriptions.size()), out);
+  for (const auto& sub : subscriptions) {
+    mi::server::proto::WriteString(sub.sender, out);
+    std::uint8_t flags = 0;
+    if (sub.audio) {
+      flags |= kGroupCallMediaAudio;
+    }
+    if (sub.video) {
+      flags |= kGroupCallMediaVideo;
+    }
+    const std::uint8_t layer =
+        std::min<std::uint8_t>(sub.video_layer, kGroupCallMaxLayers - 1);
+    flags |= static_cast<std::uint8_t>((layer + 1) << kGroupCallLayerShift);
+    out.push_back(flags);
+  }
+  return out;
+}
+
 bool ClientCore::EncodeGroupCallKeyReq(
     const std::array<std::uint8_t, 16>& msg_id,
     const std::string& group_id,
@@ -4882,6 +4912,7 @@ struct ClientCore::RemoteStream {
   std::string pinned_fingerprint;
 
   ikcpcb* kcp{nullptr};
+  std::unique_ptr<mi::shard::KcpFec> kcp_fec;
   std::uint32_t kcp_conv{0};
   std::vector<std::uint8_t> kcp_recv_buf;
   std::chrono::steady_clock::time_point kcp_last_active{};
@@ -4931,7 +4962,11 @@ struct ClientCore::RemoteStream {
           kcp_cfg.nc != kcp_cfg_in.nc ||
           kcp_cfg.min_rto != kcp_cfg_in.min_rto ||
           kcp_cfg.request_timeout_ms != kcp_cfg_in.request_timeout_ms ||
-          kcp_cfg.session_idle_sec != kcp_cfg_in.session_idle_sec) {
+          kcp_cfg.session_idle_sec != kcp_cfg_in.session_idle_sec ||
+          kcp_cfg.fec != kcp_cfg_in.fec ||
+          kcp_cfg.fec_data_shards != kcp_cfg_in.fec_data_shards ||
+          kcp_cfg.fec_parity_shards != kcp_cfg_in.fec_parity_shards ||
+          kcp_cfg.fec_adaptive != kcp_cfg_in.fec_adaptive) {
         return false;
       }
     }
@@ -4945,6 +4980,7 @@ struct ClientCore::RemoteStream {
       ikcp_release(kcp);
       kcp = nullptr;
     }
+    kcp_fec.reset();
     kcp_recv_buf.clear();
     kcp_conv = 0;
     kcp_last_active = {};
@@ -4964,11 +5000,16 @@ struct ClientCore::RemoteStream {
     plain_off = 0;
   }
 
-  static int KcpOutput(const char* buf, int len, ikcpcb* /*kcp*/, void* user) {
+  static int KcpOutput(const char* buf, int len, ikcpcb* kcp, void* user) {
     if (!buf || len <= 0 || !user) {
       return -1;
     }
     auto* self = static_cast<RemoteStream*>(user);
+    if (self->kcp_fec) {
+      self->kcp_fec->Send(reinterpret_cast<const std::uint8_t*>(buf),
+                          static_cast<std::size_t>(len), kcp->current);
+      return 0;
+    }
 #ifdef _WIN32
     const int sent = ::send(self->sock, buf, len, 0);
     return sent == len ? 0 : -1;
@@ -4978,6 +5019,23 @@ struct ClientCore::RemoteStream {
 #endif
   }
 
+  static void FecOutput(const std::uint8_t* data, std::size_t len,
+                        void* user) {
+    auto* self = static_cast<RemoteStream*>(user);
+#ifdef _WIN32
+    ::send(self->sock, reinterpret_cast<const char*>(data),
+           static_cast<int>(len), 0);
+#else
+    ::send(self->sock, data, len, 0);
+#endif
+  }
+
+  static void FecInput(const std::uint8_t* data, std::size_t len, void* user) {
+    auto* self = static_cast<RemoteStream*>(user);
+    ikcp_input(self->kcp, reinterpret_cast<const char*>(data),
+               static_cast<long>(len));
+  }
+
   bool ConnectPlain(std::string& error) {
     error.clear();
     if (host.empty() || port == 0) {
@@ -5340,21 +5398,21 @@ struct ClientCore::RemoteStream {
              (static_cast<std::uint32_t>(in[3]) << 24);
     };
     auto build_cookie_packet =
-        [&](std::uint8_t type,
+        [&](std::uint8_t type, std::uint8_t flags,
             const std::array<std::uint8_t, kKcpCookieBytes>& cookie,
             std::array<std::uint8_t, kKcpCookiePacketBytes>& out) {
           write_le32(conv, out.data());
           out[4] = kKcpCookieCmd;
           out[5] = type;
-          out[6] = 0;
+          out[6] = flags;
           out[7] = 0;
           std::memcpy(out.data() + 8, cookie.data(), cookie.size());
         };
     auto send_cookie_packet =
-        [&](std::uint8_t type,
+        [&](std::uint8_t type, std::uint8_t flags,
             const std::array<std::uint8_t, kKcpCookieBytes>& cookie) -> bool {
           std::array<std::uint8_t, kKcpCookiePacketBytes> out{};
-          build_cookie_packet(type, cookie, out);
+          build_cookie_packet(type, flags, cookie, out);
 #ifdef _WIN32
           return ::send(sock, reinterpret_cast<const char*>(out.data()),
                         static_cast<int>(out.size()), 0) ==
@@ -5365,7 +5423,8 @@ struct ClientCore::RemoteStream {
 #endif
         };
 
-    if (!send_cookie_packet(kKcpCookieHello, {})) {
+    const std::uint8_t want_flags = kcp_cfg.fec ? kKcpCookieFlagFec : 0;
+    if (!send_cookie_packet(kKcpCookieHello, want_flags, {})) {
       error = "kcp cookie hello failed";
       Close();
       return false;
@@ -5373,6 +5432,7 @@ struct ClientCore::RemoteStream {
 
     const auto start = std::chrono::steady_clock::now();
     std::array<std::uint8_t, kKcpCookieBytes> cookie{};
+    std::uint8_t granted_flags = 0;
     bool got_cookie = false;
     while (true) {
       std::uint8_t buf[64] = {};
@@ -5387,6 +5447,7 @@ struct ClientCore::RemoteStream {
             buf[4] == kKcpCookieCmd && read_le32(buf) == conv &&
             buf[5] == kKcpCookieChallenge) {
           std::memcpy(cookie.data(), buf + 8, cookie.size());
+          granted_flags = static_cast<std::uint8_t>(buf[6] & want_flags);
           got_cookie = true;
           break;
         }
@@ -5415,7 +5476,7 @@ struct ClientCore::RemoteStream {
     }
 
     if (!got_cookie ||
-        !send_cookie_packet(kKcpCookieResponse, cookie)) {
+        !send_cookie_packet(kKcpCookieResponse, granted_flags, cookie)) {
       error = "kcp cookie response failed";
       Close();
       return false;
@@ -5429,7 +5490,17 @@ struct ClientCore::RemoteStream {
       return false;
     }
     kcp->output = KcpOutput;
-    ikcp_setmtu(kcp, static_cast<int>(kcp_cfg.mtu));
+    std::uint32_t mtu = kcp_cfg.mtu;
+    if ((granted_flags & kKcpCookieFlagFec) != 0) {
+      mi::shard::FecConfig fec_cfg;
+      fec_cfg.data_shards = kcp_cfg.fec_data_shards;
+      fec_cfg.parity_shards = kcp_cfg.fec_parity_shards;
+      fec_cfg.adaptive = kcp_cfg.fec_adaptive;
+      kcp_fec = std::make_unique<mi::shard::KcpFec>(conv, fec_cfg, FecOutput,
+                                                    FecInput, this);
+      mtu -= static_cast<std::uint32_t>(mi::shard::kFecOverhead);
+    }
+    ikcp_setmtu(kcp, static_cast<int>(mtu));
     ikcp_wndsize(kcp, static_cast<int>(kcp_cfg.snd_wnd),
                  static_cast<int>(kcp_cfg.rcv_wnd));
     ikcp_nodelay(kcp, static_cast<int>(kcp_cfg.nodelay),
@@ -5708,7 +5779,12 @@ struct ClientCore::RemoteStream {
           }
 #endif
           if (n > 0) {
-            ikcp_input(kcp, reinterpret_cast<const char*>(datagram.data()), n);
+            if (!kcp_fec ||
+                !kcp_fec->Receive(datagram.data(),
+                                  static_cast<std::size_t>(n))) {
+              ikcp_input(kcp, reinterpret_cast<const char*>(datagram.data()),
+                         n);
+            }
             kcp_last_active = std::chrono::steady_clock::now();
           } else {
             break;
@@ -5727,13 +5803,21 @@ struct ClientCore::RemoteStream {
           out_bytes.clear();
         }
 
-        const std::uint32_t check = ikcp_check(kcp, now_ms);
+        std::uint32_t check = ikcp_check(kcp, now_ms);
+        if (kcp_fec && kcp_fec->pending() &&
+            static_cast<std::int32_t>(kcp_fec->deadline() - check) < 0) {
+          check = kcp_fec->deadline();
+        }
         const std::uint32_t wait_ms =
             check > now_ms ? (check - now_ms) : 1u;
         const std::uint32_t remaining = timeout_ms - (now_ms - start_ms);
         const std::uint32_t sleep_ms = std::min(wait_ms, remaining);
         WaitForReadable(sock, sleep_ms);
-        ikcp_update(kcp, NowMs());
+        const std::uint32_t update_ms = NowMs();
+        ikcp_update(kcp, update_ms);
+        if (kcp_fec) {
+          kcp_fec->Poll(update_ms);
+        }
       }
     }
 #ifdef _WIN32
@@ -11033,6 +11117,24 @@ bool ClientCore::LeaveGroupCall(const std::string& group_id,
   return true;
 }
 
+bool ClientCore::UpdateGroupCallSubscriptions(
+    const std::string& group_id,
+    const std::array<std::uint8_t, 16>& call_id,
+    bool video,
+    const std::vector<GroupCallSubscription>& subscriptions) {
+  last_error_.clear();
+  for (const auto& sub : subscriptions) {
+    if (sub.sender.empty() || sub.video_layer >= kGroupCallMaxLayers) {
+      last_error_ = "subscription invalid";
+      return false;
+    }
+  }
+  const auto resp = SendGroupCallSignal(
+      kGroupCallOpPing, group_id, call_id, video, 0, 0, 0,
+      EncodeGroupCallSubscriptions(subscriptions));
+  return resp.success;
+}
+
 bool ClientCore::RotateGroupCallKey(
     const std::string& group_id,
     const std::array<std::uint8_t, 16>& call_id,
@@ -11190,6 +11292,30 @@ std::vector<ClientCore::GroupCallEvent> ClientCore::PullGroupCallEvents(
     }
     out.push_back(std::move(ev));
   }
+  for (auto& ev : out) {
+    if (ev.op != kGroupCallOpRoster || !last_error_.empty()) {
+      continue;
+    }
+    std::uint32_t changes = 0;
+    if (!mi::server::proto::ReadUint32(resp_payload, off, changes) ||
+        changes > resp_payload.size() - off) {
+      last_error_ = "group call pull response invalid";
+      break;
+    }
+    ev.roster.reserve(changes);
+    for (std::uint32_t i = 0; i < changes; ++i) {
+      GroupCallEvent::RosterChange change;
+      if (!mi::server::proto::ReadString(resp_payload, off,
+                                         change.username) ||
+          resp_payload.size() - off < 2) {
+        last_error_ = "group call pull response invalid";
+        break;
+      }
+      change.op = resp_payload[off++];
+      change.media_flags = resp_payload[off++];
+      ev.roster.push_back(std::move(change));
+    }
+  }
   return out;
 }
 
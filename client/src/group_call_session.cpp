@@ -16,13 +16,16 @@ bool BuildRatchetsForKey(const std::array<std::uint8_t, 32>& call_key,
                          std::uint32_t key_id,
                          mi::media::StreamKind kind,
                          std::unique_ptr<MediaRatchet>& out_send,
-                         std::unique_ptr<MediaRatchet>& out_recv) {
+                         std::unique_ptr<MediaRatchet>& out_recv,
+                         std::uint8_t layer = 0) {
   MediaKeyPair keys;
-  if (!DeriveStreamChainKeys(call_key, kind, true, keys)) {
+  std::array<std::uint8_t, 32> ck{};
+  if (!DeriveStreamChainKeys(call_key, kind, true, keys) ||
+      !DeriveLayerChainKey(keys.send_ck, layer, ck)) {
     return false;
   }
-  out_send = std::make_unique<MediaRatchet>(keys.send_ck, kind, 0, key_id);
-  out_recv = std::make_unique<MediaRatchet>(keys.send_ck, kind, 0, key_id);
+  out_send = std::make_unique<MediaRatchet>(ck, kind, 0, key_id);
+  out_recv = std::make_unique<MediaRatchet>(ck, kind, 0, key_id);
   return true;
 }
 }  // namespace
@@ -42,6 +45,11 @@ bool GroupCallSession::Init(std::string& error) {
     error = "call id empty";
     return false;
   }
+  if (config_.video_layers == 0 ||
+      config_.video_layers > mi::media::kMediaMaxLayers) {
+    error = "video layers invalid";
+    return false;
+  }
   if (!SetActiveKey(config_.key_id, error)) {
     return false;
   }
@@ -71,11 +79,13 @@ bool GroupCallSession::SetActiveKey(std::uint32_t key_id, std::string& error) {
     }
   }
   if (config_.enable_video) {
-    std::unique_ptr<MediaRatchet> dummy;
-    if (!BuildRatchetsForKey(call_key, key_id, mi::media::StreamKind::kVideo,
-                             video_send_, dummy)) {
-      error = "video key derive failed";
-      return false;
+    for (std::uint8_t layer = 0; layer < config_.video_layers; ++layer) {
+      std::unique_ptr<MediaRatchet> dummy;
+      if (!BuildRatchetsForKey(call_key, key_id, mi::media::StreamKind::kVideo,
+                               video_send_[layer], dummy, layer)) {
+        error = "video key derive failed";
+        return false;
+      }
     }
   }
   active_key_id_ = key_id;
@@ -83,6 +93,7 @@ bool GroupCallSession::SetActiveKey(std::uint32_t key_id, std::string& error) {
 }
 
 bool GroupCallSession::SendFrame(mi::media::StreamKind kind,
+                                 std::uint8_t layer,
                                  const std::vector<std::uint8_t>& payload,
                                  std::uint64_t timestamp_ms,
                                  std::uint8_t flags) {
@@ -97,8 +108,9 @@ bool GroupCallSession::SendFrame(mi::media::StreamKind kind,
   if (kind == mi::media::StreamKind::kAudio) {
     ratchet = audio_send_.get();
     packet = &audio_packet_buf_;
-  } else if (kind == mi::media::StreamKind::kVideo) {
-    ratchet = video_send_.get();
+  } else if (kind == mi::media::StreamKind::kVideo &&
+             layer < config_.video_layers) {
+    ratchet = video_send_[layer].get();
     packet = &video_packet_buf_;
   }
   if (!ratchet || !packet) {
@@ -113,7 +125,11 @@ bool GroupCallSession::SendFrame(mi::media::StreamKind kind,
   frame.payload = payload;
 
   std::string err;
-  if (!ratchet->EncryptFrame(frame, *packet, err)) {
+  // Single-layer video stays on unlayered packets for older receivers.
+  const bool layered =
+      kind == mi::media::StreamKind::kVideo && config_.video_layers > 1;
+  if (layered ? !ratchet->EncryptFrame(frame, layer, *packet, err)
+              : !ratchet->EncryptFrame(frame, *packet, err)) {
     return false;
   }
   if (!core_.PushGroupMedia(config_.group_id, config_.call_id, *packet)) {
@@ -125,13 +141,39 @@ bool GroupCallSession::SendFrame(mi::media::StreamKind kind,
 bool GroupCallSession::SendAudioFrame(const std::vector<std::uint8_t>& payload,
                                       std::uint64_t timestamp_ms,
                                       std::uint8_t flags) {
-  return SendFrame(mi::media::StreamKind::kAudio, payload, timestamp_ms, flags);
+  return SendFrame(mi::media::StreamKind::kAudio, 0, payload, timestamp_ms,
+                   flags);
 }
 
 bool GroupCallSession::SendVideoFrame(const std::vector<std::uint8_t>& payload,
                                       std::uint64_t timestamp_ms,
                                       std::uint8_t flags) {
-  return SendFrame(mi::media::StreamKind::kVideo, payload, timestamp_ms, flags);
+  return SendFrame(mi::media::StreamKind::kVideo, 0, payload, timestamp_ms,
+                   flags);
+}
+
+bool GroupCallSession::SendVideoLayerFrame(
+    std::uint8_t layer, const std::vector<std::uint8_t>& payload,
+    std::uint64_t timestamp_ms, std::uint8_t flags) {
+  return SendFrame(mi::media::StreamKind::kVideo, layer, payload, timestamp_ms,
+                   flags);
+}
+
+bool GroupCallSession::UpdateSubscriptions(
+    const std::vector<mi::client::ClientCore::GroupCallSubscription>& subs,
+    std::string& error) {
+  error.clear();
+  if (!ready_) {
+    error = "group call not ready";
+    return false;
+  }
+  if (!core_.UpdateGroupCallSubscriptions(config_.group_id, config_.call_id,
+                                          config_.enable_video, subs)) {
+    error = core_.last_error().empty() ? "subscription update failed"
+                                       : core_.last_error();
+    return false;
+  }
+  return true;
 }
 
 GroupCallSession::SenderState* GroupCallSession::EnsureSenderState(
@@ -166,11 +208,14 @@ GroupCallSession::SenderState* GroupCallSession::EnsureSenderState(
     }
   }
   if (config_.enable_video) {
-    std::unique_ptr<MediaRatchet> send;
-    if (!BuildRatchetsForKey(call_key, key_id, mi::media::StreamKind::kVideo,
-                             send, state.video_recv)) {
-      error = "video key derive failed";
-      return nullptr;
+    // Senders may publish any number of layers; each has its own chain.
+    for (std::uint8_t layer = 0; layer < mi::media::kMediaMaxLayers; ++layer) {
+      std::unique_ptr<MediaRatchet> send;
+      if (!BuildRatchetsForKey(call_key, key_id, mi::media::StreamKind::kVideo,
+                               send, state.video_recv[layer], layer)) {
+        error = "video key derive failed";
+        return nullptr;
+      }
     }
   }
   auto [inserted_it, inserted] = senders_.emplace(sender, std::move(state));
@@ -203,7 +248,12 @@ bool GroupCallSession::HandleIncomingPacket(
     ratchet = state->audio_recv.get();
     jitter = &state->audio_jitter;
   } else if (kind == mi::media::StreamKind::kVideo) {
-    ratchet = state->video_recv.get();
+    std::uint8_t layer = 0;
+    if (!PeekMediaPacketLayer(packet, layer)) {
+      error = "media packet header invalid";
+      return false;
+    }
+    ratchet = state->video_recv[layer].get();
     jitter = &state->video_jitter;
   }
   if (!ratchet || !jitter) {
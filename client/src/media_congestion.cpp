@@ -0,0 +1,423 @@
+#include "media_congestion.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace mi::client::media {
+
+namespace {
+// Packets sent within this span form one group for delay variation.
+constexpr std::uint64_t kBurstMs = 5;
+constexpr std::size_t kTrendWindow = 20;
+constexpr double kTrendSmoothing = 0.9;
+constexpr double kTrendGain = 4.0;
+constexpr double kThresholdUp = 0.0087;
+constexpr double kThresholdDown = 0.039;
+constexpr double kMinThreshold = 6.0;
+constexpr double kMaxThreshold = 600.0;
+constexpr double kOveruseTimeMs = 10.0;
+constexpr std::uint64_t kAckedWindowMs = 500;
+constexpr std::size_t kMaxSentHistory = 4096;
+constexpr double kDecreaseFactor = 0.85;
+constexpr double kIncreasePerSecond = 1.08;
+
+void WriteLe16(std::uint16_t v, std::vector<std::uint8_t>& out) {
+  out.push_back(static_cast<std::uint8_t>(v & 0xFF));
+  out.push_back(static_cast<std::uint8_t>((v >> 8) & 0xFF));
+}
+
+void WriteLe32(std::uint32_t v, std::vector<std::uint8_t>& out) {
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(static_cast<std::uint8_t>((v >> (i * 8)) & 0xFF));
+  }
+}
+
+bool ReadLe16(const std::vector<std::uint8_t>& data, std::size_t& off,
+              std::uint16_t& out) {
+  if (off + 2 > data.size()) {
+    return false;
+  }
+  out = static_cast<std::uint16_t>(data[off] | (data[off + 1] << 8));
+  off += 2;
+  return true;
+}
+
+bool ReadLe32(const std::vector<std::uint8_t>& data, std::size_t& off,
+              std::uint32_t& out) {
+  if (off + 4 > data.size()) {
+    return false;
+  }
+  out = 0;
+  for (int i = 3; i >= 0; --i) {
+    out = (out << 8) | data[off + static_cast<std::size_t>(i)];
+  }
+  off += 4;
+  return true;
+}
+
+std::int64_t UnwrapAgainst(std::int64_t last, std::uint16_t seq) {
+  if (last < 0) {
+    return seq;
+  }
+  const auto delta = static_cast<std::int16_t>(
+      static_cast<std::uint16_t>(seq - static_cast<std::uint16_t>(last)));
+  return last + delta;
+}
+}  // namespace
+
+// version(1) base_seq(2) count(2) reference_ms(4) received bitmap, then a
+// 2-byte arrival offset from reference_ms per received packet.
+bool EncodeTransportFeedback(const TransportFeedback& feedback,
+                             std::vector<std::uint8_t>& out) {
+  out.clear();
+  const std::size_t count = feedback.packets.size();
+  if (count == 0 || count > kTransportFeedbackMaxPackets) {
+    return false;
+  }
+  std::uint32_t reference = 0;
+  bool has_reference = false;
+  for (const auto& pkt : feedback.packets) {
+    if (pkt.received &&
+        (!has_reference ||
+         static_cast<std::int32_t>(pkt.arrival_ms - reference) < 0)) {
+      reference = pkt.arrival_ms;
+      has_reference = true;
+    }
+  }
+  out.reserve(9 + (count + 7) / 8 + count * 2);
+  out.push_back(kTransportFeedbackVersion);
+  WriteLe16(feedback.base_seq, out);
+  WriteLe16(static_cast<std::uint16_t>(count), out);
+  WriteLe32(reference, out);
+  const std::size_t bitmap_off = out.size();
+  out.resize(bitmap_off + (count + 7) / 8, 0);
+  for (std::size_t i = 0; i < count; ++i) {
+    const auto& pkt = feedback.packets[i];
+    if (!pkt.received) {
+      continue;
+    }
+    out[bitmap_off + i / 8] |= static_cast<std::uint8_t>(1u << (i % 8));
+    const std::uint32_t offset = pkt.arrival_ms - reference;
+    WriteLe16(static_cast<std::uint16_t>(std::min<std::uint32_t>(offset,
+                                                                 0xFFFF)),
+              out);
+  }
+  return true;
+}
+
+bool DecodeTransportFeedback(const std::vector<std::uint8_t>& data,
+                             TransportFeedback& out) {
+  out = TransportFeedback{};
+  std::size_t off = 0;
+  if (data.empty() || data[off++] != kTransportFeedbackVersion) {
+    return false;
+  }
+  std::uint16_t count = 0;
+  std::uint32_t reference = 0;
+  if (!ReadLe16(data, off, out.base_seq) || !ReadLe16(data, off, count) ||
+      !ReadLe32(data, off, reference)) {
+    return false;
+  }
+  if (count == 0 || count > kTransportFeedbackMaxPackets) {
+    return false;
+  }
+  const std::size_t bitmap_off = off;
+  off += (count + 7u) / 8u;
+  if (off > data.size()) {
+    return false;
+  }
+  out.packets.resize(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    if ((data[bitmap_off + i / 8] & (1u << (i % 8))) == 0) {
+      continue;
+    }
+    std::uint16_t delta = 0;
+    if (!ReadLe16(data, off, delta)) {
+      return false;
+    }
+    out.packets[i].received = true;
+    out.packets[i].arrival_ms = reference + delta;
+  }
+  return off == data.size();
+}
+
+std::int64_t TransportFeedbackBuilder::Unwrap(std::uint16_t seq) {
+  const std::int64_t unwrapped = UnwrapAgainst(last_unwrapped_, seq);
+  last_unwrapped_ = std::max(last_unwrapped_, unwrapped);
+  return unwrapped;
+}
+
+void TransportFeedbackBuilder::OnPacket(std::uint16_t transport_seq,
+                                        std::uint64_t arrival_ms) {
+  const std::int64_t seq = Unwrap(transport_seq);
+  if (seq < 0 || (next_base_ >= 0 && seq < next_base_)) {
+    return;
+  }
+  arrivals_.emplace(seq, arrival_ms);
+}
+
+bool TransportFeedbackBuilder::Build(TransportFeedback& out) {
+  out = TransportFeedback{};
+  if (arrivals_.empty()) {
+    return false;
+  }
+  const std::int64_t last = arrivals_.rbegin()->first;
+  std::int64_t base = next_base_ >= 0 ? next_base_ : arrivals_.begin()->first;
+  const auto max_packets =
+      static_cast<std::int64_t>(kTransportFeedbackMaxPackets);
+  if (last - base + 1 > max_packets) {
+    // Too far behind (a long outage); only the newest run is useful.
+    base = last - max_packets + 1;
+    arrivals_.erase(arrivals_.begin(), arrivals_.lower_bound(base));
+  }
+  out.base_seq = static_cast<std::uint16_t>(base & 0xFFFF);
+  out.packets.resize(static_cast<std::size_t>(last - base + 1));
+  for (const auto& kv : arrivals_) {
+    auto& pkt = out.packets[static_cast<std::size_t>(kv.first - base)];
+    pkt.received = true;
+    pkt.arrival_ms = static_cast<std::uint32_t>(kv.second);
+  }
+  arrivals_.clear();
+  next_base_ = last + 1;
+  return true;
+}
+
+SendSideBandwidthEstimator::SendSideBandwidthEstimator(
+    BandwidthEstimatorConfig config)
+    : config_(config) {
+  config_.min_bps = std::max<std::uint32_t>(config_.min_bps, 1000);
+  config_.max_bps = std::max(config_.max_bps, config_.min_bps);
+  config_.start_bps =
+      std::clamp(config_.start_bps, config_.min_bps, config_.max_bps);
+  delay_bps_ = config_.start_bps;
+  loss_cap_bps_ = config_.max_bps;
+  target_bps_ = config_.start_bps;
+}
+
+std::int64_t SendSideBandwidthEstimator::UnwrapSent(std::uint16_t seq) {
+  const std::int64_t unwrapped = UnwrapAgainst(last_sent_unwrapped_, seq);
+  last_sent_unwrapped_ = std::max(last_sent_unwrapped_, unwrapped);
+  return unwrapped;
+}
+
+void SendSideBandwidthEstimator::OnPacketSent(std::uint16_t transport_seq,
+                                              std::uint64_t send_ms,
+                                              std::size_t bytes) {
+  sent_[UnwrapSent(transport_seq)] = SentPacket{send_ms, bytes};
+  while (sent_.size() > kMaxSentHistory) {
+    sent_.erase(sent_.begin());
+  }
+}
+
+void SendSideBandwidthEstimator::OnFeedback(const TransportFeedback& feedback,
+                                            std::uint64_t now_ms) {
+  if (feedback.packets.empty() || last_sent_unwrapped_ < 0) {
+    return;
+  }
+  const std::int64_t base = UnwrapAgainst(last_sent_unwrapped_,
+                                          feedback.base_seq);
+  std::size_t known = 0;
+  std::size_t lost = 0;
+  for (std::size_t i = 0; i < feedback.packets.size(); ++i) {
+    const auto it = sent_.find(base + static_cast<std::int64_t>(i));
+    if (it == sent_.end()) {
+      continue;
+    }
+    ++known;
+    const auto& pkt = feedback.packets[i];
+    if (pkt.received) {
+      OnArrival(it->second, pkt.arrival_ms);
+    } else {
+      ++lost;
+    }
+  }
+  sent_.erase(sent_.begin(),
+              sent_.lower_bound(base +
+                                static_cast<std::int64_t>(
+                                    feedback.packets.size())));
+  if (known == 0) {
+    return;
+  }
+  const double ratio = static_cast<double>(lost) / static_cast<double>(known);
+  loss_ratio_ = has_feedback_ ? 0.7 * loss_ratio_ + 0.3 * ratio : ratio;
+  has_feedback_ = true;
+  UpdateRate(now_ms);
+}
+
+void SendSideBandwidthEstimator::OnArrival(const SentPacket& sent,
+                                           std::uint64_t arrival_ms) {
+  acked_.push_back(Acked{arrival_ms, sent.bytes});
+  acked_bytes_ += sent.bytes;
+  while (!acked_.empty() &&
+         acked_.front().arrival_ms + kAckedWindowMs < arrival_ms) {
+    acked_bytes_ -= acked_.front().bytes;
+    acked_.pop_front();
+  }
+  const std::uint64_t span = std::max<std::uint64_t>(
+      arrival_ms - acked_.front().arrival_ms, 100);
+  acked_bps_ = static_cast<std::uint32_t>(
+      static_cast<double>(acked_bytes_) * 8000.0 / static_cast<double>(span));
+
+  if (!current_.valid) {
+    current_ = PacketGroup{sent.send_ms, sent.send_ms, arrival_ms, true};
+    return;
+  }
+  if (sent.send_ms >= current_.first_send_ms &&
+      sent.send_ms - current_.first_send_ms <= kBurstMs) {
+    current_.last_send_ms = std::max(current_.last_send_ms, sent.send_ms);
+    current_.arrival_ms = std::max(current_.arrival_ms, arrival_ms);
+    return;
+  }
+  if (sent.send_ms < current_.first_send_ms) {
+    return;  // reordered into an earlier group
+  }
+  if (previous_.valid) {
+    OnGroupDelta(
+        static_cast<double>(current_.last_send_ms) -
+            static_cast<double>(previous_.last_send_ms),
+        static_cast<double>(current_.arrival_ms) -
+            static_cast<double>(previous_.arrival_ms),
+        current_.arrival_ms);
+  }
+  previous_ = current_;
+  current_ = PacketGroup{sent.send_ms, sent.send_ms, arrival_ms, true};
+}
+
+void SendSideBandwidthEstimator::OnGroupDelta(double send_delta_ms,
+                                              double arrival_delta_ms,
+                                              std::uint64_t arrival_ms) {
+  if (!has_first_arrival_) {
+    first_arrival_ms_ = arrival_ms;
+    has_first_arrival_ = true;
+  }
+  delta_count_ = std::min<std::size_t>(delta_count_ + 1, 1000);
+  accumulated_delay_ms_ += arrival_delta_ms - send_delta_ms;
+  smoothed_delay_ms_ = kTrendSmoothing * smoothed_delay_ms_ +
+                       (1.0 - kTrendSmoothing) * accumulated_delay_ms_;
+  trend_window_.emplace_back(
+      static_cast<double>(arrival_ms - first_arrival_ms_), smoothed_delay_ms_);
+  if (trend_window_.size() > kTrendWindow) {
+    trend_window_.pop_front();
+  }
+
+  double trend = prev_trend_;
+  if (trend_window_.size() == kTrendWindow) {
+    // Least-squares slope of smoothed delay over arrival time.
+    double sum_x = 0.0;
+    double sum_y = 0.0;
+    for (const auto& pt : trend_window_) {
+      sum_x += pt.first;
+      sum_y += pt.second;
+    }
+    const double n = static_cast<double>(trend_window_.size());
+    const double mean_x = sum_x / n;
+    const double mean_y = sum_y / n;
+    double num = 0.0;
+    double den = 0.0;
+    for (const auto& pt : trend_window_) {
+      num += (pt.first - mean_x) * (pt.second - mean_y);
+      den += (pt.first - mean_x) * (pt.first - mean_x);
+    }
+    if (den != 0.0) {
+      trend = num / den;
+    }
+  }
+  Detect(trend, send_delta_ms, arrival_ms);
+}
+
+void SendSideBandwidthEstimator::Detect(double trend,
+                                        double group_ms,
+                                        std::uint64_t arrival_ms) {
+  if (delta_count_ < 2) {
+    prev_trend_ = trend;
+    return;
+  }
+  const double modified =
+      static_cast<double>(std::min<std::size_t>(delta_count_, 60)) * trend *
+      kTrendGain;
+  if (modified > threshold_) {
+    overuse_ms_ = overuse_ms_ < 0.0 ? group_ms / 2.0 : overuse_ms_ + group_ms;
+    ++overuse_count_;
+    if (overuse_ms_ > kOveruseTimeMs && overuse_count_ > 1 &&
+        trend >= prev_trend_) {
+      overuse_ms_ = 0.0;
+      overuse_count_ = 0;
+      usage_ = BandwidthUsage::kOverusing;
+    }
+  } else if (modified < -threshold_) {
+    overuse_ms_ = -1.0;
+    overuse_count_ = 0;
+    usage_ = BandwidthUsage::kUnderusing;
+  } else {
+    overuse_ms_ = -1.0;
+    overuse_count_ = 0;
+    usage_ = BandwidthUsage::kNormal;
+  }
+  prev_trend_ = trend;
+
+  // Adaptive threshold: chase |modified| slowly upwards, faster downwards,
+  // ignoring spikes far above it.
+  const double magnitude = std::fabs(modified);
+  if (last_threshold_ms_ == 0) {
+    last_threshold_ms_ = arrival_ms;
+  }
+  if (magnitude <= threshold_ + 15.0) {
+    const double k = magnitude < threshold_ ? kThresholdDown : kThresholdUp;
+    const double dt = static_cast<double>(
+        std::min<std::uint64_t>(arrival_ms - last_threshold_ms_, 100));
+    threshold_ += k * (magnitude - threshold_) * dt;
+    threshold_ = std::clamp(threshold_, kMinThreshold, kMaxThreshold);
+  }
+  last_threshold_ms_ = arrival_ms;
+}
+
+void SendSideBandwidthEstimator::UpdateRate(std::uint64_t now_ms) {
+  const double dt_ms =
+      last_update_ms_ == 0
+          ? 0.0
+          : static_cast<double>(
+                std::min<std::uint64_t>(now_ms - last_update_ms_, 1000));
+  last_update_ms_ = now_ms;
+  const double acked = static_cast<double>(acked_bps_);
+
+  switch (usage_) {
+    case BandwidthUsage::kOverusing:
+      // One cut per round of queue drain, down to what actually got through.
+      if (now_ms - last_decrease_ms_ >= 200) {
+        const double base = acked > 0.0 ? std::min(acked, delay_bps_)
+                                        : delay_bps_;
+        delay_bps_ = base * kDecreaseFactor;
+        last_decrease_ms_ = now_ms;
+      }
+      break;
+    case BandwidthUsage::kUnderusing:
+      break;  // queues are draining; hold
+    case BandwidthUsage::kNormal: {
+      double next = delay_bps_ * std::pow(kIncreasePerSecond, dt_ms / 1000.0);
+      if (acked > 0.0) {
+        // Do not run far ahead of what the sender actually gets through.
+        next = std::min(next, std::max(delay_bps_, 1.5 * acked + 10000.0));
+      }
+      delay_bps_ = next;
+      break;
+    }
+  }
+
+  if (loss_ratio_ > 0.10) {
+    if (now_ms - last_loss_decrease_ms_ >= 300) {
+      loss_cap_bps_ =
+          std::min(loss_cap_bps_, delay_bps_) * (1.0 - 0.5 * loss_ratio_);
+      last_loss_decrease_ms_ = now_ms;
+    }
+  } else if (loss_ratio_ < 0.02) {
+    loss_cap_bps_ *= std::pow(kIncreasePerSecond, dt_ms / 1000.0);
+  }
+
+  const double lo = static_cast<double>(config_.min_bps);
+  const double hi = static_cast<double>(config_.max_bps);
+  delay_bps_ = std::clamp(delay_bps_, lo, hi);
+  loss_cap_bps_ = std::clamp(loss_cap_bps_, lo, hi);
+  target_bps_ = static_cast<std::uint32_t>(std::min(delay_bps_, loss_cap_bps_));
+}
+
+}  // namespace mi::client::media
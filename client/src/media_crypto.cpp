@@ -18,6 +18,23 @@ void WriteLe32(std::uint32_t v, std::uint8_t out[4]) {
   out[3] = static_cast<std::uint8_t>((v >> 24) & 0xFF);
 }
 
+void WriteLe16(std::uint16_t v, std::uint8_t out[2]) {
+  out[0] = static_cast<std::uint8_t>(v & 0xFF);
+  out[1] = static_cast<std::uint8_t>((v >> 8) & 0xFF);
+}
+
+bool ReadLe16(const std::vector<std::uint8_t>& data, std::size_t& off,
+              std::uint16_t& out) {
+  if (off + 2 > data.size()) {
+    return false;
+  }
+  out = static_cast<std::uint16_t>(data[off] |
+                                   (static_cast<std::uint16_t>(data[off + 1])
+                                    << 8));
+  off += 2;
+  return true;
+}
+
 bool ReadLe32(const std::vector<std::uint8_t>& data, std::size_t& off,
               std::uint32_t& out) {
   if (off + 4 > data.size()) {
@@ -38,6 +55,36 @@ void BuildNonce(std::uint32_t seq, std::uint8_t out[24]) {
   std::memcpy(out, tmp, sizeof(tmp));
 }
 
+std::uint8_t LayerByte(const MediaPacket& packet) {
+  return static_cast<std::uint8_t>(
+      (packet.layer & mi::media::kMediaLayerMask) |
+      (packet.keyframe ? mi::media::kMediaLayerKeyframe : 0));
+}
+
+constexpr std::size_t kMaxAdBytes = 17;
+
+// The whole cleartext header is bound to the ciphertext.
+std::size_t BuildAd(const MediaPacket& packet, std::uint8_t ad[kMaxAdBytes]) {
+  std::size_t len = 0;
+  ad[len++] = packet.version;
+  ad[len++] = static_cast<std::uint8_t>(packet.kind);
+  if (packet.version >= kMediaPacketLayeredVersion) {
+    ad[len++] = LayerByte(packet);
+  }
+  if (packet.version >= kMediaPacketTransportVersion) {
+    WriteLe16(packet.transport.seq, ad + len);
+    len += 2;
+    WriteLe32(packet.transport.send_time_ms, ad + len);
+    len += 4;
+  }
+  if (packet.version >= 3) {
+    WriteLe32(packet.key_id, ad + len);
+    len += 4;
+  }
+  WriteLe32(packet.seq, ad + len);
+  return len + 4;
+}
+
 bool KdfMediaCk(const std::array<std::uint8_t, 32>& ck,
                 std::array<std::uint8_t, 32>& out_ck,
                 std::array<std::uint8_t, 32>& out_mk) {
@@ -58,11 +105,24 @@ bool KdfMediaCk(const std::array<std::uint8_t, 32>& ck,
 bool EncodeMediaPacket(const MediaPacket& packet,
                        std::vector<std::uint8_t>& out) {
   out.clear();
-  const std::size_t header_extra = (packet.version >= 3) ? 4 : 0;
+  const std::size_t header_extra =
+      (packet.version >= 3 ? 4 : 0) +
+      (packet.version >= kMediaPacketLayeredVersion ? 1 : 0) +
+      (packet.version >= kMediaPacketTransportVersion ? 6 : 0);
   out.reserve(1 + 1 + 4 + header_extra + packet.tag.size() +
               packet.cipher.size());
   out.push_back(packet.version);
   out.push_back(static_cast<std::uint8_t>(packet.kind));
+  if (packet.version >= kMediaPacketLayeredVersion) {
+    out.push_back(LayerByte(packet));
+  }
+  if (packet.version >= kMediaPacketTransportVersion) {
+    std::uint8_t transport_bytes[6];
+    WriteLe16(packet.transport.seq, transport_bytes);
+    WriteLe32(packet.transport.send_time_ms, transport_bytes + 2);
+    out.insert(out.end(), transport_bytes,
+               transport_bytes + sizeof(transport_bytes));
+  }
   if (packet.version >= 3) {
     std::uint8_t key_bytes[4];
     WriteLe32(packet.key_id, key_bytes);
@@ -80,6 +140,8 @@ bool DecodeMediaPacket(const std::vector<std::uint8_t>& data, MediaPacket& out)
   out = MediaPacket{};
   const std::size_t min_size_v2 = 1 + 1 + 4 + out.tag.size();
   const std::size_t min_size_v3 = 1 + 1 + 4 + 4 + out.tag.size();
+  const std::size_t min_size_v4 = min_size_v3 + 1;
+  const std::size_t min_size_v5 = min_size_v4 + 6;
   if (data.size() < min_size_v2) {
     return false;
   }
@@ -104,6 +166,31 @@ bool DecodeMediaPacket(const std::vector<std::uint8_t>& data, MediaPacket& out)
     if (!ReadLe32(data, off, out.seq)) {
       return false;
     }
+  } else if (version == kMediaPacketLayeredVersion ||
+             version == kMediaPacketTransportVersion) {
+    out.version = version;
+    if (data.size() < (version == kMediaPacketTransportVersion ? min_size_v5
+                                                               : min_size_v4)) {
+      return false;
+    }
+    out.kind = static_cast<mi::media::StreamKind>(data[off++]);
+    const std::uint8_t layer = data[off++];
+    out.layer = static_cast<std::uint8_t>(layer & mi::media::kMediaLayerMask);
+    out.keyframe = (layer & mi::media::kMediaLayerKeyframe) != 0;
+    if (out.layer >= mi::media::kMediaMaxLayers) {
+      return false;
+    }
+    if (version == kMediaPacketTransportVersion &&
+        (!ReadLe16(data, off, out.transport.seq) ||
+         !ReadLe32(data, off, out.transport.send_time_ms))) {
+      return false;
+    }
+    if (!ReadLe32(data, off, out.key_id)) {
+      return false;
+    }
+    if (!ReadLe32(data, off, out.seq)) {
+      return false;
+    }
   } else {
     return false;
   }
@@ -139,11 +226,17 @@ bool PeekMediaPacketHeaderWithKeyId(const std::vector<std::uint8_t>& data,
     out_key_id = 1;
     return ReadLe32(data, off, out_seq);
   }
-  if (version == 3) {
-    if (data.size() < min_size_v3) {
+  if (version == 3 || version == kMediaPacketLayeredVersion ||
+      version == kMediaPacketTransportVersion) {
+    const std::size_t layer_len = (version == 3) ? 0
+                                  : (version == kMediaPacketLayeredVersion)
+                                      ? 1
+                                      : 1 + 6;
+    if (data.size() < min_size_v3 + layer_len) {
       return false;
     }
     out_kind = static_cast<mi::media::StreamKind>(data[off++]);
+    off += layer_len;
     if (!ReadLe32(data, off, out_key_id)) {
       return false;
     }
@@ -152,15 +245,45 @@ bool PeekMediaPacketHeaderWithKeyId(const std::vector<std::uint8_t>& data,
   return false;
 }
 
+bool PeekMediaPacketTransport(const std::vector<std::uint8_t>& data,
+                              MediaTransportInfo& out) {
+  out = MediaTransportInfo{};
+  if (data.size() < 3 + 6 || data[0] != kMediaPacketTransportVersion) {
+    return false;
+  }
+  std::size_t off = 3;
+  return ReadLe16(data, off, out.seq) && ReadLe32(data, off, out.send_time_ms);
+}
+
+bool PeekMediaPacketLayer(const std::vector<std::uint8_t>& data,
+                          std::uint8_t& out_layer) {
+  out_layer = 0;
+  if (data.empty()) {
+    return false;
+  }
+  if (data[0] != kMediaPacketLayeredVersion &&
+      data[0] != kMediaPacketTransportVersion) {
+    return true;
+  }
+  if (data.size() < 3) {
+    return false;
+  }
+  out_layer = static_cast<std::uint8_t>(data[2] & mi::media::kMediaLayerMask);
+  return out_layer < mi::media::kMediaMaxLayers;
+}
+
 bool DeriveStreamChainKeys(const std::array<std::uint8_t, 32>& media_root,
                            mi::media::StreamKind kind,
                            bool initiator,
                            MediaKeyPair& out_keys) {
   out_keys = MediaKeyPair{};
   std::array<std::uint8_t, 64> buf{};
-  const char* label = (kind == mi::media::StreamKind::kVideo)
-                          ? "mi_e2ee_media_video_v1"
-                          : "mi_e2ee_media_audio_v1";
+  const char* label = "mi_e2ee_media_audio_v1";
+  if (kind == mi::media::StreamKind::kVideo) {
+    label = "mi_e2ee_media_video_v1";
+  } else if (kind == mi::media::StreamKind::kFeedback) {
+    label = "mi_e2ee_media_feedback_v1";
+  }
   if (!mi::server::crypto::HkdfSha256(
           media_root.data(), media_root.size(), nullptr, 0,
           reinterpret_cast<const std::uint8_t*>(label), std::strlen(label),
@@ -177,6 +300,23 @@ bool DeriveStreamChainKeys(const std::array<std::uint8_t, 32>& media_root,
   return true;
 }
 
+bool DeriveLayerChainKey(const std::array<std::uint8_t, 32>& stream_ck,
+                         std::uint8_t layer,
+                         std::array<std::uint8_t, 32>& out_ck) {
+  if (layer >= mi::media::kMediaMaxLayers) {
+    return false;
+  }
+  if (layer == 0) {
+    out_ck = stream_ck;
+    return true;
+  }
+  static constexpr char kLabel[] = "mi_e2ee_media_layer_v1";
+  return mi::server::crypto::HkdfSha256(
+      stream_ck.data(), stream_ck.size(), &layer, 1,
+      reinterpret_cast<const std::uint8_t*>(kLabel), sizeof(kLabel) - 1,
+      out_ck.data(), out_ck.size());
+}
+
 MediaRatchet::MediaRatchet(const std::array<std::uint8_t, 32>& chain_key,
                            mi::media::StreamKind kind,
                            std::uint32_t start_seq,
@@ -189,6 +329,47 @@ MediaRatchet::MediaRatchet(const std::array<std::uint8_t, 32>& chain_key,
 bool MediaRatchet::EncryptFrame(const mi::media::MediaFrame& frame,
                                 std::vector<std::uint8_t>& out_packet,
                                 std::string& error) {
+  MediaPacket packet;
+  packet.version = kMediaPacketVersion;
+  return EncryptPacket(frame, std::move(packet), out_packet, error);
+}
+
+bool MediaRatchet::EncryptFrame(const mi::media::MediaFrame& frame,
+                                std::uint8_t layer,
+                                std::vector<std::uint8_t>& out_packet,
+                                std::string& error) {
+  if (layer >= mi::media::kMediaMaxLayers) {
+    error = "media layer invalid";
+    return false;
+  }
+  MediaPacket packet;
+  packet.version = kMediaPacketLayeredVersion;
+  packet.layer = layer;
+  packet.keyframe = (frame.flags & mi::media::kFrameKey) != 0;
+  return EncryptPacket(frame, std::move(packet), out_packet, error);
+}
+
+bool MediaRatchet::EncryptFrame(const mi::media::MediaFrame& frame,
+                                std::uint8_t layer,
+                                const MediaTransportInfo& transport,
+                                std::vector<std::uint8_t>& out_packet,
+                                std::string& error) {
+  if (layer >= mi::media::kMediaMaxLayers) {
+    error = "media layer invalid";
+    return false;
+  }
+  MediaPacket packet;
+  packet.version = kMediaPacketTransportVersion;
+  packet.layer = layer;
+  packet.keyframe = (frame.flags & mi::media::kFrameKey) != 0;
+  packet.transport = transport;
+  return EncryptPacket(frame, std::move(packet), out_packet, error);
+}
+
+bool MediaRatchet::EncryptPacket(const mi::media::MediaFrame& frame,
+                                 MediaPacket packet,
+                                 std::vector<std::uint8_t>& out_packet,
+                                 std::string& error) {
   error.clear();
   if (frame.kind != kind_) {
     error = "media kind mismatch";
@@ -207,8 +388,6 @@ bool MediaRatchet::EncryptFrame(const mi::media::MediaFrame& frame,
     return false;
   }
 
-  MediaPacket packet;
-  packet.version = kMediaPacketVersion;
   packet.kind = kind_;
   packet.key_id = key_id_;
   packet.seq = next_seq_;
@@ -216,17 +395,8 @@ bool MediaRatchet::EncryptFrame(const mi::media::MediaFrame& frame,
 
   std::uint8_t nonce[24];
   BuildNonce(packet.seq, nonce);
-  std::uint8_t ad[1 + 1 + 4 + 4];
-  ad[0] = packet.version;
-  ad[1] = static_cast<std::uint8_t>(kind_);
-  std::size_t ad_len = 1 + 1 + 4;
-  if (packet.version >= 3) {
-    WriteLe32(packet.key_id, ad + 2);
-    WriteLe32(packet.seq, ad + 6);
-    ad_len = 1 + 1 + 4 + 4;
-  } else {
-    WriteLe32(packet.seq, ad + 2);
-  }
+  std::uint8_t ad[kMaxAdBytes];
+  const std::size_t ad_len = BuildAd(packet, ad);
 
   crypto_aead_lock(packet.cipher.data(), packet.tag.data(), mk.data(), nonce,
                    ad, ad_len, plain.data(), plain.size());
@@ -261,17 +431,8 @@ bool MediaRatchet::DecryptFrame(const std::vector<std::uint8_t>& packet,
 
   std::uint8_t nonce[24];
   BuildNonce(parsed.seq, nonce);
-  std::uint8_t ad[1 + 1 + 4 + 4];
-  ad[0] = parsed.version;
-  ad[1] = static_cast<std::uint8_t>(kind_);
-  std::size_t ad_len = 1 + 1 + 4;
-  if (parsed.version >= 3) {
-    WriteLe32(parsed.key_id, ad + 2);
-    WriteLe32(parsed.seq, ad + 6);
-    ad_len = 1 + 1 + 4 + 4;
-  } else {
-    WriteLe32(parsed.seq, ad + 2);
-  }
+  std::uint8_t ad[kMaxAdBytes];
+  const std::size_t ad_len = BuildAd(parsed, ad);
 
   std::vector<std::uint8_t> plain;
   plain.resize(parsed.cipher.size());
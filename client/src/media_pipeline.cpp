@@ -29,6 +29,8 @@ constexpr std::uint8_t kAudioPayloadVersion = 1;
 constexpr std::uint8_t kVideoPayloadVersion = 1;
 constexpr std::uint8_t kVideoFlagKeyframe = 0x01;
 constexpr std::size_t kVideoHeaderSize = 8;
+// Cadence of bitrate updates driven by the sender-side estimate.
+constexpr std::uint64_t kEstimateAdaptMs = 200;
 
 std::uint64_t NowMs() {
   return static_cast<std::uint64_t>(
@@ -414,6 +416,23 @@ void AudioPipeline::AdaptBitrate(std::uint64_t now_ms) {
   if (codec_ != AudioCodec::kOpus || !opus_) {
     return;
   }
+  MediaBandwidthEstimate estimate;
+  if (session_.GetBandwidthEstimate(estimate)) {
+    // Audio is served first out of the sender's estimate.
+    if (now_ms - last_adapt_ms_ < kEstimateAdaptMs) {
+      return;
+    }
+    const int bitrate = ClampInt(
+        static_cast<int>(std::min<std::uint32_t>(
+            estimate.target_bps,
+            static_cast<std::uint32_t>(std::numeric_limits<int>::max()))),
+        config_.min_bitrate_bps, config_.max_bitrate_bps);
+    if (bitrate != current_bitrate_bps_ && opus_->SetBitrate(bitrate)) {
+      current_bitrate_bps_ = bitrate;
+    }
+    last_adapt_ms_ = now_ms;
+    return;
+  }
   if (now_ms - last_adapt_ms_ < 1000) {
     return;
   }
@@ -1015,6 +1034,27 @@ void VideoPipeline::AdaptBitrate(std::uint64_t now_ms) {
   if (codec_ != VideoCodec::kH264 || !mf_) {
     return;
   }
+  MediaBandwidthEstimate estimate;
+  if (session_.GetBandwidthEstimate(estimate)) {
+    // Video gets what audio leaves. Cuts apply at once; raises wait for a
+    // 5% step so the encoder is not reconfigured on every report.
+    if (now_ms - last_adapt_ms_ < kEstimateAdaptMs) {
+      return;
+    }
+    const std::uint32_t budget = estimate.target_bps > estimate.audio_bps
+                                     ? estimate.target_bps - estimate.audio_bps
+                                     : 0;
+    const std::uint32_t bitrate =
+        std::clamp(budget, config_.min_bitrate_bps, config_.max_bitrate_bps);
+    const bool apply =
+        bitrate < current_bitrate_bps_ ||
+        bitrate >= current_bitrate_bps_ + current_bitrate_bps_ / 20;
+    if (apply && bitrate != current_bitrate_bps_ && mf_->SetBitrate(bitrate)) {
+      current_bitrate_bps_ = bitrate;
+    }
+    last_adapt_ms_ = now_ms;
+    return;
+  }
   if (now_ms - last_adapt_ms_ < 1000) {
     return;
   }
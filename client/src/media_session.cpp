@@ -23,7 +23,8 @@ MediaSession::MediaSession(mi::client::ClientCore& core,
     : core_(core),
       config_(std::move(config)),
       audio_jitter_(config_.audio_delay_ms, config_.audio_max_frames),
-      video_jitter_(config_.video_delay_ms, config_.video_max_frames) {}
+      video_jitter_(config_.video_delay_ms, config_.video_max_frames),
+      bwe_(config_.bandwidth) {}
 
 bool MediaSession::Init(std::string& error) {
   error.clear();
@@ -68,6 +69,19 @@ bool MediaSession::Init(std::string& error) {
         video_keys.recv_ck, mi::media::StreamKind::kVideo);
   }
 
+  if (config_.transport_feedback) {
+    MediaKeyPair feedback_keys;
+    if (!DeriveStreamChainKeys(media_root_, mi::media::StreamKind::kFeedback,
+                               config_.initiator, feedback_keys)) {
+      error = "feedback chain key derive failed";
+      return false;
+    }
+    feedback_send_ = std::make_unique<MediaRatchet>(
+        feedback_keys.send_ck, mi::media::StreamKind::kFeedback);
+    feedback_recv_ = std::make_unique<MediaRatchet>(
+        feedback_keys.recv_ck, mi::media::StreamKind::kFeedback);
+  }
+
   ready_ = true;
   return true;
 }
@@ -104,12 +118,38 @@ bool MediaSession::SendFrame(mi::media::StreamKind kind,
   frame.payload = payload;
 
   std::string err;
-  if (!ratchet->EncryptFrame(frame, *packet, err)) {
+  const std::uint64_t now_ms = NowMs();
+  MediaTransportInfo transport;
+  if (config_.transport_feedback) {
+    {
+      std::lock_guard<std::mutex> lock(congestion_mutex_);
+      transport.seq = transport_seq_++;
+    }
+    transport.send_time_ms = static_cast<std::uint32_t>(now_ms);
+    if (!ratchet->EncryptFrame(frame, 0, transport, *packet, err)) {
+      return false;
+    }
+  } else if (!ratchet->EncryptFrame(frame, *packet, err)) {
     return false;
   }
   if (!core_.PushMedia(config_.peer_username, config_.call_id, *packet)) {
     return false;
   }
+  if (config_.transport_feedback) {
+    std::lock_guard<std::mutex> lock(congestion_mutex_);
+    bwe_.OnPacketSent(transport.seq, now_ms, packet->size());
+    if (kind == mi::media::StreamKind::kAudio) {
+      audio_window_bytes_ += packet->size();
+      if (audio_window_ms_ == 0) {
+        audio_window_ms_ = now_ms;
+      } else if (now_ms - audio_window_ms_ >= 1000) {
+        audio_send_bps_ = static_cast<std::uint32_t>(
+            audio_window_bytes_ * 8000u / (now_ms - audio_window_ms_));
+        audio_window_bytes_ = 0;
+        audio_window_ms_ = now_ms;
+      }
+    }
+  }
   StatsForKind(stats_, kind).frames_sent++;
   return true;
 }
@@ -136,12 +176,16 @@ bool MediaSession::HandleIncomingPacket(const std::string& sender,
   if (!config_.peer_username.empty() && sender != config_.peer_username) {
     return false;
   }
+  const std::uint64_t arrival_ms = NowMs();
   mi::media::StreamKind kind = mi::media::StreamKind::kAudio;
   std::uint32_t seq = 0;
   if (!PeekMediaPacketHeader(packet, kind, seq)) {
     error = "media packet header invalid";
     return false;
   }
+  if (kind == mi::media::StreamKind::kFeedback) {
+    return HandleFeedback(packet, error);
+  }
 
   MediaRatchet* ratchet = nullptr;
   MediaJitterBuffer* jitter = nullptr;
@@ -170,11 +214,73 @@ bool MediaSession::HandleIncomingPacket(const std::string& sender,
     StatsForKind(stats_, kind).frames_drop++;
     return false;
   }
-  jitter->Push(frame, NowMs());
+  MediaTransportInfo transport;
+  if (feedback_send_ && PeekMediaPacketTransport(packet, transport)) {
+    feedback_builder_.OnPacket(transport.seq, arrival_ms);
+  }
+  jitter->Push(frame, arrival_ms);
   StatsForKind(stats_, kind).frames_recv++;
   return true;
 }
 
+bool MediaSession::HandleFeedback(const std::vector<std::uint8_t>& packet,
+                                  std::string& error) {
+  if (!feedback_recv_) {
+    return false;
+  }
+  mi::media::MediaFrame frame;
+  std::string err;
+  if (!feedback_recv_->DecryptFrame(packet, frame, err)) {
+    if (error.empty()) {
+      error = err.empty() ? "feedback decrypt failed" : err;
+    }
+    return false;
+  }
+  TransportFeedback feedback;
+  if (frame.call_id != config_.call_id ||
+      !DecodeTransportFeedback(frame.payload, feedback)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(congestion_mutex_);
+  bwe_.OnFeedback(feedback, NowMs());
+  return true;
+}
+
+void MediaSession::MaybeSendFeedback(std::uint64_t now_ms) {
+  if (!feedback_send_ || !feedback_builder_.pending() ||
+      now_ms - last_feedback_ms_ < config_.feedback_interval_ms) {
+    return;
+  }
+  TransportFeedback feedback;
+  mi::media::MediaFrame frame;
+  if (!feedback_builder_.Build(feedback) ||
+      !EncodeTransportFeedback(feedback, frame.payload)) {
+    return;
+  }
+  frame.call_id = config_.call_id;
+  frame.kind = mi::media::StreamKind::kFeedback;
+  frame.timestamp_ms = now_ms;
+  std::vector<std::uint8_t> packet;
+  std::string err;
+  if (!feedback_send_->EncryptFrame(frame, packet, err)) {
+    return;
+  }
+  // Best effort: a lost report only delays the estimate.
+  core_.PushMedia(config_.peer_username, config_.call_id, packet);
+  last_feedback_ms_ = now_ms;
+}
+
+bool MediaSession::GetBandwidthEstimate(MediaBandwidthEstimate& out) const {
+  std::lock_guard<std::mutex> lock(congestion_mutex_);
+  if (!bwe_.has_feedback()) {
+    return false;
+  }
+  out.target_bps = bwe_.target_bps();
+  out.audio_bps = audio_send_bps_;
+  out.loss_ratio = bwe_.loss_ratio();
+  return true;
+}
+
 bool MediaSession::PollIncoming(std::uint32_t max_packets,
                                 std::uint32_t wait_ms,
                                 std::string& error) {
@@ -195,6 +301,7 @@ bool MediaSession::PollIncoming(std::uint32_t max_packets,
       error = pkt_err;
     }
   }
+  MaybeSendFeedback(NowMs());
   return true;
 }
 
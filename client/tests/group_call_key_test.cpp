@@ -74,5 +74,20 @@ int main() {
   assert(req_call == call_id);
   assert(want_key == 9);
 
+  // Per-sender flags: audio 0x01, video 0x02, preferred layer + 1 in the
+  // high nibble (0 would mean "no preference").
+  std::vector<ClientCore::GroupCallSubscription> subs(2);
+  subs[0].sender = "alice";
+  subs[0].video_layer = 0;
+  subs[1].sender = "bob";
+  subs[1].audio = false;
+  subs[1].video_layer = 2;
+  const auto ext = ClientCore::EncodeGroupCallSubscriptions(subs);
+  const std::vector<std::uint8_t> want_ext = {
+      2, 0, 0, 0,
+      5, 0, 'a', 'l', 'i', 'c', 'e', 0x13,
+      3, 0, 'b', 'o', 'b', 0x32};
+  assert(ext == want_ext);
+
   return 0;
 }
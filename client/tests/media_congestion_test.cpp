@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "media_congestion.h"
+#include "media_crypto.h"
+
+using mi::client::media::BandwidthEstimatorConfig;
+using mi::client::media::SendSideBandwidthEstimator;
+using mi::client::media::TransportFeedback;
+using mi::client::media::TransportFeedbackBuilder;
+
+namespace {
+
+// Link profile: a FIFO bottleneck of |kbps| with a drop-tail queue of
+// |queue_ms|, fixed one-way |delay_ms| and random |loss|. At |change_ms| the
+// capacity switches to |kbps_after|.
+struct LinkProfile {
+  const char* name;
+  double kbps;
+  std::uint32_t delay_ms;
+  double loss;
+  std::uint32_t queue_ms;
+  std::uint64_t change_ms;
+  double kbps_after;
+};
+
+struct SimPacket {
+  std::uint16_t seq{0};
+  std::size_t bytes{0};
+  std::uint64_t deliver_ms{0};
+};
+
+// Deterministic: losses come from a fixed-seed LCG and time is whatever the
+// caller passes in.
+class NetworkEmulator {
+ public:
+  NetworkEmulator(const LinkProfile& profile, std::uint32_t seed)
+      : profile_(profile), rng_(seed) {}
+
+  void Send(std::uint64_t now_ms, std::uint16_t seq, std::size_t bytes) {
+    if (NextUniform() < profile_.loss) {
+      return;
+    }
+    const double now = static_cast<double>(now_ms);
+    const double start = std::max(now, link_free_ms_);
+    if (start - now > static_cast<double>(profile_.queue_ms)) {
+      return;  // queue full
+    }
+    const double kbps =
+        now_ms >= profile_.change_ms ? profile_.kbps_after : profile_.kbps;
+    link_free_ms_ = start + static_cast<double>(bytes) * 8.0 / kbps;
+    max_queue_ms_ = std::max(max_queue_ms_, link_free_ms_ - now);
+    in_flight_.push_back(SimPacket{
+        seq, bytes,
+        static_cast<std::uint64_t>(link_free_ms_) + profile_.delay_ms});
+  }
+
+  bool Receive(std::uint64_t now_ms, SimPacket& out) {
+    if (in_flight_.empty() || in_flight_.front().deliver_ms > now_ms) {
+      return false;
+    }
+    out = in_flight_.front();
+    in_flight_.pop_front();
+    return true;
+  }
+
+  double queue_ms(std::uint64_t now_ms) const {
+    return std::max(0.0, link_free_ms_ - static_cast<double>(now_ms));
+  }
+  double max_queue_ms() const { return max_queue_ms_; }
+
+ private:
+  double NextUniform() {
+    rng_ = rng_ * 1664525u + 1013904223u;
+    return static_cast<double>(rng_ >> 8) / static_cast<double>(1u << 24);
+  }
+
+  LinkProfile profile_;
+  std::uint32_t rng_;
+  double link_free_ms_{0.0};
+  double max_queue_ms_{0.0};
+  std::deque<SimPacket> in_flight_;
+};
+
+struct SimResult {
+  std::uint32_t final_bps{0};
+  std::uint32_t bps_at_change{0};
+  double avg_queue_ms{0.0};
+  double max_queue_ms{0.0};
+};
+
+// Audio at 32 kbps in 20 ms packets plus video filling the rest of the
+// target at 30 fps, one burst per frame; feedback every 100 ms.
+SimResult Run(const LinkProfile& profile, std::uint64_t duration_ms) {
+  constexpr std::uint32_t kAudioBps = 32000;
+  constexpr std::size_t kMaxPacket = 1200;
+  BandwidthEstimatorConfig cfg;
+  cfg.start_bps = 300000;
+  SendSideBandwidthEstimator bwe(cfg);
+  TransportFeedbackBuilder builder;
+  NetworkEmulator link(profile, 12345);
+  std::deque<std::pair<std::uint64_t, std::vector<std::uint8_t>>> reports;
+  std::uint16_t seq = 0;
+  SimResult result;
+  double queue_sum = 0.0;
+  std::uint64_t queue_samples = 0;
+
+  const auto send = [&](std::uint64_t now, std::size_t bytes) {
+    bwe.OnPacketSent(seq, now, bytes);
+    link.Send(now, seq, bytes);
+    ++seq;
+  };
+
+  for (std::uint64_t now = 1; now <= duration_ms; ++now) {
+    if (now % 20 == 0) {
+      send(now, kAudioBps / 8 / 50);
+    }
+    if (now % 33 == 0) {
+      const std::uint32_t video_bps =
+          std::max<std::uint32_t>(bwe.target_bps(), kAudioBps + 20000) -
+          kAudioBps;
+      std::size_t frame = video_bps / 8 / 30;
+      while (frame > 0) {
+        const std::size_t chunk = std::min(frame, kMaxPacket);
+        send(now, chunk);
+        frame -= chunk;
+      }
+    }
+
+    SimPacket pkt;
+    while (link.Receive(now, pkt)) {
+      builder.OnPacket(pkt.seq, now);
+    }
+    if (now % 100 == 0) {
+      TransportFeedback fb;
+      std::vector<std::uint8_t> wire;
+      if (builder.Build(fb) &&
+          mi::client::media::EncodeTransportFeedback(fb, wire)) {
+        reports.emplace_back(now + profile.delay_ms, std::move(wire));
+      }
+    }
+    while (!reports.empty() && reports.front().first <= now) {
+      TransportFeedback fb;
+      const bool ok = mi::client::media::DecodeTransportFeedback(
+          reports.front().second, fb);
+      assert(ok);
+      (void)ok;
+      bwe.OnFeedback(fb, now);
+      reports.pop_front();
+    }
+
+    if (now == profile.change_ms) {
+      result.bps_at_change = bwe.target_bps();
+    }
+    if (now > duration_ms / 2) {
+      queue_sum += link.queue_ms(now);
+      ++queue_samples;
+    }
+  }
+  result.final_bps = bwe.target_bps();
+  result.avg_queue_ms = queue_samples ? queue_sum / queue_samples : 0.0;
+  result.max_queue_ms = link.max_queue_ms();
+  std::printf("%-10s final=%7u bps  queue avg=%6.1f ms max=%6.1f ms\n",
+              profile.name, result.final_bps, result.avg_queue_ms,
+              result.max_queue_ms);
+  return result;
+}
+
+void TestFeedbackCodec() {
+  TransportFeedbackBuilder builder;
+  // Sequence numbers wrap; 65535 and 1 arrive, 0 is lost, 2 is reordered.
+  builder.OnPacket(65534, 1000);
+  builder.OnPacket(65535, 1004);
+  builder.OnPacket(1, 1010);
+  builder.OnPacket(2, 1009);
+  TransportFeedback fb;
+  bool ok = builder.Build(fb);
+  assert(ok);
+  assert(fb.base_seq == 65534);
+  assert(fb.packets.size() == 5);
+  assert(fb.packets[0].received && fb.packets[1].received);
+  assert(!fb.packets[2].received);
+  assert(fb.packets[3].received && fb.packets[4].received);
+
+  std::vector<std::uint8_t> wire;
+  ok = mi::client::media::EncodeTransportFeedback(fb, wire);
+  assert(ok);
+  TransportFeedback decoded;
+  ok = mi::client::media::DecodeTransportFeedback(wire, decoded);
+  assert(ok);
+  assert(decoded.base_seq == fb.base_seq);
+  assert(decoded.packets.size() == fb.packets.size());
+  for (std::size_t i = 0; i < fb.packets.size(); ++i) {
+    assert(decoded.packets[i].received == fb.packets[i].received);
+    if (fb.packets[i].received) {
+      assert(decoded.packets[i].arrival_ms - decoded.packets[1].arrival_ms ==
+             fb.packets[i].arrival_ms - fb.packets[1].arrival_ms);
+    }
+  }
+
+  // Late arrival of an already reported slot is not reported again.
+  builder.OnPacket(0, 1020);
+  assert(!builder.pending());
+  builder.OnPacket(3, 1030);
+  ok = builder.Build(fb);
+  assert(ok);
+  assert(fb.base_seq == 3 && fb.packets.size() == 1);
+
+  wire.pop_back();
+  assert(!mi::client::media::DecodeTransportFeedback(wire, decoded));
+  (void)ok;
+}
+
+void TestTransportHeader() {
+  std::array<std::uint8_t, 32> ck{};
+  ck.fill(0x42);
+  mi::client::media::MediaRatchet sender(ck, mi::media::StreamKind::kVideo);
+  mi::client::media::MediaRatchet receiver(ck, mi::media::StreamKind::kVideo);
+  mi::media::MediaFrame frame;
+  frame.kind = mi::media::StreamKind::kVideo;
+  frame.flags = mi::media::kFrameKey;
+  frame.timestamp_ms = 77;
+  frame.payload = {1, 2, 3};
+  mi::client::media::MediaTransportInfo transport;
+  transport.seq = 65535;
+  transport.send_time_ms = 123456;
+  std::vector<std::uint8_t> packet;
+  std::string err;
+  bool ok = sender.EncryptFrame(frame, 1, transport, packet, err);
+  assert(ok);
+  assert(packet[0] == mi::client::media::kMediaPacketTransportVersion);
+
+  mi::client::media::MediaTransportInfo peeked;
+  ok = mi::client::media::PeekMediaPacketTransport(packet, peeked);
+  assert(ok);
+  assert(peeked.seq == 65535 && peeked.send_time_ms == 123456);
+  mi::media::StreamKind kind{};
+  std::uint32_t key_id = 0;
+  std::uint32_t seq = 0;
+  ok = mi::client::media::PeekMediaPacketHeaderWithKeyId(packet, kind, key_id,
+                                                         seq);
+  assert(ok);
+  assert(kind == mi::media::StreamKind::kVideo && key_id == 1 && seq == 0);
+
+  // The transport fields are authenticated.
+  std::vector<std::uint8_t> tampered = packet;
+  tampered[3] ^= 0x01;
+  mi::media::MediaFrame out;
+  mi::client::media::MediaRatchet tampered_receiver(
+      ck, mi::media::StreamKind::kVideo);
+  assert(!tampered_receiver.DecryptFrame(tampered, out, err));
+  ok = receiver.DecryptFrame(packet, out, err);
+  assert(ok);
+  assert(out.payload == frame.payload);
+  (void)ok;
+}
+
+}  // namespace
+
+int main() {
+  TestFeedbackCodec();
+  TestTransportHeader();
+
+  // Clean 5 Mbps link: ramps well above the start rate without queueing.
+  const LinkProfile wide{"wide", 5000, 30, 0.0, 500, ~0ull, 5000};
+  const SimResult wide_res = Run(wide, 30000);
+  assert(wide_res.final_bps > 1000000);
+  assert(wide_res.avg_queue_ms < 50.0);
+
+  // 600 kbps bottleneck: converges near capacity, keeps the queue short.
+  const LinkProfile narrow{"narrow", 600, 40, 0.0, 1000, ~0ull, 600};
+  const SimResult narrow_res = Run(narrow, 40000);
+  assert(narrow_res.final_bps > 300000 && narrow_res.final_bps < 800000);
+  assert(narrow_res.avg_queue_ms < 200.0);
+
+  // Capacity drops from 2 Mbps to 400 kbps: the estimate follows it down
+  // from delay growth alone (the queue is deep enough that nothing is lost).
+  const LinkProfile drop{"drop", 2000, 30, 0.0, 2000, 20000, 400};
+  const SimResult drop_res = Run(drop, 40000);
+  assert(drop_res.bps_at_change > 800000);
+  assert(drop_res.final_bps < 550000);
+
+  // 15% random loss on a fat link: the loss controller backs off.
+  const LinkProfile lossy{"lossy", 5000, 30, 0.15, 500, ~0ull, 5000};
+  const SimResult lossy_res = Run(lossy, 20000);
+  assert(lossy_res.final_bps < 300000);
+  (void)wide_res;
+  (void)narrow_res;
+  (void)drop_res;
+  (void)lossy_res;
+  return 0;
+}
@@ -18,12 +18,14 @@ std::array<std::uint8_t, 16> MakeCallId() {
 
 int main() {
   using mi::client::media::DecodeMediaPacket;
+  using mi::client::media::DeriveLayerChainKey;
   using mi::client::media::DeriveStreamChainKeys;
   using mi::client::media::EncodeMediaPacket;
   using mi::client::media::MediaKeyPair;
   using mi::client::media::MediaPacket;
   using mi::client::media::MediaRatchet;
   using mi::client::media::PeekMediaPacketHeaderWithKeyId;
+  using mi::client::media::PeekMediaPacketLayer;
   using mi::media::MediaFrame;
   using mi::media::StreamKind;
 
@@ -73,5 +75,61 @@ int main() {
   assert(key_id == 1);
   assert(seq == 5);
 
+  MediaKeyPair video_keys;
+  MediaKeyPair video_peer_keys;
+  assert(DeriveStreamChainKeys(media_root, StreamKind::kVideo, true,
+                               video_keys));
+  assert(DeriveStreamChainKeys(media_root, StreamKind::kVideo, false,
+                               video_peer_keys));
+  MediaRatchet video_sender(video_keys.send_ck, StreamKind::kVideo, 0, 7);
+  MediaRatchet video_receiver(video_peer_keys.recv_ck, StreamKind::kVideo, 0,
+                              7);
+  MediaFrame video = frame;
+  video.kind = StreamKind::kVideo;
+  video.flags = mi::media::kFrameKey;
+  std::vector<std::uint8_t> layered;
+  assert(video_sender.EncryptFrame(video, 2, layered, err));
+  assert(DecodeMediaPacket(layered, decoded));
+  assert(decoded.version == mi::client::media::kMediaPacketLayeredVersion);
+  assert(decoded.layer == 2);
+  assert(decoded.keyframe);
+  assert(PeekMediaPacketHeaderWithKeyId(layered, kind, key_id, seq));
+  assert(kind == StreamKind::kVideo && key_id == 7 && seq == 0);
+  // The layer byte is authenticated even though relays can read it.
+  MediaRatchet tampered_receiver(video_peer_keys.recv_ck, StreamKind::kVideo,
+                                 0, 7);
+  std::vector<std::uint8_t> relabeled = layered;
+  relabeled[2] = 1;
+  assert(!tampered_receiver.DecryptFrame(relabeled, out, err));
+  assert(video_receiver.DecryptFrame(layered, out, err));
+  assert(out.payload == frame.payload);
+  assert(!video_sender.EncryptFrame(video, 3, layered, err));
+
+  std::uint8_t layer = 0xFF;
+  assert(PeekMediaPacketLayer(layered, layer) && layer == 2);
+  assert(PeekMediaPacketLayer(packet, layer) && layer == 0);
+
+  // Layer 0 keeps the stream chain; the others get independent chains so a
+  // subscriber forwarded only layer 1 decrypts from seq 0 without gaps.
+  std::array<std::uint8_t, 32> layer_ck{};
+  assert(DeriveLayerChainKey(video_keys.send_ck, 0, layer_ck));
+  assert(layer_ck == video_keys.send_ck);
+  std::array<std::uint8_t, 32> layer1_ck{};
+  std::array<std::uint8_t, 32> layer2_ck{};
+  assert(DeriveLayerChainKey(video_keys.send_ck, 1, layer1_ck));
+  assert(DeriveLayerChainKey(video_keys.send_ck, 2, layer2_ck));
+  assert(layer1_ck != video_keys.send_ck && layer1_ck != layer2_ck);
+  assert(!DeriveLayerChainKey(video_keys.send_ck, 3, layer_ck));
+
+  MediaRatchet layer1_sender(layer1_ck, StreamKind::kVideo, 0, 7);
+  MediaRatchet layer1_receiver(layer1_ck, StreamKind::kVideo, 0, 7);
+  MediaRatchet layer2_receiver(layer2_ck, StreamKind::kVideo, 0, 7);
+  std::vector<std::uint8_t> layer1_packet;
+  assert(layer1_sender.EncryptFrame(video, 1, layer1_packet, err));
+  assert(PeekMediaPacketLayer(layer1_packet, layer) && layer == 1);
+  assert(!layer2_receiver.DecryptFrame(layer1_packet, out, err));
+  assert(layer1_receiver.DecryptFrame(layer1_packet, out, err));
+  assert(out.payload == frame.payload);
+
   return 0;
 }
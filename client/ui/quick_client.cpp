@@ -67,6 +67,7 @@ constexpr std::uint8_t kGroupCallOpLeave = 3;
 constexpr std::uint8_t kGroupCallOpEnd = 4;
 constexpr std::uint8_t kGroupCallOpUpdate = 5;
 constexpr std::uint8_t kGroupCallOpPing = 6;
+constexpr std::uint8_t kGroupCallOpRoster = 7;
 constexpr std::uint8_t kGroupCallMediaAudio = 0x01;
 constexpr std::uint8_t kGroupCallMediaVideo = 0x02;
 constexpr int kMaxPinyinCandidatesPerKey = 5;
@@ -4503,7 +4504,9 @@ void QuickClient::HandleGroupCallEvents(
       rooms_changed = true;
     } else {
       group_call_rooms_map_[ev.group_id] = ev.call_id;
-      group_call_media_flags_[ev.group_id] = ev.media_flags;
+      if (op != kGroupCallOpRoster) {
+        group_call_media_flags_[ev.group_id] = ev.media_flags;
+      }
       rooms_changed = true;
     }
 
@@ -4517,6 +4520,19 @@ void QuickClient::HandleGroupCallEvents(
         RemoveGroupCallParticipant(ev.sender);
       } else if (op == kGroupCallOpUpdate) {
         group_call_member_media_flags_[ev.sender] = ev.media_flags;
+      } else if (op == kGroupCallOpRoster) {
+        for (const auto& change : ev.roster) {
+          if (change.op == kGroupCallOpLeave) {
+            group_call_member_media_flags_.erase(change.username);
+            RemoveGroupCallParticipant(change.username);
+            continue;
+          }
+          group_call_member_media_flags_[change.username] =
+              change.media_flags;
+          if (change.op == kGroupCallOpJoin) {
+            AddGroupCallParticipant(change.username);
+          }
+        }
       } else if (op == kGroupCallOpEnd) {
         StopMedia();
         emit groupCallStateChanged();
@@ -19,7 +19,9 @@
 #include "group_directory.h"
 #include "group_manager.h"
 #include "key_transparency.h"
+#include "kt_sth_signer.h"
 #include "media_relay.h"
+#include "media_udp_server.h"
 #include "offline_storage.h"
 #include "session_manager.h"
 
@@ -146,6 +148,14 @@ struct FileBlobUploadChunkResponse {
   std::string error;
 };
 
+struct FileBlobUploadStatusResponse {
+  bool success{false};
+  std::uint64_t bytes_received{0};
+  std::uint64_t expected_size{0};
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> missing;
+  std::string error;
+};
+
 struct FileBlobUploadFinishResponse {
   bool success{false};
   StoredFileMeta meta;
@@ -176,6 +186,9 @@ struct OfflinePushResponse {
 struct OfflinePullResponse {
   bool success{false};
   std::vector<std::vector<std::uint8_t>> messages;
+  bool paged{false};
+  std::uint64_t cursor{0};
+  bool has_more{false};
   std::string error;
 };
 
@@ -286,6 +299,9 @@ struct PrivatePullResponse {
     std::vector<std::uint8_t> payload;
   };
   std::vector<Entry> messages;
+  bool paged{false};
+  std::uint64_t cursor{0};
+  bool has_more{false};
   std::string error;
 };
 
@@ -304,6 +320,14 @@ struct MediaPullResponse {
   std::string error;
 };
 
+struct MediaFlowOpenResponse {
+  bool success{false};
+  std::uint64_t flow_id{0};
+  std::array<std::uint8_t, 32> key{};
+  std::uint16_t port{0};
+  std::string error;
+};
+
 struct GroupCallSignalResponse {
   bool success{false};
   std::array<std::uint8_t, 16> call_id{};
@@ -322,6 +346,7 @@ struct GroupCallSignalPullResponse {
     std::string sender;
     std::uint8_t media_flags{0};
     std::uint64_t ts_ms{0};
+    std::vector<GroupCallRosterChange> roster;
   };
   std::vector<Entry> events;
   std::string error;
@@ -340,6 +365,9 @@ struct GroupCipherPullResponse {
     std::vector<std::uint8_t> payload;
   };
   std::vector<Entry> messages;
+  bool paged{false};
+  std::uint64_t cursor{0};
+  bool has_more{false};
   std::string error;
 };
 
@@ -362,6 +390,9 @@ struct DeviceSyncPushResponse {
 struct DeviceSyncPullResponse {
   bool success{false};
   std::vector<std::vector<std::uint8_t>> messages;
+  bool paged{false};
+  std::uint64_t cursor{0};
+  bool has_more{false};
   std::string error;
 };
 
@@ -402,7 +433,13 @@ class ApiService {
              std::uint32_t group_threshold = 10000,
              std::optional<MySqlConfig> friend_mysql = std::nullopt,
              std::filesystem::path kt_dir = {},
-             std::filesystem::path kt_signing_key = {});
+             std::filesystem::path kt_signing_key = {},
+             KtEpochOptions kt_epoch = {},
+             KtCheckpointOptions kt_checkpoint = {});
+
+  // Routes media arriving on |udp|'s flows back through this service; set
+  // before |udp| is started.
+  void SetMediaUdp(MediaUdpServer* udp);
 
   LoginResponse Login(const LoginRequest& req, TransportKind transport);
   OpaqueRegisterStartResponse OpaqueRegisterStart(
@@ -451,10 +488,18 @@ class ApiService {
 
   FileBlobUploadResponse StoreE2eeFileBlob(
       const std::string& token, const std::vector<std::uint8_t>& blob);
+  FileBlobUploadResponse StoreE2eeFileBlob(const std::string& token,
+                                           const std::uint8_t* blob,
+                                           std::size_t blob_len);
 
   FileBlobDownloadResponse LoadE2eeFileBlob(const std::string& token,
                                              const std::string& file_id,
                                              bool wipe_after_read = true);
+  // Streams the blob into |write| instead of resp.blob.
+  FileBlobDownloadResponse LoadE2eeFileBlob(const std::string& token,
+                                             const std::string& file_id,
+                                             bool wipe_after_read,
+                                             const OfflineChunkWriter& write);
 
   FileBlobUploadStartResponse StartE2eeFileBlobUpload(
       const std::string& token, std::uint64_t expected_size = 0);
@@ -463,6 +508,20 @@ class ApiService {
       const std::string& token, const std::string& file_id,
       const std::string& upload_id, std::uint64_t offset,
       const std::vector<std::uint8_t>& chunk);
+  FileBlobUploadChunkResponse UploadE2eeFileBlobChunk(
+      const std::string& token, const std::string& file_id,
+      const std::string& upload_id, std::uint64_t offset,
+      const std::uint8_t* chunk, std::size_t chunk_len);
+  // Opens |stream| for a chunk whose bytes are written as they are received;
+  // the caller finishes it with OfflineStorage::EndBlobUploadChunk.
+  FileBlobUploadChunkResponse BeginE2eeFileBlobChunk(
+      const std::string& token, const std::string& file_id,
+      const std::string& upload_id, std::uint64_t offset,
+      std::uint64_t chunk_len, OfflineStorage::BlobChunkStream& stream);
+
+  FileBlobUploadStatusResponse QueryE2eeFileBlobUpload(
+      const std::string& token, const std::string& file_id,
+      const std::string& upload_id);
 
   FileBlobUploadFinishResponse FinishE2eeFileBlobUpload(
       const std::string& token, const std::string& file_id,
@@ -481,7 +540,9 @@ class ApiService {
                                      const std::string& recipient,
                                      std::vector<std::uint8_t> payload);
 
-  OfflinePullResponse PullOffline(const std::string& token);
+  OfflinePullResponse PullOffline(
+      const std::string& token,
+      const std::optional<OfflinePageRequest>& page = std::nullopt);
 
   FriendListResponse ListFriends(const std::string& token);
   FriendSyncResponse SyncFriends(const std::string& token,
@@ -532,7 +593,9 @@ class ApiService {
       const std::string& token, const std::string& group_id,
       const std::string& recipient, std::vector<std::uint8_t> payload);
 
-  PrivatePullResponse PullPrivate(const std::string& token);
+  PrivatePullResponse PullPrivate(
+      const std::string& token,
+      const std::optional<OfflinePageRequest>& page = std::nullopt);
 
   MediaPushResponse PushMedia(const std::string& token,
                               const std::string& recipient,
@@ -568,11 +631,24 @@ class ApiService {
                                    std::uint32_t max_packets,
                                    std::uint32_t wait_ms);
 
+  // Grants a UDP media flow for a 1:1 call with |peer| or, with |group_id|,
+  // for a group call the user has joined.
+  MediaFlowOpenResponse OpenMediaFlow(const std::string& token,
+                                      const std::string& group_id,
+                                      const std::array<std::uint8_t, 16>& call_id,
+                                      const std::string& peer);
+
+  // Relays a packet received on an open UDP media flow.
+  MediaPushResponse RelayFlowMedia(const MediaFlowInfo& flow,
+                                   std::vector<std::uint8_t> payload);
+
   GroupCipherSendResponse SendGroupCipher(const std::string& token,
                                           const std::string& group_id,
                                           std::vector<std::uint8_t> payload);
 
-  GroupCipherPullResponse PullGroupCipher(const std::string& token);
+  GroupCipherPullResponse PullGroupCipher(
+      const std::string& token,
+      const std::optional<OfflinePageRequest>& page = std::nullopt);
 
   GroupNoticePullResponse PullGroupNotices(const std::string& token);
 
@@ -580,8 +656,9 @@ class ApiService {
                                         const std::string& device_id,
                                         std::vector<std::uint8_t> payload);
 
-  DeviceSyncPullResponse PullDeviceSync(const std::string& token,
-                                        const std::string& device_id);
+  DeviceSyncPullResponse PullDeviceSync(
+      const std::string& token, const std::string& device_id,
+      const std::optional<OfflinePageRequest>& page = std::nullopt);
 
   DeviceListResponse ListDevices(const std::string& token,
                                  const std::string& device_id);
@@ -662,7 +739,17 @@ class ApiService {
   bool RateLimitFile(const std::string& action, const std::string& token,
                      std::optional<Session>& out_session,
                      std::string& out_error);
+  MediaPushResponse RelayPeerMedia(const std::string& sender,
+                                   const std::string& recipient,
+                                   const std::array<std::uint8_t, 16>& call_id,
+                                   std::vector<std::uint8_t> payload);
+  MediaPushResponse RelayGroupMedia(const std::string& sender,
+                                    const std::string& group_id,
+                                    const std::array<std::uint8_t, 16>& call_id,
+                                    std::vector<std::uint8_t> payload);
   bool SignKtSth(KeyTransparencySth& sth, std::string& out_error);
+  bool SignedKtHead(std::uint64_t min_tree_size, KeyTransparencySth& out_sth,
+                    std::string& out_error);
   FriendListResponse ListFriendsInternal(const Session& session);
   std::uint32_t CurrentFriendVersionLocked(const std::string& username) const;
   void BumpFriendVersionLocked(const std::string& username);
@@ -679,6 +766,7 @@ class ApiService {
   OfflineStorage* storage_;
   OfflineQueue* queue_;
   MediaRelay* media_relay_;
+  MediaUdpServer* media_udp_{nullptr};
   std::uint32_t group_threshold_;
   std::optional<MySqlConfig> friend_mysql_;
 
@@ -713,6 +801,8 @@ class ApiService {
   std::array<std::uint8_t, kKtSthSigSecretKeyBytes> kt_signing_sk_{};
   bool kt_signing_ready_{false};
   std::string kt_signing_error_;
+  // Last member: stopped before the log and key it signs with go away.
+  std::unique_ptr<KtSthSigner> kt_signer_;
 };
 
 }  // namespace mi::server
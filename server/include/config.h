@@ -29,6 +29,10 @@ struct ServerSection {
   std::uint16_t listen_port{0};
   std::uint32_t group_rotation_threshold{10000};
   std::string offline_dir;
+  std::uint32_t offline_queue_memory_mb{512};
+  std::uint32_t offline_queue_recipient_mb{32};
+  std::uint32_t offline_blob_open_files{256};
+  std::uint32_t offline_key_sync{2};
   bool debug_log{false};
   std::uint32_t session_ttl_sec{0};
   std::uint32_t max_connections{256};
@@ -49,6 +53,10 @@ struct ServerSection {
   bool require_tls_set{false};
   std::string tls_cert{"mi_e2ee_server.pfx"};
   std::string kt_signing_key;
+  std::uint32_t kt_epoch_ms{200};
+  std::uint32_t kt_epoch_leaves{256};
+  std::uint32_t kt_checkpoint_ms{300000};
+  std::uint32_t kt_checkpoint_leaves{4096};
   KeyProtectionMode key_protection{
 #ifdef _WIN32
       KeyProtectionMode::kDpapiMachine
@@ -61,6 +69,8 @@ struct ServerSection {
   bool secure_delete_required{false};
   std::string secure_delete_plugin;
   std::string secure_delete_plugin_sha256;
+  std::uint32_t secure_delete_workers{1};
+  std::uint32_t secure_delete_mb_per_sec{0};
   bool kcp_enable{false};
   std::uint16_t kcp_port{0};
   std::uint32_t kcp_mtu{1400};
@@ -72,6 +82,14 @@ struct ServerSection {
   std::uint32_t kcp_nc{1};
   std::uint32_t kcp_min_rto{30};
   std::uint32_t kcp_session_idle_sec{60};
+  std::uint32_t kcp_workers{0};
+  std::uint32_t kcp_batch{32};
+  bool kcp_gso{true};
+  std::uint32_t kcp_handler_threads{0};
+  bool kcp_fec{false};
+  std::uint32_t kcp_fec_data_shards{8};
+  std::uint32_t kcp_fec_parity_shards{3};
+  bool kcp_fec_adaptive{true};
   bool ops_enable{false};
   bool ops_allow_remote{false};
   shard::ScrambledString ops_token;
@@ -84,6 +102,12 @@ struct CallSection {
   std::uint32_t call_timeout_sec{3600};
   std::uint32_t media_ttl_ms{5000};
   std::uint32_t max_subscriptions{0};
+  std::uint32_t roster_coalesce_ms{0};
+  bool media_udp_enable{false};
+  std::uint16_t media_udp_port{0};
+  std::uint32_t media_udp_pps{2000};
+  std::uint32_t media_udp_kbps{8000};
+  std::uint32_t media_udp_idle_sec{30};
 };
 
 struct ServerConfig {
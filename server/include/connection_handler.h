@@ -12,6 +12,7 @@
 #include <string>
 #include <mutex>
 
+#include "api_service.h"
 #include "frame.h"
 #include "server_app.h"
 #include "secure_channel.h"
@@ -28,6 +29,12 @@ class ConnectionHandler {
               const std::string& remote_ip,
               TransportKind transport = TransportKind::kLocal);
 
+  class UploadChunkStream;
+
+  // Returns null when the frame should be buffered and passed to OnData.
+  std::unique_ptr<UploadChunkStream> BeginUploadChunkStream(
+      FrameType type, std::uint32_t payload_len, TransportKind transport);
+
   struct OpsMetrics {
     static constexpr std::size_t kLatencySampleCount = 1024;
     static constexpr std::size_t kPerfSampleCount = 120;
@@ -79,6 +86,13 @@ class ConnectionHandler {
     std::chrono::steady_clock::time_point last_seen{};
   };
 
+  std::shared_ptr<ChannelState> ChannelStateFor(const std::string& token);
+  bool SealResponseLocked(ChannelState& state, const std::string& token,
+                          const Frame& out,
+                          std::vector<std::uint8_t>& out_bytes);
+  void FinishRequest(std::chrono::steady_clock::time_point start,
+                     bool success);
+
   bool AllowUnauthByIp(const std::string& remote_ip);
   void ReportUnauthOutcome(const std::string& remote_ip, bool success);
   void CleanupUnauthStateLocked(std::chrono::steady_clock::time_point now);
@@ -99,6 +113,50 @@ class ConnectionHandler {
   std::unordered_map<std::string, std::shared_ptr<ChannelState>> channel_states_;
 };
 
+// Large kE2eeFileUploadChunk frames are decrypted a window at a time as
+// their bytes arrive and written to the upload file, so neither the frame
+// nor the chunk is ever buffered whole. The written range is committed only
+// once the tag checks out. Feed() is handed the frame payload (after the
+// header) in arbitrary pieces; Finish() produces the reply once all of it
+// was fed.
+// Either returns false when the connection must be dropped.
+class ConnectionHandler::UploadChunkStream {
+ public:
+  ~UploadChunkStream();
+
+  bool Feed(const std::uint8_t* data, std::size_t len);
+  bool Finish(std::vector<std::uint8_t>& out_bytes);
+  std::uint64_t remaining() const { return payload_len_ - consumed_; }
+  // Frame bytes currently held in memory.
+  std::size_t buffered_bytes() const { return head_.capacity() + plain_.size(); }
+
+ private:
+  friend class ConnectionHandler;
+  enum class Phase : std::uint8_t { kEnvelope, kCipher, kTag, kDiscard };
+
+  bool OnEnvelope();
+  void OnPlain(const std::uint8_t* data, std::size_t len);
+  void AbortChunk();
+
+  ConnectionHandler* owner_{nullptr};
+  std::chrono::steady_clock::time_point start_{};
+  std::uint64_t payload_len_{0};
+  std::uint64_t consumed_{0};
+  Phase phase_{Phase::kEnvelope};
+  std::vector<std::uint8_t> head_;
+  std::string token_;
+  std::shared_ptr<ChannelState> state_;
+  SecureChannel::DecryptStream decrypt_;
+  std::array<std::uint8_t, 16> tag_{};
+  std::size_t tag_len_{0};
+  bool header_done_{false};
+  OfflineStorage::BlobChunkStream chunk_;
+  FileBlobUploadChunkResponse resp_;
+  bool logout_{false};
+  bool malformed_{false};
+  std::array<std::uint8_t, 64 * 1024> plain_{};
+};
+
 }  // namespace mi::server
 
 #endif  // MI_E2EE_SERVER_CONNECTION_HANDLER_H
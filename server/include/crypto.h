@@ -13,6 +13,28 @@ struct Sha256Digest {
 
 void Sha256(const std::uint8_t* data, std::size_t len, Sha256Digest& out);
 
+// out[i] = SHA-256 of data[i][0, lens[i]) for every i < count. Hashes eight
+// messages at a time where AVX2 is the fastest backend; meant for many short
+// messages of similar length such as Merkle nodes.
+void Sha256Batch(const std::uint8_t* const* data, const std::size_t* lens,
+                 std::size_t count, Sha256Digest* out);
+
+// The backend is picked from the CPU on first use: the SHA extensions if
+// present, and for batches AVX2 8-way when there are none.
+enum class Sha256Backend : std::uint8_t {
+  kPortable = 0,
+  kShaNi = 1,     // x86 SHA extensions
+  kArmSha2 = 2,   // ARMv8 SHA2 instructions
+  kAvx2x8 = 3,    // AVX2 8-way multi-buffer, batches only
+};
+
+bool Sha256BackendSupported(Sha256Backend backend);
+// Pins Sha256 and Sha256Batch to |backend| for tests and benchmarks; with
+// kAvx2x8 single messages use the portable code. False if the CPU lacks it.
+// Not to be called while other threads hash.
+bool ForceSha256Backend(Sha256Backend backend);
+void ResetSha256Backend();
+
 void HmacSha256(const std::uint8_t* key, std::size_t key_len,
                 const std::uint8_t* data, std::size_t data_len,
                 Sha256Digest& out);
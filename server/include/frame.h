@@ -67,7 +67,9 @@ enum class FrameType : std::uint16_t {
   kGroupCallSignal = 52,
   kGroupCallSignalPull = 53,
   kGroupMediaPush = 54,
-  kGroupMediaPull = 55
+  kGroupMediaPull = 55,
+  kE2eeFileUploadStatus = 56,
+  kMediaFlowOpen = 57
 };
 
 struct Frame {
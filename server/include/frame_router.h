@@ -1,7 +1,9 @@
 #ifndef MI_E2EE_SERVER_FRAME_ROUTER_H
 #define MI_E2EE_SERVER_FRAME_ROUTER_H
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 #include "api_service.h"
 #include "frame.h"
@@ -22,6 +24,10 @@ class FrameRouter {
   ApiService* api_;
 };
 
+// Shared with the connection layer, which answers streamed upload chunks.
+std::vector<std::uint8_t> EncodeE2eeFileUploadChunkResp(
+    const FileBlobUploadChunkResponse& resp);
+
 }  // namespace mi::server
 
 #endif  // MI_E2EE_SERVER_FRAME_ROUTER_H
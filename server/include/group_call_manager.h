@@ -2,11 +2,14 @@
 #define MI_E2EE_SERVER_GROUP_CALL_MANAGER_H
 
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <deque>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -20,11 +23,19 @@ enum class GroupCallOp : std::uint8_t {
   kLeave = 3,
   kEnd = 4,
   kUpdate = 5,
-  kPing = 6
+  kPing = 6,
+  // Coalesced join/leave/update changes of one call, see
+  // GroupCallEvent::roster.
+  kRoster = 7
 };
 
 constexpr std::uint8_t kGroupCallMediaAudio = 0x01;
 constexpr std::uint8_t kGroupCallMediaVideo = 0x02;
+// Subscription flags may carry (preferred video layer + 1) in these bits;
+// zero asks for the top layer.
+constexpr std::uint8_t kGroupCallLayerMask = 0x30;
+constexpr std::uint8_t kGroupCallLayerShift = 4;
+constexpr std::uint8_t kGroupCallMaxLayers = 3;
 
 struct GroupCallConfig {
   bool enable_group_call{false};
@@ -32,11 +43,25 @@ struct GroupCallConfig {
   std::uint32_t idle_timeout_sec{60};
   std::uint32_t call_timeout_sec{3600};
   std::uint32_t max_subscriptions{0};
+  // Membership changes within this window go out as one kRoster event per
+  // member; 0 queues every join/leave/update for every member right away.
+  // Off by default: clients that predate kRoster ignore it and would stop
+  // seeing participants come and go.
+  std::uint32_t roster_coalesce_ms{0};
 };
 
 struct GroupCallSubscription {
   std::string sender;
   std::uint8_t media_flags{0};
+  std::uint8_t video_layer{kGroupCallMaxLayers - 1};
+};
+
+// Net change of one member over a coalescing window: kJoin, kLeave or
+// kUpdate.
+struct GroupCallRosterChange {
+  std::string username;
+  GroupCallOp op{GroupCallOp::kJoin};
+  std::uint8_t media_flags{0};
 };
 
 struct GroupCallEvent {
@@ -47,6 +72,7 @@ struct GroupCallEvent {
   std::string sender;
   std::uint8_t media_flags{0};
   std::uint64_t ts_ms{0};
+  std::vector<GroupCallRosterChange> roster;
 };
 
 struct GroupCallSnapshot {
@@ -58,9 +84,35 @@ struct GroupCallSnapshot {
   std::vector<std::string> members;
 };
 
+// Immutable forwarding table of one call, rebuilt whenever its roster or a
+// subscription changes. Row s of audio/video is a bitset over members: bit r
+// is set when members[r] takes that kind of media from members[s]. Row
+// s * kGroupCallMaxLayers + l of layers marks who prefers s's video layer l.
+struct GroupCallFanout {
+  std::string group_id;
+  std::uint64_t version{0};
+  std::vector<std::string> members;
+  std::unordered_map<std::string, std::uint32_t> index;
+  std::size_t words{0};
+  std::vector<std::uint64_t> audio;
+  std::vector<std::uint64_t> video;
+  std::vector<std::uint64_t> layers;
+
+  // Returns the |words|-long recipient bitset of |sender|, or null.
+  const std::uint64_t* Targets(std::uint32_t sender,
+                               std::uint8_t media_flag) const;
+  // Returns kGroupCallMaxLayers consecutive bitsets, or null.
+  const std::uint64_t* PreferredLayers(std::uint32_t sender) const;
+};
+
 struct GroupCallStats {
   std::uint64_t active_calls{0};
   std::uint64_t participants{0};
+  // Events appended to member queues, and roster events folded into one
+  // already waiting in a queue instead.
+  std::uint64_t events_queued{0};
+  std::uint64_t events_merged{0};
+  std::uint64_t roster_flushes{0};
 };
 
 class GroupCallManager {
@@ -116,10 +168,15 @@ class GroupCallManager {
                     const std::string& recipient,
                     const std::string& sender,
                     std::uint8_t media_flag) const;
+  std::shared_ptr<const GroupCallFanout> GetFanout(
+      const std::array<std::uint8_t, 16>& call_id) const;
 
   void EnqueueEvent(const std::string& recipient, GroupCallEvent event);
   void EnqueueEventForMembers(const std::vector<std::string>& members,
                               const GroupCallEvent& event);
+  // Join/leave/update of event.sender, delivered to the current members of
+  // event.call_id (coalesced when roster_coalesce_ms is set).
+  void PublishMemberEvent(const GroupCallEvent& event);
 
   void PullEvents(const std::string& recipient,
                   std::size_t max_events,
@@ -131,6 +188,9 @@ class GroupCallManager {
 
  private:
   struct CallState {
+    std::mutex mutex;
+    std::uint64_t serial{0};
+    bool ended{false};
     std::string group_id;
     std::string owner;
     std::array<std::uint8_t, 16> call_id{};
@@ -139,11 +199,53 @@ class GroupCallManager {
     std::unordered_set<std::string> members;
     std::chrono::steady_clock::time_point created_at{};
     std::chrono::steady_clock::time_point last_active{};
+    struct SenderPref {
+      std::uint8_t flags{0};
+      std::uint8_t video_layer{kGroupCallMaxLayers - 1};
+    };
     struct SubscriptionState {
-      std::unordered_map<std::string, std::uint8_t> senders;
+      std::unordered_map<std::string, SenderPref> senders;
       std::chrono::steady_clock::time_point updated_at{};
     };
     std::unordered_map<std::string, SubscriptionState> subscriptions;
+    // Rebuilt on the next read after a roster/subscription change, so a
+    // burst of joins costs one rebuild.
+    std::shared_ptr<const GroupCallFanout> fanout;
+    bool fanout_dirty{true};
+    std::vector<GroupCallRosterChange> pending_roster;
+    std::unordered_map<std::string, std::size_t> pending_index;
+    std::chrono::steady_clock::time_point pending_since{};
+  };
+  using CallPtr = std::shared_ptr<CallState>;
+
+  // username -> serial of the call the user is in, 0 when none. Readers
+  // walk fixed bucket chains without a lock; nodes are pushed with CAS and
+  // only freed with the index, a user leaving just clears its slot.
+  class UserCallIndex {
+   public:
+    UserCallIndex() = default;
+    ~UserCallIndex();
+    UserCallIndex(const UserCallIndex&) = delete;
+    UserCallIndex& operator=(const UserCallIndex&) = delete;
+
+    bool Claim(const std::string& username, std::uint64_t serial);
+    void Release(const std::string& username, std::uint64_t serial);
+    std::uint64_t Find(const std::string& username) const;
+
+   private:
+    struct Node {
+      explicit Node(std::string name) : username(std::move(name)) {}
+      const std::string username;
+      std::atomic<std::uint64_t> serial{0};
+      Node* next{nullptr};
+    };
+    static constexpr std::size_t kBuckets = 4096;
+
+    std::atomic<Node*>& HeadFor(const std::string& username);
+    const std::atomic<Node*>& HeadFor(const std::string& username) const;
+    static Node* FindIn(Node* head, const std::string& username);
+
+    std::array<std::atomic<Node*>, kBuckets> heads_{};
   };
 
   struct EventQueue {
@@ -165,9 +267,24 @@ class GroupCallManager {
 
   static std::string CallIdKey(const std::array<std::uint8_t, 16>& call_id);
   static bool IsAllZero(const std::array<std::uint8_t, 16>& call_id);
+  static void CompactRoster(std::vector<GroupCallRosterChange>& roster);
 
   bool GenerateUniqueCallId(std::array<std::uint8_t, 16>& out_call_id);
+  CallPtr FindCall(const std::array<std::uint8_t, 16>& call_id) const;
+  CallPtr FindUserCall(const std::string& username) const;
   GroupCallSnapshot BuildSnapshotLocked(const CallState& state) const;
+  void RebuildFanoutLocked(CallState& state) const;
+  const std::shared_ptr<const GroupCallFanout>& FanoutLocked(
+      CallState& state) const;
+  void RetireCallLocked(CallState& state);
+  void AddRosterChangeLocked(CallState& state,
+                             const GroupCallRosterChange& change);
+  bool TakeRosterLocked(CallState& state,
+                        std::chrono::steady_clock::time_point now,
+                        GroupCallEvent& out_event,
+                        std::vector<std::string>& out_recipients);
+  std::chrono::steady_clock::time_point FlushDueRoster(
+      const std::string& username);
 
   Bucket& BucketForKey(const std::string& key);
 
@@ -175,12 +292,22 @@ class GroupCallManager {
   std::chrono::seconds call_timeout_{std::chrono::seconds(3600)};
   std::chrono::seconds idle_timeout_{std::chrono::seconds(60)};
   std::chrono::seconds event_ttl_{std::chrono::minutes(5)};
+  std::chrono::milliseconds roster_window_{std::chrono::milliseconds(200)};
   std::size_t max_event_queue_{256};
 
-  mutable std::mutex mutex_;
-  std::unordered_map<std::string, CallState> calls_by_id_;
+  // Registry only; call state is guarded by CallState::mutex. Lock order is
+  // CallState::mutex before calls_mutex_.
+  mutable std::shared_mutex calls_mutex_;
+  std::unordered_map<std::string, CallPtr> calls_by_id_;
+  std::unordered_map<std::uint64_t, CallPtr> calls_by_serial_;
   std::unordered_map<std::string, std::string> call_by_group_;
-  std::unordered_map<std::string, std::string> call_by_user_;
+  std::atomic<std::uint64_t> next_serial_{0};
+  mutable std::atomic<std::uint64_t> fanout_version_{0};
+  UserCallIndex call_by_user_;
+
+  std::atomic<std::uint64_t> events_queued_{0};
+  std::atomic<std::uint64_t> events_merged_{0};
+  std::atomic<std::uint64_t> roster_flushes_{0};
 
   std::array<Bucket, kBucketCount> buckets_{};
 };
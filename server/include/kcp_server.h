@@ -3,7 +3,10 @@
 
 #include <array>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -26,35 +29,108 @@ struct KcpOptions {
   std::uint32_t nc{1};
   std::uint32_t min_rto{30};
   std::uint32_t session_idle_sec{60};
+  // UDP worker threads, each with its own SO_REUSEPORT socket and sessions;
+  // 0 picks one per core (up to 64). Only Linux spreads peers across
+  // sockets, elsewhere a single worker is used.
+  std::uint32_t workers{0};
+  // Datagrams per recvmmsg/sendmmsg call.
+  std::uint32_t batch{32};
+  bool gso{true};
+  // Threads running the request handler, shared by all workers, so slow
+  // requests never hold up session I/O; 0 picks one per core.
+  std::uint32_t handler_threads{0};
+  // Reed-Solomon FEC under KCP for clients that ask for it in the cookie
+  // handshake; parity adapts to the loss each client reports.
+  bool fec{false};
+  std::uint32_t fec_data_shards{8};
+  std::uint32_t fec_parity_shards{3};
+  bool fec_adaptive{true};
+};
+
+struct KcpWorkerStats {
+  std::uint64_t rx_packets{0};
+  std::uint64_t rx_bytes{0};
+  std::uint64_t rx_calls{0};
+  std::uint64_t tx_packets{0};
+  std::uint64_t tx_bytes{0};
+  std::uint64_t tx_calls{0};
+  std::uint64_t sessions{0};
+  // ikcp_update calls; idle sessions are not updated at all.
+  std::uint64_t updates{0};
+  std::uint64_t fec_recovered{0};
 };
 
 class KcpServer {
  public:
+  // Handles one reassembled request; returning false drops the session.
+  using RequestHandler = std::function<bool(const std::vector<std::uint8_t>&,
+                                            std::vector<std::uint8_t>&,
+                                            const std::string& remote_ip)>;
+
   KcpServer(Listener* listener, std::uint16_t port, KcpOptions options,
             NetworkServerLimits limits);
+  KcpServer(RequestHandler handler, std::uint16_t port, KcpOptions options,
+            NetworkServerLimits limits);
   ~KcpServer();
 
   bool Start(std::string& error);
   void Stop();
 
+  std::uint16_t port() const { return bound_port_; }
+  std::size_t worker_count() const { return workers_.size(); }
+  std::vector<KcpWorkerStats> GetWorkerStats() const;
+
  private:
-  void Run();
-  bool StartSocket(std::string& error);
-  void StopSocket();
+  struct Completion;
+
+  struct Worker {
+    std::size_t index{0};
+    std::intptr_t sock{-1};
+    // Loopback socket the handler threads poke when |completions| goes from
+    // empty to non-empty.
+    std::intptr_t wake_sock{-1};
+    std::uint16_t wake_port{0};
+    std::atomic<Completion*> completions{nullptr};
+    std::thread thread;
+    std::atomic<std::uint64_t> rx_packets{0};
+    std::atomic<std::uint64_t> rx_bytes{0};
+    std::atomic<std::uint64_t> rx_calls{0};
+    std::atomic<std::uint64_t> tx_packets{0};
+    std::atomic<std::uint64_t> tx_bytes{0};
+    std::atomic<std::uint64_t> tx_calls{0};
+    std::atomic<std::uint64_t> sessions{0};
+    std::atomic<std::uint64_t> updates{0};
+    std::atomic<std::uint64_t> fec_recovered{0};
+  };
+
+  void Run(Worker& worker);
+  bool StartSockets(std::size_t count, std::string& error);
+  void StopSockets();
+  void StartHandlers();
+  void StopHandlers();
+  void HandlerLoop();
+  bool EnqueueRequest(Worker& worker, Completion* job);
+  void PostCompletion(Worker& worker, Completion* done);
   bool TryAcquireConnectionSlot(const std::string& remote_ip);
   void ReleaseConnectionSlot(const std::string& remote_ip);
   bool InitCookieSecret(std::string& error);
 
-  Listener* listener_;
+  RequestHandler handler_;
   std::uint16_t port_{0};
+  std::uint16_t bound_port_{0};
   KcpOptions options_{};
   NetworkServerLimits limits_{};
   std::atomic<bool> running_{false};
-  std::thread worker_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::mutex handler_mutex_;
+  std::condition_variable handler_cv_;
+  std::deque<std::function<void()>> handler_queue_;
+  std::vector<std::thread> handler_threads_;
+  bool handlers_running_{false};
   std::mutex conn_mutex_;
   std::unordered_map<std::string, std::uint32_t> connections_by_ip_;
   std::uint32_t active_connections_{0};
-  std::intptr_t sock_{-1};
+  bool wsa_started_{false};
   std::array<std::uint8_t, 32> cookie_secret_{};
   bool cookie_ready_{false};
 };
@@ -2,14 +2,21 @@
 #define MI_E2EE_SERVER_KEY_TRANSPARENCY_H
 
 #include <array>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
+#include <list>
+#include <map>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "kt_merkle.h"
+
 namespace mi::server {
 
 constexpr std::size_t kKtIdentitySigPublicKeyBytes = 1952;
@@ -18,8 +25,6 @@ constexpr std::size_t kKtSthSigPublicKeyBytes = 1952;
 constexpr std::size_t kKtSthSigSecretKeyBytes = 4032;
 constexpr std::size_t kKtSthSigBytes = 3309;
 
-using Sha256Hash = std::array<std::uint8_t, 32>;
-
 struct KeyTransparencySth {
   std::uint64_t tree_size{0};
   Sha256Hash root{};
@@ -45,9 +50,26 @@ struct KeyTransparencyProof {
   std::vector<Sha256Hash> consistency_path;
 };
 
+struct KtCheckpointOptions {
+  // Checked every |interval_ms|; a checkpoint is written once |min_leaves|
+  // leaves were appended since the last one. 0 disables the checkpointer.
+  std::uint32_t interval_ms{300000};
+  std::uint32_t min_leaves{4096};
+};
+
+// Appends are group-committed: concurrent UpdateIdentityKeys calls are
+// written with one write and one fdatasync on a persistent descriptor, and
+// the root is recomputed once per batch. Load truncates a torn tail left by
+// a crash mid-write. Checkpoints (kt_checkpoint.h) next to the log hold the
+// tree's nodes; Load maps the newest valid one and replays only the log
+// after it. Bulk leaf and level hashing runs on a KtMerkleBuilder.
 class KeyTransparencyLog {
  public:
   explicit KeyTransparencyLog(std::filesystem::path log_path);
+  ~KeyTransparencyLog();
+
+  KeyTransparencyLog(const KeyTransparencyLog&) = delete;
+  KeyTransparencyLog& operator=(const KeyTransparencyLog&) = delete;
 
   bool Load(std::string& error);
 
@@ -56,6 +78,12 @@ class KeyTransparencyLog {
       const std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes>& id_sig_pk,
       const std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes>& id_dh_pk,
       std::string& error);
+  // Also reports the user's leaf (the existing one if the keys are unchanged).
+  bool UpdateIdentityKeys(
+      const std::string& username,
+      const std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes>& id_sig_pk,
+      const std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes>& id_dh_pk,
+      std::uint64_t& out_leaf_index, std::string& error);
 
   KeyTransparencySth Head() const;
 
@@ -63,36 +91,106 @@ class KeyTransparencyLog {
                               std::uint64_t client_tree_size,
                               KeyTransparencyProof& out_proof,
                               std::string& error) const;
+  // Same, against the first |tree_size| leaves (a signed epoch head rather
+  // than the live tree). Fails if the user's latest key is not in it yet.
+  bool BuildProofForLatestKey(const std::string& username,
+                              std::uint64_t client_tree_size,
+                              std::uint64_t tree_size,
+                              KeyTransparencyProof& out_proof,
+                              std::string& error) const;
+
+  bool LatestLeafIndex(const std::string& username,
+                       std::uint64_t& out_index) const;
+
+  // Batches committed so far; at most one per append.
+  std::uint64_t commit_batches() const;
 
   bool BuildConsistencyProof(std::uint64_t old_size, std::uint64_t new_size,
                              std::vector<Sha256Hash>& out_proof,
                              std::string& error) const;
 
+  // Writes <log>.<tree size>.ckpt by rename, then serves the nodes it
+  // covers from the mapped file. The previous checkpoint is kept.
+  bool WriteCheckpoint(std::string& error);
+  void StartCheckpointer(const KtCheckpointOptions& options);
+  void StopCheckpointer();
+  // Leaves served from the mapped checkpoint.
+  std::uint64_t checkpoint_size() const;
+
  private:
   struct LatestKey {
     std::uint64_t leaf_index{0};
     Sha256Hash leaf_hash{};
   };
 
-  void RebuildPow2LevelsLocked();
-  void AppendLeafHashLocked(const Sha256Hash& leaf_hash);
-
-  bool AppendEntryLocked(const std::string& username,
-                         const std::array<std::uint8_t,
-                                          kKtIdentitySigPublicKeyBytes>& id_sig_pk,
-                         const std::array<std::uint8_t,
-                                          kKtIdentityDhPublicKeyBytes>& id_dh_pk,
-                         const Sha256Hash& leaf_hash,
-                         std::string& error);
+  // One UpdateIdentityKeys call waiting for its batch; lives on the
+  // caller's stack.
+  struct PendingAppend {
+    const std::string* username{nullptr};
+    Sha256Hash leaf_hash{};
+    std::vector<std::uint8_t> record;
+    bool done{false};
+    bool ok{false};
+    std::uint64_t leaf_index{0};
+    std::string error;
+  };
 
-  void RecomputeRootLocked();
+  std::filesystem::path CheckpointPath(std::uint64_t tree_size) const;
+  // Newest first.
+  std::vector<std::filesystem::path> ListCheckpoints() const;
+  bool LoadCheckpointLocked(const std::filesystem::path& path,
+                            std::uint64_t log_file_bytes, std::string& error);
+  void RunCheckpointer(KtCheckpointOptions options);
+
+  void CommitBatch(std::unique_lock<std::mutex>& lock);
+  bool OpenAppendFile(std::string& error);
+  bool WriteAndSync(const std::vector<std::uint8_t>& data, std::string& error);
+  void CloseAppendFile();
+
+  // Served from consistency_lru_ when recently asked for.
+  std::vector<Sha256Hash> ConsistencyProofLocked(std::uint64_t old_size,
+                                                 std::uint64_t new_size) const;
+  bool BuildProofLocked(const std::string& username,
+                        std::uint64_t client_tree_size, std::size_t n,
+                        KeyTransparencyProof& out_proof,
+                        std::string& error) const;
 
   std::filesystem::path log_path_;
   mutable std::mutex mutex_;
-  std::vector<Sha256Hash> leaves_;
-  std::vector<std::vector<Sha256Hash>> pow2_levels_;
-  Sha256Hash root_{};
+  KtMerkleBuilder builder_;
+  KtMerkleTree tree_;
   std::unordered_map<std::string, LatestKey> latest_by_user_;
+
+  // Clients mostly ask from one of a few recent heads to the current one, so
+  // the same (old_size, new_size) pairs repeat; a pair's proof never changes.
+  static constexpr std::size_t kConsistencyCacheEntries = 1024;
+  using ConsistencyKey = std::pair<std::uint64_t, std::uint64_t>;
+  using ConsistencyEntry = std::pair<ConsistencyKey, std::vector<Sha256Hash>>;
+  mutable std::list<ConsistencyEntry> consistency_lru_;
+  mutable std::map<ConsistencyKey, std::list<ConsistencyEntry>::iterator>
+      consistency_index_;
+
+  std::condition_variable commit_cv_;
+  std::vector<PendingAppend*> pending_;
+  bool committing_{false};
+  std::uint64_t commit_batches_{0};
+  // Log bytes holding the tree's leaves, and where the last record starts.
+  std::uint64_t log_bytes_{0};
+  std::uint64_t last_record_offset_{0};
+  // Touched only by the committing thread.
+  std::uint64_t file_size_{0};
+#ifdef _WIN32
+  void* file_{nullptr};
+#else
+  int fd_{-1};
+#endif
+
+  std::mutex checkpoint_write_mutex_;
+  std::filesystem::path checkpoint_path_;
+  std::mutex checkpointer_mutex_;
+  std::condition_variable checkpointer_cv_;
+  std::thread checkpointer_;
+  bool checkpointer_running_{false};
 };
 
 }  // namespace mi::server
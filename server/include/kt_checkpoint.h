@@ -0,0 +1,70 @@
+#ifndef MI_E2EE_SERVER_KT_CHECKPOINT_H
+#define MI_E2EE_SERVER_KT_CHECKPOINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kt_merkle.h"
+
+namespace mi::server {
+
+// Key transparency checkpoint, little-endian:
+//   magic "MIKTCKP1" | checksum [32] | tree_size u64 | log_bytes u64 |
+//   last_record_offset u64 | user_count u64 | nodes_offset u64 | root [32] |
+//   frontier [popcount(tree_size)][32] |
+//   user_count x (name_len u16 | name | leaf_index u64) |
+//   zero padding to a multiple of 32 |
+//   nodes [KtMerkleNodeCount(tree_size)][32] (KtMerkleBase order)
+// The checksum is SHA-256 over everything after it up to the nodes. The
+// nodes are mapped as they are; every interior node is checked against its
+// children on the loader's KtMerkleBuilder, and the frontier read from them
+// must match the stored one and fold to the root.
+struct KtCheckpointInfo {
+  std::uint64_t tree_size{0};
+  // Log prefix the checkpoint covers, and where its last record starts.
+  std::uint64_t log_bytes{0};
+  std::uint64_t last_record_offset{0};
+  Sha256Hash root{};
+  std::vector<Sha256Hash> frontier;
+  std::vector<std::pair<std::string, std::uint64_t>> users;
+};
+
+// Header, frontier and user index; the nodes are written after it, from
+// |nodes_offset|.
+std::vector<std::uint8_t> BuildKtCheckpointMeta(const KtCheckpointInfo& info,
+                                                std::uint64_t& nodes_offset);
+
+bool ParseKtCheckpoint(const std::uint8_t* data, std::size_t len,
+                       KtCheckpointInfo& out, std::uint64_t& nodes_offset,
+                       std::string& error);
+
+// Read-only map of a whole file.
+class KtMappedFile {
+ public:
+  KtMappedFile() = default;
+  ~KtMappedFile();
+
+  KtMappedFile(const KtMappedFile&) = delete;
+  KtMappedFile& operator=(const KtMappedFile&) = delete;
+
+  bool Open(const std::filesystem::path& path, std::string& error);
+
+  const std::uint8_t* data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+ private:
+  const std::uint8_t* data_{nullptr};
+  std::size_t size_{0};
+#ifdef _WIN32
+  void* file_{nullptr};
+  void* mapping_{nullptr};
+#endif
+};
+
+}  // namespace mi::server
+
+#endif  // MI_E2EE_SERVER_KT_CHECKPOINT_H
@@ -0,0 +1,162 @@
+#ifndef MI_E2EE_SERVER_KT_MERKLE_H
+#define MI_E2EE_SERVER_KT_MERKLE_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mi::server {
+
+using Sha256Hash = std::array<std::uint8_t, 32>;
+
+// Nodes of the first |size| leaves held outside the tree, e.g. in a mapped
+// checkpoint: level L's size >> L nodes, levels back to back from the leaves
+// up. |owner| keeps the memory alive.
+struct KtMerkleBase {
+  std::shared_ptr<const void> owner;
+  const Sha256Hash* nodes{nullptr};
+  std::uint64_t size{0};
+};
+
+// Nodes in a base of |tree_size| leaves.
+std::uint64_t KtMerkleNodeCount(std::uint64_t tree_size);
+
+// Hashes Merkle levels on a pool of threads, started on first use. A level
+// is cut into blocks of kBlockNodes parents (64 KiB of children) that the
+// workers and the calling thread take in turn; every block writes only its
+// own slots, so the result does not depend on the thread count. One call
+// runs at a time.
+class KtMerkleBuilder {
+ public:
+  static constexpr std::size_t kBlockNodes = 1024;
+  static constexpr std::size_t kLeafBlock = 64;
+
+  // |threads| includes the caller; 0 means the hardware concurrency.
+  explicit KtMerkleBuilder(std::size_t threads = 0);
+  ~KtMerkleBuilder();
+
+  KtMerkleBuilder(const KtMerkleBuilder&) = delete;
+  KtMerkleBuilder& operator=(const KtMerkleBuilder&) = delete;
+
+  std::size_t threads() const { return threads_; }
+
+  // Runs fn(block) for every block < |blocks| and returns once all are done.
+  void ParallelFor(std::size_t blocks,
+                   const std::function<void(std::size_t)>& fn);
+  // out[i] = node hash of children[2i] and children[2i + 1], i < |count|.
+  void HashPairs(const Sha256Hash* children, std::size_t count,
+                 Sha256Hash* out);
+  // out[i] = leaf hash of leaf_data[i].
+  void HashLeaves(const std::vector<std::vector<std::uint8_t>>& leaf_data,
+                  Sha256Hash* out);
+  // Root over |leaf_hashes| without keeping the levels, e.g. to check bulk
+  // audit data against a signed head.
+  Sha256Hash Root(std::vector<Sha256Hash> leaf_hashes);
+  // True if every node of |base| above the leaves is the node hash of its
+  // two children, e.g. before trusting a mapped checkpoint.
+  bool VerifyBase(const KtMerkleBase& base);
+
+ private:
+  void StartWorkers();
+  void WorkerLoop();
+  void RunBlocks();
+
+  std::size_t threads_{1};
+  std::mutex run_mutex_;
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(std::size_t)>* fn_{nullptr};
+  std::size_t blocks_{0};
+  std::atomic<std::size_t> next_block_{0};
+  std::size_t busy_{0};
+  std::uint64_t generation_{0};
+  bool stop_{false};
+};
+
+// RFC 6962 Merkle tree over leaf hashes. Every complete subtree is stored
+// (levels_[L][i] covers leaves [i << L, (i + 1) << L)), and so is the right
+// edge of the current tree: its compact range folded from the right into the
+// hash of each suffix [start, size) the proof recursion visits. Appends cost
+// O(log n) hashes, and proofs against the current size are lookups only.
+// A prefix of the tree may live in a KtMerkleBase; appends go to in-memory
+// tails. Not thread-safe.
+class KtMerkleTree {
+ public:
+  void Clear();
+  // Bulk build, O(n) hashes.
+  void Assign(std::vector<Sha256Hash> leaves);
+  void Append(const Sha256Hash& leaf_hash);
+  // New nodes hashed level by level in batches, one right-edge update.
+  void Append(const std::vector<Sha256Hash>& leaf_hashes);
+  // Replaces the tree with |base|'s leaves.
+  void AssignBase(KtMerkleBase base);
+  // Moves the first base.size leaves (at least the current base's) into
+  // |base|, which must hold the same nodes, and drops their in-memory copy.
+  bool Rebase(KtMerkleBase base);
+  std::uint64_t base_size() const { return base_.size; }
+  // Bulk builds and appends then hash levels on |builder|, which must
+  // outlive the tree; null hashes on the calling thread.
+  void SetBuilder(KtMerkleBuilder* builder) { builder_ = builder; }
+
+  std::uint64_t size() const {
+    return base_.size + static_cast<std::uint64_t>(levels_[0].size());
+  }
+  const Sha256Hash& root() const { return edge_.root; }
+  // Complete subtrees covering [0, size()), largest first.
+  std::vector<Sha256Hash> CompactRange() const;
+  // Level |level|'s nodes [begin, begin + count), in KtMerkleBase order.
+  void CopyNodes(std::size_t level, std::uint64_t begin, std::uint64_t count,
+                 Sha256Hash* out) const;
+
+  // |tree_size| <= size(); older sizes rebuild their right edge first
+  // (O(log n) hashes).
+  Sha256Hash RootAt(std::uint64_t tree_size) const;
+  // |leaf_index| < |tree_size| <= size().
+  std::vector<Sha256Hash> AuditPath(std::uint64_t leaf_index,
+                                    std::uint64_t tree_size) const;
+  // 0 < |old_size| < |new_size| <= size().
+  std::vector<Sha256Hash> ConsistencyProof(std::uint64_t old_size,
+                                           std::uint64_t new_size) const;
+
+ private:
+  struct RightEdge {
+    std::uint64_t size{0};
+    Sha256Hash root{};
+    // suffix_hash[i] is the hash of leaves [suffix_start[i], size).
+    std::vector<std::uint64_t> suffix_start;
+    std::vector<Sha256Hash> suffix_hash;
+  };
+
+  static Sha256Hash EmptyRoot();
+
+  const Sha256Hash& Node(std::size_t level, std::uint64_t index) const;
+  std::uint64_t LevelSize(std::size_t level) const;
+  void SetBase(KtMerkleBase base);
+  void AppendLevels(const Sha256Hash& leaf_hash);
+  // Adds the parents of |level|'s complete pairs missing one level up.
+  void HashUpLevel(std::size_t level);
+  RightEdge BuildEdge(std::uint64_t tree_size) const;
+  Sha256Hash SubtreeHash(const RightEdge& edge, std::uint64_t start,
+                         std::uint64_t count) const;
+
+  KtMerkleBuilder* builder_{nullptr};
+  KtMerkleBase base_;
+  std::vector<std::uint64_t> base_offsets_;
+  // Nodes past the base, per level.
+  std::vector<std::vector<Sha256Hash>> levels_{1};
+  RightEdge edge_{0, EmptyRoot(), {}, {}};
+};
+
+}  // namespace mi::server
+
+#endif  // MI_E2EE_SERVER_KT_MERKLE_H
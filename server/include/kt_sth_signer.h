@@ -0,0 +1,77 @@
+#ifndef MI_E2EE_SERVER_KT_STH_SIGNER_H
+#define MI_E2EE_SERVER_KT_STH_SIGNER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "key_transparency.h"
+
+namespace mi::server {
+
+struct KtEpochOptions {
+  // An epoch closes this long after its first append, or once |max_leaves|
+  // appends are waiting, whichever comes first.
+  std::uint32_t interval_ms{200};
+  std::uint32_t max_leaves{256};
+};
+
+// Signs the key transparency head once per epoch on a background thread so
+// readers get a pre-signed STH instead of an ML-DSA signature per request.
+// The signed head is keyed by (tree_size, root): an epoch whose head did not
+// change reuses the previous signature.
+class KtSthSigner {
+ public:
+  using SignFn =
+      std::function<bool(KeyTransparencySth& sth, std::string& error)>;
+
+  KtSthSigner(const KeyTransparencyLog* log, SignFn sign,
+              KtEpochOptions options = {});
+  ~KtSthSigner();
+
+  KtSthSigner(const KtSthSigner&) = delete;
+  KtSthSigner& operator=(const KtSthSigner&) = delete;
+
+  void Start();
+  void Stop();
+
+  // Counts an append towards the current epoch.
+  void NotifyAppend();
+
+  // Latest signed head. Blocks only when it covers fewer than
+  // |min_tree_size| leaves, closing the epoch early for the caller.
+  bool SignedHead(std::uint64_t min_tree_size, KeyTransparencySth& out_sth,
+                  std::string& error);
+
+  std::uint64_t signatures() const;
+
+ private:
+  void Run();
+
+  const KeyTransparencyLog* log_;
+  SignFn sign_;
+  KtEpochOptions options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable wake_cv_;
+  std::condition_variable signed_cv_;
+  std::thread thread_;
+  bool running_{false};
+
+  KeyTransparencySth head_;
+  bool have_head_{false};
+  std::string error_;
+  std::uint64_t epochs_{0};
+  std::uint64_t signatures_{0};
+  std::uint64_t demand_{0};
+  std::uint32_t pending_{0};
+  std::chrono::steady_clock::time_point epoch_start_{};
+};
+
+}  // namespace mi::server
+
+#endif  // MI_E2EE_SERVER_KT_STH_SIGNER_H
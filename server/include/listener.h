@@ -3,6 +3,7 @@
 
 #include <cstddef>
 #include <functional>
+#include <memory>
 #include <string>
 #include <thread>
 #include <vector>
@@ -32,6 +33,9 @@ class Listener {
                const std::string& remote_ip,
                TransportKind transport);
 
+  std::unique_ptr<ConnectionHandler::UploadChunkStream> BeginUploadChunkStream(
+      FrameType type, std::uint32_t payload_len, TransportKind transport);
+
  private:
   ConnectionHandler handler_;
 };
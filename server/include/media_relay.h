@@ -2,10 +2,13 @@
 #define MI_E2EE_SERVER_MEDIA_RELAY_H
 
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
-#include <deque>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -21,6 +24,57 @@ struct MediaRelayPacket {
 struct MediaRelayStats {
   std::uint64_t queues{0};
   std::uint64_t packets{0};
+  std::uint64_t dropped{0};
+};
+
+constexpr std::size_t kMediaRelayLayers = 3;
+
+// Simulcast selection for one packet of roster index |sender|. Row l of
+// |preferred| (|words| each) marks the recipients that asked for layer l.
+struct MediaRelayLayerSelect {
+  std::uint32_t sender{0};
+  std::uint8_t layer{0};
+  bool keyframe{false};
+  const std::uint64_t* preferred{nullptr};
+};
+
+// A relayed packet is stored once and shared by every subscriber queue it was
+// fanned out to; the last reference frees it.
+struct MediaRelaySlab {
+  std::atomic<std::uint32_t> refs{1};
+  MediaRelayPacket packet;
+};
+
+class MediaRelayPacketRef {
+ public:
+  MediaRelayPacketRef() = default;
+  explicit MediaRelayPacketRef(MediaRelaySlab* adopt) : slab_(adopt) {}
+  MediaRelayPacketRef(const MediaRelayPacketRef& other);
+  MediaRelayPacketRef(MediaRelayPacketRef&& other) noexcept;
+  MediaRelayPacketRef& operator=(MediaRelayPacketRef other) noexcept;
+  ~MediaRelayPacketRef();
+
+  const MediaRelayPacket* get() const {
+    return slab_ ? &slab_->packet : nullptr;
+  }
+  const MediaRelayPacket* operator->() const { return get(); }
+  const MediaRelayPacket& operator*() const { return slab_->packet; }
+  explicit operator bool() const { return slab_ != nullptr; }
+
+  // Moves the packet out when this is the last reference, copies otherwise.
+  MediaRelayPacket Detach();
+
+ private:
+  MediaRelaySlab* slab_{nullptr};
+};
+
+// Receives a subscriber's packets as they are relayed instead of queueing
+// them for Pull, e.g. a UDP media flow.
+class MediaRelaySink {
+ public:
+  virtual ~MediaRelaySink() = default;
+  // Returns false to fall back to the subscriber's pull queue.
+  virtual bool Deliver(const MediaRelayPacket& packet) = 0;
 };
 
 class MediaRelay {
@@ -36,34 +90,138 @@ class MediaRelay {
                    const std::array<std::uint8_t, 16>& call_id,
                    const MediaRelayPacket& packet);
 
+  // Stores |packet| once and queues it for every roster member whose bit is
+  // set in |targets| (|words| 64-bit words). A roster is resolved to queues
+  // once per |roster_version|; later packets just walk the bitset. With
+  // |layer|, a recipient only gets the layer it currently follows and moves
+  // to its preferred layer at that layer's next keyframe.
+  void EnqueueFanout(const std::array<std::uint8_t, 16>& call_id,
+                     std::uint64_t roster_version,
+                     const std::vector<std::string>& roster,
+                     const std::uint64_t* targets,
+                     std::size_t words,
+                     MediaRelayPacket packet,
+                     const MediaRelayLayerSelect* layer = nullptr);
+
+  void Pull(const std::string& recipient,
+            const std::array<std::uint8_t, 16>& call_id,
+            std::size_t max_packets,
+            std::chrono::milliseconds wait,
+            std::vector<MediaRelayPacketRef>& out);
   void Pull(const std::string& recipient,
             const std::array<std::uint8_t, 16>& call_id,
             std::size_t max_packets,
             std::chrono::milliseconds wait,
             std::vector<MediaRelayPacket>& out);
 
+  // Attaches (or with null, detaches) a push sink for |participant|; a
+  // subscriber with a sink is not expired while idle.
+  void SetSink(const std::string& participant,
+               const std::array<std::uint8_t, 16>& call_id,
+               std::shared_ptr<MediaRelaySink> sink);
+
   void Cleanup();
   MediaRelayStats GetStats();
 
  private:
-  struct Queue {
-    std::deque<MediaRelayPacket> packets;
-    std::chrono::steady_clock::time_point last_seen{};
+  // Bounded MPSC ring. Slot i of lap n is writable by ticket t = n*cap + i
+  // while its state is 2t and holds that ticket's packet while it is 2t+1.
+  // A producer that finds the previous lap's packet still unread claims it
+  // by CAS and drops it, so the newest max_queue packets are kept; the
+  // consumer takes a packet with the same CAS and skips tickets it lost.
+  struct Slot {
+    std::atomic<std::uint64_t> state{0};
+    std::atomic<MediaRelaySlab*> slab{nullptr};
+    std::atomic<std::int64_t> created_ns{0};
   };
 
-  struct Bucket {
-    std::mutex mutex;
+  struct Subscriber {
+    explicit Subscriber(std::size_t cap);
+    ~Subscriber();
+
+    const std::size_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<std::uint64_t> tail{0};
+    alignas(64) std::atomic<std::uint64_t> head{0};
+    std::atomic<std::int64_t> last_seen_ns{0};
+    std::atomic<bool> waiting{false};
+    std::atomic<bool> has_sink{false};
+    std::shared_ptr<MediaRelaySink> sink;
+    // Serialises consumers (pulls and TTL cleanup) of this ring.
+    std::mutex consumer_mutex;
+    std::mutex wait_mutex;
     std::condition_variable cv;
-    std::unordered_map<std::string, Queue> queues;
   };
 
-  static constexpr std::size_t kBucketCount = 64;
+  // Recipients currently forwarded each layer of one sender.
+  struct LayerState {
+    explicit LayerState(std::size_t words);
+    std::unique_ptr<std::atomic<std::uint64_t>[]> current;
+  };
+
+  struct RosterBinding {
+    RosterBinding(std::uint64_t roster_version,
+                  const std::vector<std::string>& roster);
+    ~RosterBinding();
+    LayerState* LayerFor(std::uint32_t sender) const;
+
+    std::uint64_t version{0};
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<Subscriber>> subscribers;
+    std::size_t words{0};
+    std::unique_ptr<std::atomic<LayerState*>[]> layers;
+  };
+
+  // Participants of a call are interned to dense ids on first use.
+  struct CallEntry {
+    std::unordered_map<std::string, std::uint32_t> ids;
+    std::vector<std::shared_ptr<Subscriber>> subscribers;
+    std::vector<std::string> names;
+    std::vector<std::uint32_t> free_ids;
+    std::shared_ptr<const RosterBinding> roster;
+    // Set when a bound subscriber expired; the next packet rebinds even at
+    // the same version, carrying the layer state over.
+    bool roster_stale{false};
+  };
 
-  Bucket& BucketForKey(const std::string& key);
+  struct CallIdHash {
+    std::size_t operator()(const std::array<std::uint8_t, 16>& id) const;
+  };
+
+  struct Shard {
+    std::shared_mutex mutex;
+    std::unordered_map<std::array<std::uint8_t, 16>, CallEntry, CallIdHash>
+        calls;
+  };
 
-  std::array<Bucket, kBucketCount> buckets_;
+  static constexpr std::size_t kShardCount = 16;
+
+  Shard& ShardFor(const std::array<std::uint8_t, 16>& call_id);
+  std::shared_ptr<Subscriber> FindOrCreate(
+      const std::string& participant,
+      const std::array<std::uint8_t, 16>& call_id);
+  std::shared_ptr<Subscriber> InternLocked(CallEntry& call,
+                                           const std::string& participant);
+  std::shared_ptr<const RosterBinding> BindRoster(
+      const std::array<std::uint8_t, 16>& call_id,
+      std::uint64_t roster_version,
+      const std::vector<std::string>& roster);
+  void Push(Subscriber& sub, MediaRelaySlab* slab, std::int64_t created_ns);
+  // Consumer side, under sub.consumer_mutex. A non-zero |expired_before_ns|
+  // only takes the oldest packet if it was queued before that time.
+  MediaRelaySlab* Pop(Subscriber& sub, std::int64_t expired_before_ns = 0);
+  static std::uint64_t SelectLayerWord(const LayerState& state,
+                                       const MediaRelayLayerSelect& select,
+                                       std::size_t words,
+                                       std::size_t w);
+  static void CarryLayers(const RosterBinding& from, const RosterBinding& to);
+  static bool HasReadable(const Subscriber& sub);
+  static std::uint64_t QueuedPackets(const Subscriber& sub);
+
+  std::array<Shard, kShardCount> shards_;
   std::size_t max_queue_{0};
   std::chrono::milliseconds ttl_{0};
+  std::atomic<std::uint64_t> dropped_{0};
 };
 
 }  // namespace mi::server
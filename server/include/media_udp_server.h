@@ -0,0 +1,131 @@
+#ifndef MI_E2EE_SERVER_MEDIA_UDP_SERVER_H
+#define MI_E2EE_SERVER_MEDIA_UDP_SERVER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace mi::server {
+
+class MediaRelay;
+
+// Media datagrams are sealed per flow:
+//   magic(1) type(1) flow_id(8) counter(8) body tag(16)
+// where body is XChaCha20-Poly1305 under the flow key, the header is the
+// associated data and tag is the Poly1305 mac. The nonce is the direction,
+// flow_id and counter, so the two directions never share one. Client media
+// bodies are the E2EE media packet as is; server media bodies are the
+// sender (string) followed by the packet.
+inline constexpr std::uint8_t kMediaDatagramMagic = 0xD7;
+inline constexpr std::size_t kMediaDatagramHeaderBytes = 18;
+inline constexpr std::size_t kMediaDatagramTagBytes = 16;
+inline constexpr std::size_t kMediaDatagramMaxBytes = 1400;
+
+enum class MediaDatagramType : std::uint8_t {
+  kBind = 1,
+  kBindAck = 2,
+  kMedia = 3
+};
+
+enum class MediaDatagramDirection : std::uint8_t {
+  kToServer = 0,
+  kToClient = 1
+};
+
+struct MediaDatagram {
+  MediaDatagramType type{MediaDatagramType::kMedia};
+  std::uint64_t flow_id{0};
+  std::uint64_t counter{0};
+  std::vector<std::uint8_t> body;
+};
+
+bool EncodeMediaDatagram(const MediaDatagram& dgram,
+                         MediaDatagramDirection direction,
+                         const std::array<std::uint8_t, 32>& key,
+                         std::vector<std::uint8_t>& out);
+bool DecodeMediaDatagram(const std::uint8_t* data, std::size_t len,
+                         MediaDatagramDirection direction,
+                         const std::array<std::uint8_t, 32>& key,
+                         MediaDatagram& out);
+bool PeekMediaDatagramFlow(const std::uint8_t* data, std::size_t len,
+                           std::uint64_t& out_flow_id);
+
+struct MediaUdpOptions {
+  std::uint32_t max_pps{2000};
+  std::uint32_t max_kbps{8000};
+  std::uint32_t flow_idle_sec{30};
+  std::uint32_t max_flows{4096};
+};
+
+struct MediaFlowInfo {
+  std::string username;
+  std::array<std::uint8_t, 16> call_id{};
+  std::string group_id;  // group call flow
+  std::string peer;      // 1:1 call flow
+};
+
+struct MediaFlowGrant {
+  std::uint64_t flow_id{0};
+  std::array<std::uint8_t, 32> key{};
+  std::uint16_t port{0};
+};
+
+// Optional UDP media port. A flow is granted over the secure channel, bound
+// to the client's address by its first authenticated datagram, and from then
+// on receives relayed packets of its call directly instead of pulling them.
+class MediaUdpServer {
+ public:
+  using Forwarder = std::function<void(const MediaFlowInfo& flow,
+                                       std::vector<std::uint8_t> packet)>;
+
+  MediaUdpServer(MediaRelay* relay, std::uint16_t port,
+                 MediaUdpOptions options = {});
+  ~MediaUdpServer();
+
+  // Set before Start; receives every authenticated media packet.
+  void SetForwarder(Forwarder forwarder);
+
+  bool Start(std::string& error);
+  void Stop();
+  std::uint16_t port() const { return bound_port_; }
+
+  // Replaces any earlier flow of the same user and call.
+  bool OpenFlow(MediaFlowInfo info, MediaFlowGrant& out, std::string& error);
+  std::size_t FlowCount();
+
+ private:
+  class Flow;
+
+  void Run();
+  bool StartSocket(std::string& error);
+  void StopSocket();
+  void HandleDatagram(const std::uint8_t* data, std::size_t len,
+                      const void* addr, int addr_len, std::uint64_t now_ms);
+  void ExpireFlows(std::uint64_t now_ms);
+  static std::string FlowKey(const std::string& username,
+                             const std::array<std::uint8_t, 16>& call_id);
+
+  MediaRelay* relay_;
+  std::uint16_t port_{0};
+  std::uint16_t bound_port_{0};
+  MediaUdpOptions options_{};
+  Forwarder forwarder_;
+  std::atomic<bool> running_{false};
+  std::thread worker_;
+  std::intptr_t sock_{-1};
+
+  std::mutex flows_mutex_;
+  std::unordered_map<std::uint64_t, std::shared_ptr<Flow>> flows_;
+  std::unordered_map<std::string, std::uint64_t> flow_by_call_;
+};
+
+}  // namespace mi::server
+
+#endif  // MI_E2EE_SERVER_MEDIA_UDP_SERVER_H
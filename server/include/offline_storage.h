@@ -2,15 +2,22 @@
 #define MI_E2EE_SERVER_OFFLINE_STORAGE_H
 
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <fstream>
 #include <functional>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -60,6 +67,14 @@ struct BlobUploadChunkResult {
   std::string error;
 };
 
+struct BlobUploadStatusResult {
+  bool success{false};
+  std::uint64_t bytes_received{0};
+  std::uint64_t expected_size{0};
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> missing;
+  std::string error;
+};
+
 struct BlobUploadFinishResult {
   bool success{false};
   StoredFileMeta meta;
@@ -84,18 +99,40 @@ struct BlobDownloadChunkResult {
 struct OfflineStorageStats {
   std::uint64_t files{0};
   std::uint64_t bytes{0};
+  std::uint64_t pending_wipes{0};
+  std::uint64_t pending_wipe_bytes{0};
+};
+
+// Streaming callbacks for OfflineStorage. A reader must fill exactly |len|
+// bytes; a writer receives the total plaintext size with every piece.
+using OfflineChunkReader =
+    std::function<bool(std::uint8_t* out, std::size_t len)>;
+using OfflineChunkWriter = std::function<bool(
+    std::uint64_t total, const std::uint8_t* data, std::size_t len)>;
+
+// How erase-key writes are made durable: kBatched shares one directory
+// fsync between concurrent writers into the same fan-out directory.
+enum class KeySyncPolicy : std::uint8_t {
+  kNone = 0,
+  kImmediate = 1,
+  kBatched = 2
 };
 
 struct SecureDeleteConfig {
   bool enabled{false};
   std::filesystem::path plugin_path;
+  // Background wipe workers; 0 wipes synchronously in the caller.
+  std::uint32_t workers{1};
+  std::uint64_t max_bytes_per_sec{0};  // 0 = unlimited
 };
 
 class OfflineStorage {
  public:
   OfflineStorage(std::filesystem::path base_dir,
                  std::chrono::seconds ttl = std::chrono::hours(12),
-                 SecureDeleteConfig secure_delete = {});
+                 SecureDeleteConfig secure_delete = {},
+                 std::size_t max_open_blob_files = 256,
+                 KeySyncPolicy key_sync = KeySyncPolicy::kBatched);
   ~OfflineStorage();
 
   PutResult Put(const std::string& owner,
@@ -104,6 +141,12 @@ class OfflineStorage {
   PutBlobResult PutBlob(const std::string& owner,
                         const std::vector<std::uint8_t>& blob);
 
+  // Encrypt/copy |size| bytes pulled from |read| one stream chunk at a time.
+  PutResult PutStream(const std::string& owner, std::uint64_t size,
+                      const OfflineChunkReader& read);
+  PutBlobResult PutBlobStream(const std::string& owner, std::uint64_t size,
+                              const OfflineChunkReader& read);
+
   BlobUploadStartResult BeginBlobUpload(const std::string& owner,
                                         std::uint64_t expected_size = 0);
 
@@ -111,12 +154,43 @@ class OfflineStorage {
       const std::string& owner, const std::string& file_id,
       const std::string& upload_id, std::uint64_t offset,
       const std::vector<std::uint8_t>& chunk);
+  BlobUploadChunkResult AppendBlobUploadChunk(
+      const std::string& owner, const std::string& file_id,
+      const std::string& upload_id, std::uint64_t offset,
+      const std::uint8_t* chunk, std::size_t len);
+
+  // Piecewise AppendBlobUploadChunk for callers that cannot hold the chunk:
+  // Begin reserves [offset, offset + size), Write lands bytes in order and
+  // End marks the range received only when |commit| is set; otherwise the
+  // bytes written are zeroed.
+  class BlobChunkStream;
+  BlobUploadChunkResult BeginBlobUploadChunk(const std::string& owner,
+                                             const std::string& file_id,
+                                             const std::string& upload_id,
+                                             std::uint64_t offset,
+                                             std::uint64_t size,
+                                             BlobChunkStream& stream);
+  bool WriteBlobUploadChunk(BlobChunkStream& stream, const std::uint8_t* data,
+                            std::size_t len);
+  BlobUploadChunkResult EndBlobUploadChunk(BlobChunkStream& stream,
+                                           bool commit);
+
+  // Missing (offset, length) ranges below the expected size, or below the
+  // highest received byte when the size was not declared up front.
+  BlobUploadStatusResult QueryBlobUpload(const std::string& owner,
+                                         const std::string& file_id,
+                                         const std::string& upload_id);
 
   BlobUploadFinishResult FinishBlobUpload(const std::string& owner,
                                           const std::string& file_id,
                                           const std::string& upload_id,
                                           std::uint64_t total_size);
 
+  // Drops the session and wipes its .part file; fails while chunks are still
+  // being written.
+  bool AbortBlobUpload(const std::string& owner, const std::string& file_id,
+                       const std::string& upload_id, std::string& error);
+
   BlobDownloadStartResult BeginBlobDownload(const std::string& owner,
                                             const std::string& file_id,
                                             bool wipe_after_read);
@@ -133,6 +207,15 @@ class OfflineStorage {
   std::optional<std::vector<std::uint8_t>> FetchBlob(
       const std::string& file_id, bool wipe_after_read, std::string& error);
 
+  // Each piece handed to |write| is authenticated on its own; on failure the
+  // caller must discard what it already received.
+  bool FetchStream(const std::string& file_id,
+                   const std::array<std::uint8_t, 32>& file_key,
+                   bool wipe_after_read, const OfflineChunkWriter& write,
+                   std::string& error);
+  bool FetchBlobStream(const std::string& file_id, bool wipe_after_read,
+                       const OfflineChunkWriter& write, std::string& error);
+
   std::optional<StoredFileMeta> Meta(const std::string& file_id) const;
 
   OfflineStorageStats GetStats() const;
@@ -143,7 +226,40 @@ class OfflineStorage {
 
  private:
   using SecureDeleteFn = int (*)(const char*);
+  class BlobFile;
+  class DirSyncBatcher;
+
+ public:
+  class BlobChunkStream {
+   public:
+    bool open() const { return open_; }
+    std::uint64_t remaining() const { return size_ - written_; }
+
+   private:
+    friend class OfflineStorage;
+
+    std::string file_id_;
+    std::uint64_t offset_{0};
+    std::uint64_t size_{0};
+    std::uint64_t written_{0};
+    std::shared_ptr<BlobFile> file_;
+    bool duplicate_{false};
+    bool failed_{false};
+    bool open_{false};
+  };
+
+ private:
 
+  // Files live in <base>/<id[0:2]>/<id[2:4]>/; stores written before the
+  // fan-out keep flat files until the background migration moves them.
+  std::filesystem::path FanoutDir(const std::string& file_id) const;
+  std::filesystem::path LegacyPath(const std::string& file_id,
+                                   const char* ext) const;
+  std::filesystem::path ResolveExistingPath(const std::string& file_id) const;
+  std::optional<std::filesystem::path> LocateKeyForData(
+      const std::filesystem::path& data_path) const;
+  bool EnsureFanoutDir(const std::string& file_id);
+  void MigrateLegacyLayout(std::vector<std::string> ids);
   std::filesystem::path ResolvePath(const std::string& file_id) const;
   std::filesystem::path ResolveUploadTempPath(const std::string& file_id) const;
   std::filesystem::path ResolveKeyPath(const std::string& file_id) const;
@@ -186,24 +302,33 @@ class OfflineStorage {
   bool LoadSecureDeletePlugin(const std::filesystem::path& path,
                               std::string& error);
   bool CallSecureDeletePlugin(const std::filesystem::path& path) const;
-  void BestEffortWipe(const std::filesystem::path& path) const;
-  void WipeFile(const std::filesystem::path& path) const;
+  // Both return the number of bytes overwritten, which is what the wipe
+  // rate limit is charged.
+  std::uint64_t BestEffortWipe(const std::filesystem::path& path) const;
+  std::uint64_t WipeFile(const std::filesystem::path& path) const;
+  // Moves the file (and its erase key) into pending_wipe/ and hands it to
+  // the wipe workers.
+  void QueueWipe(const std::filesystem::path& path);
+  void EnqueuePendingWipe(const std::filesystem::path& path);
+  void ResumePendingWipes();
+  void WipeWorkerLoop();
+
+  struct PendingWipe {
+    std::filesystem::path path;
+    std::uint64_t bytes{0};
+  };
 
-  std::filesystem::path base_dir_;
-  std::chrono::seconds ttl_;
-  mutable std::mutex mutex_;
-  std::unordered_map<std::string, StoredFileMeta> metadata_;
-  SecureDeleteConfig secure_delete_{};
-  void* secure_delete_handle_{nullptr};
-  SecureDeleteFn secure_delete_fn_{nullptr};
-  bool secure_delete_ready_{false};
-  std::string secure_delete_error_;
   struct BlobUploadSession {
     std::string upload_id;
     std::string owner;
     std::uint64_t expected_size{0};
     std::uint64_t bytes_received{0};
+    std::map<std::uint64_t, std::uint64_t> received;
+    // Ranges reserved by chunks still being written, keyed by start.
+    std::map<std::uint64_t, std::uint64_t> writing;
     std::filesystem::path temp_path;
+    std::shared_ptr<BlobFile> file;
+    std::uint32_t inflight{0};
     std::chrono::steady_clock::time_point created_at{};
     std::chrono::steady_clock::time_point last_activity{};
   };
@@ -212,14 +337,74 @@ class OfflineStorage {
     std::string download_id;
     std::string file_id;
     std::string owner;
+    std::filesystem::path path;
     std::uint64_t total_size{0};
     std::uint64_t next_offset{0};
     bool wipe_after_read{false};
+    std::shared_ptr<BlobFile> file;
+    bool busy{false};
     std::chrono::steady_clock::time_point created_at{};
     std::chrono::steady_clock::time_point last_activity{};
   };
-  std::unordered_map<std::string, BlobUploadSession> blob_uploads_;
-  std::unordered_map<std::string, BlobDownloadSession> blob_downloads_;
+
+  struct MetaExpiry {
+    std::chrono::steady_clock::time_point expires_at{};
+    std::string file_id;
+  };
+
+  struct MetaExpiryCompare {
+    bool operator()(const MetaExpiry& a, const MetaExpiry& b) const {
+      return a.expires_at > b.expires_at;
+    }
+  };
+
+  // Metadata, upload sessions (by file id) and download sessions (by
+  // download id) all live in the shard of their file id.
+  struct MetaShard {
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, StoredFileMeta> metadata;
+    std::unordered_map<std::string, BlobUploadSession> uploads;
+    std::unordered_map<std::string, BlobDownloadSession> downloads;
+    std::priority_queue<MetaExpiry, std::vector<MetaExpiry>, MetaExpiryCompare>
+        expiries;
+  };
+
+  static constexpr std::size_t kMetaShardCount = 16;
+
+  MetaShard& ShardFor(const std::string& file_id);
+  const MetaShard& ShardFor(const std::string& file_id) const;
+  void InsertMetaLocked(MetaShard& shard, const StoredFileMeta& meta);
+  void RebuildFromDisk();
+  std::shared_ptr<BlobFile> NewBlobFile(const std::filesystem::path& path,
+                                        bool writable, bool truncate);
+  bool AcquireBlobFile(const std::shared_ptr<BlobFile>& file);
+
+  std::filesystem::path base_dir_;
+  std::chrono::seconds ttl_;
+  std::array<MetaShard, kMetaShardCount> shards_{};
+  SecureDeleteConfig secure_delete_{};
+  void* secure_delete_handle_{nullptr};
+  SecureDeleteFn secure_delete_fn_{nullptr};
+  bool secure_delete_ready_{false};
+  std::string secure_delete_error_;
+  std::size_t max_open_blob_files_{256};
+  std::atomic<std::size_t> open_blob_files_{0};
+  std::mutex blob_file_mutex_;
+  std::list<std::weak_ptr<BlobFile>> blob_file_ring_;
+  std::filesystem::path pending_wipe_dir_;
+  mutable std::mutex wipe_mutex_;
+  std::condition_variable wipe_cv_;
+  std::deque<PendingWipe> wipe_queue_;
+  std::uint64_t wipe_queue_bytes_{0};
+  std::size_t wipes_in_progress_{0};
+  std::chrono::steady_clock::time_point next_wipe_slot_{};
+  bool wipe_stop_{false};
+  std::vector<std::thread> wipe_workers_;
+  std::unique_ptr<DirSyncBatcher> dir_sync_;
+  std::unique_ptr<std::atomic<bool>[]> fanout_ready_;
+  std::atomic<bool> migration_pending_{false};
+  std::atomic<bool> migration_stop_{false};
+  std::thread migration_thread_;
 };
 
 struct OfflineMessage {
@@ -241,12 +426,49 @@ struct OfflineQueueStats {
   std::uint64_t group_cipher_messages{0};
   std::uint64_t device_sync_messages{0};
   std::uint64_t group_notice_messages{0};
+  std::uint64_t resident_bytes{0};
+  std::uint64_t spilled_bytes{0};
+  std::uint64_t spilled_messages{0};
+  std::uint64_t spill_count{0};
+  std::uint64_t restore_count{0};
+};
+
+// Byte caps on queued payloads held in memory (0 = unlimited). Past the
+// per-recipient cap that recipient's oldest resident payloads are spilled;
+// past the total cap the largest resident queues are, down to 7/8 of it.
+// Spilled payloads go to a per-recipient spill file and are read back on
+// pull. Spilling is disabled when spill_dir is empty.
+struct OfflineQueueLimits {
+  std::uint64_t max_resident_bytes{0};
+  std::uint64_t max_recipient_resident_bytes{0};
+  std::filesystem::path spill_dir;
+};
+
+// Paged pull: messages of one kind with message_id <= ack_cursor are removed,
+// then up to max_messages / max_bytes (0 = unlimited) of the remaining ones are
+// copied out without being removed. The returned cursor is acked by the next
+// pull, so delivery is at-least-once.
+struct OfflinePageRequest {
+  std::uint64_t ack_cursor{0};
+  std::uint32_t max_messages{0};
+  std::uint32_t max_bytes{0};
+};
+
+struct OfflinePage {
+  std::vector<OfflineMessage> messages;
+  std::uint64_t cursor{0};
+  bool has_more{false};
 };
 
 class OfflineQueue {
  public:
   explicit OfflineQueue(std::chrono::seconds default_ttl =
-                            std::chrono::hours(24));
+                            std::chrono::hours(24),
+                        OfflineQueueLimits limits = {});
+  ~OfflineQueue();
+
+  OfflineQueue(const OfflineQueue&) = delete;
+  OfflineQueue& operator=(const OfflineQueue&) = delete;
 
   void Enqueue(const std::string& recipient,
                std::vector<std::uint8_t> payload,
@@ -281,6 +503,9 @@ class OfflineQueue {
   std::vector<std::vector<std::uint8_t>> DrainDeviceSync(
       const std::string& recipient);
 
+  OfflinePage FetchPage(const std::string& recipient, QueueMessageKind kind,
+                        const OfflinePageRequest& request);
+
   OfflineQueueStats GetStats() const;
 
   void CleanupExpired();
@@ -290,6 +515,9 @@ class OfflineQueue {
     OfflineMessage msg;
     std::uint64_t message_id{0};
     std::chrono::steady_clock::time_point expires_at{};
+    std::uint64_t bytes{0};
+    bool spilled{false};
+    std::uint64_t spill_offset{0};
   };
 
   struct ExpiryItem {
@@ -304,11 +532,26 @@ class OfflineQueue {
     }
   };
 
+  static constexpr std::size_t kKindCount = 5;
+
   struct RecipientQueue {
     std::list<StoredMessage> messages;
     std::unordered_map<std::uint64_t, std::list<StoredMessage>::iterator> by_id;
+    // Per kind, by message_id, so a paged pull starts at its cursor.
+    std::array<std::map<std::uint64_t, std::list<StoredMessage>::iterator>,
+               kKindCount>
+        by_kind;
+    std::uint64_t resident_bytes{0};
+    std::uint64_t spilled_bytes{0};
+    std::uint64_t spilled_messages{0};
+    std::filesystem::path spill_path;
+    std::uint64_t spill_end{0};
+    // Nonzero while SpillOldest writes this queue's file outside the lock.
+    std::uint64_t spill_ticket{0};
   };
 
+  using MessageIter = std::list<StoredMessage>::iterator;
+
   struct Shard {
     mutable std::mutex mutex;
     std::unordered_map<std::string, RecipientQueue> recipients;
@@ -322,9 +565,26 @@ class OfflineQueue {
   std::size_t ShardIndexFor(const std::string& recipient) const;
   void CleanupExpiredLocked(Shard& shard,
                             std::chrono::steady_clock::time_point now);
+  void EnqueueStored(const std::string& recipient, StoredMessage stored);
+  MessageIter EraseLocked(RecipientQueue& queue, MessageIter it);
+  void ReleaseSpillLocked(RecipientQueue& queue);
+  void EnforceLimits(const std::string& recipient, std::uint64_t own_excess);
+  bool LargestResidentQueue(std::string& out) const;
+  std::uint64_t SpillOldest(const std::string& recipient, std::uint64_t want);
+  bool ReadSpilledLocked(const RecipientQueue& queue,
+                         const StoredMessage& stored, std::ifstream& in,
+                         std::vector<std::uint8_t>& out);
+  bool TakePayloadLocked(RecipientQueue& queue, StoredMessage& stored,
+                         std::ifstream& in, std::vector<std::uint8_t>& out);
 
   std::chrono::seconds default_ttl_;
+  OfflineQueueLimits limits_;
   std::array<Shard, kShardCount> shards_{};
+  std::atomic<std::uint64_t> resident_bytes_{0};
+  std::atomic<std::uint64_t> spill_count_{0};
+  std::atomic<std::uint64_t> restore_count_{0};
+  std::atomic<std::uint64_t> next_spill_file_{1};
+  std::mutex evict_mutex_;
 };
 
 }  // namespace mi::server
@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "frame.h"
+#include "monocypher.h"
 #include "pake.h"
 
 namespace mi::server {
@@ -29,6 +30,41 @@ class SecureChannel {
   bool Decrypt(const std::uint8_t* input, std::size_t len,
                FrameType frame_type, std::vector<std::uint8_t>& out_plain);
 
+  // Incremental Decrypt for frames too large to buffer whole. Update()
+  // releases plaintext as ciphertext arrives; none of it is authentic until
+  // FinishDecrypt() has checked the tag.
+  class DecryptStream {
+   public:
+    DecryptStream() = default;
+    ~DecryptStream();
+    DecryptStream(const DecryptStream&) = delete;
+    DecryptStream& operator=(const DecryptStream&) = delete;
+
+    bool Update(const std::uint8_t* cipher, std::size_t len,
+                std::uint8_t* out_plain);
+    std::uint64_t remaining() const { return cipher_len_ - processed_; }
+
+   private:
+    friend class SecureChannel;
+
+    std::array<std::uint8_t, 32> key_{};
+    std::array<std::uint8_t, 8> nonce_{};
+    std::array<std::uint8_t, 64> keystream_{};
+    std::size_t keystream_used_{64};
+    std::uint64_t counter_{1};
+    crypto_poly1305_ctx poly_{};
+    std::uint64_t seq_{0};
+    std::uint64_t cipher_len_{0};
+    std::uint64_t processed_{0};
+    bool active_{false};
+  };
+
+  // |header| is the 8-byte sequence prefix of the encrypted payload and
+  // |cipher_len| the ciphertext length between it and the 16-byte tag.
+  bool BeginDecrypt(const std::uint8_t* header, std::uint64_t cipher_len,
+                    FrameType frame_type, DecryptStream& stream) const;
+  bool FinishDecrypt(DecryptStream& stream, const std::uint8_t* mac);
+
  private:
   bool CanAcceptSeq(std::uint64_t seq) const;
   void MarkSeqReceived(std::uint64_t seq);
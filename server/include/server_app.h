@@ -44,6 +44,7 @@ class ServerApp {
   const ServerConfig& config() const { return config_; }
   SessionManager* sessions() { return sessions_.get(); }
   const SessionManager* sessions() const { return sessions_.get(); }
+  ApiService* api() { return api_.get(); }
   OfflineStorage* offline_storage() { return offline_storage_.get(); }
   OfflineQueue* offline_queue() { return offline_queue_.get(); }
   MediaRelay* media_relay() { return media_relay_.get(); }
@@ -121,6 +121,9 @@ constexpr std::uint8_t kGroupNoticeLeave = 2;
 constexpr std::uint8_t kGroupNoticeKick = 3;
 constexpr std::uint8_t kGroupNoticeRoleSet = 4;
 
+// Pieces a one-shot file upload is appended to its upload session in.
+constexpr std::size_t kOneShotUploadChunkBytes = 1u * 1024u * 1024u;
+
 std::vector<std::uint8_t> BuildGroupNoticePayload(
     std::uint8_t kind, const std::string& target_username,
     std::optional<mi::server::GroupRole> role = std::nullopt) {
@@ -163,6 +166,12 @@ bool DecodeGroupCallSubscriptions(const std::vector<std::uint8_t>& ext,
     mi::server::GroupCallSubscription sub;
     sub.sender = std::move(sender);
     sub.media_flags = flags;
+    const std::uint8_t layer = static_cast<std::uint8_t>(
+        (flags & mi::server::kGroupCallLayerMask) >>
+        mi::server::kGroupCallLayerShift);
+    if (layer != 0) {
+      sub.video_layer = static_cast<std::uint8_t>(layer - 1);
+    }
     out.push_back(std::move(sub));
   }
   if (off != ext.size()) {
@@ -182,6 +191,8 @@ bool PeekMediaPacketKindFlag(const std::vector<std::uint8_t>& payload,
   const std::uint8_t kind = payload[1];
   const std::size_t min_size_v2 = 1 + 1 + 4 + 16;
   const std::size_t min_size_v3 = 1 + 1 + 4 + 4 + 16;
+  const std::size_t min_size_v4 = 1 + 1 + 1 + 4 + 4 + 16;
+  const std::size_t min_size_v5 = min_size_v4 + 2 + 4;
   if (version == 2) {
     if (payload.size() < min_size_v2) {
       return false;
@@ -190,6 +201,12 @@ bool PeekMediaPacketKindFlag(const std::vector<std::uint8_t>& payload,
     if (payload.size() < min_size_v3) {
       return false;
     }
+  } else if (version == 4 || version == 5) {
+    if (payload.size() < (version == 4 ? min_size_v4 : min_size_v5) ||
+        (payload[2] & mi::media::kMediaLayerMask) >=
+            mi::media::kMediaMaxLayers) {
+      return false;
+    }
   } else {
     return false;
   }
@@ -205,6 +222,20 @@ bool PeekMediaPacketKindFlag(const std::vector<std::uint8_t>& payload,
   return false;
 }
 
+// Only v4+ packets carry a simulcast layer; callers validate the size first.
+bool PeekMediaPacketLayer(const std::vector<std::uint8_t>& payload,
+                          std::uint8_t& out_layer,
+                          bool& out_keyframe) {
+  out_layer = 0;
+  out_keyframe = false;
+  if (payload.size() < 3 || (payload[0] != 4 && payload[0] != 5)) {
+    return false;
+  }
+  out_layer = static_cast<std::uint8_t>(payload[2] & mi::media::kMediaLayerMask);
+  out_keyframe = (payload[2] & mi::media::kMediaLayerKeyframe) != 0;
+  return true;
+}
+
 }  // namespace
 
 namespace mi::server {
@@ -282,7 +313,9 @@ ApiService::ApiService(SessionManager* sessions, GroupManager* groups,
                        std::uint32_t group_threshold,
                        std::optional<MySqlConfig> friend_mysql,
                        std::filesystem::path kt_dir,
-                       std::filesystem::path kt_signing_key)
+                       std::filesystem::path kt_signing_key,
+                       KtEpochOptions kt_epoch,
+                       KtCheckpointOptions kt_checkpoint)
     : sessions_(sessions),
       groups_(groups),
       calls_(calls),
@@ -307,6 +340,7 @@ ApiService::ApiService(SessionManager* sessions, GroupManager* groups,
       kt_log_ = std::make_unique<KeyTransparencyLog>(path);
       kt_log_->Load(err);
     }
+    kt_log_->StartCheckpointer(kt_checkpoint);
   }
   if (kt_log_) {
     if (!kt_signing_key.empty()) {
@@ -325,6 +359,15 @@ ApiService::ApiService(SessionManager* sessions, GroupManager* groups,
       kt_signing_error_ = "kt signing key missing";
     }
   }
+  if (kt_log_ && kt_signing_ready_) {
+    kt_signer_ = std::make_unique<KtSthSigner>(
+        kt_log_.get(),
+        [this](KeyTransparencySth& sth, std::string& err) {
+          return SignKtSth(sth, err);
+        },
+        kt_epoch);
+    kt_signer_->Start();
+  }
 }
 
 ApiService::RateLimiter::RateLimiter(double capacity, double refill_per_sec,
@@ -495,6 +538,18 @@ bool ApiService::SignKtSth(KeyTransparencySth& sth, std::string& out_error) {
   return true;
 }
 
+bool ApiService::SignedKtHead(std::uint64_t min_tree_size,
+                              KeyTransparencySth& out_sth,
+                              std::string& out_error) {
+  out_error.clear();
+  if (!kt_signer_) {
+    out_error = kt_signing_error_.empty() ? "kt signing unavailable"
+                                          : kt_signing_error_;
+    return false;
+  }
+  return kt_signer_->SignedHead(min_tree_size, out_sth, out_error);
+}
+
 LoginResponse ApiService::Login(const LoginRequest& req, TransportKind transport) {
   LoginResponse resp;
   if (!sessions_) {
@@ -1054,6 +1109,12 @@ FileDownloadResponse ApiService::LoadEphemeralFile(
 
 FileBlobUploadResponse ApiService::StoreE2eeFileBlob(
     const std::string& token, const std::vector<std::uint8_t>& blob) {
+  return StoreE2eeFileBlob(token, blob.data(), blob.size());
+}
+
+FileBlobUploadResponse ApiService::StoreE2eeFileBlob(const std::string& token,
+                                                     const std::uint8_t* blob,
+                                                     std::size_t blob_len) {
   FileBlobUploadResponse resp;
   if (!sessions_ || !storage_) {
     resp.error = "storage unavailable";
@@ -1065,29 +1126,74 @@ FileBlobUploadResponse ApiService::StoreE2eeFileBlob(
     resp.error = rl_error;
     return resp;
   }
-  if (blob.empty()) {
+  if (!blob || blob_len == 0) {
     resp.error = "empty payload";
     return resp;
   }
-  if (blob.size() > (320u * 1024u * 1024u)) {
+  if (blob_len > (320u * 1024u * 1024u)) {
     resp.error = "payload too large";
     return resp;
   }
 
-  auto put = storage_->PutBlob(sess->username, blob);
-  if (!put.success) {
-    resp.error = put.error;
+  // One-shot uploads go through an upload session like chunked ones, each
+  // piece written straight from the frame. A failed upload drops its
+  // session at once instead of leaving the .part file to the session TTL.
+  const auto begun = storage_->BeginBlobUpload(
+      sess->username, static_cast<std::uint64_t>(blob_len));
+  if (!begun.success) {
+    resp.error = begun.error;
     return resp;
   }
+  const auto abort_upload = [&](const std::string& error) {
+    std::string abort_err;
+    storage_->AbortBlobUpload(sess->username, begun.file_id, begun.upload_id,
+                              abort_err);
+    resp.error = error;
+    return resp;
+  };
+  for (std::size_t pos = 0; pos < blob_len;) {
+    const std::size_t len = std::min(blob_len - pos, kOneShotUploadChunkBytes);
+    const auto put = storage_->AppendBlobUploadChunk(
+        sess->username, begun.file_id, begun.upload_id, pos, blob + pos, len);
+    if (!put.success) {
+      return abort_upload(put.error);
+    }
+    pos += len;
+  }
+  const auto finished = storage_->FinishBlobUpload(
+      sess->username, begun.file_id, begun.upload_id,
+      static_cast<std::uint64_t>(blob_len));
+  if (!finished.success) {
+    return abort_upload(finished.error);
+  }
   resp.success = true;
-  resp.file_id = put.file_id;
-  resp.meta = put.meta;
+  resp.file_id = begun.file_id;
+  resp.meta = finished.meta;
   return resp;
 }
 
 FileBlobDownloadResponse ApiService::LoadE2eeFileBlob(
     const std::string& token, const std::string& file_id,
     bool wipe_after_read) {
+  std::vector<std::uint8_t> blob;
+  auto resp = LoadE2eeFileBlob(
+      token, file_id, wipe_after_read,
+      [&](std::uint64_t total, const std::uint8_t* data, std::size_t len) {
+        if (blob.empty()) {
+          blob.reserve(static_cast<std::size_t>(total));
+        }
+        blob.insert(blob.end(), data, data + len);
+        return true;
+      });
+  if (resp.success) {
+    resp.blob = std::move(blob);
+  }
+  return resp;
+}
+
+FileBlobDownloadResponse ApiService::LoadE2eeFileBlob(
+    const std::string& token, const std::string& file_id,
+    bool wipe_after_read, const OfflineChunkWriter& write) {
   FileBlobDownloadResponse resp;
   if (!sessions_ || !storage_) {
     resp.error = "storage unavailable";
@@ -1107,13 +1213,11 @@ FileBlobDownloadResponse ApiService::LoadE2eeFileBlob(
   const auto meta = storage_->Meta(file_id);
 
   std::string err;
-  auto data = storage_->FetchBlob(file_id, wipe_after_read, err);
-  if (!data.has_value()) {
+  if (!storage_->FetchBlobStream(file_id, wipe_after_read, write, err)) {
     resp.error = err;
     return resp;
   }
   resp.success = true;
-  resp.blob = std::move(*data);
   if (meta.has_value()) {
     resp.meta = *meta;
   }
@@ -1149,6 +1253,14 @@ FileBlobUploadChunkResponse ApiService::UploadE2eeFileBlobChunk(
     const std::string& token, const std::string& file_id,
     const std::string& upload_id, std::uint64_t offset,
     const std::vector<std::uint8_t>& chunk) {
+  return UploadE2eeFileBlobChunk(token, file_id, upload_id, offset,
+                                 chunk.data(), chunk.size());
+}
+
+FileBlobUploadChunkResponse ApiService::UploadE2eeFileBlobChunk(
+    const std::string& token, const std::string& file_id,
+    const std::string& upload_id, std::uint64_t offset,
+    const std::uint8_t* chunk, std::size_t chunk_len) {
   FileBlobUploadChunkResponse resp;
   if (!sessions_ || !storage_) {
     resp.error = "storage unavailable";
@@ -1161,7 +1273,7 @@ FileBlobUploadChunkResponse ApiService::UploadE2eeFileBlobChunk(
     return resp;
   }
   const auto appended = storage_->AppendBlobUploadChunk(
-      sess->username, file_id, upload_id, offset, chunk);
+      sess->username, file_id, upload_id, offset, chunk, chunk_len);
   if (!appended.success) {
     resp.error = appended.error;
     return resp;
@@ -1171,6 +1283,58 @@ FileBlobUploadChunkResponse ApiService::UploadE2eeFileBlobChunk(
   return resp;
 }
 
+FileBlobUploadChunkResponse ApiService::BeginE2eeFileBlobChunk(
+    const std::string& token, const std::string& file_id,
+    const std::string& upload_id, std::uint64_t offset,
+    std::uint64_t chunk_len, OfflineStorage::BlobChunkStream& stream) {
+  FileBlobUploadChunkResponse resp;
+  if (!sessions_ || !storage_) {
+    resp.error = "storage unavailable";
+    return resp;
+  }
+  std::optional<Session> sess;
+  std::string rl_error;
+  if (!RateLimitAuth("file_blob_upload_chunk", token, sess, rl_error)) {
+    resp.error = rl_error;
+    return resp;
+  }
+  const auto begun = storage_->BeginBlobUploadChunk(
+      sess->username, file_id, upload_id, offset, chunk_len, stream);
+  if (!begun.success) {
+    resp.error = begun.error;
+    return resp;
+  }
+  resp.success = true;
+  resp.bytes_received = begun.bytes_received;
+  return resp;
+}
+
+FileBlobUploadStatusResponse ApiService::QueryE2eeFileBlobUpload(
+    const std::string& token, const std::string& file_id,
+    const std::string& upload_id) {
+  FileBlobUploadStatusResponse resp;
+  if (!sessions_ || !storage_) {
+    resp.error = "storage unavailable";
+    return resp;
+  }
+  std::optional<Session> sess;
+  std::string rl_error;
+  if (!RateLimitAuth("file_blob_upload_status", token, sess, rl_error)) {
+    resp.error = rl_error;
+    return resp;
+  }
+  auto status = storage_->QueryBlobUpload(sess->username, file_id, upload_id);
+  if (!status.success) {
+    resp.error = status.error;
+    return resp;
+  }
+  resp.success = true;
+  resp.bytes_received = status.bytes_received;
+  resp.expected_size = status.expected_size;
+  resp.missing = std::move(status.missing);
+  return resp;
+}
+
 FileBlobUploadFinishResponse ApiService::FinishE2eeFileBlobUpload(
     const std::string& token, const std::string& file_id,
     const std::string& upload_id, std::uint64_t total_size) {
@@ -1244,7 +1408,7 @@ FileBlobDownloadChunkResponse ApiService::DownloadE2eeFileBlobChunk(
     return resp;
   }
 
-  const auto got = storage_->ReadBlobDownloadChunk(
+  auto got = storage_->ReadBlobDownloadChunk(
       sess->username, file_id, download_id, offset, max_len);
   if (!got.success) {
     resp.error = got.error;
@@ -1253,7 +1417,7 @@ FileBlobDownloadChunkResponse ApiService::DownloadE2eeFileBlobChunk(
   resp.success = true;
   resp.offset = got.offset;
   resp.eof = got.eof;
-  resp.chunk = got.chunk;
+  resp.chunk = std::move(got.chunk);
   return resp;
 }
 
@@ -1329,7 +1493,8 @@ OfflinePushResponse ApiService::EnqueueOffline(const std::string& token,
   return resp;
 }
 
-OfflinePullResponse ApiService::PullOffline(const std::string& token) {
+OfflinePullResponse ApiService::PullOffline(
+    const std::string& token, const std::optional<OfflinePageRequest>& page) {
   OfflinePullResponse resp;
   if (!sessions_ || !queue_) {
     resp.error = "queue unavailable";
@@ -1341,7 +1506,19 @@ OfflinePullResponse ApiService::PullOffline(const std::string& token) {
     resp.error = rl_error;
     return resp;
   }
-  resp.messages = queue_->Drain(sess->username);
+  if (page.has_value()) {
+    auto fetched =
+        queue_->FetchPage(sess->username, QueueMessageKind::kGeneric, *page);
+    resp.messages.reserve(fetched.messages.size());
+    for (auto& m : fetched.messages) {
+      resp.messages.push_back(std::move(m.payload));
+    }
+    resp.paged = true;
+    resp.cursor = fetched.cursor;
+    resp.has_more = fetched.has_more;
+  } else {
+    resp.messages = queue_->Drain(sess->username);
+  }
   resp.success = true;
   return resp;
 }
@@ -3252,6 +3429,9 @@ PreKeyPublishResponse ApiService::PublishPreKeyBundle(
       resp.error = kt_err.empty() ? "kt update failed" : kt_err;
       return resp;
     }
+    if (kt_signer_) {
+      kt_signer_->NotifyAppend();
+    }
   }
 
   {
@@ -3326,22 +3506,33 @@ PreKeyFetchResponse ApiService::FetchPreKeyBundle(
   }
 
   if (kt_log_) {
+    // Prove against the current signed epoch; a key published since then
+    // closes the epoch early. Retried once in case the friend republishes
+    // in between.
     KeyTransparencyProof proof;
+    KeyTransparencySth sth;
     std::string kt_err;
-    if (!kt_log_->BuildProofForLatestKey(friend_username, client_kt_tree_size,
-                                         proof, kt_err)) {
+    bool proved = false;
+    for (int attempt = 0; attempt < 2 && !proved; ++attempt) {
+      std::uint64_t leaf_index = 0;
+      if (!kt_log_->LatestLeafIndex(friend_username, leaf_index)) {
+        resp.error = "kt entry not found";
+        return resp;
+      }
+      if (!SignedKtHead(leaf_index + 1, sth, kt_err)) {
+        resp.error = kt_err.empty() ? "kt sign failed" : kt_err;
+        return resp;
+      }
+      proved = kt_log_->BuildProofForLatestKey(
+          friend_username, client_kt_tree_size, sth.tree_size, proof, kt_err);
+    }
+    if (!proved) {
       resp.error = kt_err.empty() ? "kt proof failed" : kt_err;
       return resp;
     }
     resp.kt_version = 1;
-    resp.kt_tree_size = proof.sth.tree_size;
-    resp.kt_root = proof.sth.root;
-    KeyTransparencySth sth = proof.sth;
-    std::string sign_err;
-    if (!SignKtSth(sth, sign_err)) {
-      resp.error = sign_err.empty() ? "kt sign failed" : sign_err;
-      return resp;
-    }
+    resp.kt_tree_size = sth.tree_size;
+    resp.kt_root = sth.root;
     resp.kt_signature = std::move(sth.signature);
     resp.kt_leaf_index = proof.leaf_index;
     resp.kt_audit_path = std::move(proof.audit_path);
@@ -3369,9 +3560,8 @@ KeyTransparencyHeadResponse ApiService::GetKeyTransparencyHead(
     resp.error = "kt disabled";
     return resp;
   }
-  resp.sth = kt_log_->Head();
   std::string sign_err;
-  if (!SignKtSth(resp.sth, sign_err)) {
+  if (!SignedKtHead(0, resp.sth, sign_err)) {
     resp.error = sign_err.empty() ? "kt sign failed" : sign_err;
     return resp;
   }
@@ -3541,11 +3731,20 @@ MediaPushResponse ApiService::PushMedia(
     resp.error = rl_error;
     return resp;
   }
+  return RelayPeerMedia(sess->username, recipient, call_id,
+                        std::move(payload));
+}
+
+MediaPushResponse ApiService::RelayPeerMedia(
+    const std::string& sender, const std::string& recipient,
+    const std::array<std::uint8_t, 16>& call_id,
+    std::vector<std::uint8_t> payload) {
+  MediaPushResponse resp;
   if (recipient.empty()) {
     resp.error = "recipient empty";
     return resp;
   }
-  if (recipient == sess->username) {
+  if (recipient == sender) {
     resp.error = "invalid recipient";
     return resp;
   }
@@ -3571,14 +3770,14 @@ MediaPushResponse ApiService::PushMedia(
   if (friend_mysql_.has_value()) {
     std::string block_err;
     const bool recipient_blocks_sender =
-        IsBlockedMysql(*friend_mysql_, recipient, sess->username, block_err);
+        IsBlockedMysql(*friend_mysql_, recipient, sender, block_err);
     if (!block_err.empty()) {
       resp.error = block_err;
       return resp;
     }
     std::string block_err2;
     const bool sender_blocks_recipient =
-        IsBlockedMysql(*friend_mysql_, sess->username, recipient, block_err2);
+        IsBlockedMysql(*friend_mysql_, sender, recipient, block_err2);
     if (!block_err2.empty()) {
       resp.error = block_err2;
       return resp;
@@ -3586,24 +3785,24 @@ MediaPushResponse ApiService::PushMedia(
     blocked = recipient_blocks_sender || sender_blocks_recipient;
   } else {
     std::lock_guard<std::mutex> lock(friends_mutex_);
-    const auto it = blocks_.find(sess->username);
+    const auto it = blocks_.find(sender);
     if (it != blocks_.end() && it->second.count(recipient) != 0) {
       blocked = true;
     }
     const auto it2 = blocks_.find(recipient);
-    if (it2 != blocks_.end() && it2->second.count(sess->username) != 0) {
+    if (it2 != blocks_.end() && it2->second.count(sender) != 0) {
       blocked = true;
     }
   }
 #else
   {
     std::lock_guard<std::mutex> lock(friends_mutex_);
-    const auto it = blocks_.find(sess->username);
+    const auto it = blocks_.find(sender);
     if (it != blocks_.end() && it->second.count(recipient) != 0) {
       blocked = true;
     }
     const auto it2 = blocks_.find(recipient);
-    if (it2 != blocks_.end() && it2->second.count(sess->username) != 0) {
+    if (it2 != blocks_.end() && it2->second.count(sender) != 0) {
       blocked = true;
     }
   }
@@ -3618,20 +3817,20 @@ MediaPushResponse ApiService::PushMedia(
 #ifdef MI_E2EE_ENABLE_MYSQL
   if (friend_mysql_.has_value()) {
     std::string err;
-    is_friend = AreFriendsMysql(*friend_mysql_, sess->username, recipient, err);
+    is_friend = AreFriendsMysql(*friend_mysql_, sender, recipient, err);
     if (!err.empty()) {
       resp.error = err;
       return resp;
     }
   } else {
     std::lock_guard<std::mutex> lock(friends_mutex_);
-    const auto it = friends_.find(sess->username);
+    const auto it = friends_.find(sender);
     is_friend = (it != friends_.end() && it->second.count(recipient) != 0);
   }
 #else
   {
     std::lock_guard<std::mutex> lock(friends_mutex_);
-    const auto it = friends_.find(sess->username);
+    const auto it = friends_.find(sender);
     is_friend = (it != friends_.end() && it->second.count(recipient) != 0);
   }
 #endif
@@ -3642,7 +3841,7 @@ MediaPushResponse ApiService::PushMedia(
   }
 
   MediaRelayPacket packet;
-  packet.sender = sess->username;
+  packet.sender = sender;
   packet.payload = std::move(payload);
   media_relay_->Enqueue(recipient, call_id, std::move(packet));
   resp.success = true;
@@ -3673,12 +3872,13 @@ MediaPullResponse ApiService::PullMedia(const std::string& token,
     wait_ms = 1000;
   }
 
-  std::vector<MediaRelayPacket> pulled;
+  std::vector<MediaRelayPacketRef> pulled;
   media_relay_->Pull(sess->username, call_id, max_packets,
                      std::chrono::milliseconds(wait_ms), pulled);
   resp.success = true;
   resp.packets.reserve(pulled.size());
-  for (auto& pkt : pulled) {
+  for (auto& ref : pulled) {
+    MediaRelayPacket pkt = ref.Detach();
     MediaPullResponse::Entry entry;
     entry.sender = std::move(pkt.sender);
     entry.payload = std::move(pkt.payload);
@@ -3781,7 +3981,7 @@ GroupCallSignalResponse ApiService::GroupCallSignal(
     ev.sender = sess->username;
     ev.media_flags = media_flags;
     ev.ts_ms = ts_ms;
-    calls_->EnqueueEventForMembers(snapshot.members, ev);
+    calls_->PublishMemberEvent(ev);
     return resp;
   }
 
@@ -3804,7 +4004,11 @@ GroupCallSignalResponse ApiService::GroupCallSignal(
     ev.sender = sess->username;
     ev.media_flags = media_flags;
     ev.ts_ms = ts_ms;
-    calls_->EnqueueEventForMembers(snapshot.members, ev);
+    if (ended) {
+      calls_->EnqueueEventForMembers(snapshot.members, ev);
+    } else {
+      calls_->PublishMemberEvent(ev);
+    }
     return resp;
   }
 
@@ -3858,7 +4062,7 @@ GroupCallSignalResponse ApiService::GroupCallSignal(
       ev.sender = sess->username;
       ev.media_flags = media_flags;
       ev.ts_ms = ts_ms;
-      calls_->EnqueueEventForMembers(snapshot.members, ev);
+      calls_->PublishMemberEvent(ev);
     }
     return resp;
   }
@@ -3907,6 +4111,7 @@ GroupCallSignalPullResponse ApiService::PullGroupCallSignals(
     entry.sender = ev.sender;
     entry.media_flags = ev.media_flags;
     entry.ts_ms = ev.ts_ms;
+    entry.roster = ev.roster;
     resp.events.push_back(std::move(entry));
   }
   return resp;
@@ -3931,11 +4136,20 @@ MediaPushResponse ApiService::PushGroupMedia(
     resp.error = rl_error;
     return resp;
   }
+  return RelayGroupMedia(sess->username, group_id, call_id,
+                         std::move(payload));
+}
+
+MediaPushResponse ApiService::RelayGroupMedia(
+    const std::string& sender, const std::string& group_id,
+    const std::array<std::uint8_t, 16>& call_id,
+    std::vector<std::uint8_t> payload) {
+  MediaPushResponse resp;
   if (group_id.empty()) {
     resp.error = "group id empty";
     return resp;
   }
-  if (!directory_->HasMember(group_id, sess->username)) {
+  if (!directory_->HasMember(group_id, sender)) {
     resp.error = "not in group";
     return resp;
   }
@@ -3944,13 +4158,13 @@ MediaPushResponse ApiService::PushGroupMedia(
     return resp;
   }
 
-  GroupCallSnapshot snapshot;
-  if (!calls_->GetCall(call_id, snapshot) || snapshot.group_id != group_id) {
+  const auto fanout = calls_->GetFanout(call_id);
+  if (!fanout || fanout->group_id != group_id) {
     resp.error = "call not found";
     return resp;
   }
-  if (std::find(snapshot.members.begin(), snapshot.members.end(),
-                sess->username) == snapshot.members.end()) {
+  const auto sender_it = fanout->index.find(sender);
+  if (sender_it == fanout->index.end()) {
     resp.error = "not in call";
     return resp;
   }
@@ -3961,22 +4175,22 @@ MediaPushResponse ApiService::PushGroupMedia(
     return resp;
   }
 
-  std::vector<std::string> recipients;
-  recipients.reserve(snapshot.members.size());
-  for (const auto& member : snapshot.members) {
-    if (member == sess->username) {
-      continue;
-    }
-    if (!calls_->IsSubscribed(call_id, member, sess->username, kind_flag)) {
-      continue;
-    }
-    recipients.push_back(member);
-  }
-  if (!recipients.empty()) {
+  const std::uint64_t* targets = fanout->Targets(sender_it->second, kind_flag);
+  if (targets &&
+      std::any_of(targets, targets + fanout->words,
+                  [](std::uint64_t w) { return w != 0; })) {
     MediaRelayPacket packet;
-    packet.sender = sess->username;
-    packet.payload = payload;
-    media_relay_->EnqueueMany(recipients, call_id, packet);
+    packet.sender = sender;
+    packet.payload = std::move(payload);
+    MediaRelayLayerSelect select;
+    const bool layered =
+        kind_flag == kGroupCallMediaVideo &&
+        PeekMediaPacketLayer(packet.payload, select.layer, select.keyframe);
+    select.sender = sender_it->second;
+    select.preferred = fanout->PreferredLayers(sender_it->second);
+    media_relay_->EnqueueFanout(call_id, fanout->version, fanout->members,
+                                targets, fanout->words, std::move(packet),
+                                layered ? &select : nullptr);
   }
   resp.success = true;
   return resp;
@@ -4020,12 +4234,13 @@ MediaPullResponse ApiService::PullGroupMedia(
     return resp;
   }
 
-  std::vector<MediaRelayPacket> pulled;
+  std::vector<MediaRelayPacketRef> pulled;
   media_relay_->Pull(sess->username, call_id, max_packets,
                      std::chrono::milliseconds(wait_ms), pulled);
   resp.success = true;
   resp.packets.reserve(pulled.size());
-  for (auto& pkt : pulled) {
+  for (auto& ref : pulled) {
+    MediaRelayPacket pkt = ref.Detach();
     MediaPullResponse::Entry entry;
     entry.sender = std::move(pkt.sender);
     entry.payload = std::move(pkt.payload);
@@ -4034,6 +4249,100 @@ MediaPullResponse ApiService::PullGroupMedia(
   return resp;
 }
 
+void ApiService::SetMediaUdp(MediaUdpServer* udp) {
+  media_udp_ = udp;
+  if (!media_udp_) {
+    return;
+  }
+  media_udp_->SetForwarder(
+      [this](const MediaFlowInfo& flow, std::vector<std::uint8_t> payload) {
+        RelayFlowMedia(flow, std::move(payload));
+      });
+}
+
+MediaFlowOpenResponse ApiService::OpenMediaFlow(
+    const std::string& token, const std::string& group_id,
+    const std::array<std::uint8_t, 16>& call_id, const std::string& peer) {
+  MediaFlowOpenResponse resp;
+  if (!sessions_ || !media_relay_ || !media_udp_) {
+    resp.error = "media udp disabled";
+    return resp;
+  }
+  std::optional<Session> sess;
+  std::string rl_error;
+  if (!RateLimitAuth("media_flow_open", token, sess, rl_error)) {
+    resp.error = rl_error;
+    return resp;
+  }
+
+  MediaFlowInfo info;
+  info.username = sess->username;
+  info.call_id = call_id;
+  if (!group_id.empty()) {
+    if (!calls_ || !calls_->enabled()) {
+      resp.error = "group call disabled";
+      return resp;
+    }
+    const auto fanout = calls_->GetFanout(call_id);
+    if (!fanout || fanout->group_id != group_id) {
+      resp.error = "call not found";
+      return resp;
+    }
+    if (fanout->index.count(sess->username) == 0) {
+      resp.error = "not in call";
+      return resp;
+    }
+    info.group_id = group_id;
+  } else {
+    if (peer.empty()) {
+      resp.error = "recipient empty";
+      return resp;
+    }
+    if (peer == sess->username) {
+      resp.error = "invalid recipient";
+      return resp;
+    }
+    std::string exists_err;
+    if (!sessions_->UserExists(peer, exists_err)) {
+      resp.error = exists_err.empty() ? "recipient not found" : exists_err;
+      return resp;
+    }
+    info.peer = peer;
+  }
+
+  MediaFlowGrant grant;
+  std::string err;
+  if (!media_udp_->OpenFlow(std::move(info), grant, err)) {
+    resp.error = err;
+    return resp;
+  }
+  resp.success = true;
+  resp.flow_id = grant.flow_id;
+  resp.key = grant.key;
+  resp.port = grant.port;
+  return resp;
+}
+
+MediaPushResponse ApiService::RelayFlowMedia(const MediaFlowInfo& flow,
+                                             std::vector<std::uint8_t> payload) {
+  if (!flow.group_id.empty()) {
+    MediaPushResponse resp;
+    if (!media_relay_ || !calls_ || !directory_ || !calls_->enabled()) {
+      resp.error = "media relay unavailable";
+      return resp;
+    }
+    return RelayGroupMedia(flow.username, flow.group_id, flow.call_id,
+                           std::move(payload));
+  }
+  if (!sessions_ || !media_relay_) {
+    MediaPushResponse resp;
+    resp.error = "media relay unavailable";
+    return resp;
+  }
+  return RelayPeerMedia(flow.username, flow.peer, flow.call_id,
+                        std::move(payload));
+}
+
 GroupSenderKeySendResponse ApiService::SendGroupSenderKey(
     const std::string& token, const std::string& group_id,
     const std::string& recipient, std::vector<std::uint8_t> payload) {
@@ -4120,7 +4429,8 @@ GroupSenderKeySendResponse ApiService::SendGroupSenderKey(
   return resp;
 }
 
-PrivatePullResponse ApiService::PullPrivate(const std::string& token) {
+PrivatePullResponse ApiService::PullPrivate(
+    const std::string& token, const std::optional<OfflinePageRequest>& page) {
   PrivatePullResponse resp;
   if (!sessions_ || !queue_) {
     resp.error = "queue unavailable";
@@ -4133,12 +4443,22 @@ PrivatePullResponse ApiService::PullPrivate(const std::string& token) {
     return resp;
   }
 
-  const auto messages = queue_->DrainPrivate(sess->username);
+  std::vector<OfflineMessage> messages;
+  if (page.has_value()) {
+    auto fetched =
+        queue_->FetchPage(sess->username, QueueMessageKind::kPrivate, *page);
+    messages = std::move(fetched.messages);
+    resp.paged = true;
+    resp.cursor = fetched.cursor;
+    resp.has_more = fetched.has_more;
+  } else {
+    messages = queue_->DrainPrivate(sess->username);
+  }
   resp.messages.reserve(messages.size());
-  for (const auto& m : messages) {
+  for (auto& m : messages) {
     PrivatePullResponse::Entry e;
-    e.sender = m.sender;
-    e.payload = m.payload;
+    e.sender = std::move(m.sender);
+    e.payload = std::move(m.payload);
     resp.messages.push_back(std::move(e));
   }
   resp.success = true;
@@ -4236,7 +4556,8 @@ GroupCipherSendResponse ApiService::SendGroupCipher(
   return resp;
 }
 
-GroupCipherPullResponse ApiService::PullGroupCipher(const std::string& token) {
+GroupCipherPullResponse ApiService::PullGroupCipher(
+    const std::string& token, const std::optional<OfflinePageRequest>& page) {
   GroupCipherPullResponse resp;
   if (!sessions_ || !queue_) {
     resp.error = "queue unavailable";
@@ -4249,17 +4570,27 @@ GroupCipherPullResponse ApiService::PullGroupCipher(const std::string& token) {
     return resp;
   }
 
-  const auto messages = queue_->DrainGroupCipher(sess->username);
+  std::vector<OfflineMessage> messages;
+  if (page.has_value()) {
+    auto fetched = queue_->FetchPage(sess->username,
+                                     QueueMessageKind::kGroupCipher, *page);
+    messages = std::move(fetched.messages);
+    resp.paged = true;
+    resp.cursor = fetched.cursor;
+    resp.has_more = fetched.has_more;
+  } else {
+    messages = queue_->DrainGroupCipher(sess->username);
+  }
   resp.messages.reserve(messages.size());
-  for (const auto& m : messages) {
+  for (auto& m : messages) {
     if (!m.group_id.empty() && directory_ &&
         !directory_->HasMember(m.group_id, sess->username)) {
       continue;
     }
     GroupCipherPullResponse::Entry e;
-    e.group_id = m.group_id;
-    e.sender = m.sender;
-    e.payload = m.payload;
+    e.group_id = std::move(m.group_id);
+    e.sender = std::move(m.sender);
+    e.payload = std::move(m.payload);
     resp.messages.push_back(std::move(e));
   }
   resp.success = true;
@@ -4410,8 +4741,9 @@ DeviceSyncPushResponse ApiService::PushDeviceSync(
   return resp;
 }
 
-DeviceSyncPullResponse ApiService::PullDeviceSync(const std::string& token,
-                                                  const std::string& device_id) {
+DeviceSyncPullResponse ApiService::PullDeviceSync(
+    const std::string& token, const std::string& device_id,
+    const std::optional<OfflinePageRequest>& page) {
   DeviceSyncPullResponse resp;
   if (!sessions_ || !queue_) {
     resp.error = "queue unavailable";
@@ -4450,7 +4782,20 @@ DeviceSyncPullResponse ApiService::PullDeviceSync(const std::string& token,
     }
   }
 
-  resp.messages = queue_->DrainDeviceSync(MakeDeviceQueueKey(sess->username, device_id));
+  const std::string queue_key = MakeDeviceQueueKey(sess->username, device_id);
+  if (page.has_value()) {
+    auto fetched =
+        queue_->FetchPage(queue_key, QueueMessageKind::kDeviceSync, *page);
+    resp.messages.reserve(fetched.messages.size());
+    for (auto& m : fetched.messages) {
+      resp.messages.push_back(std::move(m.payload));
+    }
+    resp.paged = true;
+    resp.cursor = fetched.cursor;
+    resp.has_more = fetched.has_more;
+  } else {
+    resp.messages = queue_->DrainDeviceSync(queue_key);
+  }
   resp.success = true;
   return resp;
 }
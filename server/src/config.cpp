@@ -168,6 +168,14 @@ void ApplyKV(IniState& state, const std::string& key,
       ParseUint32(value, state.cfg->server.group_rotation_threshold);
     } else if (key == "offline_dir") {
       state.cfg->server.offline_dir = value;
+    } else if (key == "offline_queue_memory_mb") {
+      ParseUint32(value, state.cfg->server.offline_queue_memory_mb);
+    } else if (key == "offline_queue_recipient_mb") {
+      ParseUint32(value, state.cfg->server.offline_queue_recipient_mb);
+    } else if (key == "offline_blob_open_files") {
+      ParseUint32(value, state.cfg->server.offline_blob_open_files);
+    } else if (key == "offline_key_sync") {
+      ParseUint32(value, state.cfg->server.offline_key_sync);
     } else if (key == "debug_log") {
       ParseBool(value, state.cfg->server.debug_log);
     } else if (key == "session_ttl_sec") {
@@ -198,6 +206,14 @@ void ApplyKV(IniState& state, const std::string& key,
       state.cfg->server.tls_cert = value;
     } else if (key == "kt_signing_key") {
       state.cfg->server.kt_signing_key = value;
+    } else if (key == "kt_epoch_ms") {
+      ParseUint32(value, state.cfg->server.kt_epoch_ms);
+    } else if (key == "kt_epoch_leaves") {
+      ParseUint32(value, state.cfg->server.kt_epoch_leaves);
+    } else if (key == "kt_checkpoint_ms") {
+      ParseUint32(value, state.cfg->server.kt_checkpoint_ms);
+    } else if (key == "kt_checkpoint_leaves") {
+      ParseUint32(value, state.cfg->server.kt_checkpoint_leaves);
     } else if (key == "key_protection") {
       ParseKeyProtection(value, state.cfg->server.key_protection);
     } else if (key == "allow_legacy_login") {
@@ -210,6 +226,10 @@ void ApplyKV(IniState& state, const std::string& key,
       state.cfg->server.secure_delete_plugin = value;
     } else if (key == "secure_delete_plugin_sha256") {
       state.cfg->server.secure_delete_plugin_sha256 = value;
+    } else if (key == "secure_delete_workers") {
+      ParseUint32(value, state.cfg->server.secure_delete_workers);
+    } else if (key == "secure_delete_mb_per_sec") {
+      ParseUint32(value, state.cfg->server.secure_delete_mb_per_sec);
     } else if (key == "ops_enable") {
       ParseBool(value, state.cfg->server.ops_enable);
     } else if (key == "ops_allow_remote") {
@@ -242,6 +262,22 @@ void ApplyKV(IniState& state, const std::string& key,
       ParseUint32(value, state.cfg->server.kcp_min_rto);
     } else if (key == "session_idle_sec") {
       ParseUint32(value, state.cfg->server.kcp_session_idle_sec);
+    } else if (key == "workers") {
+      ParseUint32(value, state.cfg->server.kcp_workers);
+    } else if (key == "batch") {
+      ParseUint32(value, state.cfg->server.kcp_batch);
+    } else if (key == "gso") {
+      ParseBool(value, state.cfg->server.kcp_gso);
+    } else if (key == "handler_threads") {
+      ParseUint32(value, state.cfg->server.kcp_handler_threads);
+    } else if (key == "fec") {
+      ParseBool(value, state.cfg->server.kcp_fec);
+    } else if (key == "fec_data_shards") {
+      ParseUint32(value, state.cfg->server.kcp_fec_data_shards);
+    } else if (key == "fec_parity_shards") {
+      ParseUint32(value, state.cfg->server.kcp_fec_parity_shards);
+    } else if (key == "fec_adaptive") {
+      ParseBool(value, state.cfg->server.kcp_fec_adaptive);
     }
     return;
   }
@@ -258,6 +294,18 @@ void ApplyKV(IniState& state, const std::string& key,
       ParseUint32(value, state.cfg->call.media_ttl_ms);
     } else if (key == "max_subscriptions") {
       ParseUint32(value, state.cfg->call.max_subscriptions);
+    } else if (key == "roster_coalesce_ms") {
+      ParseUint32(value, state.cfg->call.roster_coalesce_ms);
+    } else if (key == "media_udp_enable") {
+      ParseBool(value, state.cfg->call.media_udp_enable);
+    } else if (key == "media_udp_port") {
+      ParseUint16(value, state.cfg->call.media_udp_port);
+    } else if (key == "media_udp_pps") {
+      ParseUint32(value, state.cfg->call.media_udp_pps);
+    } else if (key == "media_udp_kbps") {
+      ParseUint32(value, state.cfg->call.media_udp_kbps);
+    } else if (key == "media_udp_idle_sec") {
+      ParseUint32(value, state.cfg->call.media_udp_idle_sec);
     }
     return;
   }
@@ -450,6 +498,18 @@ bool LoadConfig(const std::string& path, ServerConfig& out_config,
     if (out_config.server.kcp_session_idle_sec == 0) {
       out_config.server.kcp_session_idle_sec = 60;
     }
+    if (out_config.server.kcp_batch == 0) {
+      out_config.server.kcp_batch = 32;
+    }
+  }
+  if (out_config.call.media_udp_enable) {
+    if (out_config.call.media_udp_port == 0) {
+      out_config.call.media_udp_port =
+          static_cast<std::uint16_t>(out_config.server.listen_port + 1);
+    }
+    if (out_config.call.media_udp_idle_sec == 0) {
+      out_config.call.media_udp_idle_sec = 30;
+    }
   }
   return true;
 }
@@ -20,7 +20,9 @@
 #include <sys/resource.h>
 #endif
 
+#include "api_service.h"
 #include "buffer_pool.h"
+#include "frame_router.h"
 #include "protocol.h"
 #include "secure_channel.h"
 
@@ -119,6 +121,14 @@ bool LooksLikeSessionToken(std::string_view token) {
 
 constexpr std::uint64_t kPerfSampleIntervalNs = 1000000000ull;
 
+// Smaller upload chunks are cheaper to buffer than to stream.
+constexpr std::uint32_t kUploadStreamMinBytes = 256u * 1024u;
+// token_len(2) + session token(64) + channel sequence(8).
+constexpr std::size_t kUploadStreamEnvelopeBytes = 2 + 64 + 8;
+constexpr std::size_t kUploadStreamTagBytes = 16;
+// file_id + upload_id + offset + chunk length prefix.
+constexpr std::size_t kUploadStreamMaxHeaderBytes = 1024;
+
 std::uint64_t GetProcessRssBytes() {
 #ifdef _WIN32
   PROCESS_MEMORY_COUNTERS_EX pmc{};
@@ -417,22 +427,7 @@ bool ConnectionHandler::OnData(const std::uint8_t* data, std::size_t len,
     return false;
   }
   metrics_.requests_total.fetch_add(1, std::memory_order_relaxed);
-  const auto finish = [&](bool success) {
-    const auto now = std::chrono::steady_clock::now();
-    const auto latency_us = static_cast<std::uint64_t>(
-        std::chrono::duration_cast<std::chrono::microseconds>(
-            now - start)
-            .count());
-    metrics_.total_latency_us.fetch_add(latency_us, std::memory_order_relaxed);
-    UpdateMax(metrics_.max_latency_us, latency_us);
-    RecordLatencySample(metrics_, latency_us);
-    MaybeSamplePerf(metrics_, now);
-    if (success) {
-      metrics_.requests_ok.fetch_add(1, std::memory_order_relaxed);
-    } else {
-      metrics_.requests_fail.fetch_add(1, std::memory_order_relaxed);
-    }
-  };
+  const auto finish = [&](bool success) { FinishRequest(start, success); };
   Frame out;
   std::string error;
   auto& byte_pool = mi::shard::GlobalByteBufferPool();
@@ -510,7 +505,7 @@ bool ConnectionHandler::OnData(const std::uint8_t* data, std::size_t len,
         proto::WriteString("unauthorized", out.payload);
       } else {
         out.payload.push_back(1);
-        proto::WriteUint32(4, out.payload);  // version
+        proto::WriteUint32(5, out.payload);  // version
 
         const auto now = std::chrono::steady_clock::now();
         const auto uptime_sec = static_cast<std::uint64_t>(
@@ -589,9 +584,12 @@ bool ConnectionHandler::OnData(const std::uint8_t* data, std::size_t len,
           const auto stats = storage->GetStats();
           proto::WriteUint64(stats.files, out.payload);
           proto::WriteUint64(stats.bytes, out.payload);
+          proto::WriteUint64(stats.pending_wipes, out.payload);
+          proto::WriteUint64(stats.pending_wipe_bytes, out.payload);
         } else {
-          proto::WriteUint64(0, out.payload);
-          proto::WriteUint64(0, out.payload);
+          for (int i = 0; i < 4; ++i) {
+            proto::WriteUint64(0, out.payload);
+          }
         }
 
         if (auto* calls = app_->group_calls()) {
@@ -693,29 +691,11 @@ bool ConnectionHandler::OnData(const std::uint8_t* data, std::size_t len,
     }
   }
 
-  std::shared_ptr<ChannelState> state;
-  {
-    std::lock_guard<std::mutex> lock(channel_mutex_);
-    const auto it = channel_states_.find(token);
-    if (it != channel_states_.end()) {
-      state = it->second;
-    }
-  }
+  const auto state = ChannelStateFor(token);
   if (!state) {
-    auto keys = app_->sessions()->GetKeys(token);
-    if (!keys.has_value()) {
-      const bool ok = WritePlainLogoutError({}, out_bytes);
-      finish(false);
-      return ok;
-    }
-    auto new_state = std::make_shared<ChannelState>();
-    new_state->channel = SecureChannel(*keys, SecureChannelRole::kServer);
-    {
-      std::lock_guard<std::mutex> lock(channel_mutex_);
-      const auto [it, inserted] = channel_states_.emplace(token, new_state);
-      (void)inserted;
-      state = it->second;
-    }
+    const bool ok = WritePlainLogoutError({}, out_bytes);
+    finish(false);
+    return ok;
   }
 
   std::lock_guard<std::mutex> state_lock(state->mutex);
@@ -744,15 +724,65 @@ bool ConnectionHandler::OnData(const std::uint8_t* data, std::size_t len,
     return false;
   }
 
+  const bool sealed = SealResponseLocked(*state, token, out, out_bytes);
+  inner.payload.swap(plain);
+  if (!sealed) {
+    finish(false);
+    return false;
+  }
+  finish(out.payload.empty() || out.payload[0] != 0);
+  return true;
+}
+
+void ConnectionHandler::FinishRequest(
+    std::chrono::steady_clock::time_point start, bool success) {
+  const auto now = std::chrono::steady_clock::now();
+  const auto latency_us = static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(now - start)
+          .count());
+  metrics_.total_latency_us.fetch_add(latency_us, std::memory_order_relaxed);
+  UpdateMax(metrics_.max_latency_us, latency_us);
+  RecordLatencySample(metrics_, latency_us);
+  MaybeSamplePerf(metrics_, now);
+  if (success) {
+    metrics_.requests_ok.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    metrics_.requests_fail.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+std::shared_ptr<ConnectionHandler::ChannelState>
+ConnectionHandler::ChannelStateFor(const std::string& token) {
+  {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    const auto it = channel_states_.find(token);
+    if (it != channel_states_.end()) {
+      return it->second;
+    }
+  }
+  auto keys = app_->sessions()->GetKeys(token);
+  if (!keys.has_value()) {
+    return nullptr;
+  }
+  auto new_state = std::make_shared<ChannelState>();
+  new_state->channel = SecureChannel(*keys, SecureChannelRole::kServer);
+  std::lock_guard<std::mutex> lock(channel_mutex_);
+  const auto [it, inserted] = channel_states_.emplace(token, new_state);
+  (void)inserted;
+  return it->second;
+}
+
+bool ConnectionHandler::SealResponseLocked(
+    ChannelState& state, const std::string& token, const Frame& out,
+    std::vector<std::uint8_t>& out_bytes) {
+  auto& pool = mi::shard::GlobalByteBufferPool();
   mi::shard::ScopedBuffer cipher_buf(pool, out.payload.size() + 64, false);
   auto& cipher_out = cipher_buf.get();
-  if (!state->channel.Encrypt(state->send_seq, out.type, out.payload,
-                              cipher_out)) {
-    inner.payload.swap(plain);
-    finish(false);
+  if (!state.channel.Encrypt(state.send_seq, out.type, out.payload,
+                             cipher_out)) {
     return false;
   }
-  state->send_seq++;
+  state.send_seq++;
 
   Frame envelope;
   envelope.type = out.type;
@@ -760,7 +790,6 @@ bool ConnectionHandler::OnData(const std::uint8_t* data, std::size_t len,
   proto::WriteString(token, envelope.payload);
   envelope.payload.insert(envelope.payload.end(), cipher_out.begin(),
                           cipher_out.end());
-  inner.payload.swap(plain);
 
   EncodeFrame(envelope, out_bytes);
   if (out.type == FrameType::kLogout) {
@@ -768,7 +797,225 @@ bool ConnectionHandler::OnData(const std::uint8_t* data, std::size_t len,
     channel_states_.erase(token);
     ClearAuthDecryptFailures(token);
   }
-  finish(out.payload.empty() || out.payload[0] != 0);
+  return true;
+}
+
+std::unique_ptr<ConnectionHandler::UploadChunkStream>
+ConnectionHandler::BeginUploadChunkStream(FrameType type,
+                                          std::uint32_t payload_len,
+                                          TransportKind transport) {
+  if (!app_ || type != FrameType::kE2eeFileUploadChunk ||
+      payload_len < kUploadStreamMinBytes) {
+    return nullptr;
+  }
+  if (!app_->api() || !app_->offline_storage() || !app_->sessions()) {
+    return nullptr;
+  }
+  const auto& cfg = app_->config().server;
+  if (cfg.require_tls && transport != TransportKind::kTls &&
+      transport != TransportKind::kLocal) {
+    return nullptr;
+  }
+  metrics_.requests_total.fetch_add(1, std::memory_order_relaxed);
+  auto stream = std::make_unique<UploadChunkStream>();
+  stream->owner_ = this;
+  stream->start_ = std::chrono::steady_clock::now();
+  stream->payload_len_ = payload_len;
+  stream->head_.reserve(kUploadStreamEnvelopeBytes);
+  return stream;
+}
+
+ConnectionHandler::UploadChunkStream::~UploadChunkStream() {
+  AbortChunk();
+  mi::shard::SecureWipe(plain_.data(), plain_.size());
+}
+
+// Zeroes whatever reached the upload file and releases the range unreceived.
+void ConnectionHandler::UploadChunkStream::AbortChunk() {
+  if (chunk_.open()) {
+    owner_->app_->offline_storage()->EndBlobUploadChunk(chunk_, false);
+  }
+}
+
+bool ConnectionHandler::UploadChunkStream::Feed(const std::uint8_t* data,
+                                                std::size_t len) {
+  if (len > remaining() || (!data && len != 0)) {
+    return false;
+  }
+  consumed_ += len;
+  while (len > 0) {
+    std::size_t take = 0;
+    switch (phase_) {
+      case Phase::kEnvelope: {
+        take = std::min(len, kUploadStreamEnvelopeBytes - head_.size());
+        head_.insert(head_.end(), data, data + take);
+        if (head_.size() == kUploadStreamEnvelopeBytes && !OnEnvelope()) {
+          return false;
+        }
+        break;
+      }
+      case Phase::kCipher: {
+        take = static_cast<std::size_t>(std::min<std::uint64_t>(
+            std::min(len, plain_.size()), decrypt_.remaining()));
+        if (!decrypt_.Update(data, take, plain_.data())) {
+          return false;
+        }
+        OnPlain(plain_.data(), take);
+        if (decrypt_.remaining() == 0) {
+          phase_ = Phase::kTag;
+        }
+        break;
+      }
+      case Phase::kTag: {
+        take = std::min(len, tag_.size() - tag_len_);
+        std::copy(data, data + take, tag_.begin() + tag_len_);
+        tag_len_ += take;
+        break;
+      }
+      case Phase::kDiscard:
+        take = len;
+        break;
+    }
+    data += take;
+    len -= take;
+  }
+  return true;
+}
+
+bool ConnectionHandler::UploadChunkStream::OnEnvelope() {
+  std::size_t offset = 0;
+  std::string_view token_view;
+  const proto::ByteView view{head_.data(), head_.size()};
+  if (!proto::ReadStringView(view, offset, token_view) ||
+      !LooksLikeSessionToken(token_view)) {
+    return false;
+  }
+  token_.assign(token_view);
+  const std::uint64_t overhead = kUploadStreamEnvelopeBytes +
+                                 kUploadStreamTagBytes;
+  if (payload_len_ <= overhead) {
+    return false;
+  }
+  if (owner_->IsAuthTokenBanned(token_)) {
+    owner_->metrics_.rate_limited.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  phase_ = Phase::kDiscard;
+  if (!owner_->app_->sessions()->TouchSession(token_)) {
+    std::lock_guard<std::mutex> lock(owner_->channel_mutex_);
+    owner_->channel_states_.erase(token_);
+    logout_ = true;
+    return true;
+  }
+  state_ = owner_->ChannelStateFor(token_);
+  if (!state_) {
+    logout_ = true;
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  if (state_->channel.BeginDecrypt(head_.data() + offset,
+                                   payload_len_ - overhead,
+                                   FrameType::kE2eeFileUploadChunk,
+                                   decrypt_)) {
+    phase_ = Phase::kCipher;
+  }
+  head_.clear();
+  return true;
+}
+
+// Plaintext is file_id, upload_id, offset and the length-prefixed chunk; the
+// chunk bytes go to the upload file uncommitted, anything else is dropped.
+void ConnectionHandler::UploadChunkStream::OnPlain(const std::uint8_t* data,
+                                                   std::size_t len) {
+  if (!header_done_ && !malformed_) {
+    const std::size_t take =
+        std::min(len, kUploadStreamMaxHeaderBytes - head_.size());
+    head_.insert(head_.end(), data, data + take);
+    std::size_t offset = 0;
+    std::string_view file_id;
+    std::string_view upload_id;
+    std::uint64_t chunk_offset = 0;
+    std::uint32_t chunk_len = 0;
+    const proto::ByteView view{head_.data(), head_.size()};
+    if (!proto::ReadStringView(view, offset, file_id) ||
+        !proto::ReadStringView(view, offset, upload_id) ||
+        !proto::ReadUint64(view, offset, chunk_offset) ||
+        !proto::ReadUint32(view, offset, chunk_len)) {
+      malformed_ = head_.size() >= kUploadStreamMaxHeaderBytes;
+      return;
+    }
+    header_done_ = true;
+    if (offset + static_cast<std::uint64_t>(chunk_len) !=
+        payload_len_ - kUploadStreamEnvelopeBytes - kUploadStreamTagBytes) {
+      malformed_ = true;
+      return;
+    }
+    auto* api = owner_->app_->api();
+    resp_ = api->BeginE2eeFileBlobChunk(token_, std::string(file_id),
+                                        std::string(upload_id), chunk_offset,
+                                        chunk_len, chunk_);
+    std::vector<std::uint8_t> rest(head_.begin() +
+                                       static_cast<std::ptrdiff_t>(offset),
+                                   head_.end());
+    mi::shard::SecureWipe(head_.data(), head_.size());
+    head_.clear();
+    OnPlain(rest.data(), rest.size());
+    mi::shard::SecureWipe(rest.data(), rest.size());
+    data += take;
+    len -= take;
+  }
+  if (header_done_ && !malformed_ && chunk_.open() && len > 0) {
+    owner_->app_->offline_storage()->WriteBlobUploadChunk(chunk_, data, len);
+  }
+}
+
+bool ConnectionHandler::UploadChunkStream::Finish(
+    std::vector<std::uint8_t>& out_bytes) {
+  auto* handler = owner_;
+  if (remaining() != 0) {
+    AbortChunk();
+    handler->FinishRequest(start_, false);
+    return false;
+  }
+  if (logout_) {
+    const bool ok = WritePlainLogoutError({}, out_bytes);
+    handler->FinishRequest(start_, false);
+    return ok;
+  }
+
+  std::lock_guard<std::mutex> state_lock(state_->mutex);
+  if (phase_ != Phase::kTag || tag_len_ != tag_.size() ||
+      !state_->channel.FinishDecrypt(decrypt_, tag_.data())) {
+    // The unauthenticated bytes are zeroed and never marked received; the
+    // client retransmits the chunk.
+    AbortChunk();
+    handler->ReportAuthDecryptFailure(token_);
+    const bool ok = WritePlainLogoutError({}, out_bytes);
+    handler->FinishRequest(start_, false);
+    return ok;
+  }
+  handler->ClearAuthDecryptFailures(token_);
+  if (!header_done_ || malformed_) {
+    AbortChunk();
+    handler->FinishRequest(start_, false);
+    return false;
+  }
+  if (chunk_.open()) {
+    const auto ended =
+        handler->app_->offline_storage()->EndBlobUploadChunk(chunk_, true);
+    resp_.success = ended.success;
+    resp_.bytes_received = ended.bytes_received;
+    resp_.error = ended.error;
+  }
+
+  Frame out;
+  out.type = FrameType::kE2eeFileUploadChunk;
+  out.payload = EncodeE2eeFileUploadChunkResp(resp_);
+  if (!handler->SealResponseLocked(*state_, token_, out, out_bytes)) {
+    handler->FinishRequest(start_, false);
+    return false;
+  }
+  handler->FinishRequest(start_, resp_.success);
   return true;
 }
 
@@ -4,6 +4,7 @@
 #include <array>
 #include <cstdint>
 #include <cstring>
+#include <optional>
 #include <vector>
 
 #include "protocol.h"
@@ -64,6 +65,45 @@ std::size_t EncodedBytesSize(const std::array<std::uint8_t, N>&) {
   return EncodedBytesSize(N);
 }
 
+constexpr std::size_t kPageTrailerSize = 8 + 1;
+
+// Optional trailing fields on queue pulls: ack_cursor u64, max_messages u32,
+// max_bytes u32. Legacy requests omit them and drain everything.
+bool ReadPageRequest(proto::ByteView data, std::size_t& offset,
+                     std::optional<OfflinePageRequest>& page) {
+  page.reset();
+  if (offset == data.size) {
+    return true;
+  }
+  OfflinePageRequest req;
+  if (!proto::ReadUint64(data, offset, req.ack_cursor) ||
+      !proto::ReadUint32(data, offset, req.max_messages) ||
+      !proto::ReadUint32(data, offset, req.max_bytes) ||
+      offset != data.size) {
+    return false;
+  }
+  page = req;
+  return true;
+}
+
+// kOfflinePull and kPrivatePull used to ignore whatever followed the header,
+// so a trailer that is not a page request still means a full drain there.
+void ReadLegacyPageRequest(proto::ByteView data, std::size_t offset,
+                           std::optional<OfflinePageRequest>& page) {
+  if (!ReadPageRequest(data, offset, page)) {
+    page.reset();
+  }
+}
+
+void WritePageTrailer(bool paged, std::uint64_t cursor, bool has_more,
+                      std::vector<std::uint8_t>& out) {
+  if (!paged) {
+    return;
+  }
+  proto::WriteUint64(cursor, out);
+  out.push_back(has_more ? 1 : 0);
+}
+
 std::vector<std::uint8_t> EncodeLoginResp(const LoginResponse& resp) {
   std::vector<std::uint8_t> out;
   std::size_t reserve = 1;
@@ -308,6 +348,9 @@ std::vector<std::uint8_t> EncodeOfflinePullResp(
     for (const auto& msg : resp.messages) {
       reserve += EncodedBytesSize(msg);
     }
+    if (resp.paged) {
+      reserve += kPageTrailerSize;
+    }
     out.reserve(reserve);
   } else {
     out.reserve(1 + EncodedStringSize(resp.error));
@@ -318,6 +361,7 @@ std::vector<std::uint8_t> EncodeOfflinePullResp(
     for (const auto& m : resp.messages) {
       proto::WriteBytes(m, out);
     }
+    WritePageTrailer(resp.paged, resp.cursor, resp.has_more, out);
   } else {
     proto::WriteString(resp.error, out);
   }
@@ -639,6 +683,9 @@ std::vector<std::uint8_t> EncodePrivatePullResp(const PrivatePullResponse& resp)
       reserve += EncodedStringSize(e.sender);
       reserve += EncodedBytesSize(e.payload);
     }
+    if (resp.paged) {
+      reserve += kPageTrailerSize;
+    }
     out.reserve(reserve);
   } else {
     out.reserve(1 + EncodedStringSize(resp.error));
@@ -650,6 +697,7 @@ std::vector<std::uint8_t> EncodePrivatePullResp(const PrivatePullResponse& resp)
       proto::WriteString(e.sender, out);
       proto::WriteBytes(e.payload, out);
     }
+    WritePageTrailer(resp.paged, resp.cursor, resp.has_more, out);
   } else {
     proto::WriteString(resp.error, out);
   }
@@ -695,6 +743,25 @@ std::vector<std::uint8_t> EncodeMediaPullResp(const MediaPullResponse& resp) {
   return out;
 }
 
+std::vector<std::uint8_t> EncodeMediaFlowOpenResp(
+    const MediaFlowOpenResponse& resp) {
+  std::vector<std::uint8_t> out;
+  if (resp.success) {
+    out.reserve(1 + 8 + resp.key.size() + 4);
+  } else {
+    out.reserve(1 + EncodedStringSize(resp.error));
+  }
+  out.push_back(resp.success ? 1 : 0);
+  if (resp.success) {
+    proto::WriteUint64(resp.flow_id, out);
+    out.insert(out.end(), resp.key.begin(), resp.key.end());
+    proto::WriteUint32(resp.port, out);
+  } else {
+    proto::WriteString(resp.error, out);
+  }
+  return out;
+}
+
 std::vector<std::uint8_t> EncodeGroupCallSignalResp(
     const GroupCallSignalResponse& resp) {
   std::vector<std::uint8_t> out;
@@ -734,6 +801,12 @@ std::vector<std::uint8_t> EncodeGroupCallSignalPullResp(
       reserve += EncodedStringSize(e.sender);
       reserve += 1;
       reserve += 8;
+      if (!e.roster.empty()) {
+        reserve += 4;
+        for (const auto& change : e.roster) {
+          reserve += EncodedStringSize(change.username) + 2;
+        }
+      }
     }
     out.reserve(reserve);
   } else {
@@ -751,6 +824,19 @@ std::vector<std::uint8_t> EncodeGroupCallSignalPullResp(
       out.push_back(e.media_flags);
       proto::WriteUint64(e.ts_ms, out);
     }
+    // Roster diffs trail the fixed entries so older clients, which stop
+    // after |count| entries, still parse the response.
+    for (const auto& e : resp.events) {
+      if (e.op != static_cast<std::uint8_t>(GroupCallOp::kRoster)) {
+        continue;
+      }
+      proto::WriteUint32(static_cast<std::uint32_t>(e.roster.size()), out);
+      for (const auto& change : e.roster) {
+        proto::WriteString(change.username, out);
+        out.push_back(static_cast<std::uint8_t>(change.op));
+        out.push_back(change.media_flags);
+      }
+    }
   } else {
     proto::WriteString(resp.error, out);
   }
@@ -782,6 +868,9 @@ std::vector<std::uint8_t> EncodeGroupCipherPullResp(
       reserve += EncodedStringSize(e.sender);
       reserve += EncodedBytesSize(e.payload);
     }
+    if (resp.paged) {
+      reserve += kPageTrailerSize;
+    }
     out.reserve(reserve);
   } else {
     out.reserve(1 + EncodedStringSize(resp.error));
@@ -794,6 +883,7 @@ std::vector<std::uint8_t> EncodeGroupCipherPullResp(
       proto::WriteString(e.sender, out);
       proto::WriteBytes(e.payload, out);
     }
+    WritePageTrailer(resp.paged, resp.cursor, resp.has_more, out);
   } else {
     proto::WriteString(resp.error, out);
   }
@@ -851,6 +941,9 @@ std::vector<std::uint8_t> EncodeDeviceSyncPullResp(
     for (const auto& msg : resp.messages) {
       reserve += EncodedBytesSize(msg);
     }
+    if (resp.paged) {
+      reserve += kPageTrailerSize;
+    }
     out.reserve(reserve);
   } else {
     out.reserve(1 + EncodedStringSize(resp.error));
@@ -861,6 +954,7 @@ std::vector<std::uint8_t> EncodeDeviceSyncPullResp(
     for (const auto& msg : resp.messages) {
       proto::WriteBytes(msg, out);
     }
+    WritePageTrailer(resp.paged, resp.cursor, resp.has_more, out);
   } else {
     proto::WriteString(resp.error, out);
   }
@@ -1000,17 +1094,23 @@ std::vector<std::uint8_t> EncodeE2eeFileUploadStartResp(
   return out;
 }
 
-std::vector<std::uint8_t> EncodeE2eeFileUploadChunkResp(
-    const FileBlobUploadChunkResponse& resp) {
+std::vector<std::uint8_t> EncodeE2eeFileUploadStatusResp(
+    const FileBlobUploadStatusResponse& resp) {
   std::vector<std::uint8_t> out;
   if (resp.success) {
-    out.reserve(1 + 8);
+    out.reserve(1 + 8 + 8 + 4 + resp.missing.size() * 16);
   } else {
     out.reserve(1 + EncodedStringSize(resp.error));
   }
   out.push_back(resp.success ? 1 : 0);
   if (resp.success) {
     proto::WriteUint64(resp.bytes_received, out);
+    proto::WriteUint64(resp.expected_size, out);
+    proto::WriteUint32(static_cast<std::uint32_t>(resp.missing.size()), out);
+    for (const auto& range : resp.missing) {
+      proto::WriteUint64(range.first, out);
+      proto::WriteUint64(range.second, out);
+    }
   } else {
     proto::WriteString(resp.error, out);
   }
@@ -1073,6 +1173,23 @@ std::vector<std::uint8_t> EncodeE2eeFileDownloadChunkResp(
 
 }  // namespace
 
+std::vector<std::uint8_t> EncodeE2eeFileUploadChunkResp(
+    const FileBlobUploadChunkResponse& resp) {
+  std::vector<std::uint8_t> out;
+  if (resp.success) {
+    out.reserve(1 + 8);
+  } else {
+    out.reserve(1 + EncodedStringSize(resp.error));
+  }
+  out.push_back(resp.success ? 1 : 0);
+  if (resp.success) {
+    proto::WriteUint64(resp.bytes_received, out);
+  } else {
+    proto::WriteString(resp.error, out);
+  }
+  return out;
+}
+
 FrameRouter::FrameRouter(ApiService* api) : api_(api) {}
 
 bool FrameRouter::Handle(const Frame& in, Frame& out, const std::string& token,
@@ -1321,7 +1438,9 @@ bool FrameRouter::HandleView(const FrameView& in, Frame& out,
       return true;
     }
     case FrameType::kOfflinePull: {
-      auto resp = api_->PullOffline(token);
+      std::optional<OfflinePageRequest> page;
+      ReadLegacyPageRequest(payload_view, offset, page);
+      auto resp = api_->PullOffline(token, page);
       out.payload = EncodeOfflinePullResp(resp);
       return true;
     }
@@ -1554,7 +1673,9 @@ bool FrameRouter::HandleView(const FrameView& in, Frame& out,
       if (token.empty()) {
         return false;
       }
-      auto resp = api_->PullPrivate(token);
+      std::optional<OfflinePageRequest> page;
+      ReadLegacyPageRequest(payload_view, offset, page);
+      auto resp = api_->PullPrivate(token, page);
       out.payload = EncodePrivatePullResp(resp);
       return true;
     }
@@ -1689,6 +1810,25 @@ bool FrameRouter::HandleView(const FrameView& in, Frame& out,
       out.payload = EncodeMediaPullResp(resp);
       return true;
     }
+    case FrameType::kMediaFlowOpen: {
+      if (token.empty()) {
+        return false;
+      }
+      if (!proto::ReadStringView(payload_view, offset, s1_view)) {
+        return false;
+      }
+      AssignString(s1, s1_view);  // group_id
+      std::array<std::uint8_t, 16> call_id{};
+      if (!ReadFixed16(payload_view, offset, call_id) ||
+          !proto::ReadStringView(payload_view, offset, s2_view) ||
+          offset != payload_bytes.size()) {
+        return false;
+      }
+      AssignString(s2, s2_view);  // peer
+      auto resp = api_->OpenMediaFlow(token, s1, call_id, s2);
+      out.payload = EncodeMediaFlowOpenResp(resp);
+      return true;
+    }
     case FrameType::kGroupCipherSend: {
       if (token.empty()) {
         return false;
@@ -1710,10 +1850,11 @@ bool FrameRouter::HandleView(const FrameView& in, Frame& out,
       if (token.empty()) {
         return false;
       }
-      if (offset != payload_bytes.size()) {
+      std::optional<OfflinePageRequest> page;
+      if (!ReadPageRequest(payload_view, offset, page)) {
         return false;
       }
-      auto resp = api_->PullGroupCipher(token);
+      auto resp = api_->PullGroupCipher(token, page);
       out.payload = EncodeGroupCipherPullResp(resp);
       return true;
     }
@@ -1749,12 +1890,13 @@ bool FrameRouter::HandleView(const FrameView& in, Frame& out,
       if (token.empty()) {
         return false;
       }
+      std::optional<OfflinePageRequest> page;
       if (!proto::ReadStringView(payload_view, offset, s1_view) ||  // device_id
-          offset != payload_bytes.size()) {
+          !ReadPageRequest(payload_view, offset, page)) {
         return false;
       }
       AssignString(s1, s1_view);
-      auto resp = api_->PullDeviceSync(token, s1);
+      auto resp = api_->PullDeviceSync(token, s1, page);
       out.payload = EncodeDeviceSyncPullResp(resp);
       return true;
     }
@@ -1867,21 +2009,36 @@ bool FrameRouter::HandleView(const FrameView& in, Frame& out,
         return false;
       }
       std::uint64_t off = 0;
-      std::vector<std::uint8_t> chunk;
+      proto::ByteView chunk;
       if (!proto::ReadStringView(payload_view, offset, s1_view) ||
           !proto::ReadStringView(payload_view, offset, s2_view) ||
           !proto::ReadUint64(payload_view, offset, off) ||
-          !proto::ReadBytes(payload_view, offset, chunk) ||
+          !proto::ReadBytesView(payload_view, offset, chunk) ||
           offset != payload_bytes.size()) {
         return false;
       }
       AssignString(s1, s1_view);
       AssignString(s2, s2_view);
-      auto resp =
-          api_->UploadE2eeFileBlobChunk(token, s1, s2, off, chunk);
+      auto resp = api_->UploadE2eeFileBlobChunk(token, s1, s2, off, chunk.data,
+                                                chunk.size);
       out.payload = EncodeE2eeFileUploadChunkResp(resp);
       return true;
     }
+    case FrameType::kE2eeFileUploadStatus: {
+      if (token.empty()) {
+        return false;
+      }
+      if (!proto::ReadStringView(payload_view, offset, s1_view) ||
+          !proto::ReadStringView(payload_view, offset, s2_view) ||
+          offset != payload_bytes.size()) {
+        return false;
+      }
+      AssignString(s1, s1_view);
+      AssignString(s2, s2_view);
+      auto resp = api_->QueryE2eeFileBlobUpload(token, s1, s2);
+      out.payload = EncodeE2eeFileUploadStatusResp(resp);
+      return true;
+    }
     case FrameType::kE2eeFileUploadFinish: {
       if (token.empty()) {
         return false;
@@ -1940,12 +2097,12 @@ bool FrameRouter::HandleView(const FrameView& in, Frame& out,
       if (token.empty()) {
         return false;
       }
-      std::vector<std::uint8_t> blob;
-      if (!proto::ReadBytes(payload_view, offset, blob) ||
+      proto::ByteView blob;
+      if (!proto::ReadBytesView(payload_view, offset, blob) ||
           offset != payload_bytes.size()) {
         return false;
       }
-      auto resp = api_->StoreE2eeFileBlob(token, blob);
+      auto resp = api_->StoreE2eeFileBlob(token, blob.data, blob.size);
       out.payload = EncodeE2eeFileUploadResp(resp);
       return true;
     }
@@ -1964,8 +2121,43 @@ bool FrameRouter::HandleView(const FrameView& in, Frame& out,
       if (offset != payload_bytes.size()) {
         return false;
       }
-      auto resp = api_->LoadE2eeFileBlob(token, s1, wipe);
-      out.payload = EncodeE2eeFileDownloadResp(resp);
+      // Stream the file straight into the response after a header that is
+      // filled in once the size is known. The reply is one frame, so a file
+      // that cannot fit is refused before any of it is read (or wiped).
+      constexpr std::size_t kHeaderSize = 1 + 8 + 4;
+      constexpr std::size_t kEnvelopeReserve = 1024;
+      constexpr std::uint64_t kMaxSingleFrameFile =
+          kMaxFramePayloadBytes - kHeaderSize - kEnvelopeReserve;
+      std::vector<std::uint8_t> body(kHeaderSize, 0);
+      bool too_large = false;
+      auto resp = api_->LoadE2eeFileBlob(
+          token, s1, wipe,
+          [&](std::uint64_t total, const std::uint8_t* data, std::size_t len) {
+            if (total > kMaxSingleFrameFile) {
+              too_large = true;
+              return false;
+            }
+            if (body.size() == kHeaderSize) {
+              body.reserve(kHeaderSize + static_cast<std::size_t>(total));
+            }
+            body.insert(body.end(), data, data + len);
+            return true;
+          });
+      if (!resp.success) {
+        if (too_large) {
+          resp.error = "file too large; use chunked download";
+        }
+        out.payload = EncodeE2eeFileDownloadResp(resp);
+        return true;
+      }
+      std::vector<std::uint8_t> header;
+      header.reserve(kHeaderSize);
+      header.push_back(1);
+      proto::WriteUint64(resp.meta.size, header);
+      proto::WriteUint32(static_cast<std::uint32_t>(body.size() - kHeaderSize),
+                         header);
+      std::memcpy(body.data(), header.data(), header.size());
+      out.payload = std::move(body);
       return true;
     }
     default:
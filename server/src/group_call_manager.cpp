@@ -23,6 +23,81 @@ GroupCallManager::GroupCallManager(GroupCallConfig config)
   const std::uint32_t ttl =
       std::max<std::uint32_t>(config_.idle_timeout_sec, 60);
   event_ttl_ = std::chrono::seconds(ttl);
+  roster_window_ = std::chrono::milliseconds(config_.roster_coalesce_ms);
+}
+
+GroupCallManager::UserCallIndex::~UserCallIndex() {
+  for (auto& head : heads_) {
+    Node* node = head.load(std::memory_order_relaxed);
+    while (node) {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+}
+
+std::atomic<GroupCallManager::UserCallIndex::Node*>&
+GroupCallManager::UserCallIndex::HeadFor(const std::string& username) {
+  return heads_[std::hash<std::string>{}(username) % kBuckets];
+}
+
+const std::atomic<GroupCallManager::UserCallIndex::Node*>&
+GroupCallManager::UserCallIndex::HeadFor(const std::string& username) const {
+  return heads_[std::hash<std::string>{}(username) % kBuckets];
+}
+
+GroupCallManager::UserCallIndex::Node* GroupCallManager::UserCallIndex::FindIn(
+    Node* head, const std::string& username) {
+  for (Node* node = head; node; node = node->next) {
+    if (node->username == username) {
+      return node;
+    }
+  }
+  return nullptr;
+}
+
+bool GroupCallManager::UserCallIndex::Claim(const std::string& username,
+                                            std::uint64_t serial) {
+  auto& head = HeadFor(username);
+  Node* first = head.load(std::memory_order_acquire);
+  Node* node = FindIn(first, username);
+  if (!node) {
+    auto fresh = std::make_unique<Node>(username);
+    while (true) {
+      fresh->next = first;
+      if (head.compare_exchange_weak(first, fresh.get(),
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+        node = fresh.release();
+        break;
+      }
+      // Someone else pushed; they may have added the same user.
+      node = FindIn(first, username);
+      if (node) {
+        break;
+      }
+    }
+  }
+  std::uint64_t expected = 0;
+  return node->serial.compare_exchange_strong(expected, serial,
+                                              std::memory_order_acq_rel);
+}
+
+void GroupCallManager::UserCallIndex::Release(const std::string& username,
+                                              std::uint64_t serial) {
+  Node* node =
+      FindIn(HeadFor(username).load(std::memory_order_acquire), username);
+  if (node) {
+    node->serial.compare_exchange_strong(serial, 0, std::memory_order_acq_rel);
+  }
+}
+
+std::uint64_t GroupCallManager::UserCallIndex::Find(
+    const std::string& username) const {
+  const Node* node =
+      FindIn(HeadFor(username).load(std::memory_order_acquire), username);
+  return node ? node->serial.load(std::memory_order_acquire) : 0;
 }
 
 bool GroupCallManager::IsAllZero(const std::array<std::uint8_t, 16>& call_id) {
@@ -60,6 +135,24 @@ bool GroupCallManager::GenerateUniqueCallId(
   return false;
 }
 
+GroupCallManager::CallPtr GroupCallManager::FindCall(
+    const std::array<std::uint8_t, 16>& call_id) const {
+  std::shared_lock<std::shared_mutex> lock(calls_mutex_);
+  const auto it = calls_by_id_.find(CallIdKey(call_id));
+  return it == calls_by_id_.end() ? nullptr : it->second;
+}
+
+GroupCallManager::CallPtr GroupCallManager::FindUserCall(
+    const std::string& username) const {
+  const std::uint64_t serial = call_by_user_.Find(username);
+  if (serial == 0) {
+    return nullptr;
+  }
+  std::shared_lock<std::shared_mutex> lock(calls_mutex_);
+  const auto it = calls_by_serial_.find(serial);
+  return it == calls_by_serial_.end() ? nullptr : it->second;
+}
+
 GroupCallSnapshot GroupCallManager::BuildSnapshotLocked(
     const CallState& state) const {
   GroupCallSnapshot snap;
@@ -75,6 +168,218 @@ GroupCallSnapshot GroupCallManager::BuildSnapshotLocked(
   return snap;
 }
 
+const std::uint64_t* GroupCallFanout::Targets(std::uint32_t sender,
+                                              std::uint8_t media_flag) const {
+  if (sender >= members.size()) {
+    return nullptr;
+  }
+  if (media_flag == kGroupCallMediaAudio) {
+    return audio.data() + static_cast<std::size_t>(sender) * words;
+  }
+  if (media_flag == kGroupCallMediaVideo) {
+    return video.data() + static_cast<std::size_t>(sender) * words;
+  }
+  return nullptr;
+}
+
+const std::uint64_t* GroupCallFanout::PreferredLayers(
+    std::uint32_t sender) const {
+  if (sender >= members.size()) {
+    return nullptr;
+  }
+  return layers.data() +
+         static_cast<std::size_t>(sender) * kGroupCallMaxLayers * words;
+}
+
+void GroupCallManager::RebuildFanoutLocked(CallState& state) const {
+  auto fanout = std::make_shared<GroupCallFanout>();
+  fanout->group_id = state.group_id;
+  fanout->version = ++fanout_version_;
+  fanout->members.assign(state.members.begin(), state.members.end());
+  std::sort(fanout->members.begin(), fanout->members.end());
+  const std::size_t n = fanout->members.size();
+  fanout->index.reserve(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    fanout->index.emplace(fanout->members[i], static_cast<std::uint32_t>(i));
+  }
+  const std::size_t words = (n + 63) / 64;
+  fanout->words = words;
+
+  // Members without a subscription list take everything; start every row
+  // from that set and add the explicit subscribers on top.
+  std::vector<std::uint64_t> open(words, 0);
+  for (std::size_t r = 0; r < n; ++r) {
+    if (state.subscriptions.find(fanout->members[r]) ==
+        state.subscriptions.end()) {
+      open[r / 64] |= 1ull << (r % 64);
+    }
+  }
+  fanout->audio.resize(n * words);
+  fanout->video.resize(n * words);
+  fanout->layers.assign(n * kGroupCallMaxLayers * words, 0);
+  constexpr std::size_t kTop = kGroupCallMaxLayers - 1;
+  for (std::size_t s = 0; s < n; ++s) {
+    std::copy(open.begin(), open.end(), fanout->audio.begin() + s * words);
+    std::copy(open.begin(), open.end(), fanout->video.begin() + s * words);
+    auto* top = fanout->layers.data() + (s * kGroupCallMaxLayers + kTop) * words;
+    for (std::size_t w = 0; w < words; ++w) {
+      top[w] = ~0ull;
+    }
+  }
+  for (const auto& kv : state.subscriptions) {
+    const auto r_it = fanout->index.find(kv.first);
+    if (r_it == fanout->index.end()) {
+      continue;
+    }
+    const std::size_t r = r_it->second;
+    for (const auto& sender : kv.second.senders) {
+      const auto s_it = fanout->index.find(sender.first);
+      if (s_it == fanout->index.end()) {
+        continue;
+      }
+      const std::size_t s = s_it->second;
+      const std::uint64_t bit = 1ull << (r % 64);
+      const std::uint8_t flags = sender.second.flags;
+      if ((flags & kGroupCallMediaAudio) != 0) {
+        fanout->audio[s * words + r / 64] |= bit;
+      }
+      if ((flags & kGroupCallMediaVideo) != 0) {
+        fanout->video[s * words + r / 64] |= bit;
+      }
+      const std::size_t layer = sender.second.video_layer;
+      if (layer != kTop && layer < kGroupCallMaxLayers) {
+        auto* rows = fanout->layers.data() + s * kGroupCallMaxLayers * words;
+        rows[kTop * words + r / 64] &= ~bit;
+        rows[layer * words + r / 64] |= bit;
+      }
+    }
+  }
+  for (std::size_t s = 0; s < n; ++s) {
+    const std::uint64_t self = ~(1ull << (s % 64));
+    fanout->audio[s * words + s / 64] &= self;
+    fanout->video[s * words + s / 64] &= self;
+  }
+  state.fanout = std::move(fanout);
+  state.fanout_dirty = false;
+}
+
+const std::shared_ptr<const GroupCallFanout>& GroupCallManager::FanoutLocked(
+    CallState& state) const {
+  if (state.fanout_dirty || !state.fanout) {
+    RebuildFanoutLocked(state);
+  }
+  return state.fanout;
+}
+
+void GroupCallManager::RetireCallLocked(CallState& state) {
+  state.ended = true;
+  state.pending_roster.clear();
+  state.pending_index.clear();
+  for (const auto& member : state.members) {
+    call_by_user_.Release(member, state.serial);
+  }
+  std::unique_lock<std::shared_mutex> lock(calls_mutex_);
+  calls_by_id_.erase(CallIdKey(state.call_id));
+  calls_by_serial_.erase(state.serial);
+  const auto it = call_by_group_.find(state.group_id);
+  if (it != call_by_group_.end() && it->second == CallIdKey(state.call_id)) {
+    call_by_group_.erase(it);
+  }
+}
+
+namespace {
+// Folds |next| into the earlier change |into| of the same member.
+void FoldRosterChange(GroupCallRosterChange& into,
+                      const GroupCallRosterChange& next) {
+  if (next.op == GroupCallOp::kUpdate && into.op == GroupCallOp::kJoin) {
+    into.media_flags = next.media_flags;
+    return;
+  }
+  into.op = next.op;
+  into.media_flags = next.media_flags;
+}
+}  // namespace
+
+void GroupCallManager::CompactRoster(
+    std::vector<GroupCallRosterChange>& roster) {
+  std::unordered_map<std::string, std::size_t> index;
+  index.reserve(roster.size());
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i < roster.size(); ++i) {
+    const auto it = index.find(roster[i].username);
+    if (it != index.end()) {
+      FoldRosterChange(roster[it->second], roster[i]);
+      continue;
+    }
+    index.emplace(roster[i].username, kept);
+    if (kept != i) {
+      roster[kept] = std::move(roster[i]);
+    }
+    ++kept;
+  }
+  roster.resize(kept);
+}
+
+void GroupCallManager::AddRosterChangeLocked(
+    CallState& state, const GroupCallRosterChange& change) {
+  if (state.pending_roster.empty()) {
+    state.pending_since = std::chrono::steady_clock::now();
+  }
+  const auto it = state.pending_index.find(change.username);
+  if (it != state.pending_index.end()) {
+    FoldRosterChange(state.pending_roster[it->second], change);
+    return;
+  }
+  state.pending_index.emplace(change.username, state.pending_roster.size());
+  state.pending_roster.push_back(change);
+}
+
+bool GroupCallManager::TakeRosterLocked(
+    CallState& state, std::chrono::steady_clock::time_point now,
+    GroupCallEvent& out_event, std::vector<std::string>& out_recipients) {
+  if (state.ended || state.pending_roster.empty() ||
+      now - state.pending_since < roster_window_) {
+    return false;
+  }
+  out_event = GroupCallEvent{};
+  out_event.op = GroupCallOp::kRoster;
+  out_event.group_id = state.group_id;
+  out_event.call_id = state.call_id;
+  out_event.key_id = state.key_id;
+  out_event.ts_ms = NowMs();
+  out_event.roster = std::move(state.pending_roster);
+  state.pending_roster.clear();
+  state.pending_index.clear();
+  out_recipients.assign(state.members.begin(), state.members.end());
+  roster_flushes_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+std::chrono::steady_clock::time_point GroupCallManager::FlushDueRoster(
+    const std::string& username) {
+  const auto never = std::chrono::steady_clock::time_point::max();
+  if (roster_window_.count() == 0) {
+    return never;
+  }
+  const CallPtr call = FindUserCall(username);
+  if (!call) {
+    return never;
+  }
+  GroupCallEvent event;
+  std::vector<std::string> recipients;
+  {
+    std::lock_guard<std::mutex> lock(call->mutex);
+    const auto now = std::chrono::steady_clock::now();
+    if (!TakeRosterLocked(*call, now, event, recipients)) {
+      return call->pending_roster.empty() || call->ended
+                 ? never
+                 : call->pending_since + roster_window_;
+    }
+  }
+  EnqueueEventForMembers(recipients, event);
+  return never;
+}
+
 GroupCallManager::Bucket& GroupCallManager::BucketForKey(
     const std::string& key) {
   const std::size_t idx = std::hash<std::string>{}(key) % kBucketCount;
@@ -99,47 +404,53 @@ bool GroupCallManager::CreateCall(
     return false;
   }
 
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (call_by_group_.find(group_id) != call_by_group_.end()) {
-    error = "call already active";
+  const std::uint64_t serial = ++next_serial_;
+  if (!call_by_user_.Claim(owner, serial)) {
+    error = "already in call";
     return false;
   }
-  if (call_by_user_.find(owner) != call_by_user_.end()) {
-    error = "already in call";
+
+  std::unique_lock<std::shared_mutex> lock(calls_mutex_);
+  if (call_by_group_.find(group_id) != call_by_group_.end()) {
+    lock.unlock();
+    call_by_user_.Release(owner, serial);
+    error = "call already active";
     return false;
   }
 
   std::array<std::uint8_t, 16> call_id = out_call_id;
   if (IsAllZero(call_id)) {
     if (!GenerateUniqueCallId(call_id)) {
+      lock.unlock();
+      call_by_user_.Release(owner, serial);
       error = "call id generate failed";
       return false;
     }
-  } else {
-    const std::string key = CallIdKey(call_id);
-    if (calls_by_id_.find(key) != calls_by_id_.end()) {
-      error = "call id conflict";
-      return false;
-    }
+  } else if (calls_by_id_.find(CallIdKey(call_id)) != calls_by_id_.end()) {
+    lock.unlock();
+    call_by_user_.Release(owner, serial);
+    error = "call id conflict";
+    return false;
   }
 
-  CallState state;
-  state.group_id = group_id;
-  state.owner = owner;
-  state.call_id = call_id;
-  state.key_id = 1;
-  state.media_flags = media_flags;
-  state.members.insert(owner);
-  state.created_at = std::chrono::steady_clock::now();
-  state.last_active = state.created_at;
+  auto state = std::make_shared<CallState>();
+  state->serial = serial;
+  state->group_id = group_id;
+  state->owner = owner;
+  state->call_id = call_id;
+  state->key_id = 1;
+  state->media_flags = media_flags;
+  state->members.insert(owner);
+  state->created_at = std::chrono::steady_clock::now();
+  state->last_active = state->created_at;
+  out_snapshot = BuildSnapshotLocked(*state);
 
   const std::string id_key = CallIdKey(call_id);
   calls_by_id_[id_key] = state;
+  calls_by_serial_[serial] = state;
   call_by_group_[group_id] = id_key;
-  call_by_user_[owner] = id_key;
 
   out_call_id = call_id;
-  out_snapshot = BuildSnapshotLocked(state);
   return true;
 }
 
@@ -161,34 +472,40 @@ bool GroupCallManager::JoinCall(
     return false;
   }
 
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (call_by_user_.find(username) != call_by_user_.end()) {
+  const CallPtr call = FindCall(call_id);
+  if (!call) {
+    error = call_by_user_.Find(username) != 0 ? "already in call"
+                                              : "call not found";
+    return false;
+  }
+  if (!call_by_user_.Claim(username, call->serial)) {
     error = "already in call";
     return false;
   }
-
-  const std::string id_key = CallIdKey(call_id);
-  auto it = calls_by_id_.find(id_key);
-  if (it == calls_by_id_.end()) {
+  std::lock_guard<std::mutex> lock(call->mutex);
+  CallState& state = *call;
+  if (state.ended) {
+    call_by_user_.Release(username, state.serial);
     error = "call not found";
     return false;
   }
-  CallState& state = it->second;
   if (state.group_id != group_id) {
+    call_by_user_.Release(username, state.serial);
     error = "call mismatch";
     return false;
   }
   if (config_.max_room_size > 0 &&
       state.members.size() >= config_.max_room_size) {
+    call_by_user_.Release(username, state.serial);
     error = "room full";
     return false;
   }
   if (state.members.insert(username).second) {
     state.key_id++;
+    state.fanout_dirty = true;
   }
   state.media_flags = media_flags;
   state.last_active = std::chrono::steady_clock::now();
-  call_by_user_[username] = id_key;
 
   out_snapshot = BuildSnapshotLocked(state);
   return true;
@@ -213,14 +530,17 @@ bool GroupCallManager::LeaveCall(
     return false;
   }
 
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::string id_key = CallIdKey(call_id);
-  auto it = calls_by_id_.find(id_key);
-  if (it == calls_by_id_.end()) {
+  const CallPtr call = FindCall(call_id);
+  if (!call) {
+    error = "call not found";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(call->mutex);
+  CallState& state = *call;
+  if (state.ended) {
     error = "call not found";
     return false;
   }
-  CallState& state = it->second;
   if (state.group_id != group_id) {
     error = "call mismatch";
     return false;
@@ -231,25 +551,21 @@ bool GroupCallManager::LeaveCall(
   }
 
   out_snapshot = BuildSnapshotLocked(state);
+  if (state.members.size() == 1 || state.owner == username) {
+    RetireCallLocked(state);
+    out_ended = true;
+    return true;
+  }
+
   state.members.erase(username);
-  call_by_user_.erase(username);
+  call_by_user_.Release(username, state.serial);
   state.subscriptions.erase(username);
   for (auto& kv : state.subscriptions) {
     kv.second.senders.erase(username);
   }
-
-  if (state.members.empty() || state.owner == username) {
-    calls_by_id_.erase(it);
-    call_by_group_.erase(group_id);
-    for (const auto& member : out_snapshot.members) {
-      call_by_user_.erase(member);
-    }
-    out_ended = true;
-    return true;
-  }
-
   state.key_id++;
   state.last_active = std::chrono::steady_clock::now();
+  state.fanout_dirty = true;
   out_snapshot = BuildSnapshotLocked(state);
   return true;
 }
@@ -271,14 +587,17 @@ bool GroupCallManager::EndCall(
     return false;
   }
 
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::string id_key = CallIdKey(call_id);
-  auto it = calls_by_id_.find(id_key);
-  if (it == calls_by_id_.end()) {
+  const CallPtr call = FindCall(call_id);
+  if (!call) {
+    error = "call not found";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(call->mutex);
+  CallState& state = *call;
+  if (state.ended) {
     error = "call not found";
     return false;
   }
-  CallState& state = it->second;
   if (state.group_id != group_id) {
     error = "call mismatch";
     return false;
@@ -288,11 +607,7 @@ bool GroupCallManager::EndCall(
     return false;
   }
   out_snapshot = BuildSnapshotLocked(state);
-  calls_by_id_.erase(it);
-  call_by_group_.erase(group_id);
-  for (const auto& member : out_snapshot.members) {
-    call_by_user_.erase(member);
-  }
+  RetireCallLocked(state);
   return true;
 }
 
@@ -311,14 +626,17 @@ bool GroupCallManager::TouchCall(
     error = "invalid params";
     return false;
   }
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::string id_key = CallIdKey(call_id);
-  auto it = calls_by_id_.find(id_key);
-  if (it == calls_by_id_.end()) {
+  const CallPtr call = FindCall(call_id);
+  if (!call) {
+    error = "call not found";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(call->mutex);
+  CallState& state = *call;
+  if (state.ended) {
     error = "call not found";
     return false;
   }
-  CallState& state = it->second;
   if (state.members.find(username) == state.members.end()) {
     error = "not in call";
     return false;
@@ -332,13 +650,15 @@ bool GroupCallManager::GetCall(
     const std::array<std::uint8_t, 16>& call_id,
     GroupCallSnapshot& out_snapshot) const {
   out_snapshot = GroupCallSnapshot{};
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::string id_key = CallIdKey(call_id);
-  auto it = calls_by_id_.find(id_key);
-  if (it == calls_by_id_.end()) {
+  const CallPtr call = FindCall(call_id);
+  if (!call) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(call->mutex);
+  if (call->ended) {
     return false;
   }
-  out_snapshot = BuildSnapshotLocked(it->second);
+  out_snapshot = BuildSnapshotLocked(*call);
   return true;
 }
 
@@ -346,17 +666,11 @@ bool GroupCallManager::GetUserCallId(
     const std::string& username,
     std::array<std::uint8_t, 16>& out_call_id) const {
   out_call_id.fill(0);
-  std::lock_guard<std::mutex> lock(mutex_);
-  const auto it = call_by_user_.find(username);
-  if (it == call_by_user_.end()) {
-    return false;
-  }
-  const std::string& id_key = it->second;
-  auto it_call = calls_by_id_.find(id_key);
-  if (it_call == calls_by_id_.end()) {
+  const CallPtr call = FindUserCall(username);
+  if (!call) {
     return false;
   }
-  out_call_id = it_call->second.call_id;
+  out_call_id = call->call_id;
   return true;
 }
 
@@ -374,14 +688,17 @@ bool GroupCallManager::UpdateSubscriptions(
     error = "recipient empty";
     return false;
   }
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::string id_key = CallIdKey(call_id);
-  auto it = calls_by_id_.find(id_key);
-  if (it == calls_by_id_.end()) {
+  const CallPtr call = FindCall(call_id);
+  if (!call) {
+    error = "call not found";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(call->mutex);
+  CallState& state = *call;
+  if (state.ended) {
     error = "call not found";
     return false;
   }
-  CallState& state = it->second;
   if (state.members.find(recipient) == state.members.end()) {
     error = "not in call";
     return false;
@@ -410,8 +727,12 @@ bool GroupCallManager::UpdateSubscriptions(
     if (flags == 0) {
       continue;
     }
-    entry.senders[sub.sender] = flags;
+    auto& pref = entry.senders[sub.sender];
+    pref.flags = flags;
+    pref.video_layer = std::min<std::uint8_t>(sub.video_layer,
+                                              kGroupCallMaxLayers - 1);
   }
+  state.fanout_dirty = true;
   return true;
 }
 
@@ -426,26 +747,35 @@ bool GroupCallManager::IsSubscribed(
   if ((media_flag & (kGroupCallMediaAudio | kGroupCallMediaVideo)) == 0) {
     return false;
   }
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::string id_key = CallIdKey(call_id);
-  auto it = calls_by_id_.find(id_key);
-  if (it == calls_by_id_.end()) {
+  const auto fanout = GetFanout(call_id);
+  if (!fanout) {
     return false;
   }
-  const CallState& state = it->second;
-  if (state.members.find(recipient) == state.members.end() ||
-      state.members.find(sender) == state.members.end()) {
+  const auto r_it = fanout->index.find(recipient);
+  const auto s_it = fanout->index.find(sender);
+  if (r_it == fanout->index.end() || s_it == fanout->index.end()) {
     return false;
   }
-  auto sub_it = state.subscriptions.find(recipient);
-  if (sub_it == state.subscriptions.end()) {
-    return true;
+  const std::uint32_t r = r_it->second;
+  const auto check = [&](std::uint8_t flag) {
+    const std::uint64_t* targets = fanout->Targets(s_it->second, flag);
+    return (media_flag & flag) != 0 && targets &&
+           (targets[r / 64] & (1ull << (r % 64))) != 0;
+  };
+  return check(kGroupCallMediaAudio) || check(kGroupCallMediaVideo);
+}
+
+std::shared_ptr<const GroupCallFanout> GroupCallManager::GetFanout(
+    const std::array<std::uint8_t, 16>& call_id) const {
+  const CallPtr call = FindCall(call_id);
+  if (!call) {
+    return nullptr;
   }
-  const auto sender_it = sub_it->second.senders.find(sender);
-  if (sender_it == sub_it->second.senders.end()) {
-    return false;
+  std::lock_guard<std::mutex> lock(call->mutex);
+  if (call->ended) {
+    return nullptr;
   }
-  return (sender_it->second & media_flag) != 0;
+  return FanoutLocked(*call);
 }
 
 void GroupCallManager::EnqueueEvent(const std::string& recipient,
@@ -456,19 +786,37 @@ void GroupCallManager::EnqueueEvent(const std::string& recipient,
   if (event.ts_ms == 0) {
     event.ts_ms = NowMs();
   }
-  GroupCallManager::EventQueue::StoredEvent stored;
-  stored.event = std::move(event);
-  stored.created_at = std::chrono::steady_clock::now();
+  const auto now = std::chrono::steady_clock::now();
   auto& bucket = BucketForKey(recipient);
   {
     std::lock_guard<std::mutex> lock(bucket.mutex);
     auto& queue = bucket.queues[recipient];
-    queue.last_seen = std::chrono::steady_clock::now();
+    queue.last_seen = now;
+    // A roster diff the member has not pulled yet absorbs the next one.
+    if (event.op == GroupCallOp::kRoster && !queue.events.empty()) {
+      GroupCallEvent& tail = queue.events.back().event;
+      if (tail.op == GroupCallOp::kRoster && tail.call_id == event.call_id) {
+        tail.roster.insert(tail.roster.end(), event.roster.begin(),
+                           event.roster.end());
+        if (tail.roster.size() >
+            2 * std::max<std::size_t>(config_.max_room_size, 64)) {
+          CompactRoster(tail.roster);
+        }
+        tail.key_id = event.key_id;
+        tail.ts_ms = event.ts_ms;
+        events_merged_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+    GroupCallManager::EventQueue::StoredEvent stored;
+    stored.event = std::move(event);
+    stored.created_at = now;
     queue.events.push_back(std::move(stored));
     while (queue.events.size() > max_event_queue_) {
       queue.events.pop_front();
     }
   }
+  events_queued_.fetch_add(1, std::memory_order_relaxed);
   bucket.cv.notify_all();
 }
 
@@ -480,6 +828,39 @@ void GroupCallManager::EnqueueEventForMembers(
   }
 }
 
+void GroupCallManager::PublishMemberEvent(const GroupCallEvent& event) {
+  if (!config_.enable_group_call || event.sender.empty()) {
+    return;
+  }
+  const CallPtr call = FindCall(event.call_id);
+  if (!call) {
+    return;
+  }
+  GroupCallEvent roster;
+  std::vector<std::string> recipients;
+  {
+    std::lock_guard<std::mutex> lock(call->mutex);
+    if (call->ended) {
+      return;
+    }
+    if (roster_window_.count() == 0) {
+      recipients.assign(call->members.begin(), call->members.end());
+    } else {
+      GroupCallRosterChange change;
+      change.username = event.sender;
+      change.op = event.op;
+      change.media_flags = event.media_flags;
+      AddRosterChangeLocked(*call, change);
+      if (!TakeRosterLocked(*call, std::chrono::steady_clock::now(), roster,
+                            recipients)) {
+        return;
+      }
+    }
+  }
+  EnqueueEventForMembers(recipients,
+                         roster_window_.count() == 0 ? event : roster);
+}
+
 void GroupCallManager::PullEvents(const std::string& recipient,
                                   std::size_t max_events,
                                   std::chrono::milliseconds wait,
@@ -489,14 +870,27 @@ void GroupCallManager::PullEvents(const std::string& recipient,
     return;
   }
   const auto deadline = std::chrono::steady_clock::now() + wait;
+  auto flush_at = FlushDueRoster(recipient);
   auto& bucket = BucketForKey(recipient);
   std::unique_lock<std::mutex> lock(bucket.mutex);
   const auto has_data = [&]() {
     const auto it = bucket.queues.find(recipient);
     return it != bucket.queues.end() && !it->second.events.empty();
   };
-  if (!has_data() && wait.count() > 0) {
-    bucket.cv.wait_until(lock, deadline, has_data);
+  // A quiet call has nothing else to flush its pending roster, so the
+  // waiting member does it when the window closes.
+  while (!has_data()) {
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      break;
+    }
+    if (flush_at <= now) {
+      lock.unlock();
+      flush_at = FlushDueRoster(recipient);
+      lock.lock();
+      continue;
+    }
+    bucket.cv.wait_until(lock, std::min(deadline, flush_at), has_data);
   }
   auto it = bucket.queues.find(recipient);
   if (it == bucket.queues.end() || it->second.events.empty()) {
@@ -509,31 +903,46 @@ void GroupCallManager::PullEvents(const std::string& recipient,
   for (std::size_t i = 0; i < count; ++i) {
     out.push_back(std::move(queue.events.front().event));
     queue.events.pop_front();
+    if (out.back().op == GroupCallOp::kRoster) {
+      CompactRoster(out.back().roster);
+    }
   }
   queue.last_seen = std::chrono::steady_clock::now();
 }
 
 void GroupCallManager::Cleanup() {
   const auto now = std::chrono::steady_clock::now();
+  std::vector<CallPtr> calls;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    for (auto it = calls_by_id_.begin(); it != calls_by_id_.end();) {
-      CallState& state = it->second;
+    std::shared_lock<std::shared_mutex> lock(calls_mutex_);
+    calls.reserve(calls_by_id_.size());
+    for (const auto& kv : calls_by_id_) {
+      calls.push_back(kv.second);
+    }
+  }
+  for (const auto& call : calls) {
+    GroupCallEvent roster;
+    std::vector<std::string> recipients;
+    {
+      std::lock_guard<std::mutex> lock(call->mutex);
+      CallState& state = *call;
+      if (state.ended) {
+        continue;
+      }
       const bool expired =
           (call_timeout_.count() > 0 &&
            now - state.created_at > call_timeout_) ||
           (idle_timeout_.count() > 0 &&
            now - state.last_active > idle_timeout_);
       if (expired) {
-        for (const auto& member : state.members) {
-          call_by_user_.erase(member);
-        }
-        call_by_group_.erase(state.group_id);
-        it = calls_by_id_.erase(it);
+        RetireCallLocked(state);
+        continue;
+      }
+      if (!TakeRosterLocked(state, now, roster, recipients)) {
         continue;
       }
-      ++it;
     }
+    EnqueueEventForMembers(recipients, roster);
   }
 
   for (auto& bucket : buckets_) {
@@ -558,13 +967,25 @@ void GroupCallManager::Cleanup() {
 
 GroupCallStats GroupCallManager::GetStats() {
   GroupCallStats stats;
-  std::lock_guard<std::mutex> lock(mutex_);
-  stats.active_calls = calls_by_id_.size();
-  std::uint64_t participants = 0;
-  for (const auto& kv : calls_by_id_) {
-    participants += kv.second.members.size();
+  std::vector<CallPtr> calls;
+  {
+    std::shared_lock<std::shared_mutex> lock(calls_mutex_);
+    calls.reserve(calls_by_id_.size());
+    for (const auto& kv : calls_by_id_) {
+      calls.push_back(kv.second);
+    }
+  }
+  for (const auto& call : calls) {
+    std::lock_guard<std::mutex> lock(call->mutex);
+    if (call->ended) {
+      continue;
+    }
+    stats.active_calls++;
+    stats.participants += call->members.size();
   }
-  stats.participants = participants;
+  stats.events_queued = events_queued_.load(std::memory_order_relaxed);
+  stats.events_merged = events_merged_.load(std::memory_order_relaxed);
+  stats.roster_flushes = roster_flushes_.load(std::memory_order_relaxed);
   return stats;
 }
 
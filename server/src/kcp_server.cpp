@@ -5,6 +5,8 @@
 #include <cerrno>
 #include <cstring>
 #include <limits>
+#include <queue>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -22,27 +24,44 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
 #include "crypto.h"
 #include "ikcp.h"
+#include "kcp_fec.h"
 
 namespace mi::server {
 
 namespace {
 
-constexpr std::uint32_t kTickMsMin = 5;
+// Longest poll wait, so Stop() is noticed even with no timer due.
 constexpr std::uint32_t kTickMsMax = 50;
 constexpr std::uint8_t kKcpCookieCmd = 0xFF;
 constexpr std::uint8_t kKcpCookieHello = 1;
 constexpr std::uint8_t kKcpCookieChallenge = 2;
 constexpr std::uint8_t kKcpCookieResponse = 3;
+// Cookie packet byte 6: the client asks for FEC in hello and confirms in
+// response, the server grants it in the challenge.
+constexpr std::uint8_t kKcpCookieFlagFec = 0x01;
 constexpr std::uint32_t kKcpCookieWindowMs = 30000;
 constexpr std::size_t kKcpCookieBytes = 16;
 constexpr std::size_t kKcpCookiePacketBytes = 24;
+constexpr std::size_t kMaxWorkers = 64;
+constexpr std::size_t kMaxBatch = 256;
+// Receive batches per tick before sessions are serviced, so a flood cannot
+// starve the update/response path.
+constexpr std::size_t kMaxRxRounds = 16;
+// Kernel limits for one UDP_SEGMENT send.
+constexpr std::size_t kMaxGsoSegments = 64;
+constexpr std::size_t kMaxGsoBytes = 65000;
+// Stale timer entries tolerated per live session before the heap is rebuilt.
+constexpr std::size_t kTimerSlackPerSession = 2;
+constexpr std::size_t kTimerSlackMin = 1024;
 
 std::uint32_t NowMs() {
   static const auto kStart = std::chrono::steady_clock::now();
@@ -93,6 +112,7 @@ void WriteLe64(std::uint64_t v, std::uint8_t out[8]) {
 struct CookiePacket {
   std::uint32_t conv{0};
   std::uint8_t type{0};
+  std::uint8_t flags{0};
   std::array<std::uint8_t, kKcpCookieBytes> cookie{};
 };
 
@@ -106,17 +126,19 @@ bool ParseCookiePacket(const std::uint8_t* data, std::size_t len,
   }
   out.conv = ReadLe32(data);
   out.type = data[5];
+  out.flags = data[6];
   std::memcpy(out.cookie.data(), data + 8, out.cookie.size());
   return true;
 }
 
 void BuildCookiePacket(std::uint32_t conv, std::uint8_t type,
+                       std::uint8_t flags,
                        const std::array<std::uint8_t, kKcpCookieBytes>& cookie,
                        std::array<std::uint8_t, kKcpCookiePacketBytes>& out) {
   WriteLe32(conv, out.data());
   out[4] = kKcpCookieCmd;
   out[5] = type;
-  out[6] = 0;
+  out[6] = flags;
   out[7] = 0;
   std::memcpy(out.data() + 8, cookie.data(), cookie.size());
 }
@@ -181,6 +203,7 @@ bool SetNonBlocking(std::intptr_t sock) {
 #endif
 }
 
+#ifndef __linux__
 bool WouldBlock() {
 #ifdef _WIN32
   const int err = WSAGetLastError();
@@ -189,6 +212,7 @@ bool WouldBlock() {
   return errno == EAGAIN || errno == EWOULDBLOCK;
 #endif
 }
+#endif
 
 #ifdef _WIN32
 std::string Win32ErrorMessage(DWORD code) {
@@ -212,44 +236,415 @@ std::string Win32ErrorMessage(DWORD code) {
 }
 #endif
 
+struct Datagram {
+  std::vector<std::uint8_t> data;
+  std::size_t len{0};
+  sockaddr_storage addr{};
+  socklen_t addr_len{0};
+};
+
+bool SameAddr(const Datagram& a, const Datagram& b) {
+  return a.addr_len == b.addr_len &&
+         std::memcmp(&a.addr, &b.addr, static_cast<std::size_t>(a.addr_len)) ==
+             0;
+}
+
+// Receives up to size() datagrams per call without blocking: one recvmmsg
+// on Linux, a recvfrom loop elsewhere.
+class RxBatch {
+ public:
+  RxBatch(std::size_t count, std::size_t capacity) : slots_(count) {
+    for (auto& slot : slots_) {
+      slot.data.resize(capacity);
+    }
+#ifdef __linux__
+    msgs_.resize(count);
+    iovs_.resize(count);
+#endif
+  }
+
+  Datagram& operator[](std::size_t i) { return slots_[i]; }
+
+  std::size_t Receive(std::intptr_t sock) {
+#ifdef __linux__
+    for (std::size_t i = 0; i < slots_.size(); ++i) {
+      iovs_[i].iov_base = slots_[i].data.data();
+      iovs_[i].iov_len = slots_[i].data.size();
+      msghdr& hdr = msgs_[i].msg_hdr;
+      hdr = msghdr{};
+      hdr.msg_name = &slots_[i].addr;
+      hdr.msg_namelen = sizeof(slots_[i].addr);
+      hdr.msg_iov = &iovs_[i];
+      hdr.msg_iovlen = 1;
+      msgs_[i].msg_len = 0;
+    }
+    int n = -1;
+    do {
+      n = ::recvmmsg(static_cast<int>(sock), msgs_.data(),
+                     static_cast<unsigned int>(msgs_.size()), MSG_DONTWAIT,
+                     nullptr);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      return 0;
+    }
+    for (int i = 0; i < n; ++i) {
+      slots_[i].len = msgs_[i].msg_len;
+      slots_[i].addr_len = msgs_[i].msg_hdr.msg_namelen;
+    }
+    return static_cast<std::size_t>(n);
+#else
+    std::size_t count = 0;
+    for (std::size_t tries = 0;
+         count < slots_.size() && tries < slots_.size(); ++tries) {
+      Datagram& slot = slots_[count];
+      slot.addr_len = sizeof(slot.addr);
+#ifdef _WIN32
+      const int n = recvfrom(static_cast<SOCKET>(sock),
+                             reinterpret_cast<char*>(slot.data.data()),
+                             static_cast<int>(slot.data.size()), 0,
+                             reinterpret_cast<sockaddr*>(&slot.addr),
+                             &slot.addr_len);
+#else
+      const ssize_t n = recvfrom(static_cast<int>(sock), slot.data.data(),
+                                 slot.data.size(), 0,
+                                 reinterpret_cast<sockaddr*>(&slot.addr),
+                                 &slot.addr_len);
+#endif
+      if (n < 0) {
+        if (WouldBlock()) {
+          break;
+        }
+        continue;
+      }
+      slot.len = static_cast<std::size_t>(n);
+      ++count;
+    }
+    return count;
+#endif
+  }
+
+ private:
+  std::vector<Datagram> slots_;
+#ifdef __linux__
+  std::vector<mmsghdr> msgs_;
+  std::vector<iovec> iovs_;
+#endif
+};
+
+// Collects outgoing datagrams and sends them in one sendmmsg on Flush.
+// Runs of equal-sized packets to the same peer go out as a single UDP GSO
+// send where the kernel supports it.
+class TxBatch {
+ public:
+  TxBatch(std::intptr_t sock, std::size_t count, std::size_t capacity,
+          bool gso)
+      : sock_(sock), slots_(count) {
+    for (auto& slot : slots_) {
+      slot.data.resize(capacity);
+    }
+#ifdef __linux__
+    msgs_.resize(count);
+    iovs_.resize(count);
+    controls_.resize(count);
+    gso_ = gso;
+#else
+    (void)gso;
+#endif
+  }
+  ~TxBatch() { Flush(); }
+
+  void Queue(const std::uint8_t* data, std::size_t len,
+             const sockaddr_storage& addr, socklen_t addr_len) {
+    if (len == 0) {
+      return;
+    }
+    if (count_ == slots_.size()) {
+      Flush();
+    }
+    Datagram& slot = slots_[count_];
+    if (slot.data.size() < len) {
+      slot.data.resize(len);
+    }
+    std::memcpy(slot.data.data(), data, len);
+    slot.len = len;
+    slot.addr = addr;
+    slot.addr_len = addr_len;
+    ++count_;
+  }
+
+  void Flush() {
+    std::size_t start = 0;
+    while (start < count_) {
+#ifdef __linux__
+      std::size_t msgs = 0;
+      bool used_gso = false;
+      std::size_t i = start;
+      while (i < count_) {
+        std::size_t j = i + 1;
+        const std::size_t seg = slots_[i].len;
+        std::size_t total = seg;
+        while (gso_ && j < count_ && j - i < kMaxGsoSegments &&
+               slots_[j - 1].len == seg && slots_[j].len <= seg &&
+               total + slots_[j].len <= kMaxGsoBytes &&
+               SameAddr(slots_[j], slots_[i])) {
+          total += slots_[j].len;
+          ++j;
+        }
+        for (std::size_t k = i; k < j; ++k) {
+          iovs_[k].iov_base = slots_[k].data.data();
+          iovs_[k].iov_len = slots_[k].len;
+        }
+        msghdr& hdr = msgs_[msgs].msg_hdr;
+        hdr = msghdr{};
+        hdr.msg_name = &slots_[i].addr;
+        hdr.msg_namelen = slots_[i].addr_len;
+        hdr.msg_iov = &iovs_[i];
+        hdr.msg_iovlen = j - i;
+        if (j - i > 1) {
+          Control& control = controls_[msgs];
+          hdr.msg_control = control.buf;
+          hdr.msg_controllen = sizeof(control.buf);
+          cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+          cm->cmsg_level = IPPROTO_UDP;
+          cm->cmsg_type = UDP_SEGMENT;
+          cm->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+          const auto seg16 = static_cast<std::uint16_t>(seg);
+          std::memcpy(CMSG_DATA(cm), &seg16, sizeof(seg16));
+          used_gso = true;
+        }
+        ++msgs;
+        i = j;
+      }
+      const int sent =
+          ::sendmmsg(static_cast<int>(sock_), msgs_.data(),
+                     static_cast<unsigned int>(msgs), MSG_DONTWAIT);
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (used_gso && (errno == EIO || errno == EINVAL ||
+                         errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+          gso_ = false;  // no GSO on this path, resend one by one
+          continue;
+        }
+        break;  // full or failing: KCP retransmits what is dropped here
+      }
+      ++calls_;
+      for (int m = 0; m < sent; ++m) {
+        const std::size_t n = msgs_[m].msg_hdr.msg_iovlen;
+        for (std::size_t k = 0; k < n; ++k) {
+          bytes_ += slots_[start + k].len;
+        }
+        packets_ += n;
+        start += n;
+      }
+      if (sent == 0) {
+        break;
+      }
+#else
+      const Datagram& slot = slots_[start++];
+#ifdef _WIN32
+      sendto(static_cast<SOCKET>(sock_),
+             reinterpret_cast<const char*>(slot.data.data()),
+             static_cast<int>(slot.len), 0,
+             reinterpret_cast<const sockaddr*>(&slot.addr), slot.addr_len);
+#else
+      sendto(static_cast<int>(sock_), slot.data.data(), slot.len, 0,
+             reinterpret_cast<const sockaddr*>(&slot.addr), slot.addr_len);
+#endif
+      ++calls_;
+      ++packets_;
+      bytes_ += slot.len;
+#endif
+    }
+    count_ = 0;
+  }
+
+  std::uint64_t packets() const { return packets_; }
+  std::uint64_t bytes() const { return bytes_; }
+  std::uint64_t calls() const { return calls_; }
+
+ private:
+  std::intptr_t sock_;
+  std::vector<Datagram> slots_;
+  std::size_t count_{0};
+  std::uint64_t packets_{0};
+  std::uint64_t bytes_{0};
+  std::uint64_t calls_{0};
+#ifdef __linux__
+  union Control {
+    cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(std::uint16_t))];
+  };
+  std::vector<mmsghdr> msgs_;
+  std::vector<iovec> iovs_;
+  std::vector<Control> controls_;
+  bool gso_{false};
+#endif
+};
+
 struct KcpSession {
   ikcpcb* kcp{nullptr};
   std::uint32_t conv{0};
-  std::intptr_t sock{-1};
+  TxBatch* tx{nullptr};
   sockaddr_storage addr{};
   socklen_t addr_len{0};
   std::string remote_ip;
   std::string remote_endpoint;
   std::uint64_t last_active_ms{0};
   std::uint64_t bytes_total{0};
+  // Deadline of this session's live timer entry; older entries are stale.
+  std::uint32_t next_update_ms{0};
+  bool ready{false};
+  // Tells a reused conv apart from the session a completion was made for.
+  std::uint64_t id{0};
+  // A request batch is with the handler threads; further requests wait in
+  // the KCP receive queue so responses keep their order.
+  bool busy{false};
+  std::unique_ptr<mi::shard::KcpFec> fec;
+};
+
+struct TimerEntry {
+  std::uint32_t due_ms{0};
+  std::uint32_t conv{0};
 };
 
-int KcpOutput(const char* buf, int len, ikcpcb* /*kcp*/, void* user) {
+bool TimeAfter(std::uint32_t a, std::uint32_t b) {
+  return static_cast<std::int32_t>(a - b) > 0;
+}
+
+struct TimerLater {
+  bool operator()(const TimerEntry& a, const TimerEntry& b) const {
+    return TimeAfter(a.due_ms, b.due_ms);
+  }
+};
+
+using TimerHeap =
+    std::priority_queue<TimerEntry, std::vector<TimerEntry>, TimerLater>;
+
+// ikcp_check caps its answer at one interval even when there is nothing to
+// send, so a session with no queued, unacked or pending-ack data and an
+// open remote window sleeps until its idle expiry instead; input wakes it.
+bool KcpQuiescent(const ikcpcb* kcp) {
+  return kcp->updated != 0 && kcp->nsnd_que == 0 && kcp->nsnd_buf == 0 &&
+         kcp->ackcount == 0 && kcp->probe == 0 && kcp->rmt_wnd != 0;
+}
+
+int KcpOutput(const char* buf, int len, ikcpcb* kcp, void* user) {
   if (!buf || len <= 0 || !user) {
     return -1;
   }
   auto* sess = static_cast<KcpSession*>(user);
-  const auto* data = reinterpret_cast<const std::uint8_t*>(buf);
+  if (sess->fec) {
+    sess->fec->Send(reinterpret_cast<const std::uint8_t*>(buf),
+                    static_cast<std::size_t>(len), kcp->current);
+    return 0;
+  }
+  sess->tx->Queue(reinterpret_cast<const std::uint8_t*>(buf),
+                  static_cast<std::size_t>(len), sess->addr, sess->addr_len);
+  return 0;
+}
+
+void FecOutput(const std::uint8_t* data, std::size_t len, void* user) {
+  auto* sess = static_cast<KcpSession*>(user);
+  sess->tx->Queue(data, len, sess->addr, sess->addr_len);
+}
+
+void FecInput(const std::uint8_t* data, std::size_t len, void* user) {
+  auto* sess = static_cast<KcpSession*>(user);
+  ikcp_input(sess->kcp, reinterpret_cast<const char*>(data),
+             static_cast<long>(len));
+}
+
+bool OpenWakeSocket(std::intptr_t& out, std::uint16_t& port) {
 #ifdef _WIN32
-  const int sent = sendto(static_cast<SOCKET>(sess->sock),
-                          reinterpret_cast<const char*>(data), len, 0,
-                          reinterpret_cast<const sockaddr*>(&sess->addr),
-                          sess->addr_len);
-  return sent == len ? 0 : -1;
+  const SOCKET sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock == INVALID_SOCKET) {
+    return false;
+  }
+  out = static_cast<std::intptr_t>(sock);
 #else
-  const ssize_t sent = sendto(static_cast<int>(sess->sock), data,
-                              static_cast<std::size_t>(len), 0,
-                              reinterpret_cast<const sockaddr*>(&sess->addr),
-                              sess->addr_len);
-  return sent == len ? 0 : -1;
+  const int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    return false;
+  }
+  out = static_cast<std::intptr_t>(sock);
+#endif
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = 0;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sockaddr_in bound{};
+  socklen_t bound_len = sizeof(bound);
+#ifdef _WIN32
+  if (::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+          SOCKET_ERROR ||
+      ::getsockname(sock, reinterpret_cast<sockaddr*>(&bound), &bound_len) !=
+          0) {
+    return false;
+  }
+#else
+  if (::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      ::getsockname(sock, reinterpret_cast<sockaddr*>(&bound), &bound_len) !=
+          0) {
+    return false;
+  }
+#endif
+  port = ntohs(bound.sin_port);
+  return SetNonBlocking(out);
+}
+
+void CloseSocketHandle(std::intptr_t sock) {
+#ifdef _WIN32
+  closesocket(static_cast<SOCKET>(sock));
+#else
+  ::close(static_cast<int>(sock));
+#endif
+}
+
+std::size_t ResolveWorkerCount(const KcpOptions& options) {
+#ifdef __linux__
+  if (options.workers > 0) {
+    return std::min<std::size_t>(options.workers, kMaxWorkers);
+  }
+  const unsigned cores = std::thread::hardware_concurrency();
+  return std::max<std::size_t>(1, std::min<std::size_t>(cores, kMaxWorkers));
+#else
+  (void)options;
+  return 1;
 #endif
 }
 
 }  // namespace
 
+// One session's batch of reassembled requests, handled in order on a
+// handler thread and handed back to its worker with the responses.
+struct KcpServer::Completion {
+  std::uint32_t conv{0};
+  std::uint64_t session_id{0};
+  std::string remote_ip;
+  std::vector<std::vector<std::uint8_t>> requests;
+  std::vector<std::vector<std::uint8_t>> responses;
+  bool ok{true};
+  Completion* next{nullptr};
+};
+
 KcpServer::KcpServer(Listener* listener, std::uint16_t port, KcpOptions options,
                      NetworkServerLimits limits)
-    : listener_(listener),
+    : KcpServer(
+          listener ? RequestHandler([listener](
+                                        const std::vector<std::uint8_t>& request,
+                                        std::vector<std::uint8_t>& response,
+                                        const std::string& remote_ip) {
+            return listener->Process(request, response, remote_ip,
+                                     TransportKind::kKcp);
+          })
+                   : RequestHandler(),
+          port, options, limits) {}
+
+KcpServer::KcpServer(RequestHandler handler, std::uint16_t port,
+                     KcpOptions options, NetworkServerLimits limits)
+    : handler_(std::move(handler)),
       port_(port),
       options_(options),
       limits_(limits) {}
@@ -261,31 +656,58 @@ bool KcpServer::Start(std::string& error) {
   if (running_.load()) {
     return true;
   }
-  if (!listener_ || port_ == 0) {
+  if (!handler_) {
     error = "invalid listener/port";
     return false;
   }
   if (!InitCookieSecret(error)) {
     return false;
   }
-  if (!StartSocket(error)) {
+  if (!StartSockets(ResolveWorkerCount(options_), error)) {
     return false;
   }
+  StartHandlers();
   running_.store(true);
-  worker_ = std::thread(&KcpServer::Run, this);
+  for (auto& worker : workers_) {
+    worker->thread = std::thread(&KcpServer::Run, this, std::ref(*worker));
+  }
   return true;
 }
 
 void KcpServer::Stop() {
   running_.store(false);
-  StopSocket();
-  if (worker_.joinable()) {
-    worker_.join();
+  for (auto& worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+  StopHandlers();
+  StopSockets();
+}
+
+std::vector<KcpWorkerStats> KcpServer::GetWorkerStats() const {
+  std::vector<KcpWorkerStats> out;
+  out.reserve(workers_.size());
+  for (const auto& worker : workers_) {
+    KcpWorkerStats stats;
+    stats.rx_packets = worker->rx_packets.load(std::memory_order_relaxed);
+    stats.rx_bytes = worker->rx_bytes.load(std::memory_order_relaxed);
+    stats.rx_calls = worker->rx_calls.load(std::memory_order_relaxed);
+    stats.tx_packets = worker->tx_packets.load(std::memory_order_relaxed);
+    stats.tx_bytes = worker->tx_bytes.load(std::memory_order_relaxed);
+    stats.tx_calls = worker->tx_calls.load(std::memory_order_relaxed);
+    stats.sessions = worker->sessions.load(std::memory_order_relaxed);
+    stats.updates = worker->updates.load(std::memory_order_relaxed);
+    stats.fec_recovered =
+        worker->fec_recovered.load(std::memory_order_relaxed);
+    out.push_back(stats);
   }
+  return out;
 }
 
-bool KcpServer::StartSocket(std::string& error) {
+bool KcpServer::StartSockets(std::size_t count, std::string& error) {
   error.clear();
+  StopSockets();
 #ifdef _WIN32
   WSADATA wsa;
   const int wsa_rc = WSAStartup(MAKEWORD(2, 2), &wsa);
@@ -294,79 +716,228 @@ bool KcpServer::StartSocket(std::string& error) {
             Win32ErrorMessage(static_cast<DWORD>(wsa_rc));
     return false;
   }
+  wsa_started_ = true;
 #endif
+  std::uint16_t port = port_;
+  for (std::size_t i = 0; i < count; ++i) {
+    auto worker = std::make_unique<Worker>();
+    worker->index = i;
 #ifdef _WIN32
-  const SOCKET sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if (sock == INVALID_SOCKET) {
-    const DWORD last = WSAGetLastError();
-    error = "socket(AF_INET,SOCK_DGRAM) failed: " + std::to_string(last) +
-            " " + Win32ErrorMessage(last);
-    WSACleanup();
-    return false;
-  }
-  sock_ = static_cast<std::intptr_t>(sock);
+    const SOCKET sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+      const DWORD last = WSAGetLastError();
+      error = "socket(AF_INET,SOCK_DGRAM) failed: " + std::to_string(last) +
+              " " + Win32ErrorMessage(last);
+      StopSockets();
+      return false;
+    }
+    worker->sock = static_cast<std::intptr_t>(sock);
 #else
-  const int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) {
-    const int last = errno;
-    error = "socket(AF_INET,SOCK_DGRAM) failed: " + std::to_string(last) +
-            " " + std::strerror(last);
-    return false;
-  }
-  sock_ = static_cast<std::intptr_t>(sock);
+    const int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+      const int last = errno;
+      error = "socket(AF_INET,SOCK_DGRAM) failed: " + std::to_string(last) +
+              " " + std::strerror(last);
+      StopSockets();
+      return false;
+    }
+    worker->sock = static_cast<std::intptr_t>(sock);
 #endif
+    const std::intptr_t fd = worker->sock;
+    workers_.push_back(std::move(worker));
 
-  int yes = 1;
+    int yes = 1;
 #ifdef _WIN32
-  setsockopt(static_cast<SOCKET>(sock_), SOL_SOCKET, SO_REUSEADDR,
-             reinterpret_cast<const char*>(&yes), sizeof(yes));
+    setsockopt(static_cast<SOCKET>(fd), SOL_SOCKET, SO_REUSEADDR,
+               reinterpret_cast<const char*>(&yes), sizeof(yes));
 #else
-  ::setsockopt(static_cast<int>(sock_), SOL_SOCKET, SO_REUSEADDR, &yes,
-               sizeof(yes));
+    ::setsockopt(static_cast<int>(fd), SOL_SOCKET, SO_REUSEADDR, &yes,
+                 sizeof(yes));
+#endif
+#ifdef __linux__
+    // The kernel hashes each peer onto one socket of the group, so every
+    // session stays with a single worker.
+    if (count > 1 &&
+        ::setsockopt(static_cast<int>(fd), SOL_SOCKET, SO_REUSEPORT, &yes,
+                     sizeof(yes)) != 0) {
+      const int last = errno;
+      error = "setsockopt(SO_REUSEPORT) failed: " + std::to_string(last) +
+              " " + std::strerror(last);
+      StopSockets();
+      return false;
+    }
 #endif
 
-  sockaddr_in addr{};
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port_);
-  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    sockaddr_in bound{};
+    socklen_t bound_len = sizeof(bound);
 #ifdef _WIN32
-  if (::bind(static_cast<SOCKET>(sock_), reinterpret_cast<sockaddr*>(&addr),
-             sizeof(addr)) == SOCKET_ERROR) {
-    const DWORD last = WSAGetLastError();
-    error = "bind(0.0.0.0:" + std::to_string(port_) + ") failed: " +
-            std::to_string(last) + " " + Win32ErrorMessage(last);
-    StopSocket();
-    return false;
-  }
+    if (::bind(static_cast<SOCKET>(fd), reinterpret_cast<sockaddr*>(&addr),
+               sizeof(addr)) == SOCKET_ERROR ||
+        ::getsockname(static_cast<SOCKET>(fd),
+                      reinterpret_cast<sockaddr*>(&bound), &bound_len) != 0) {
+      const DWORD last = WSAGetLastError();
+      error = "bind(0.0.0.0:" + std::to_string(port) + ") failed: " +
+              std::to_string(last) + " " + Win32ErrorMessage(last);
+      StopSockets();
+      return false;
+    }
 #else
-  if (::bind(static_cast<int>(sock_), reinterpret_cast<sockaddr*>(&addr),
-             sizeof(addr)) < 0) {
-    const int last = errno;
-    error = "bind(0.0.0.0:" + std::to_string(port_) + ") failed: " +
-            std::to_string(last) + " " + std::strerror(last);
-    StopSocket();
-    return false;
+    if (::bind(static_cast<int>(fd), reinterpret_cast<sockaddr*>(&addr),
+               sizeof(addr)) < 0 ||
+        ::getsockname(static_cast<int>(fd),
+                      reinterpret_cast<sockaddr*>(&bound), &bound_len) != 0) {
+      const int last = errno;
+      error = "bind(0.0.0.0:" + std::to_string(port) + ") failed: " +
+              std::to_string(last) + " " + std::strerror(last);
+      StopSockets();
+      return false;
+    }
+#endif
+    // Port 0 binds the first socket anywhere; the rest join it there.
+    port = ntohs(bound.sin_port);
+
+    if (!SetNonBlocking(fd)) {
+      error = "set non-blocking failed";
+      StopSockets();
+      return false;
+    }
+    Worker& added = *workers_.back();
+    if (!OpenWakeSocket(added.wake_sock, added.wake_port)) {
+      error = "kcp wake socket failed";
+      StopSockets();
+      return false;
+    }
+  }
+  bound_port_ = port;
+  return true;
+}
+
+void KcpServer::StopSockets() {
+  for (auto& worker : workers_) {
+    if (worker->wake_sock != -1) {
+      CloseSocketHandle(worker->wake_sock);
+      worker->wake_sock = -1;
+    }
+    Completion* done = worker->completions.exchange(nullptr);
+    while (done) {
+      Completion* next = done->next;
+      delete done;
+      done = next;
+    }
+    if (worker->sock == -1) {
+      continue;
+    }
+    CloseSocketHandle(worker->sock);
+    worker->sock = -1;
+  }
+  workers_.clear();
+#ifdef _WIN32
+  if (wsa_started_) {
+    WSACleanup();
+    wsa_started_ = false;
   }
 #endif
+}
+
+void KcpServer::StartHandlers() {
+  std::lock_guard<std::mutex> lock(handler_mutex_);
+  if (handlers_running_) {
+    return;
+  }
+  handlers_running_ = true;
+  std::uint32_t count = options_.handler_threads;
+  if (count == 0) {
+    const auto hc = std::thread::hardware_concurrency();
+    count = hc == 0 ? 4u : hc;
+  }
+  handler_threads_.reserve(count);
+  for (std::uint32_t i = 0; i < count; ++i) {
+    handler_threads_.emplace_back(&KcpServer::HandlerLoop, this);
+  }
+}
 
-  if (!SetNonBlocking(sock_)) {
-    error = "set non-blocking failed";
-    StopSocket();
+void KcpServer::StopHandlers() {
+  {
+    std::lock_guard<std::mutex> lock(handler_mutex_);
+    handlers_running_ = false;
+  }
+  handler_cv_.notify_all();
+  for (auto& t : handler_threads_) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+  handler_threads_.clear();
+}
+
+void KcpServer::HandlerLoop() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(handler_mutex_);
+      handler_cv_.wait(lock, [this] {
+        return !handlers_running_ || !handler_queue_.empty();
+      });
+      if (!handlers_running_ && handler_queue_.empty()) {
+        return;
+      }
+      task = std::move(handler_queue_.front());
+      handler_queue_.pop_front();
+    }
+    if (task) {
+      task();
+    }
+  }
+}
+
+// Not bounded by max_pending_tasks: a session has at most one batch queued,
+// so the queue never outgrows the session limit.
+bool KcpServer::EnqueueRequest(Worker& worker, Completion* job) {
+  std::lock_guard<std::mutex> lock(handler_mutex_);
+  if (!handlers_running_) {
     return false;
   }
+  handler_queue_.push_back([this, &worker, job]() {
+    for (const auto& request : job->requests) {
+      std::vector<std::uint8_t> response;
+      if (!handler_(request, response, job->remote_ip)) {
+        job->ok = false;
+        break;
+      }
+      job->responses.push_back(std::move(response));
+    }
+    job->requests.clear();
+    PostCompletion(worker, job);
+  });
+  handler_cv_.notify_one();
   return true;
 }
 
-void KcpServer::StopSocket() {
-  if (sock_ != -1) {
+void KcpServer::PostCompletion(Worker& worker, Completion* done) {
+  Completion* head = worker.completions.load(std::memory_order_relaxed);
+  do {
+    done->next = head;
+  } while (!worker.completions.compare_exchange_weak(
+      head, done, std::memory_order_release, std::memory_order_relaxed));
+  if (head) {
+    return;  // the worker has not drained the earlier ones yet
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(worker.wake_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const char poke = 0;
 #ifdef _WIN32
-    closesocket(static_cast<SOCKET>(sock_));
-    WSACleanup();
+  sendto(static_cast<SOCKET>(worker.wake_sock), &poke, 1, 0,
+         reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
 #else
-    ::close(static_cast<int>(sock_));
+  sendto(static_cast<int>(worker.wake_sock), &poke, 1, 0,
+         reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
 #endif
-    sock_ = -1;
-  }
 }
 
 bool KcpServer::InitCookieSecret(std::string& error) {
@@ -424,180 +995,307 @@ void KcpServer::ReleaseConnectionSlot(const std::string& remote_ip) {
   }
 }
 
-void KcpServer::Run() {
+void KcpServer::Run(Worker& worker) {
   std::unordered_map<std::uint32_t, std::unique_ptr<KcpSession>> sessions;
-  const std::uint32_t tick_ms =
-      std::max(kTickMsMin, std::min(kTickMsMax, options_.interval));
+  const std::intptr_t sock = worker.sock;
+  const std::intptr_t wake_sock = worker.wake_sock;
+  std::uint64_t next_session_id = 0;
   const std::uint64_t idle_ms =
       std::max<std::uint64_t>(1000u,
                               static_cast<std::uint64_t>(
                                   options_.session_idle_sec) * 1000u);
 
-  std::vector<std::uint8_t> recv_buf;
-  recv_buf.resize(std::max<std::uint32_t>(options_.mtu, 1200u) + 256u);
+  const std::size_t batch = std::max<std::size_t>(
+      1, std::min<std::size_t>(options_.batch, kMaxBatch));
+  const std::size_t datagram_bytes =
+      std::max<std::uint32_t>(options_.mtu, 1200u) + 256u;
+  RxBatch rx(batch, datagram_bytes);
+  TxBatch tx(sock, batch, datagram_bytes, options_.gso);
+  std::uint64_t rx_packets = 0;
+  std::uint64_t rx_bytes = 0;
+  std::uint64_t rx_calls = 0;
+  std::uint64_t updates = 0;
+  std::uint64_t fec_recovered = 0;
+  mi::shard::FecConfig fec_cfg;
+  fec_cfg.data_shards = options_.fec_data_shards;
+  fec_cfg.parity_shards = options_.fec_parity_shards;
+  fec_cfg.adaptive = options_.fec_adaptive;
+
+  // Sessions are serviced only when their timer fires or input arrives.
+  TimerHeap timers;
+  std::vector<std::uint32_t> ready;
+
+  const auto drop_session = [&](KcpSession* sess) {
+    ReleaseConnectionSlot(sess->remote_ip);
+    ikcp_release(sess->kcp);
+  };
+  const auto mark_ready = [&](KcpSession* sess) {
+    if (!sess->ready) {
+      sess->ready = true;
+      ready.push_back(sess->conv);
+    }
+  };
+  const auto schedule = [&](KcpSession* sess, std::uint32_t now) {
+    const bool fec_pending = sess->fec && sess->fec->pending();
+    const bool quiescent = KcpQuiescent(sess->kcp) && !fec_pending;
+    if (quiescent && sess->busy) {
+      return;  // the completion wakes it
+    }
+    std::uint32_t due =
+        quiescent
+            ? static_cast<std::uint32_t>(sess->last_active_ms + idle_ms + 1)
+            : ikcp_check(sess->kcp, now);
+    if (fec_pending && TimeAfter(due, sess->fec->deadline())) {
+      due = sess->fec->deadline();
+    }
+    // ikcp_check reports overdue resends as "now" until the next flush
+    // slot; never spin on them within the tick that just updated.
+    if (!TimeAfter(due, now)) {
+      due = now + 1;
+    }
+    if (due != sess->next_update_ms) {
+      sess->next_update_ms = due;
+      timers.push(TimerEntry{due, sess->conv});
+    }
+  };
 
   while (running_.load()) {
+    std::uint32_t wait_ms = kTickMsMax;
+    if (!timers.empty()) {
+      const std::uint32_t now = NowMs();
+      const std::uint32_t due = timers.top().due_ms;
+      wait_ms = TimeAfter(due, now) ? std::min(kTickMsMax, due - now) : 0;
+    }
     fd_set readfds;
     FD_ZERO(&readfds);
 #ifdef _WIN32
-    FD_SET(static_cast<SOCKET>(sock_), &readfds);
+    FD_SET(static_cast<SOCKET>(sock), &readfds);
+    FD_SET(static_cast<SOCKET>(wake_sock), &readfds);
     TIMEVAL tv{};
     tv.tv_sec = 0;
-    tv.tv_usec = static_cast<long>(tick_ms) * 1000;
+    tv.tv_usec = static_cast<long>(wait_ms) * 1000;
     select(0, &readfds, nullptr, nullptr, &tv);
 #else
-    FD_SET(static_cast<int>(sock_), &readfds);
+    FD_SET(static_cast<int>(sock), &readfds);
+    FD_SET(static_cast<int>(wake_sock), &readfds);
     timeval tv{};
     tv.tv_sec = 0;
-    tv.tv_usec = static_cast<long>(tick_ms) * 1000;
-    select(static_cast<int>(sock_) + 1, &readfds, nullptr, nullptr, &tv);
+    tv.tv_usec = static_cast<long>(wait_ms) * 1000;
+    select(static_cast<int>(std::max(sock, wake_sock)) + 1, &readfds, nullptr,
+           nullptr, &tv);
 #endif
 
     const std::uint32_t now = NowMs();
 
-    while (running_.load()) {
-      sockaddr_storage peer_addr{};
-      socklen_t peer_len = sizeof(peer_addr);
+    // Drain the pokes before taking the queue: a completion posted after
+    // the exchange finds it empty and pokes again.
+    char poke[16];
 #ifdef _WIN32
-      const int n = recvfrom(static_cast<SOCKET>(sock_),
-                             reinterpret_cast<char*>(recv_buf.data()),
-                             static_cast<int>(recv_buf.size()), 0,
-                             reinterpret_cast<sockaddr*>(&peer_addr),
-                             &peer_len);
-      if (n == SOCKET_ERROR) {
-        if (WouldBlock()) {
-          break;
-        }
+    while (recv(static_cast<SOCKET>(wake_sock), poke, sizeof(poke), 0) > 0) {
+    }
+#else
+    while (recv(static_cast<int>(wake_sock), poke, sizeof(poke), 0) > 0) {
+    }
+#endif
+    Completion* done = worker.completions.exchange(nullptr,
+                                                   std::memory_order_acquire);
+    Completion* fifo = nullptr;
+    while (done) {
+      Completion* next = done->next;
+      done->next = fifo;
+      fifo = done;
+      done = next;
+    }
+    while (fifo) {
+      std::unique_ptr<Completion> job(fifo);
+      fifo = fifo->next;
+      const auto it = sessions.find(job->conv);
+      if (it == sessions.end() || it->second->id != job->session_id) {
         continue;
       }
-#else
-      const ssize_t n = recvfrom(static_cast<int>(sock_), recv_buf.data(),
-                                 recv_buf.size(), 0,
-                                 reinterpret_cast<sockaddr*>(&peer_addr),
-                                 &peer_len);
-      if (n < 0) {
-        if (WouldBlock()) {
+      auto* sess = it->second.get();
+      sess->busy = false;
+      sess->last_active_ms = now;
+      sess->kcp->current = now;
+      bool drop = !job->ok;
+      for (const auto& response : job->responses) {
+        sess->bytes_total += response.size();
+        if (sess->bytes_total > limits_.max_connection_bytes) {
+          drop = true;
           break;
         }
-        continue;
-      }
-#endif
-      if (n <= 0) {
-        break;
+        if (!response.empty()) {
+          ikcp_send(sess->kcp,
+                    reinterpret_cast<const char*>(response.data()),
+                    static_cast<int>(response.size()));
+        }
       }
-      if (static_cast<std::size_t>(n) < sizeof(IUINT32)) {
+      ikcp_flush(sess->kcp);
+      if (drop) {
+        drop_session(sess);
+        sessions.erase(it);
         continue;
       }
+      mark_ready(sess);
+    }
 
-      const IUINT32 conv = ikcp_getconv(recv_buf.data());
-      auto it = sessions.find(conv);
-      if (it == sessions.end()) {
-        CookiePacket cookie_pkt{};
-        if (!ParseCookiePacket(recv_buf.data(), static_cast<std::size_t>(n),
-                               cookie_pkt) ||
-            cookie_pkt.conv != conv) {
+    for (std::size_t round = 0; round < kMaxRxRounds && running_.load();
+         ++round) {
+      const std::size_t received = rx.Receive(sock);
+      if (received == 0) {
+        break;
+      }
+      ++rx_calls;
+      for (std::size_t r = 0; r < received; ++r) {
+        Datagram& dgram = rx[r];
+        const std::size_t n = dgram.len;
+        rx_packets++;
+        rx_bytes += n;
+        if (n < sizeof(IUINT32)) {
           continue;
         }
-        if (cookie_pkt.type == kKcpCookieHello) {
+        const sockaddr_storage& peer_addr = dgram.addr;
+        const socklen_t peer_len = dgram.addr_len;
+
+        const IUINT32 conv = ikcp_getconv(dgram.data.data());
+        auto it = sessions.find(conv);
+        if (it == sessions.end()) {
+          CookiePacket cookie_pkt{};
+          if (!ParseCookiePacket(dgram.data.data(), n, cookie_pkt) ||
+              cookie_pkt.conv != conv) {
+            continue;
+          }
+          if (cookie_pkt.type == kKcpCookieHello) {
+            const std::uint64_t bucket =
+                static_cast<std::uint64_t>(NowMs() / kKcpCookieWindowMs);
+            const auto cookie =
+                BuildCookie(cookie_secret_, peer_addr, peer_len, conv, bucket);
+            std::array<std::uint8_t, kKcpCookiePacketBytes> out{};
+            const std::uint8_t grant =
+                options_.fec ? (cookie_pkt.flags & kKcpCookieFlagFec) : 0;
+            BuildCookiePacket(conv, kKcpCookieChallenge, grant, cookie, out);
+            tx.Queue(out.data(), out.size(), peer_addr, peer_len);
+            continue;
+          }
+          if (cookie_pkt.type != kKcpCookieResponse) {
+            continue;
+          }
           const std::uint64_t bucket =
               static_cast<std::uint64_t>(NowMs() / kKcpCookieWindowMs);
-          const auto cookie =
+          const auto cookie_now =
               BuildCookie(cookie_secret_, peer_addr, peer_len, conv, bucket);
-          std::array<std::uint8_t, kKcpCookiePacketBytes> out{};
-          BuildCookiePacket(conv, kKcpCookieChallenge, cookie, out);
-#ifdef _WIN32
-          sendto(static_cast<SOCKET>(sock_),
-                 reinterpret_cast<const char*>(out.data()),
-                 static_cast<int>(out.size()), 0,
-                 reinterpret_cast<const sockaddr*>(&peer_addr), peer_len);
-#else
-          sendto(static_cast<int>(sock_), out.data(), out.size(), 0,
-                 reinterpret_cast<const sockaddr*>(&peer_addr), peer_len);
-#endif
-          continue;
-        }
-        if (cookie_pkt.type != kKcpCookieResponse) {
-          continue;
-        }
-        const std::uint64_t bucket =
-            static_cast<std::uint64_t>(NowMs() / kKcpCookieWindowMs);
-        const auto cookie_now =
-            BuildCookie(cookie_secret_, peer_addr, peer_len, conv, bucket);
-        const auto cookie_prev =
-            bucket > 0 ? BuildCookie(cookie_secret_, peer_addr, peer_len, conv,
-                                     bucket - 1)
-                       : cookie_now;
-        if (!ConstantTimeEqual(cookie_pkt.cookie, cookie_now) &&
-            !ConstantTimeEqual(cookie_pkt.cookie, cookie_prev)) {
+          const auto cookie_prev =
+              bucket > 0 ? BuildCookie(cookie_secret_, peer_addr, peer_len,
+                                       conv, bucket - 1)
+                         : cookie_now;
+          if (!ConstantTimeEqual(cookie_pkt.cookie, cookie_now) &&
+              !ConstantTimeEqual(cookie_pkt.cookie, cookie_prev)) {
+            continue;
+          }
+
+          const std::string remote_ip = IpToString(peer_addr);
+          const std::string remote_endpoint = EndpointToString(peer_addr);
+          if (!TryAcquireConnectionSlot(remote_ip)) {
+            continue;
+          }
+          auto sess = std::make_unique<KcpSession>();
+          sess->conv = conv;
+          sess->id = ++next_session_id;
+          sess->tx = &tx;
+          sess->addr = peer_addr;
+          sess->addr_len = peer_len;
+          sess->remote_ip = remote_ip;
+          sess->remote_endpoint = remote_endpoint;
+          sess->last_active_ms = now;
+          sess->bytes_total = 0;
+          sess->kcp = ikcp_create(conv, sess.get());
+          if (!sess->kcp) {
+            ReleaseConnectionSlot(remote_ip);
+            continue;
+          }
+          sess->kcp->output = KcpOutput;
+          std::uint32_t mtu = options_.mtu;
+          if (options_.fec && (cookie_pkt.flags & kKcpCookieFlagFec) != 0) {
+            sess->fec = std::make_unique<mi::shard::KcpFec>(
+                conv, fec_cfg, FecOutput, FecInput, sess.get());
+            mtu -= static_cast<std::uint32_t>(mi::shard::kFecOverhead);
+          }
+          ikcp_setmtu(sess->kcp, static_cast<int>(mtu));
+          ikcp_wndsize(sess->kcp, static_cast<int>(options_.snd_wnd),
+                       static_cast<int>(options_.rcv_wnd));
+          ikcp_nodelay(sess->kcp, static_cast<int>(options_.nodelay),
+                       static_cast<int>(options_.interval),
+                       static_cast<int>(options_.resend),
+                       static_cast<int>(options_.nc));
+          if (options_.min_rto > 0) {
+            sess->kcp->rx_minrto = static_cast<int>(options_.min_rto);
+          }
+          mark_ready(sess.get());
+          sessions.emplace(conv, std::move(sess));
           continue;
         }
-
-        const std::string remote_ip = IpToString(peer_addr);
         const std::string remote_endpoint = EndpointToString(peer_addr);
-        if (!TryAcquireConnectionSlot(remote_ip)) {
+        if (!remote_endpoint.empty() &&
+            it->second->remote_endpoint != remote_endpoint) {
           continue;
         }
-        auto sess = std::make_unique<KcpSession>();
-        sess->conv = conv;
-        sess->sock = sock_;
-        sess->addr = peer_addr;
-        sess->addr_len = peer_len;
-        sess->remote_ip = remote_ip;
-        sess->remote_endpoint = remote_endpoint;
+
+        auto* sess = it->second.get();
         sess->last_active_ms = now;
-        sess->bytes_total = 0;
-        sess->kcp = ikcp_create(conv, sess.get());
-        if (!sess->kcp) {
-          ReleaseConnectionSlot(remote_ip);
+        sess->bytes_total += static_cast<std::uint64_t>(n);
+        if (sess->bytes_total > limits_.max_connection_bytes) {
+          drop_session(sess);
+          sessions.erase(it);
           continue;
         }
-        sess->kcp->output = KcpOutput;
-        ikcp_setmtu(sess->kcp, static_cast<int>(options_.mtu));
-        ikcp_wndsize(sess->kcp, static_cast<int>(options_.snd_wnd),
-                     static_cast<int>(options_.rcv_wnd));
-        ikcp_nodelay(sess->kcp, static_cast<int>(options_.nodelay),
-                     static_cast<int>(options_.interval),
-                     static_cast<int>(options_.resend),
-                     static_cast<int>(options_.nc));
-        if (options_.min_rto > 0) {
-          sess->kcp->rx_minrto = static_cast<int>(options_.min_rto);
-        }
-        it = sessions.emplace(conv, std::move(sess)).first;
-        continue;
-      } else {
-        const std::string remote_endpoint = EndpointToString(peer_addr);
-        if (!remote_endpoint.empty() &&
-            it->second->remote_endpoint != remote_endpoint) {
-          continue;
+        // RTT samples are taken against kcp->current, which is stale
+        // while the session sleeps.
+        sess->kcp->current = now;
+        const std::uint64_t recovered =
+            sess->fec ? sess->fec->stats().recovered : 0;
+        if (sess->fec && sess->fec->Receive(dgram.data.data(), n)) {
+          fec_recovered += sess->fec->stats().recovered - recovered;
+        } else {
+          ikcp_input(sess->kcp,
+                     reinterpret_cast<const char*>(dgram.data.data()),
+                     static_cast<long>(n));
         }
+        mark_ready(sess);
       }
+      tx.Flush();
+    }
 
-      auto* sess = it->second.get();
-      sess->last_active_ms = now;
-      sess->bytes_total += static_cast<std::uint64_t>(n);
-      if (sess->bytes_total > limits_.max_connection_bytes) {
-        ReleaseConnectionSlot(sess->remote_ip);
-        ikcp_release(sess->kcp);
-        sessions.erase(it);
-        continue;
+    while (!timers.empty() && !TimeAfter(timers.top().due_ms, now)) {
+      const TimerEntry entry = timers.top();
+      timers.pop();
+      const auto it = sessions.find(entry.conv);
+      if (it != sessions.end() &&
+          it->second->next_update_ms == entry.due_ms) {
+        mark_ready(it->second.get());
       }
-      ikcp_input(sess->kcp, reinterpret_cast<const char*>(recv_buf.data()),
-                 n);
     }
 
-    for (auto it = sessions.begin(); it != sessions.end();) {
-      std::vector<std::uint8_t> request;
-      std::vector<std::uint8_t> response;
+    for (const std::uint32_t conv : ready) {
+      const auto it = sessions.find(conv);
+      if (it == sessions.end() || !it->second->ready) {
+        continue;
+      }
       auto* sess = it->second.get();
+      sess->ready = false;
       ikcp_update(sess->kcp, now);
+      ++updates;
+      if (sess->fec) {
+        sess->fec->Poll(now);
+      }
 
       bool drop = false;
-      for (;;) {
+      std::unique_ptr<Completion> job;
+      while (!sess->busy) {
         const int peek = ikcp_peeksize(sess->kcp);
         if (peek <= 0) {
           break;
         }
-        request.resize(static_cast<std::size_t>(peek));
+        std::vector<std::uint8_t> request(static_cast<std::size_t>(peek));
         const int n = ikcp_recv(sess->kcp,
                                 reinterpret_cast<char*>(request.data()),
                                 peek);
@@ -611,43 +1309,59 @@ void KcpServer::Run() {
           drop = true;
           break;
         }
-
-        response.clear();
-        if (!listener_->Process(request, response, sess->remote_ip,
-                                TransportKind::kKcp)) {
-          drop = true;
-          break;
+        if (!job) {
+          job = std::make_unique<Completion>();
+          job->conv = sess->conv;
+          job->session_id = sess->id;
+          job->remote_ip = sess->remote_ip;
         }
-        sess->last_active_ms = now;
-        sess->bytes_total += response.size();
-        if (sess->bytes_total > limits_.max_connection_bytes) {
+        job->requests.push_back(std::move(request));
+      }
+      if (job && !drop) {
+        if (EnqueueRequest(worker, job.get())) {
+          job.release();
+          sess->busy = true;
+        } else {
           drop = true;
-          break;
-        }
-        if (!response.empty()) {
-          ikcp_send(sess->kcp,
-                    reinterpret_cast<const char*>(response.data()),
-                    static_cast<int>(response.size()));
-          ikcp_flush(sess->kcp);
         }
       }
 
       const std::uint64_t idle_for = now - sess->last_active_ms;
-      if (drop || idle_for > idle_ms) {
-        ReleaseConnectionSlot(sess->remote_ip);
-        ikcp_release(sess->kcp);
-        it = sessions.erase(it);
+      if (drop || (!sess->busy && idle_for > idle_ms)) {
+        drop_session(sess);
+        sessions.erase(it);
         continue;
       }
-      ++it;
+      schedule(sess, now);
     }
+    ready.clear();
+    tx.Flush();
+
+    if (timers.size() >
+        sessions.size() * kTimerSlackPerSession + kTimerSlackMin) {
+      TimerHeap live;
+      for (const auto& entry : sessions) {
+        live.push(TimerEntry{entry.second->next_update_ms, entry.first});
+      }
+      timers.swap(live);
+    }
+
+    worker.rx_packets.store(rx_packets, std::memory_order_relaxed);
+    worker.rx_bytes.store(rx_bytes, std::memory_order_relaxed);
+    worker.rx_calls.store(rx_calls, std::memory_order_relaxed);
+    worker.tx_packets.store(tx.packets(), std::memory_order_relaxed);
+    worker.tx_bytes.store(tx.bytes(), std::memory_order_relaxed);
+    worker.tx_calls.store(tx.calls(), std::memory_order_relaxed);
+    worker.sessions.store(sessions.size(), std::memory_order_relaxed);
+    worker.updates.store(updates, std::memory_order_relaxed);
+    worker.fec_recovered.store(fec_recovered, std::memory_order_relaxed);
   }
 
   for (auto& entry : sessions) {
-    ReleaseConnectionSlot(entry.second->remote_ip);
-    ikcp_release(entry.second->kcp);
+    drop_session(entry.second.get());
   }
   sessions.clear();
+  worker.sessions.store(0, std::memory_order_relaxed);
 }
 
 }  // namespace mi::server
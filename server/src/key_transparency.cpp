@@ -1,46 +1,39 @@
 #include "key_transparency.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
-#include <limits>
+#include <memory>
 #include <string_view>
+#include <unordered_map>
 #include <utility>
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX 1
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "crypto.h"
+#include "kt_checkpoint.h"
 
 namespace mi::server {
 
 namespace {
 
 constexpr std::uint8_t kLeafPrefix = 0x00;
-constexpr std::uint8_t kNodePrefix = 0x01;
-
-bool IsPowerOfTwo(std::size_t n) {
-  return n != 0 && ((n & (n - 1)) == 0);
-}
-
-std::size_t Log2PowerOfTwo(std::size_t n) {
-  std::size_t out = 0;
-  while (n > 1) {
-    n >>= 1;
-    out++;
-  }
-  return out;
-}
-
-std::size_t LargestPowerOfTwoLessThan(std::size_t n) {
-  if (n <= 1) {
-    return 0;
-  }
-  std::size_t k = 1;
-  while ((k << 1) < n) {
-    k <<= 1;
-  }
-  return k;
-}
+constexpr char kLogMagic[8] = {'M', 'I', 'K', 'T', 'L', 'O', 'G', '1'};
+constexpr std::size_t kMaxUsernameBytes = 4096;
+constexpr std::size_t kLoadChunkRecords = 4096;
 
 Sha256Hash HashSha256(const std::uint8_t* data, std::size_t len) {
   crypto::Sha256Digest d;
@@ -56,91 +49,6 @@ Sha256Hash HashLeaf(const std::vector<std::uint8_t>& leaf_data) {
   return HashSha256(buf.data(), buf.size());
 }
 
-Sha256Hash HashNode(const Sha256Hash& left, const Sha256Hash& right) {
-  std::uint8_t buf[1 + 32 + 32];
-  buf[0] = kNodePrefix;
-  std::memcpy(buf + 1, left.data(), left.size());
-  std::memcpy(buf + 1 + 32, right.data(), right.size());
-  return HashSha256(buf, sizeof(buf));
-}
-
-Sha256Hash MerkleTreeHash(const std::vector<Sha256Hash>& leaves,
-                          const std::vector<std::vector<Sha256Hash>>& pow2_levels,
-                          std::size_t start, std::size_t n) {
-  if (n == 0) {
-    static constexpr std::uint8_t kEmpty[1] = {0};
-    return HashSha256(kEmpty, 0);
-  }
-  if (n == 1) {
-    return leaves[start];
-  }
-  if (IsPowerOfTwo(n)) {
-    const std::size_t level = Log2PowerOfTwo(n);
-    if (level == 0) {
-      return leaves[start];
-    }
-    const std::size_t idx = start >> level;
-    const std::size_t vec_idx = level - 1;
-    if (vec_idx < pow2_levels.size() && idx < pow2_levels[vec_idx].size()) {
-      return pow2_levels[vec_idx][idx];
-    }
-  }
-  const std::size_t k = LargestPowerOfTwoLessThan(n);
-  const auto left = MerkleTreeHash(leaves, pow2_levels, start, k);
-  const auto right = MerkleTreeHash(leaves, pow2_levels, start + k, n - k);
-  return HashNode(left, right);
-}
-
-std::vector<Sha256Hash> MerkleAuditPath(std::size_t m,
-                                        const std::vector<Sha256Hash>& leaves,
-                                        const std::vector<std::vector<Sha256Hash>>& pow2_levels,
-                                        std::size_t start, std::size_t n) {
-  if (n <= 1) {
-    return {};
-  }
-  const std::size_t k = LargestPowerOfTwoLessThan(n);
-  if (m < k) {
-    auto path = MerkleAuditPath(m, leaves, pow2_levels, start, k);
-    path.push_back(MerkleTreeHash(leaves, pow2_levels, start + k, n - k));
-    return path;
-  }
-  auto path = MerkleAuditPath(m - k, leaves, pow2_levels, start + k, n - k);
-  path.push_back(MerkleTreeHash(leaves, pow2_levels, start, k));
-  return path;
-}
-
-std::vector<Sha256Hash> MerkleSubProof(std::size_t m,
-                                       const std::vector<Sha256Hash>& leaves,
-                                       const std::vector<std::vector<Sha256Hash>>& pow2_levels,
-                                       std::size_t start, std::size_t n,
-                                       bool b) {
-  if (m == n) {
-    if (b) {
-      return {};
-    }
-    return {MerkleTreeHash(leaves, pow2_levels, start, n)};
-  }
-  const std::size_t k = LargestPowerOfTwoLessThan(n);
-  if (m <= k) {
-    auto proof = MerkleSubProof(m, leaves, pow2_levels, start, k, b);
-    proof.push_back(MerkleTreeHash(leaves, pow2_levels, start + k, n - k));
-    return proof;
-  }
-  auto proof =
-      MerkleSubProof(m - k, leaves, pow2_levels, start + k, n - k, false);
-  proof.push_back(MerkleTreeHash(leaves, pow2_levels, start, k));
-  return proof;
-}
-
-std::vector<Sha256Hash> MerkleConsistencyProof(
-    std::size_t m, const std::vector<Sha256Hash>& leaves, std::size_t start,
-    std::size_t n, const std::vector<std::vector<Sha256Hash>>& pow2_levels) {
-  if (m == 0 || m == n) {
-    return {};
-  }
-  return MerkleSubProof(m, leaves, pow2_levels, start, n, true);
-}
-
 std::vector<std::uint8_t> BuildLeafData(
     const std::string& username,
     const std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes>& id_sig_pk,
@@ -166,12 +74,19 @@ bool ReadExact(std::ifstream& in, void* dst, std::size_t len) {
   return in.good();
 }
 
-void WriteUint16(std::ofstream& out, std::uint16_t v) {
-  const std::uint8_t b[2] = {
-      static_cast<std::uint8_t>(v & 0xFF),
-      static_cast<std::uint8_t>((v >> 8) & 0xFF),
-  };
-  out.write(reinterpret_cast<const char*>(b), sizeof(b));
+// u16 username length | username | id_sig_pk | id_dh_pk
+std::vector<std::uint8_t> BuildLogRecord(
+    const std::string& username,
+    const std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes>& id_sig_pk,
+    const std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes>& id_dh_pk) {
+  std::vector<std::uint8_t> out;
+  out.reserve(2 + username.size() + id_sig_pk.size() + id_dh_pk.size());
+  out.push_back(static_cast<std::uint8_t>(username.size() & 0xFF));
+  out.push_back(static_cast<std::uint8_t>((username.size() >> 8) & 0xFF));
+  out.insert(out.end(), username.begin(), username.end());
+  out.insert(out.end(), id_sig_pk.begin(), id_sig_pk.end());
+  out.insert(out.end(), id_dh_pk.begin(), id_dh_pk.end());
+  return out;
 }
 
 bool ReadUint16(std::ifstream& in, std::uint16_t& v) {
@@ -183,18 +98,117 @@ bool ReadUint16(std::ifstream& in, std::uint16_t& v) {
   return true;
 }
 
+// One whole record; false at the end of the log or a torn tail.
+bool ReadLogRecord(
+    std::ifstream& in, std::string& username,
+    std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes>& id_sig_pk,
+    std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes>& id_dh_pk) {
+  std::uint16_t user_len = 0;
+  if (!ReadUint16(in, user_len)) {
+    return false;
+  }
+  if (user_len == 0 || user_len > kMaxUsernameBytes) {
+    return false;
+  }
+  username.resize(user_len);
+  return ReadExact(in, username.data(), username.size()) &&
+         ReadExact(in, id_sig_pk.data(), id_sig_pk.size()) &&
+         ReadExact(in, id_dh_pk.data(), id_dh_pk.size());
+}
+
+std::uint64_t LogRecordBytes(const std::string& username) {
+  return 2 + username.size() + kKtIdentitySigPublicKeyBytes +
+         kKtIdentityDhPublicKeyBytes;
+}
+
+// What ReadLogRecord stopped at is a torn write only if it is shorter than
+// the record it starts, or nothing but zeros; anything else is corruption.
+bool IsTornTail(std::ifstream& in, std::uint64_t offset,
+                std::uint64_t file_bytes) {
+  const std::uint64_t remaining = file_bytes - offset;
+  in.clear();
+  in.seekg(static_cast<std::streamoff>(offset));
+  std::uint16_t user_len = 0;
+  if (!ReadUint16(in, user_len)) {
+    return true;
+  }
+  const std::uint64_t min_user_len = user_len == 0 ? 1 : user_len;
+  if (user_len <= kMaxUsernameBytes &&
+      remaining < 2 + min_user_len + kKtIdentitySigPublicKeyBytes +
+                      kKtIdentityDhPublicKeyBytes) {
+    return true;
+  }
+  in.clear();
+  in.seekg(static_cast<std::streamoff>(offset));
+  char buf[4096];
+  for (std::uint64_t left = remaining; left != 0;) {
+    const std::size_t n =
+        static_cast<std::size_t>(std::min<std::uint64_t>(left, sizeof(buf)));
+    if (!ReadExact(in, buf, n)) {
+      return false;
+    }
+    if (std::any_of(buf, buf + n, [](char c) { return c != 0; })) {
+      return false;
+    }
+    left -= n;
+  }
+  return true;
+}
+
+bool SyncPath(const std::filesystem::path& path, bool directory) {
+#ifdef _WIN32
+  if (directory) {
+    // NTFS journals the rename itself.
+    return true;
+  }
+  HANDLE h = CreateFileW(path.wstring().c_str(), GENERIC_WRITE,
+                         FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (h == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  const bool ok = FlushFileBuffers(h) != 0;
+  CloseHandle(h);
+  return ok;
+#else
+  const int fd = ::open(path.c_str(),
+                        (directory ? O_RDONLY | O_DIRECTORY : O_WRONLY) |
+                            O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+#endif
+}
+
+constexpr std::string_view kCheckpointSuffix = ".ckpt";
+constexpr std::uint64_t kCheckpointChunkNodes = 1u << 16;
+
 }  // namespace
 
 KeyTransparencyLog::KeyTransparencyLog(std::filesystem::path log_path)
-    : log_path_(std::move(log_path)) {}
+    : log_path_(std::move(log_path)) {
+  tree_.SetBuilder(&builder_);
+}
+
+KeyTransparencyLog::~KeyTransparencyLog() {
+  StopCheckpointer();
+  CloseAppendFile();
+}
 
 bool KeyTransparencyLog::Load(std::string& error) {
   error.clear();
   std::lock_guard<std::mutex> lock(mutex_);
-  leaves_.clear();
-  pow2_levels_.clear();
+  CloseAppendFile();
+  tree_.Clear();
   latest_by_user_.clear();
-  root_ = Sha256Hash{};
+  consistency_lru_.clear();
+  consistency_index_.clear();
+  log_bytes_ = 0;
+  last_record_offset_ = 0;
+  checkpoint_path_.clear();
 
   if (log_path_.empty()) {
     error = "kt log path empty";
@@ -203,7 +217,6 @@ bool KeyTransparencyLog::Load(std::string& error) {
 
   std::error_code ec;
   if (!std::filesystem::exists(log_path_, ec)) {
-    RecomputeRootLocked();
     return true;
   }
 
@@ -213,47 +226,92 @@ bool KeyTransparencyLog::Load(std::string& error) {
     return false;
   }
 
+  // Everything past the last whole record is a write torn by a crash (a
+  // short tail, or zeros where the size grew before the data landed). It
+  // was never acknowledged, so it is cut off before the next append.
+  std::uint64_t valid_bytes = 0;
+  std::vector<Sha256Hash> leaves;
   char magic[8];
-  if (!ReadExact(in, magic, sizeof(magic))) {
-    RecomputeRootLocked();
-    return true;
-  }
-  if (std::string_view(magic, sizeof(magic)) != "MIKTLOG1") {
-    error = "kt log magic mismatch";
-    return false;
-  }
-
-  while (true) {
-    std::uint16_t user_len = 0;
-    if (!ReadUint16(in, user_len)) {
-      break;
-    }
-    if (user_len == 0 || user_len > 4096) {
-      error = "kt log username length invalid";
+  if (ReadExact(in, magic, sizeof(magic))) {
+    if (std::string_view(magic, sizeof(magic)) !=
+        std::string_view(kLogMagic, sizeof(kLogMagic))) {
+      error = "kt log magic mismatch";
       return false;
     }
-    std::string username;
-    username.resize(user_len);
-    if (!ReadExact(in, username.data(), username.size())) {
-      break;
+    valid_bytes = sizeof(magic);
+  }
+
+  const std::uint64_t file_bytes = std::filesystem::file_size(log_path_, ec);
+  if (valid_bytes != 0 && !ec) {
+    // Start from the newest checkpoint that checks out against the log and
+    // replay only the records after it.
+    for (const auto& path : ListCheckpoints()) {
+      std::string ckpt_err;
+      if (LoadCheckpointLocked(path, file_bytes, ckpt_err)) {
+        valid_bytes = log_bytes_;
+        break;
+      }
     }
-
+    in.clear();
+    in.seekg(static_cast<std::streamoff>(valid_bytes));
+  }
+
+  // Records are read in chunks whose leaves are hashed on the builder.
+  const std::uint64_t base = tree_.size();
+  std::vector<std::string> usernames;
+  std::vector<std::vector<std::uint8_t>> leaf_data;
+  const auto hash_chunk = [&] {
+    const std::size_t offset = leaves.size();
+    leaves.resize(offset + leaf_data.size());
+    builder_.HashLeaves(leaf_data, leaves.data() + offset);
+    for (std::size_t i = 0; i < usernames.size(); ++i) {
+      latest_by_user_[usernames[i]] = LatestKey{
+          base + static_cast<std::uint64_t>(offset + i), leaves[offset + i]};
+    }
+    usernames.clear();
+    leaf_data.clear();
+  };
+  while (valid_bytes != 0) {
+    std::string username;
     std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes> id_sig_pk{};
     std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes> id_dh_pk{};
-    if (!ReadExact(in, id_sig_pk.data(), id_sig_pk.size()) ||
-        !ReadExact(in, id_dh_pk.data(), id_dh_pk.size())) {
+    if (!ReadLogRecord(in, username, id_sig_pk, id_dh_pk)) {
       break;
     }
+    leaf_data.push_back(BuildLeafData(username, id_sig_pk, id_dh_pk));
+    last_record_offset_ = valid_bytes;
+    valid_bytes += LogRecordBytes(username);
+    usernames.push_back(std::move(username));
+    if (leaf_data.size() == kLoadChunkRecords) {
+      hash_chunk();
+    }
+  }
+  hash_chunk();
 
-    const auto leaf_data = BuildLeafData(username, id_sig_pk, id_dh_pk);
-    const auto leaf_hash = HashLeaf(leaf_data);
-    const std::uint64_t idx = static_cast<std::uint64_t>(leaves_.size());
-    leaves_.push_back(leaf_hash);
-    latest_by_user_[username] = LatestKey{idx, leaf_hash};
+  if (!ec && file_bytes > valid_bytes) {
+    if (valid_bytes != 0 && !IsTornTail(in, valid_bytes, file_bytes)) {
+      tree_.Clear();
+      latest_by_user_.clear();
+      log_bytes_ = 0;
+      last_record_offset_ = 0;
+      checkpoint_path_.clear();
+      error = "kt log username length invalid";
+      return false;
+    }
+    in.close();
+    std::filesystem::resize_file(log_path_, valid_bytes, ec);
+    if (ec) {
+      error = "kt log truncate failed";
+      return false;
+    }
   }
 
-  RebuildPow2LevelsLocked();
-  RecomputeRootLocked();
+  log_bytes_ = valid_bytes;
+  if (base != 0) {
+    tree_.Append(leaves);
+  } else {
+    tree_.Assign(std::move(leaves));
+  }
   return true;
 }
 
@@ -262,82 +320,143 @@ bool KeyTransparencyLog::UpdateIdentityKeys(
     const std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes>& id_sig_pk,
     const std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes>& id_dh_pk,
     std::string& error) {
+  std::uint64_t leaf_index = 0;
+  return UpdateIdentityKeys(username, id_sig_pk, id_dh_pk, leaf_index, error);
+}
+
+bool KeyTransparencyLog::UpdateIdentityKeys(
+    const std::string& username,
+    const std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes>& id_sig_pk,
+    const std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes>& id_dh_pk,
+    std::uint64_t& out_leaf_index, std::string& error) {
   error.clear();
+  out_leaf_index = 0;
   if (username.empty()) {
     error = "username empty";
     return false;
   }
+  if (username.size() > kMaxUsernameBytes) {
+    error = "username too long";
+    return false;
+  }
   if (log_path_.empty()) {
     error = "kt log path empty";
     return false;
   }
 
-  const auto leaf_data = BuildLeafData(username, id_sig_pk, id_dh_pk);
-  const auto leaf_hash = HashLeaf(leaf_data);
+  PendingAppend self;
+  self.username = &username;
+  self.leaf_hash = HashLeaf(BuildLeafData(username, id_sig_pk, id_dh_pk));
+  self.record = BuildLogRecord(username, id_sig_pk, id_dh_pk);
 
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::unique_lock<std::mutex> lock(mutex_);
   auto it = latest_by_user_.find(username);
-  if (it != latest_by_user_.end() && it->second.leaf_hash == leaf_hash) {
+  if (it != latest_by_user_.end() && it->second.leaf_hash == self.leaf_hash) {
+    out_leaf_index = it->second.leaf_index;
     return true;
   }
-  if (!AppendEntryLocked(username, id_sig_pk, id_dh_pk, leaf_hash, error)) {
+  // The first caller to find no commit in flight writes everything queued
+  // so far; the rest wait for it (or for the next leader).
+  pending_.push_back(&self);
+  while (!self.done) {
+    if (committing_) {
+      commit_cv_.wait(lock);
+      continue;
+    }
+    CommitBatch(lock);
+  }
+  if (!self.ok) {
+    error = self.error;
     return false;
   }
-  latest_by_user_[username] = LatestKey{
-      static_cast<std::uint64_t>(leaves_.size() - 1), leaf_hash};
-  RecomputeRootLocked();
+  out_leaf_index = self.leaf_index;
   return true;
 }
 
-void KeyTransparencyLog::RebuildPow2LevelsLocked() {
-  pow2_levels_.clear();
-  const std::vector<Sha256Hash>* prev = &leaves_;
-  while (prev->size() >= 2) {
-    std::vector<Sha256Hash> level;
-    level.reserve(prev->size() / 2);
-    for (std::size_t i = 0; i + 1 < prev->size(); i += 2) {
-      level.push_back(HashNode((*prev)[i], (*prev)[i + 1]));
-    }
-    pow2_levels_.push_back(std::move(level));
-    prev = &pow2_levels_.back();
-  }
-}
-
-void KeyTransparencyLog::AppendLeafHashLocked(const Sha256Hash& leaf_hash) {
-  leaves_.push_back(leaf_hash);
-  const std::size_t n = leaves_.size();
-  if (n < 2) {
-    return;
-  }
-
-  std::size_t block = 2;
-  std::size_t level_idx = 0;
-  while (block != 0 && (n % block) == 0) {
-    if (pow2_levels_.size() <= level_idx) {
-      pow2_levels_.resize(level_idx + 1);
+void KeyTransparencyLog::CommitBatch(std::unique_lock<std::mutex>& lock) {
+  committing_ = true;
+  std::vector<PendingAppend*> batch;
+  batch.swap(pending_);
+
+  // Only the committer appends, so the tree stays at |base| until the batch
+  // lands. A user repeating the same keys shares the existing leaf.
+  const std::uint64_t base = tree_.size();
+  std::unordered_map<std::string, PendingAppend*> batch_latest;
+  std::vector<std::pair<PendingAppend*, PendingAppend*>> repeats;
+  std::vector<PendingAppend*> fresh;
+  std::vector<std::uint8_t> data;
+  for (PendingAppend* p : batch) {
+    const auto bit = batch_latest.find(*p->username);
+    if (bit != batch_latest.end()) {
+      if (bit->second->leaf_hash == p->leaf_hash) {
+        repeats.emplace_back(p, bit->second);
+        continue;
+      }
+    } else {
+      const auto lit = latest_by_user_.find(*p->username);
+      if (lit != latest_by_user_.end() &&
+          lit->second.leaf_hash == p->leaf_hash) {
+        p->ok = true;
+        p->leaf_index = lit->second.leaf_index;
+        continue;
+      }
     }
-
-    const auto& prev =
-        level_idx == 0 ? leaves_ : pow2_levels_[level_idx - 1];
-    if (prev.size() < 2) {
-      break;
+    p->leaf_index = base + fresh.size();
+    batch_latest[*p->username] = p;
+    fresh.push_back(p);
+    data.insert(data.end(), p->record.begin(), p->record.end());
+  }
+
+  const std::uint64_t data_offset =
+      log_bytes_ == 0 ? sizeof(kLogMagic) : log_bytes_;
+  const std::uint64_t last_offset =
+      fresh.empty() ? 0
+                    : data_offset + data.size() - fresh.back()->record.size();
+
+  lock.unlock();
+  std::string err;
+  const bool ok = fresh.empty() || WriteAndSync(data, err);
+  lock.lock();
+
+  if (ok && !fresh.empty()) {
+    std::vector<Sha256Hash> leaf_hashes;
+    leaf_hashes.reserve(fresh.size());
+    for (PendingAppend* p : fresh) {
+      leaf_hashes.push_back(p->leaf_hash);
+      latest_by_user_[*p->username] = LatestKey{p->leaf_index, p->leaf_hash};
+      p->ok = true;
     }
-    const auto node = HashNode(prev[prev.size() - 2], prev[prev.size() - 1]);
-    pow2_levels_[level_idx].push_back(node);
-
-    level_idx++;
-    if (block > (std::numeric_limits<std::size_t>::max)() / 2u) {
-      break;
+    tree_.Append(leaf_hashes);
+    log_bytes_ = data_offset + data.size();
+    last_record_offset_ = last_offset;
+    commit_batches_++;
+  } else if (!ok) {
+    for (PendingAppend* p : fresh) {
+      p->error = err.empty() ? "write kt log failed" : err;
     }
-    block *= 2;
   }
+  for (const auto& [p, first] : repeats) {
+    p->ok = first->ok;
+    p->leaf_index = first->leaf_index;
+    p->error = first->error;
+  }
+  for (PendingAppend* p : batch) {
+    p->done = true;
+  }
+  committing_ = false;
+  commit_cv_.notify_all();
+}
+
+std::uint64_t KeyTransparencyLog::commit_batches() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return commit_batches_;
 }
 
 KeyTransparencySth KeyTransparencyLog::Head() const {
   std::lock_guard<std::mutex> lock(mutex_);
   KeyTransparencySth sth;
-  sth.tree_size = static_cast<std::uint64_t>(leaves_.size());
-  sth.root = root_;
+  sth.tree_size = tree_.size();
+  sth.root = tree_.root();
   return sth;
 }
 
@@ -351,29 +470,70 @@ bool KeyTransparencyLog::BuildProofForLatestKey(
     return false;
   }
 
+  std::lock_guard<std::mutex> lock(mutex_);
+  return BuildProofLocked(username, client_tree_size,
+                          static_cast<std::size_t>(tree_.size()),
+                          out_proof, error);
+}
+
+bool KeyTransparencyLog::BuildProofForLatestKey(
+    const std::string& username, std::uint64_t client_tree_size,
+    std::uint64_t tree_size, KeyTransparencyProof& out_proof,
+    std::string& error) const {
+  error.clear();
+  out_proof = KeyTransparencyProof{};
+  if (username.empty()) {
+    error = "username empty";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (tree_size > tree_.size()) {
+    error = "tree size beyond head";
+    return false;
+  }
+  return BuildProofLocked(username, client_tree_size,
+                          static_cast<std::size_t>(tree_size), out_proof,
+                          error);
+}
+
+bool KeyTransparencyLog::LatestLeafIndex(const std::string& username,
+                                         std::uint64_t& out_index) const {
   std::lock_guard<std::mutex> lock(mutex_);
   const auto it = latest_by_user_.find(username);
+  if (it == latest_by_user_.end()) {
+    return false;
+  }
+  out_index = it->second.leaf_index;
+  return true;
+}
+
+bool KeyTransparencyLog::BuildProofLocked(const std::string& username,
+                                          std::uint64_t client_tree_size,
+                                          std::size_t n,
+                                          KeyTransparencyProof& out_proof,
+                                          std::string& error) const {
+  const auto it = latest_by_user_.find(username);
   if (it == latest_by_user_.end()) {
     error = "kt entry not found";
     return false;
   }
-  const std::size_t n = leaves_.size();
   if (n == 0) {
     error = "kt empty";
     return false;
   }
+  if (it->second.leaf_index >= static_cast<std::uint64_t>(n)) {
+    error = "kt entry pending";
+    return false;
+  }
 
   out_proof.sth.tree_size = static_cast<std::uint64_t>(n);
-  out_proof.sth.root = root_;
+  out_proof.sth.root = tree_.RootAt(n);
   out_proof.leaf_index = it->second.leaf_index;
-  out_proof.audit_path =
-      MerkleAuditPath(static_cast<std::size_t>(it->second.leaf_index), leaves_,
-                      pow2_levels_, 0, n);
+  out_proof.audit_path = tree_.AuditPath(it->second.leaf_index, n);
   if (client_tree_size > 0 &&
       client_tree_size < static_cast<std::uint64_t>(n)) {
-    out_proof.consistency_path =
-        MerkleConsistencyProof(static_cast<std::size_t>(client_tree_size),
-                               leaves_, 0, n, pow2_levels_);
+    out_proof.consistency_path = ConsistencyProofLocked(client_tree_size, n);
   }
   return true;
 }
@@ -384,7 +544,7 @@ bool KeyTransparencyLog::BuildConsistencyProof(
   error.clear();
   out_proof.clear();
   std::lock_guard<std::mutex> lock(mutex_);
-  const std::uint64_t current = static_cast<std::uint64_t>(leaves_.size());
+  const std::uint64_t current = tree_.size();
   if (old_size == 0 || new_size == 0 || old_size > new_size) {
     error = "invalid sizes";
     return false;
@@ -396,59 +556,425 @@ bool KeyTransparencyLog::BuildConsistencyProof(
   if (old_size == new_size) {
     return true;
   }
-  out_proof =
-      MerkleConsistencyProof(static_cast<std::size_t>(old_size), leaves_, 0,
-                             static_cast<std::size_t>(new_size), pow2_levels_);
+  out_proof = ConsistencyProofLocked(old_size, new_size);
   return true;
 }
 
-bool KeyTransparencyLog::AppendEntryLocked(
-    const std::string& username,
-    const std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes>& id_sig_pk,
-    const std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes>& id_dh_pk,
-    const Sha256Hash& leaf_hash, std::string& error) {
+std::vector<Sha256Hash> KeyTransparencyLog::ConsistencyProofLocked(
+    std::uint64_t old_size, std::uint64_t new_size) const {
+  const ConsistencyKey key{old_size, new_size};
+  const auto it = consistency_index_.find(key);
+  if (it != consistency_index_.end()) {
+    consistency_lru_.splice(consistency_lru_.begin(), consistency_lru_,
+                            it->second);
+    return it->second->second;
+  }
+  auto proof = tree_.ConsistencyProof(old_size, new_size);
+  consistency_lru_.emplace_front(key, proof);
+  consistency_index_[key] = consistency_lru_.begin();
+  if (consistency_lru_.size() > kConsistencyCacheEntries) {
+    consistency_index_.erase(consistency_lru_.back().first);
+    consistency_lru_.pop_back();
+  }
+  return proof;
+}
+
+std::filesystem::path KeyTransparencyLog::CheckpointPath(
+    std::uint64_t tree_size) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), ".%016llx",
+                static_cast<unsigned long long>(tree_size));
+  auto path = log_path_;
+  path += name;
+  path += kCheckpointSuffix;
+  return path;
+}
+
+std::vector<std::filesystem::path> KeyTransparencyLog::ListCheckpoints()
+    const {
+  std::vector<std::pair<std::uint64_t, std::filesystem::path>> found;
+  const std::string prefix = log_path_.filename().string() + ".";
+  std::error_code ec;
+  const auto dir = log_path_.has_parent_path() ? log_path_.parent_path()
+                                               : std::filesystem::path(".");
+  for (std::filesystem::directory_iterator it(dir, ec), end; !ec && it != end;
+       it.increment(ec)) {
+    const std::string name = it->path().filename().string();
+    if (name.size() != prefix.size() + 16 + kCheckpointSuffix.size() ||
+        name.compare(0, prefix.size(), prefix) != 0 ||
+        std::string_view(name).substr(prefix.size() + 16) !=
+            kCheckpointSuffix) {
+      continue;
+    }
+    const std::string hex = name.substr(prefix.size(), 16);
+    if (hex.find_first_not_of("0123456789abcdef") != std::string::npos) {
+      continue;
+    }
+    found.emplace_back(std::stoull(hex, nullptr, 16), it->path());
+  }
+  std::sort(found.begin(), found.end(),
+            [](const auto& a, const auto& b) { return a.first > b.first; });
+  std::vector<std::filesystem::path> out;
+  out.reserve(found.size());
+  for (auto& entry : found) {
+    out.push_back(std::move(entry.second));
+  }
+  return out;
+}
+
+bool KeyTransparencyLog::LoadCheckpointLocked(const std::filesystem::path& path,
+                                              std::uint64_t log_file_bytes,
+                                              std::string& error) {
+  auto map = std::make_shared<KtMappedFile>();
+  if (!map->Open(path, error)) {
+    return false;
+  }
+  KtCheckpointInfo info;
+  std::uint64_t nodes_offset = 0;
+  if (!ParseKtCheckpoint(map->data(), map->size(), info, nodes_offset,
+                         error)) {
+    return false;
+  }
+  if (info.log_bytes > log_file_bytes) {
+    error = "kt checkpoint beyond log";
+    return false;
+  }
+  const auto* nodes =
+      reinterpret_cast<const Sha256Hash*>(map->data() + nodes_offset);
+
+  // The checkpoint's last record must still be in the log where it was.
+  {
+    std::ifstream in(log_path_, std::ios::binary);
+    in.seekg(static_cast<std::streamoff>(info.last_record_offset));
+    std::string username;
+    std::array<std::uint8_t, kKtIdentitySigPublicKeyBytes> id_sig_pk{};
+    std::array<std::uint8_t, kKtIdentityDhPublicKeyBytes> id_dh_pk{};
+    if (!ReadLogRecord(in, username, id_sig_pk, id_dh_pk) ||
+        info.last_record_offset + LogRecordBytes(username) != info.log_bytes ||
+        HashLeaf(BuildLeafData(username, id_sig_pk, id_dh_pk)) !=
+            nodes[info.tree_size - 1]) {
+      error = "kt checkpoint does not match log";
+      return false;
+    }
+  }
+
+  const std::uint64_t tree_size = info.tree_size;
+  if (!builder_.VerifyBase(KtMerkleBase{map, nodes, tree_size})) {
+    error = "kt checkpoint nodes corrupt";
+    return false;
+  }
+  tree_.AssignBase(KtMerkleBase{map, nodes, tree_size});
+  if (tree_.root() != info.root || tree_.CompactRange() != info.frontier) {
+    tree_.Clear();
+    error = "kt checkpoint root mismatch";
+    return false;
+  }
+  latest_by_user_.reserve(info.users.size());
+  for (auto& [name, leaf_index] : info.users) {
+    latest_by_user_[std::move(name)] = LatestKey{leaf_index, nodes[leaf_index]};
+  }
+  log_bytes_ = info.log_bytes;
+  last_record_offset_ = info.last_record_offset;
+  checkpoint_path_ = path;
+  return true;
+}
+
+bool KeyTransparencyLog::WriteCheckpoint(std::string& error) {
   error.clear();
+  std::lock_guard<std::mutex> write_lock(checkpoint_write_mutex_);
+  KtCheckpointInfo info;
+  std::filesystem::path previous;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (log_path_.empty()) {
+      error = "kt log path empty";
+      return false;
+    }
+    info.tree_size = tree_.size();
+    if (info.tree_size == 0 || info.tree_size == tree_.base_size()) {
+      return true;
+    }
+    info.log_bytes = log_bytes_;
+    info.last_record_offset = last_record_offset_;
+    info.root = tree_.root();
+    info.frontier = tree_.CompactRange();
+    info.users.reserve(latest_by_user_.size());
+    for (const auto& [name, latest] : latest_by_user_) {
+      info.users.emplace_back(name, latest.leaf_index);
+    }
+    previous = checkpoint_path_;
+  }
+
+  std::uint64_t nodes_offset = 0;
+  const auto meta = BuildKtCheckpointMeta(info, nodes_offset);
+  info.users.clear();
+  const auto path = CheckpointPath(info.tree_size);
+  auto tmp = path;
+  tmp += ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      error = "open kt checkpoint failed";
+      return false;
+    }
+    out.write(reinterpret_cast<const char*>(meta.data()),
+              static_cast<std::streamsize>(meta.size()));
+    // Nodes below info.tree_size never change, so copy them in chunks and
+    // let appends and proofs run in between.
+    std::vector<Sha256Hash> chunk;
+    for (std::size_t level = 0; (info.tree_size >> level) != 0; ++level) {
+      const std::uint64_t count = info.tree_size >> level;
+      for (std::uint64_t begin = 0; begin < count;
+           begin += kCheckpointChunkNodes) {
+        const std::uint64_t n =
+            (std::min)(kCheckpointChunkNodes, count - begin);
+        chunk.resize(static_cast<std::size_t>(n));
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          tree_.CopyNodes(level, begin, n, chunk.data());
+        }
+        out.write(reinterpret_cast<const char*>(chunk.data()),
+                  static_cast<std::streamsize>(chunk.size() *
+                                               sizeof(Sha256Hash)));
+      }
+    }
+    out.close();
+    if (!out) {
+      std::error_code ec;
+      std::filesystem::remove(tmp, ec);
+      error = "write kt checkpoint failed";
+      return false;
+    }
+  }
+  std::error_code ec;
+  if (!SyncPath(tmp, false)) {
+    std::filesystem::remove(tmp, ec);
+    error = "sync kt checkpoint failed";
+    return false;
+  }
+  std::filesystem::rename(tmp, path, ec);
+  if (ec) {
+    std::filesystem::remove(tmp, ec);
+    error = "rename kt checkpoint failed";
+    return false;
+  }
+  SyncPath(path.parent_path().empty() ? std::filesystem::path(".")
+                                      : path.parent_path(),
+           true);
+
+  // Serve the covered nodes from the new file and drop their heap copies.
+  auto map = std::make_shared<KtMappedFile>();
+  if (!map->Open(path, error)) {
+    return false;
+  }
+  const auto* nodes =
+      reinterpret_cast<const Sha256Hash*>(map->data() + nodes_offset);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!tree_.Rebase(KtMerkleBase{map, nodes, info.tree_size})) {
+      error = "kt checkpoint rebase failed";
+      return false;
+    }
+    checkpoint_path_ = path;
+  }
+
+  // Keep the previous checkpoint as a fallback; older ones are dropped.
+  for (const auto& old : ListCheckpoints()) {
+    if (old != path && old != previous) {
+      std::filesystem::remove(old, ec);
+    }
+  }
+  return true;
+}
+
+std::uint64_t KeyTransparencyLog::checkpoint_size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tree_.base_size();
+}
+
+void KeyTransparencyLog::StartCheckpointer(const KtCheckpointOptions& options) {
+  std::lock_guard<std::mutex> lock(checkpointer_mutex_);
+  if (checkpointer_running_ || options.interval_ms == 0 || log_path_.empty()) {
+    return;
+  }
+  checkpointer_running_ = true;
+  checkpointer_ = std::thread([this, options]() { RunCheckpointer(options); });
+}
+
+void KeyTransparencyLog::StopCheckpointer() {
+  {
+    std::lock_guard<std::mutex> lock(checkpointer_mutex_);
+    if (!checkpointer_running_) {
+      return;
+    }
+    checkpointer_running_ = false;
+  }
+  checkpointer_cv_.notify_all();
+  if (checkpointer_.joinable()) {
+    checkpointer_.join();
+  }
+}
+
+void KeyTransparencyLog::RunCheckpointer(KtCheckpointOptions options) {
+  const auto interval = std::chrono::milliseconds(options.interval_ms);
+  const std::uint64_t min_leaves = (std::max)(options.min_leaves, 1u);
+  std::unique_lock<std::mutex> lock(checkpointer_mutex_);
+  while (checkpointer_running_) {
+    checkpointer_cv_.wait_for(lock, interval,
+                              [this]() { return !checkpointer_running_; });
+    if (!checkpointer_running_) {
+      break;
+    }
+    lock.unlock();
+    std::uint64_t pending = 0;
+    {
+      std::lock_guard<std::mutex> tree_lock(mutex_);
+      pending = tree_.size() - tree_.base_size();
+    }
+    if (pending >= min_leaves) {
+      // A failed write is retried at the next interval; startup falls back
+      // to the previous checkpoint or a full replay meanwhile.
+      std::string err;
+      WriteCheckpoint(err);
+    }
+    lock.lock();
+  }
+}
+
+bool KeyTransparencyLog::OpenAppendFile(std::string& error) {
   std::error_code ec;
   const auto dir = log_path_.has_parent_path() ? log_path_.parent_path()
                                                : std::filesystem::path{};
   if (!dir.empty()) {
     std::filesystem::create_directories(dir, ec);
   }
-
-  const bool exists = std::filesystem::exists(log_path_, ec);
-  std::ofstream out(log_path_, std::ios::binary | std::ios::app);
-  if (!out) {
+#ifdef _WIN32
+  HANDLE h = CreateFileW(log_path_.wstring().c_str(), GENERIC_WRITE,
+                         FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (h == INVALID_HANDLE_VALUE) {
+    error = "open kt log for append failed";
+    return false;
+  }
+  LARGE_INTEGER size{};
+  if (!GetFileSizeEx(h, &size)) {
+    CloseHandle(h);
+    error = "open kt log for append failed";
+    return false;
+  }
+  file_ = h;
+  file_size_ = static_cast<std::uint64_t>(size.QuadPart);
+#else
+  fd_ = ::open(log_path_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (fd_ < 0) {
     error = "open kt log for append failed";
     return false;
   }
-  if (!exists) {
-    out.write("MIKTLOG1", 8);
+  const off_t size = ::lseek(fd_, 0, SEEK_END);
+  if (size < 0) {
+    CloseAppendFile();
+    error = "open kt log for append failed";
+    return false;
   }
+  file_size_ = static_cast<std::uint64_t>(size);
+#endif
+  return true;
+}
 
-  const std::uint16_t user_len = static_cast<std::uint16_t>(
-      username.size() > 0xFFFF ? 0xFFFF : username.size());
-  if (user_len == 0 || user_len != username.size()) {
-    error = "username too long";
+bool KeyTransparencyLog::WriteAndSync(const std::vector<std::uint8_t>& data,
+                                      std::string& error) {
+#ifdef _WIN32
+  const bool open = file_ != nullptr;
+#else
+  const bool open = fd_ >= 0;
+#endif
+  if (!open && !OpenAppendFile(error)) {
     return false;
   }
-  WriteUint16(out, user_len);
-  out.write(username.data(), static_cast<std::streamsize>(username.size()));
-  out.write(reinterpret_cast<const char*>(id_sig_pk.data()),
-            static_cast<std::streamsize>(id_sig_pk.size()));
-  out.write(reinterpret_cast<const char*>(id_dh_pk.data()),
-            static_cast<std::streamsize>(id_dh_pk.size()));
-  out.flush();
-  if (!out.good()) {
+  std::vector<std::uint8_t> buf;
+  const std::vector<std::uint8_t>* out = &data;
+  if (file_size_ == 0) {
+    buf.assign(kLogMagic, kLogMagic + sizeof(kLogMagic));
+    buf.insert(buf.end(), data.begin(), data.end());
+    out = &buf;
+  }
+  const std::uint8_t* p = out->data();
+  std::size_t left = out->size();
+  std::uint64_t offset = file_size_;
+  bool ok = true;
+#ifdef _WIN32
+  HANDLE h = static_cast<HANDLE>(file_);
+  while (ok && left > 0) {
+    OVERLAPPED ov{};
+    ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFFu);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    const DWORD want = static_cast<DWORD>(
+        (std::min)(left, static_cast<std::size_t>(1u << 30)));
+    DWORD wrote = 0;
+    if (!WriteFile(h, p, want, &wrote, &ov) || wrote == 0) {
+      ok = false;
+      break;
+    }
+    p += wrote;
+    left -= wrote;
+    offset += wrote;
+  }
+  if (ok) {
+    ok = FlushFileBuffers(h) != 0;
+  }
+  if (!ok) {
+    LARGE_INTEGER end{};
+    end.QuadPart = static_cast<LONGLONG>(file_size_);
+    SetFilePointerEx(h, end, nullptr, FILE_BEGIN);
+    SetEndOfFile(h);
+  }
+#else
+  while (ok && left > 0) {
+    const ssize_t rc = ::pwrite(fd_, p, left, static_cast<off_t>(offset));
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      ok = false;
+      break;
+    }
+    p += rc;
+    left -= static_cast<std::size_t>(rc);
+    offset += static_cast<std::uint64_t>(rc);
+  }
+  if (ok) {
+#if defined(__APPLE__)
+    ok = ::fsync(fd_) == 0;
+#else
+    ok = ::fdatasync(fd_) == 0;
+#endif
+  }
+  if (!ok) {
+    // Drop the partial batch so the next one starts on a record boundary.
+    (void)::ftruncate(fd_, static_cast<off_t>(file_size_));
+  }
+#endif
+  if (!ok) {
     error = "write kt log failed";
     return false;
   }
-
-  AppendLeafHashLocked(leaf_hash);
+  file_size_ += out->size();
   return true;
 }
 
-void KeyTransparencyLog::RecomputeRootLocked() {
-  root_ = MerkleTreeHash(leaves_, pow2_levels_, 0, leaves_.size());
+void KeyTransparencyLog::CloseAppendFile() {
+#ifdef _WIN32
+  if (file_ != nullptr) {
+    CloseHandle(static_cast<HANDLE>(file_));
+    file_ = nullptr;
+  }
+#else
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+#endif
+  file_size_ = 0;
 }
 
 }  // namespace mi::server
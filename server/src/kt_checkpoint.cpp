@@ -0,0 +1,233 @@
+#include "kt_checkpoint.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX 1
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "crypto.h"
+
+namespace mi::server {
+
+namespace {
+
+constexpr char kMagic[8] = {'M', 'I', 'K', 'T', 'C', 'K', 'P', '1'};
+constexpr std::size_t kChecksumOffset = 8;
+// The checksum covers everything after it up to the nodes.
+constexpr std::size_t kSummedOffset = kChecksumOffset + 32;
+constexpr std::size_t kHeaderBytes = kSummedOffset + 5 * 8 + 32;
+
+void PutU64(std::vector<std::uint8_t>& out, std::uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    out.push_back(static_cast<std::uint8_t>((v >> (i * 8)) & 0xFF));
+  }
+}
+
+std::uint64_t GetU64(const std::uint8_t* p) {
+  std::uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+std::size_t PopCount(std::uint64_t v) {
+  std::size_t n = 0;
+  for (; v != 0; v &= v - 1) {
+    n++;
+  }
+  return n;
+}
+
+Sha256Hash Checksum(const std::uint8_t* meta, std::size_t len) {
+  crypto::Sha256Digest d;
+  crypto::Sha256(meta + kSummedOffset, len - kSummedOffset, d);
+  return d.bytes;
+}
+
+}  // namespace
+
+std::vector<std::uint8_t> BuildKtCheckpointMeta(const KtCheckpointInfo& info,
+                                                std::uint64_t& nodes_offset) {
+  std::vector<std::uint8_t> out(kMagic, kMagic + sizeof(kMagic));
+  out.resize(kSummedOffset);
+  PutU64(out, info.tree_size);
+  PutU64(out, info.log_bytes);
+  PutU64(out, info.last_record_offset);
+  PutU64(out, info.users.size());
+  const std::size_t nodes_offset_at = out.size();
+  PutU64(out, 0);
+  out.insert(out.end(), info.root.begin(), info.root.end());
+  for (const auto& h : info.frontier) {
+    out.insert(out.end(), h.begin(), h.end());
+  }
+  for (const auto& [name, leaf_index] : info.users) {
+    out.push_back(static_cast<std::uint8_t>(name.size() & 0xFF));
+    out.push_back(static_cast<std::uint8_t>((name.size() >> 8) & 0xFF));
+    out.insert(out.end(), name.begin(), name.end());
+    PutU64(out, leaf_index);
+  }
+  out.resize((out.size() + 31) / 32 * 32);
+  nodes_offset = out.size();
+  for (int i = 0; i < 8; ++i) {
+    out[nodes_offset_at + i] =
+        static_cast<std::uint8_t>((nodes_offset >> (i * 8)) & 0xFF);
+  }
+  const auto sum = Checksum(out.data(), out.size());
+  std::memcpy(out.data() + kChecksumOffset, sum.data(), sum.size());
+  return out;
+}
+
+bool ParseKtCheckpoint(const std::uint8_t* data, std::size_t len,
+                       KtCheckpointInfo& out, std::uint64_t& nodes_offset,
+                       std::string& error) {
+  out = KtCheckpointInfo{};
+  if (len < kHeaderBytes || std::memcmp(data, kMagic, sizeof(kMagic)) != 0) {
+    error = "kt checkpoint header invalid";
+    return false;
+  }
+  const std::uint8_t* p = data + kSummedOffset;
+  out.tree_size = GetU64(p);
+  out.log_bytes = GetU64(p + 8);
+  out.last_record_offset = GetU64(p + 16);
+  const std::uint64_t user_count = GetU64(p + 24);
+  nodes_offset = GetU64(p + 32);
+  std::memcpy(out.root.data(), p + 40, out.root.size());
+
+  const std::uint64_t node_count = KtMerkleNodeCount(out.tree_size);
+  if (out.tree_size == 0 || out.tree_size > (std::uint64_t{1} << 48) ||
+      nodes_offset < kHeaderBytes || nodes_offset > len ||
+      (len - nodes_offset) / 32 != node_count ||
+      (len - nodes_offset) % 32 != 0 ||
+      out.last_record_offset >= out.log_bytes) {
+    error = "kt checkpoint size mismatch";
+    return false;
+  }
+  const auto sum = Checksum(data, static_cast<std::size_t>(nodes_offset));
+  if (std::memcmp(sum.data(), data + kChecksumOffset, sum.size()) != 0) {
+    error = "kt checkpoint checksum mismatch";
+    return false;
+  }
+
+  std::size_t off = kHeaderBytes;
+  const std::size_t pieces = PopCount(out.tree_size);
+  if (nodes_offset - off < pieces * 32) {
+    error = "kt checkpoint frontier truncated";
+    return false;
+  }
+  out.frontier.resize(pieces);
+  for (auto& h : out.frontier) {
+    std::memcpy(h.data(), data + off, h.size());
+    off += h.size();
+  }
+  out.users.reserve(static_cast<std::size_t>(
+      (std::min)(user_count, out.tree_size)));
+  for (std::uint64_t i = 0; i < user_count; ++i) {
+    if (nodes_offset - off < 2) {
+      error = "kt checkpoint users truncated";
+      return false;
+    }
+    const std::size_t name_len =
+        static_cast<std::size_t>(data[off]) |
+        (static_cast<std::size_t>(data[off + 1]) << 8);
+    off += 2;
+    if (name_len == 0 || nodes_offset - off < name_len + 8) {
+      error = "kt checkpoint users truncated";
+      return false;
+    }
+    std::string name(reinterpret_cast<const char*>(data + off), name_len);
+    off += name_len;
+    const std::uint64_t leaf_index = GetU64(data + off);
+    off += 8;
+    if (leaf_index >= out.tree_size) {
+      error = "kt checkpoint user leaf invalid";
+      return false;
+    }
+    out.users.emplace_back(std::move(name), leaf_index);
+  }
+  return true;
+}
+
+KtMappedFile::~KtMappedFile() {
+#ifdef _WIN32
+  if (data_ != nullptr) {
+    UnmapViewOfFile(data_);
+  }
+  if (mapping_ != nullptr) {
+    CloseHandle(static_cast<HANDLE>(mapping_));
+  }
+  if (file_ != nullptr) {
+    CloseHandle(static_cast<HANDLE>(file_));
+  }
+#else
+  if (data_ != nullptr) {
+    ::munmap(const_cast<std::uint8_t*>(data_), size_);
+  }
+#endif
+}
+
+bool KtMappedFile::Open(const std::filesystem::path& path,
+                        std::string& error) {
+#ifdef _WIN32
+  HANDLE h = CreateFileW(path.wstring().c_str(), GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (h == INVALID_HANDLE_VALUE) {
+    error = "open kt checkpoint failed";
+    return false;
+  }
+  file_ = h;
+  LARGE_INTEGER size{};
+  if (!GetFileSizeEx(h, &size) || size.QuadPart <= 0) {
+    error = "kt checkpoint empty";
+    return false;
+  }
+  HANDLE m = CreateFileMappingW(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (m == nullptr) {
+    error = "map kt checkpoint failed";
+    return false;
+  }
+  mapping_ = m;
+  void* view = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+  if (view == nullptr) {
+    error = "map kt checkpoint failed";
+    return false;
+  }
+  data_ = static_cast<const std::uint8_t*>(view);
+  size_ = static_cast<std::size_t>(size.QuadPart);
+#else
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    error = "open kt checkpoint failed";
+    return false;
+  }
+  struct stat st {};
+  if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    error = "kt checkpoint empty";
+    return false;
+  }
+  void* view = ::mmap(nullptr, static_cast<std::size_t>(st.st_size),
+                      PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (view == MAP_FAILED) {
+    error = "map kt checkpoint failed";
+    return false;
+  }
+  data_ = static_cast<const std::uint8_t*>(view);
+  size_ = static_cast<std::size_t>(st.st_size);
+#endif
+  return true;
+}
+
+}  // namespace mi::server
@@ -0,0 +1,529 @@
+#include "kt_merkle.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "crypto.h"
+
+namespace mi::server {
+
+namespace {
+
+constexpr std::uint8_t kLeafPrefix = 0x00;
+constexpr std::uint8_t kNodePrefix = 0x01;
+
+Sha256Hash HashNode(const Sha256Hash& left, const Sha256Hash& right) {
+  std::uint8_t buf[1 + 32 + 32];
+  buf[0] = kNodePrefix;
+  std::memcpy(buf + 1, left.data(), left.size());
+  std::memcpy(buf + 1 + 32, right.data(), right.size());
+  crypto::Sha256Digest d;
+  crypto::Sha256(buf, sizeof(buf), d);
+  return d.bytes;
+}
+
+// out[i] = HashNode(child(2 * (first + i)), child(2 * (first + i) + 1)) for
+// i < count, through Sha256Batch a chunk at a time.
+template <typename Child>
+void HashParents(const Child& child, std::uint64_t first, std::size_t count,
+                 Sha256Hash* out) {
+  constexpr std::size_t kChunk = 128;
+  std::uint8_t bufs[kChunk][1 + 32 + 32];
+  const std::uint8_t* ptrs[kChunk];
+  std::size_t lens[kChunk];
+  crypto::Sha256Digest digests[kChunk];
+  for (std::size_t done = 0; done < count;) {
+    const std::size_t n = (std::min)(count - done, kChunk);
+    for (std::size_t i = 0; i < n; ++i) {
+      const std::uint64_t parent = first + done + i;
+      const Sha256Hash& left = child(parent * 2);
+      const Sha256Hash& right = child(parent * 2 + 1);
+      bufs[i][0] = kNodePrefix;
+      std::memcpy(bufs[i] + 1, left.data(), left.size());
+      std::memcpy(bufs[i] + 1 + 32, right.data(), right.size());
+      ptrs[i] = bufs[i];
+      lens[i] = sizeof(bufs[i]);
+    }
+    crypto::Sha256Batch(ptrs, lens, n, digests);
+    for (std::size_t i = 0; i < n; ++i) {
+      out[done + i] = digests[i].bytes;
+    }
+    done += n;
+  }
+}
+
+std::size_t BlockCount(std::size_t items, std::size_t block) {
+  return (items + block - 1) / block;
+}
+
+Sha256Hash HashEmpty() {
+  static constexpr std::uint8_t kEmpty[1] = {0};
+  crypto::Sha256Digest d;
+  crypto::Sha256(kEmpty, 0, d);
+  return d.bytes;
+}
+
+bool IsPowerOfTwo(std::uint64_t n) { return n != 0 && (n & (n - 1)) == 0; }
+
+std::size_t Log2PowerOfTwo(std::uint64_t n) {
+  std::size_t out = 0;
+  while (n > 1) {
+    n >>= 1;
+    out++;
+  }
+  return out;
+}
+
+std::uint64_t LargestPowerOfTwoLessThan(std::uint64_t n) {
+  if (n <= 1) {
+    return 0;
+  }
+  std::uint64_t k = 1;
+  while ((k << 1) < n) {
+    k <<= 1;
+  }
+  return k;
+}
+
+}  // namespace
+
+std::uint64_t KtMerkleNodeCount(std::uint64_t tree_size) {
+  std::uint64_t total = 0;
+  for (; tree_size != 0; tree_size >>= 1) {
+    total += tree_size;
+  }
+  return total;
+}
+
+KtMerkleBuilder::KtMerkleBuilder(std::size_t threads) {
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  threads_ = (std::max)(threads, std::size_t{1});
+}
+
+KtMerkleBuilder::~KtMerkleBuilder() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void KtMerkleBuilder::StartWorkers() {
+  workers_.reserve(threads_ - 1);
+  for (std::size_t i = 1; i < threads_; ++i) {
+    workers_.emplace_back([this] { WorkerLoop(); });
+  }
+}
+
+void KtMerkleBuilder::WorkerLoop() {
+  std::uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+    if (stop_) {
+      return;
+    }
+    seen = generation_;
+    lock.unlock();
+    RunBlocks();
+    lock.lock();
+    if (--busy_ == 0) {
+      done_cv_.notify_one();
+    }
+  }
+}
+
+void KtMerkleBuilder::RunBlocks() {
+  for (std::size_t block = next_block_.fetch_add(1); block < blocks_;
+       block = next_block_.fetch_add(1)) {
+    (*fn_)(block);
+  }
+}
+
+void KtMerkleBuilder::ParallelFor(
+    std::size_t blocks, const std::function<void(std::size_t)>& fn) {
+  if (threads_ == 1 || blocks <= 1) {
+    for (std::size_t block = 0; block < blocks; ++block) {
+      fn(block);
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> run(run_mutex_);
+  if (workers_.empty()) {
+    StartWorkers();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fn_ = &fn;
+    blocks_ = blocks;
+    next_block_.store(0);
+    busy_ = workers_.size();
+    generation_++;
+  }
+  work_cv_.notify_all();
+  RunBlocks();
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [&] { return busy_ == 0; });
+  fn_ = nullptr;
+}
+
+void KtMerkleBuilder::HashPairs(const Sha256Hash* children, std::size_t count,
+                                Sha256Hash* out) {
+  const auto child = [children](std::uint64_t index) -> const Sha256Hash& {
+    return children[index];
+  };
+  ParallelFor(BlockCount(count, kBlockNodes), [&](std::size_t block) {
+    const std::size_t begin = block * kBlockNodes;
+    HashParents(child, begin, (std::min)(count - begin, kBlockNodes),
+                out + begin);
+  });
+}
+
+void KtMerkleBuilder::HashLeaves(
+    const std::vector<std::vector<std::uint8_t>>& leaf_data,
+    Sha256Hash* out) {
+  ParallelFor(BlockCount(leaf_data.size(), kLeafBlock),
+              [&](std::size_t block) {
+                const std::size_t begin = block * kLeafBlock;
+                const std::size_t n =
+                    (std::min)(leaf_data.size() - begin, kLeafBlock);
+                std::vector<std::vector<std::uint8_t>> bufs(n);
+                const std::uint8_t* ptrs[kLeafBlock];
+                std::size_t lens[kLeafBlock];
+                crypto::Sha256Digest digests[kLeafBlock];
+                for (std::size_t i = 0; i < n; ++i) {
+                  const auto& data = leaf_data[begin + i];
+                  bufs[i].reserve(1 + data.size());
+                  bufs[i].push_back(kLeafPrefix);
+                  bufs[i].insert(bufs[i].end(), data.begin(), data.end());
+                  ptrs[i] = bufs[i].data();
+                  lens[i] = bufs[i].size();
+                }
+                crypto::Sha256Batch(ptrs, lens, n, digests);
+                for (std::size_t i = 0; i < n; ++i) {
+                  out[begin + i] = digests[i].bytes;
+                }
+              });
+}
+
+Sha256Hash KtMerkleBuilder::Root(std::vector<Sha256Hash> leaf_hashes) {
+  if (leaf_hashes.empty()) {
+    return HashEmpty();
+  }
+  // An odd node out moves up a level as is; that matches RFC 6962's split
+  // at the largest power of two.
+  std::vector<Sha256Hash> level = std::move(leaf_hashes);
+  std::vector<Sha256Hash> next;
+  while (level.size() > 1) {
+    next.resize((level.size() + 1) / 2);
+    HashPairs(level.data(), level.size() / 2, next.data());
+    if (level.size() % 2 != 0) {
+      next.back() = level.back();
+    }
+    level.swap(next);
+  }
+  return level[0];
+}
+
+bool KtMerkleBuilder::VerifyBase(const KtMerkleBase& base) {
+  std::atomic<bool> ok{true};
+  const Sha256Hash* children = base.nodes;
+  for (std::uint64_t width = base.size; width >= 2; width >>= 1) {
+    const Sha256Hash* parents = children + width;
+    const auto count = static_cast<std::size_t>(width >> 1);
+    const auto child = [children](std::uint64_t index) -> const Sha256Hash& {
+      return children[index];
+    };
+    ParallelFor(BlockCount(count, kBlockNodes), [&](std::size_t block) {
+      if (!ok.load(std::memory_order_relaxed)) {
+        return;
+      }
+      const std::size_t begin = block * kBlockNodes;
+      const std::size_t n = (std::min)(count - begin, kBlockNodes);
+      std::vector<Sha256Hash> expected(n);
+      HashParents(child, begin, n, expected.data());
+      if (std::memcmp(expected.data(), parents + begin,
+                      n * sizeof(Sha256Hash)) != 0) {
+        ok.store(false, std::memory_order_relaxed);
+      }
+    });
+    if (!ok.load()) {
+      return false;
+    }
+    children = parents;
+  }
+  return true;
+}
+
+Sha256Hash KtMerkleTree::EmptyRoot() { return HashEmpty(); }
+
+void KtMerkleTree::Clear() {
+  SetBase({});
+  levels_.assign(1, {});
+  edge_ = BuildEdge(0);
+}
+
+void KtMerkleTree::Assign(std::vector<Sha256Hash> leaves) {
+  SetBase({});
+  levels_.assign(1, std::move(leaves));
+  for (std::size_t level = 0; LevelSize(level) >= 2; ++level) {
+    HashUpLevel(level);
+  }
+  edge_ = BuildEdge(size());
+}
+
+void KtMerkleTree::Append(const Sha256Hash& leaf_hash) {
+  AppendLevels(leaf_hash);
+  edge_ = BuildEdge(size());
+}
+
+void KtMerkleTree::Append(const std::vector<Sha256Hash>& leaf_hashes) {
+  if (leaf_hashes.empty()) {
+    return;
+  }
+  levels_[0].insert(levels_[0].end(), leaf_hashes.begin(), leaf_hashes.end());
+  for (std::size_t level = 0; LevelSize(level) >= 2; ++level) {
+    HashUpLevel(level);
+  }
+  edge_ = BuildEdge(size());
+}
+
+void KtMerkleTree::AssignBase(KtMerkleBase base) {
+  SetBase(std::move(base));
+  levels_.assign(1, {});
+  edge_ = BuildEdge(size());
+}
+
+bool KtMerkleTree::Rebase(KtMerkleBase base) {
+  if (base.size < base_.size || base.size > size()) {
+    return false;
+  }
+  for (std::size_t level = 0; level < levels_.size(); ++level) {
+    const std::uint64_t moved = (base.size >> level) - (base_.size >> level);
+    auto& tail = levels_[level];
+    tail.erase(tail.begin(),
+               tail.begin() + static_cast<std::ptrdiff_t>(moved));
+  }
+  SetBase(std::move(base));
+  return true;
+}
+
+void KtMerkleTree::SetBase(KtMerkleBase base) {
+  base_ = std::move(base);
+  base_offsets_.clear();
+  std::uint64_t offset = 0;
+  for (std::uint64_t n = base_.size; n != 0; n >>= 1) {
+    base_offsets_.push_back(offset);
+    offset += n;
+  }
+}
+
+const Sha256Hash& KtMerkleTree::Node(std::size_t level,
+                                     std::uint64_t index) const {
+  const std::uint64_t in_base = base_.size >> level;
+  if (index < in_base) {
+    return base_.nodes[base_offsets_[level] + index];
+  }
+  return levels_[level][static_cast<std::size_t>(index - in_base)];
+}
+
+std::uint64_t KtMerkleTree::LevelSize(std::size_t level) const {
+  const std::uint64_t tail =
+      level < levels_.size() ? levels_[level].size() : 0;
+  return (base_.size >> level) + tail;
+}
+
+void KtMerkleTree::AppendLevels(const Sha256Hash& leaf_hash) {
+  levels_[0].push_back(leaf_hash);
+  // Each completed pair closes a subtree one level up.
+  for (std::size_t level = 0; LevelSize(level) % 2 == 0; ++level) {
+    if (levels_.size() <= level + 1) {
+      levels_.emplace_back();
+    }
+    const std::uint64_t n = LevelSize(level);
+    levels_[level + 1].push_back(
+        HashNode(Node(level, n - 2), Node(level, n - 1)));
+  }
+}
+
+void KtMerkleTree::HashUpLevel(std::size_t level) {
+  if (levels_.size() <= level + 1) {
+    levels_.emplace_back();
+  }
+  const std::uint64_t first = LevelSize(level + 1);
+  const std::size_t count =
+      static_cast<std::size_t>(LevelSize(level) / 2 - first);
+  auto& out = levels_[level + 1];
+  const std::size_t offset = out.size();
+  out.resize(offset + count);
+  const auto child = [this, level](std::uint64_t index) -> const Sha256Hash& {
+    return Node(level, index);
+  };
+  const auto hash_block = [&](std::size_t block) {
+    const std::size_t begin = block * KtMerkleBuilder::kBlockNodes;
+    const std::size_t n =
+        (std::min)(count - begin, KtMerkleBuilder::kBlockNodes);
+    HashParents(child, first + begin, n, out.data() + offset + begin);
+  };
+  const std::size_t blocks = BlockCount(count, KtMerkleBuilder::kBlockNodes);
+  if (builder_ != nullptr) {
+    builder_->ParallelFor(blocks, hash_block);
+    return;
+  }
+  for (std::size_t block = 0; block < blocks; ++block) {
+    hash_block(block);
+  }
+}
+
+std::vector<Sha256Hash> KtMerkleTree::CompactRange() const {
+  std::vector<Sha256Hash> out;
+  const std::uint64_t n = size();
+  std::uint64_t start = 0;
+  for (std::size_t bit = 64; bit-- > 0;) {
+    if ((n >> bit) & 1u) {
+      out.push_back(Node(bit, start >> bit));
+      start += std::uint64_t{1} << bit;
+    }
+  }
+  return out;
+}
+
+void KtMerkleTree::CopyNodes(std::size_t level, std::uint64_t begin,
+                             std::uint64_t count, Sha256Hash* out) const {
+  for (std::uint64_t i = 0; i < count; ++i) {
+    out[i] = Node(level, begin + i);
+  }
+}
+
+KtMerkleTree::RightEdge KtMerkleTree::BuildEdge(
+    std::uint64_t tree_size) const {
+  RightEdge edge;
+  edge.size = tree_size;
+  if (tree_size == 0) {
+    edge.root = EmptyRoot();
+    return edge;
+  }
+  // The compact range of [0, tree_size): one complete subtree per set bit.
+  std::uint64_t starts[64];
+  std::size_t levels[64];
+  std::size_t pieces = 0;
+  std::uint64_t start = 0;
+  for (std::size_t bit = 64; bit-- > 0;) {
+    if ((tree_size >> bit) & 1u) {
+      starts[pieces] = start;
+      levels[pieces] = bit;
+      pieces++;
+      start += std::uint64_t{1} << bit;
+    }
+  }
+  edge.suffix_start.resize(pieces);
+  edge.suffix_hash.resize(pieces);
+  Sha256Hash acc{};
+  for (std::size_t i = pieces; i-- > 0;) {
+    const auto& node = Node(levels[i], starts[i] >> levels[i]);
+    acc = i + 1 == pieces ? node : HashNode(node, acc);
+    edge.suffix_start[i] = starts[i];
+    edge.suffix_hash[i] = acc;
+  }
+  edge.root = acc;
+  return edge;
+}
+
+Sha256Hash KtMerkleTree::SubtreeHash(const RightEdge& edge, std::uint64_t start,
+                                     std::uint64_t count) const {
+  if (IsPowerOfTwo(count) && start % count == 0) {
+    const std::size_t level = Log2PowerOfTwo(count);
+    return Node(level, start >> level);
+  }
+  if (start + count == edge.size) {
+    const auto it = std::lower_bound(edge.suffix_start.begin(),
+                                     edge.suffix_start.end(), start);
+    if (it != edge.suffix_start.end() && *it == start) {
+      return edge.suffix_hash[static_cast<std::size_t>(
+          it - edge.suffix_start.begin())];
+    }
+  }
+  const std::uint64_t k = LargestPowerOfTwoLessThan(count);
+  return HashNode(SubtreeHash(edge, start, k),
+                  SubtreeHash(edge, start + k, count - k));
+}
+
+Sha256Hash KtMerkleTree::RootAt(std::uint64_t tree_size) const {
+  if (tree_size == edge_.size) {
+    return edge_.root;
+  }
+  return BuildEdge(tree_size).root;
+}
+
+std::vector<Sha256Hash> KtMerkleTree::AuditPath(
+    std::uint64_t leaf_index, std::uint64_t tree_size) const {
+  RightEdge other;
+  if (tree_size != edge_.size) {
+    other = BuildEdge(tree_size);
+  }
+  const RightEdge& edge = tree_size == edge_.size ? edge_ : other;
+
+  // Siblings from the root down; the proof lists them leaf first.
+  std::vector<Sha256Hash> path;
+  std::uint64_t start = 0;
+  std::uint64_t count = tree_size;
+  std::uint64_t m = leaf_index;
+  while (count > 1) {
+    const std::uint64_t k = LargestPowerOfTwoLessThan(count);
+    if (m < k) {
+      path.push_back(SubtreeHash(edge, start + k, count - k));
+      count = k;
+    } else {
+      path.push_back(SubtreeHash(edge, start, k));
+      start += k;
+      m -= k;
+      count -= k;
+    }
+  }
+  std::reverse(path.begin(), path.end());
+  return path;
+}
+
+std::vector<Sha256Hash> KtMerkleTree::ConsistencyProof(
+    std::uint64_t old_size, std::uint64_t new_size) const {
+  RightEdge other;
+  if (new_size != edge_.size) {
+    other = BuildEdge(new_size);
+  }
+  const RightEdge& edge = new_size == edge_.size ? edge_ : other;
+
+  // RFC 6962 SUBPROOF, unrolled from the root down.
+  std::vector<Sha256Hash> outer;
+  std::uint64_t start = 0;
+  std::uint64_t count = new_size;
+  std::uint64_t m = old_size;
+  bool whole_old_tree = true;
+  while (m != count) {
+    const std::uint64_t k = LargestPowerOfTwoLessThan(count);
+    if (m <= k) {
+      outer.push_back(SubtreeHash(edge, start + k, count - k));
+      count = k;
+    } else {
+      outer.push_back(SubtreeHash(edge, start, k));
+      start += k;
+      m -= k;
+      count -= k;
+      whole_old_tree = false;
+    }
+  }
+  std::vector<Sha256Hash> proof;
+  proof.reserve(outer.size() + 1);
+  if (!whole_old_tree) {
+    proof.push_back(SubtreeHash(edge, start, count));
+  }
+  proof.insert(proof.end(), outer.rbegin(), outer.rend());
+  return proof;
+}
+
+}  // namespace mi::server
@@ -0,0 +1,143 @@
+#include "kt_sth_signer.h"
+
+#include <utility>
+
+namespace mi::server {
+
+KtSthSigner::KtSthSigner(const KeyTransparencyLog* log, SignFn sign,
+                         KtEpochOptions options)
+    : log_(log), sign_(std::move(sign)), options_(options) {
+  if (options_.max_leaves == 0) {
+    options_.max_leaves = 1;
+  }
+}
+
+KtSthSigner::~KtSthSigner() { Stop(); }
+
+void KtSthSigner::Start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_ || !log_ || !sign_) {
+    return;
+  }
+  running_ = true;
+  thread_ = std::thread([this]() { Run(); });
+}
+
+void KtSthSigner::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+  }
+  wake_cv_.notify_all();
+  signed_cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void KtSthSigner::NotifyAppend() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pending_ == 0) {
+    epoch_start_ = std::chrono::steady_clock::now();
+  }
+  ++pending_;
+  if (pending_ == 1 || pending_ >= options_.max_leaves) {
+    wake_cv_.notify_one();
+  }
+}
+
+bool KtSthSigner::SignedHead(std::uint64_t min_tree_size,
+                             KeyTransparencySth& out_sth,
+                             std::string& error) {
+  error.clear();
+  std::unique_lock<std::mutex> lock(mutex_);
+  const auto covered = [&]() {
+    return have_head_ && head_.tree_size >= min_tree_size;
+  };
+  if (!covered()) {
+    if (!running_) {
+      error = "kt signer stopped";
+      return false;
+    }
+    if (min_tree_size > demand_) {
+      demand_ = min_tree_size;
+    }
+    const std::uint64_t epoch = epochs_;
+    wake_cv_.notify_one();
+    signed_cv_.wait(lock, [&]() {
+      return !running_ || covered() || (epochs_ != epoch && !error_.empty());
+    });
+    if (!covered()) {
+      error = error_.empty() ? "kt signer stopped" : error_;
+      return false;
+    }
+  }
+  out_sth = head_;
+  return true;
+}
+
+std::uint64_t KtSthSigner::signatures() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return signatures_;
+}
+
+void KtSthSigner::Run() {
+  const auto interval = std::chrono::milliseconds(options_.interval_ms);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_) {
+    const auto now = std::chrono::steady_clock::now();
+    const bool due = !have_head_ || demand_ > head_.tree_size ||
+                     pending_ >= options_.max_leaves ||
+                     (pending_ > 0 && now - epoch_start_ >= interval);
+    if (!due) {
+      if (pending_ > 0) {
+        wake_cv_.wait_until(lock, epoch_start_ + interval);
+      } else {
+        wake_cv_.wait(lock);
+      }
+      continue;
+    }
+    pending_ = 0;
+    lock.unlock();
+
+    // Only this thread writes head_, so it can be read unlocked here.
+    KeyTransparencySth sth = log_->Head();
+    std::string err;
+    bool ok = true;
+    bool signed_now = false;
+    if (have_head_ && sth.tree_size == head_.tree_size &&
+        sth.root == head_.root) {
+      sth.signature = head_.signature;
+    } else {
+      ok = sign_(sth, err);
+      signed_now = ok;
+    }
+
+    lock.lock();
+    ++epochs_;
+    if (ok) {
+      head_ = std::move(sth);
+      have_head_ = true;
+      error_.clear();
+      if (signed_now) {
+        ++signatures_;
+      }
+    } else {
+      // Fail the waiters instead of retrying in a loop; the next append or
+      // reader starts another epoch.
+      error_ = err.empty() ? "kt sign failed" : err;
+      demand_ = 0;
+      if (!have_head_) {
+        signed_cv_.notify_all();
+        wake_cv_.wait(lock);
+        continue;
+      }
+    }
+    signed_cv_.notify_all();
+  }
+}
+
+}  // namespace mi::server
@@ -29,4 +29,10 @@ bool Listener::Process(const std::uint8_t* frame_bytes,
   return handler_.OnData(frame_bytes, len, out_bytes, remote_ip, transport);
 }
 
+std::unique_ptr<ConnectionHandler::UploadChunkStream>
+Listener::BeginUploadChunkStream(FrameType type, std::uint32_t payload_len,
+                                 TransportKind transport) {
+  return handler_.BeginUploadChunkStream(type, payload_len, transport);
+}
+
 }  // namespace mi::server
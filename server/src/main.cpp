@@ -15,6 +15,7 @@
 #include "server_app.h"
 #include "network_server.h"
 #include "kcp_server.h"
+#include "media_udp_server.h"
 
 namespace {
 
@@ -163,6 +164,14 @@ int main(int argc, char** argv) {
       kcp_opts.nc = cfg.server.kcp_nc;
       kcp_opts.min_rto = cfg.server.kcp_min_rto;
       kcp_opts.session_idle_sec = cfg.server.kcp_session_idle_sec;
+      kcp_opts.workers = cfg.server.kcp_workers;
+      kcp_opts.batch = cfg.server.kcp_batch;
+      kcp_opts.gso = cfg.server.kcp_gso;
+      kcp_opts.handler_threads = cfg.server.kcp_handler_threads;
+      kcp_opts.fec = cfg.server.kcp_fec;
+      kcp_opts.fec_data_shards = cfg.server.kcp_fec_data_shards;
+      kcp_opts.fec_parity_shards = cfg.server.kcp_fec_parity_shards;
+      kcp_opts.fec_adaptive = cfg.server.kcp_fec_adaptive;
       kcp = std::make_unique<mi::server::KcpServer>(&listener, kcp_port,
                                                     kcp_opts, limits);
       std::string kcp_error;
@@ -174,6 +183,23 @@ int main(int argc, char** argv) {
     }
   }
 
+  std::unique_ptr<mi::server::MediaUdpServer> media_udp;
+  if (cfg.call.media_udp_enable) {
+    mi::server::MediaUdpOptions udp_opts;
+    udp_opts.max_pps = cfg.call.media_udp_pps;
+    udp_opts.max_kbps = cfg.call.media_udp_kbps;
+    udp_opts.flow_idle_sec = cfg.call.media_udp_idle_sec;
+    media_udp = std::make_unique<mi::server::MediaUdpServer>(
+        app.media_relay(), cfg.call.media_udp_port, udp_opts);
+    app.api()->SetMediaUdp(media_udp.get());
+    std::string udp_error;
+    if (!media_udp->Start(udp_error)) {
+      LogError(udp_error.empty() ? "media udp start failed" : udp_error);
+      return 1;
+    }
+    LogInfo(verbose, "media udp initialized");
+  }
+
   LogInfo(verbose, "server initialized");
   while (true) {
     std::string tick_error;
@@ -1,31 +1,402 @@
 #include "media_relay.h"
 
-#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace mi::server {
 
 namespace {
-std::string MakeKey(const std::string& recipient,
-                    const std::array<std::uint8_t, 16>& call_id) {
-  static constexpr char kHex[] = "0123456789abcdef";
-  std::string key;
-  key.reserve(recipient.size() + 1 + call_id.size() * 2);
-  key.append(recipient);
-  key.push_back('|');
-  for (const auto b : call_id) {
-    key.push_back(kHex[b >> 4]);
-    key.push_back(kHex[b & 0x0F]);
-  }
-  return key;
+std::int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+MediaRelaySlab* AcquireSlab(MediaRelaySlab* slab) {
+  slab->refs.fetch_add(1, std::memory_order_relaxed);
+  return slab;
+}
+
+unsigned LowestBit(std::uint64_t bits) {
+#if defined(_MSC_VER)
+  unsigned long idx = 0;
+  _BitScanForward64(&idx, bits);
+  return static_cast<unsigned>(idx);
+#else
+  return static_cast<unsigned>(__builtin_ctzll(bits));
+#endif
+}
+
+void ReleaseSlab(MediaRelaySlab* slab) {
+  if (slab && slab->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete slab;
+  }
 }
 }  // namespace
 
+MediaRelayPacketRef::MediaRelayPacketRef(const MediaRelayPacketRef& other)
+    : slab_(other.slab_ ? AcquireSlab(other.slab_) : nullptr) {}
+
+MediaRelayPacketRef::MediaRelayPacketRef(MediaRelayPacketRef&& other) noexcept
+    : slab_(other.slab_) {
+  other.slab_ = nullptr;
+}
+
+MediaRelayPacketRef& MediaRelayPacketRef::operator=(
+    MediaRelayPacketRef other) noexcept {
+  std::swap(slab_, other.slab_);
+  return *this;
+}
+
+MediaRelayPacketRef::~MediaRelayPacketRef() { ReleaseSlab(slab_); }
+
+MediaRelayPacket MediaRelayPacketRef::Detach() {
+  MediaRelayPacket out;
+  if (!slab_) {
+    return out;
+  }
+  if (slab_->refs.load(std::memory_order_acquire) == 1) {
+    out = std::move(slab_->packet);
+  } else {
+    out = slab_->packet;
+  }
+  ReleaseSlab(slab_);
+  slab_ = nullptr;
+  return out;
+}
+
+MediaRelay::Subscriber::Subscriber(std::size_t cap)
+    : capacity(cap), slots(std::make_unique<Slot[]>(cap)) {
+  for (std::size_t i = 0; i < cap; ++i) {
+    slots[i].state.store(2 * static_cast<std::uint64_t>(i),
+                         std::memory_order_relaxed);
+  }
+}
+
+MediaRelay::Subscriber::~Subscriber() {
+  for (std::size_t i = 0; i < capacity; ++i) {
+    if ((slots[i].state.load(std::memory_order_acquire) & 1u) != 0) {
+      ReleaseSlab(slots[i].slab.load(std::memory_order_relaxed));
+    }
+  }
+}
+
+MediaRelay::LayerState::LayerState(std::size_t words)
+    : current(std::make_unique<std::atomic<std::uint64_t>[]>(
+          kMediaRelayLayers * words)) {
+  for (std::size_t i = 0; i < kMediaRelayLayers * words; ++i) {
+    current[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+MediaRelay::RosterBinding::RosterBinding(
+    std::uint64_t roster_version, const std::vector<std::string>& roster)
+    : version(roster_version),
+      names(roster),
+      words((roster.size() + 63) / 64),
+      layers(std::make_unique<std::atomic<LayerState*>[]>(roster.size())) {
+  for (std::size_t i = 0; i < roster.size(); ++i) {
+    layers[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+MediaRelay::RosterBinding::~RosterBinding() {
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    delete layers[i].load(std::memory_order_relaxed);
+  }
+}
+
+MediaRelay::LayerState* MediaRelay::RosterBinding::LayerFor(
+    std::uint32_t sender) const {
+  if (sender >= names.size()) {
+    return nullptr;
+  }
+  auto& slot = layers[sender];
+  LayerState* state = slot.load(std::memory_order_acquire);
+  if (state) {
+    return state;
+  }
+  auto* fresh = new LayerState(words);
+  if (slot.compare_exchange_strong(state, fresh, std::memory_order_acq_rel,
+                                   std::memory_order_acquire)) {
+    return fresh;
+  }
+  delete fresh;
+  return state;
+}
+
+std::size_t MediaRelay::CallIdHash::operator()(
+    const std::array<std::uint8_t, 16>& id) const {
+  std::uint64_t lo = 0;
+  std::uint64_t hi = 0;
+  std::memcpy(&lo, id.data(), sizeof(lo));
+  std::memcpy(&hi, id.data() + sizeof(lo), sizeof(hi));
+  return static_cast<std::size_t>(lo ^ (hi * 0x9E3779B97F4A7C15ull));
+}
+
 MediaRelay::MediaRelay(std::size_t max_queue, std::chrono::milliseconds ttl)
     : max_queue_(max_queue), ttl_(ttl) {}
 
-MediaRelay::Bucket& MediaRelay::BucketForKey(const std::string& key) {
-  const std::size_t idx = std::hash<std::string>{}(key) % kBucketCount;
-  return buckets_[idx];
+MediaRelay::Shard& MediaRelay::ShardFor(
+    const std::array<std::uint8_t, 16>& call_id) {
+  return shards_[CallIdHash{}(call_id) % kShardCount];
+}
+
+std::shared_ptr<MediaRelay::Subscriber> MediaRelay::FindOrCreate(
+    const std::string& participant,
+    const std::array<std::uint8_t, 16>& call_id) {
+  if (max_queue_ == 0) {
+    return nullptr;
+  }
+  auto& shard = ShardFor(call_id);
+  {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto call = shard.calls.find(call_id);
+    if (call != shard.calls.end()) {
+      const auto it = call->second.ids.find(participant);
+      if (it != call->second.ids.end()) {
+        return call->second.subscribers[it->second];
+      }
+    }
+  }
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  return InternLocked(shard.calls[call_id], participant);
+}
+
+std::shared_ptr<MediaRelay::Subscriber> MediaRelay::InternLocked(
+    CallEntry& call, const std::string& participant) {
+  const auto it = call.ids.find(participant);
+  if (it != call.ids.end()) {
+    return call.subscribers[it->second];
+  }
+  std::uint32_t id = 0;
+  if (!call.free_ids.empty()) {
+    id = call.free_ids.back();
+    call.free_ids.pop_back();
+  } else {
+    id = static_cast<std::uint32_t>(call.subscribers.size());
+    call.subscribers.emplace_back();
+    call.names.emplace_back();
+  }
+  auto sub = std::make_shared<Subscriber>(max_queue_);
+  sub->last_seen_ns.store(NowNs(), std::memory_order_relaxed);
+  call.subscribers[id] = sub;
+  call.names[id] = participant;
+  call.ids.emplace(participant, id);
+  return sub;
+}
+
+std::shared_ptr<const MediaRelay::RosterBinding> MediaRelay::BindRoster(
+    const std::array<std::uint8_t, 16>& call_id,
+    std::uint64_t roster_version,
+    const std::vector<std::string>& roster) {
+  auto& shard = ShardFor(call_id);
+  {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto call = shard.calls.find(call_id);
+    if (call != shard.calls.end() && call->second.roster &&
+        !call->second.roster_stale &&
+        call->second.roster->version == roster_version) {
+      return call->second.roster;
+    }
+  }
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  auto& call = shard.calls[call_id];
+  if (call.roster && !call.roster_stale &&
+      call.roster->version == roster_version) {
+    return call.roster;
+  }
+  auto binding = std::make_shared<RosterBinding>(roster_version, roster);
+  binding->subscribers.reserve(roster.size());
+  for (const auto& member : roster) {
+    binding->subscribers.push_back(member.empty() ? nullptr
+                                                  : InternLocked(call, member));
+  }
+  // A late packet of an older roster must not evict the current binding.
+  if (!call.roster || call.roster->version < roster_version ||
+      (call.roster_stale && call.roster->version == roster_version)) {
+    if (call.roster) {
+      CarryLayers(*call.roster, *binding);
+    }
+    call.roster = binding;
+    call.roster_stale = false;
+  }
+  return binding;
+}
+
+void MediaRelay::CarryLayers(const RosterBinding& from,
+                             const RosterBinding& to) {
+  std::unordered_map<std::string, std::uint32_t> index;
+  index.reserve(to.names.size());
+  for (std::uint32_t i = 0; i < to.names.size(); ++i) {
+    index.emplace(to.names[i], i);
+  }
+  for (std::size_t s = 0; s < from.names.size(); ++s) {
+    const LayerState* old = from.layers[s].load(std::memory_order_acquire);
+    const auto sender = index.find(from.names[s]);
+    if (!old || sender == index.end()) {
+      continue;
+    }
+    LayerState* state = to.LayerFor(sender->second);
+    for (std::size_t l = 0; l < kMediaRelayLayers; ++l) {
+      for (std::size_t w = 0; w < from.words; ++w) {
+        std::uint64_t bits =
+            old->current[l * from.words + w].load(std::memory_order_relaxed);
+        while (bits != 0) {
+          const std::size_t r = w * 64 + LowestBit(bits);
+          bits &= bits - 1;
+          const auto it = index.find(from.names[r]);
+          if (it == index.end()) {
+            continue;
+          }
+          state->current[l * to.words + it->second / 64].fetch_or(
+              1ull << (it->second % 64), std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+}
+
+std::uint64_t MediaRelay::SelectLayerWord(const LayerState& state,
+                                          const MediaRelayLayerSelect& select,
+                                          std::size_t words,
+                                          std::size_t w) {
+  const std::size_t layer = select.layer;
+  auto* current = state.current.get();
+  if (select.keyframe && select.preferred) {
+    // Recipients that prefer this layer switch to it, and recipients that
+    // follow no layer yet start with the best one at or below their choice.
+    std::uint64_t following = 0;
+    std::uint64_t at_or_above = 0;
+    for (std::size_t l = 0; l < kMediaRelayLayers; ++l) {
+      following |= current[l * words + w].load(std::memory_order_relaxed);
+      if (l >= layer) {
+        at_or_above |= select.preferred[l * words + w];
+      }
+    }
+    const std::uint64_t moving =
+        select.preferred[layer * words + w] | (~following & at_or_above);
+    if (moving != 0) {
+      for (std::size_t l = 0; l < kMediaRelayLayers; ++l) {
+        if (l == layer) {
+          current[l * words + w].fetch_or(moving, std::memory_order_relaxed);
+        } else {
+          current[l * words + w].fetch_and(~moving, std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+  return current[layer * words + w].load(std::memory_order_relaxed);
+}
+
+void MediaRelay::Push(Subscriber& sub, MediaRelaySlab* slab,
+                      std::int64_t created_ns) {
+  if (sub.has_sink.load(std::memory_order_acquire)) {
+    const auto sink = std::atomic_load(&sub.sink);
+    if (sink && sink->Deliver(slab->packet)) {
+      sub.last_seen_ns.store(created_ns, std::memory_order_relaxed);
+      ReleaseSlab(slab);
+      return;
+    }
+  }
+  const std::uint64_t cap = sub.capacity;
+  const std::uint64_t ticket = sub.tail.fetch_add(1, std::memory_order_acq_rel);
+  Slot& slot = sub.slots[ticket % cap];
+  const std::uint64_t writable = 2 * ticket;
+  for (;;) {
+    std::uint64_t state = slot.state.load(std::memory_order_acquire);
+    if (state == writable) {
+      break;
+    }
+    if (ticket >= cap && state == writable - 2 * cap + 1) {
+      MediaRelaySlab* old = slot.slab.load(std::memory_order_relaxed);
+      if (slot.state.compare_exchange_weak(state, writable,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_acquire)) {
+        ReleaseSlab(old);
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        break;
+      }
+      continue;
+    }
+    // The previous lap's producer has not published yet.
+    std::this_thread::yield();
+  }
+  slot.slab.store(slab, std::memory_order_relaxed);
+  slot.created_ns.store(created_ns, std::memory_order_relaxed);
+  slot.state.store(writable + 1, std::memory_order_release);
+  sub.last_seen_ns.store(created_ns, std::memory_order_relaxed);
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sub.waiting.load(std::memory_order_relaxed)) {
+    { std::lock_guard<std::mutex> lock(sub.wait_mutex); }
+    sub.cv.notify_one();
+  }
+}
+
+MediaRelaySlab* MediaRelay::Pop(Subscriber& sub,
+                                std::int64_t expired_before_ns) {
+  const std::uint64_t cap = sub.capacity;
+  for (;;) {
+    const std::uint64_t head = sub.head.load(std::memory_order_relaxed);
+    const std::uint64_t tail = sub.tail.load(std::memory_order_acquire);
+    if (head >= tail) {
+      return nullptr;
+    }
+    if (tail - head > cap) {
+      // Everything older than the last |cap| tickets was dropped.
+      sub.head.store(tail - cap, std::memory_order_relaxed);
+      continue;
+    }
+    Slot& slot = sub.slots[head % cap];
+    const std::uint64_t ready = 2 * head + 1;
+    std::uint64_t state = slot.state.load(std::memory_order_acquire);
+    if (state < ready) {
+      return nullptr;  // still being written
+    }
+    if (state == ready) {
+      MediaRelaySlab* slab = slot.slab.load(std::memory_order_relaxed);
+      const auto created = slot.created_ns.load(std::memory_order_relaxed);
+      if (expired_before_ns != 0 && created >= expired_before_ns) {
+        return nullptr;
+      }
+      if (slot.state.compare_exchange_strong(state, ready - 1 + 2 * cap,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire)) {
+        sub.head.store(head + 1, std::memory_order_relaxed);
+        return slab;
+      }
+    }
+    // A producer lapped us and dropped this ticket.
+    sub.head.store(head + 1, std::memory_order_relaxed);
+  }
+}
+
+bool MediaRelay::HasReadable(const Subscriber& sub) {
+  const std::uint64_t head = sub.head.load(std::memory_order_relaxed);
+  const std::uint64_t tail = sub.tail.load(std::memory_order_acquire);
+  if (head >= tail) {
+    return false;
+  }
+  if (tail - head > sub.capacity) {
+    return true;
+  }
+  return sub.slots[head % sub.capacity].state.load(
+             std::memory_order_acquire) != 2 * head;
+}
+
+std::uint64_t MediaRelay::QueuedPackets(const Subscriber& sub) {
+  const std::uint64_t head = sub.head.load(std::memory_order_relaxed);
+  const std::uint64_t tail = sub.tail.load(std::memory_order_relaxed);
+  if (head >= tail) {
+    return 0;
+  }
+  return std::min<std::uint64_t>(tail - head, sub.capacity);
 }
 
 void MediaRelay::Enqueue(const std::string& recipient,
@@ -34,105 +405,240 @@ void MediaRelay::Enqueue(const std::string& recipient,
   if (recipient.empty()) {
     return;
   }
+  auto sub = FindOrCreate(recipient, call_id);
+  if (!sub) {
+    return;
+  }
   const auto now = std::chrono::steady_clock::now();
   packet.created_at = now;
-  const std::string key = MakeKey(recipient, call_id);
-  auto& bucket = BucketForKey(key);
-  {
-    std::lock_guard<std::mutex> lock(bucket.mutex);
-    auto& q = bucket.queues[key];
-    q.last_seen = now;
-    q.packets.push_back(std::move(packet));
-    while (q.packets.size() > max_queue_) {
-      q.packets.pop_front();
-    }
-  }
-  bucket.cv.notify_all();
+  auto* slab = new MediaRelaySlab();
+  slab->packet = std::move(packet);
+  Push(*sub, slab,
+       std::chrono::duration_cast<std::chrono::nanoseconds>(
+           now.time_since_epoch())
+           .count());
 }
 
 void MediaRelay::EnqueueMany(const std::vector<std::string>& recipients,
                              const std::array<std::uint8_t, 16>& call_id,
                              const MediaRelayPacket& packet) {
-  if (recipients.empty()) {
+  if (recipients.empty() || max_queue_ == 0) {
     return;
   }
+  std::vector<std::shared_ptr<Subscriber>> subs;
+  subs.reserve(recipients.size());
+  auto& shard = ShardFor(call_id);
+  {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    const auto call = shard.calls.find(call_id);
+    for (const auto& recipient : recipients) {
+      if (recipient.empty()) {
+        continue;
+      }
+      std::shared_ptr<Subscriber> sub;
+      if (call != shard.calls.end()) {
+        const auto it = call->second.ids.find(recipient);
+        if (it != call->second.ids.end()) {
+          sub = call->second.subscribers[it->second];
+        }
+      }
+      subs.push_back(std::move(sub));
+    }
+  }
+  std::size_t idx = 0;
   for (const auto& recipient : recipients) {
     if (recipient.empty()) {
       continue;
     }
-    MediaRelayPacket copy;
-    copy.sender = packet.sender;
-    copy.payload = packet.payload;
-    Enqueue(recipient, call_id, std::move(copy));
+    if (!subs[idx]) {
+      subs[idx] = FindOrCreate(recipient, call_id);
+    }
+    ++idx;
   }
+
+  const auto now = std::chrono::steady_clock::now();
+  const auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          now.time_since_epoch())
+                          .count();
+  auto* slab = new MediaRelaySlab();
+  slab->packet.sender = packet.sender;
+  slab->packet.payload = packet.payload;
+  slab->packet.created_at = now;
+  for (const auto& sub : subs) {
+    if (sub) {
+      Push(*sub, AcquireSlab(slab), now_ns);
+    }
+  }
+  ReleaseSlab(slab);
+}
+
+void MediaRelay::EnqueueFanout(const std::array<std::uint8_t, 16>& call_id,
+                               std::uint64_t roster_version,
+                               const std::vector<std::string>& roster,
+                               const std::uint64_t* targets,
+                               std::size_t words,
+                               MediaRelayPacket packet,
+                               const MediaRelayLayerSelect* layer) {
+  if (!targets || words == 0 || roster.empty() || max_queue_ == 0) {
+    return;
+  }
+  const auto binding = BindRoster(call_id, roster_version, roster);
+  const auto& subs = binding->subscribers;
+  words = std::min(words, binding->words);
+  const LayerState* layer_state = nullptr;
+  if (layer) {
+    if (layer->layer >= kMediaRelayLayers) {
+      return;
+    }
+    layer_state = binding->LayerFor(layer->sender);
+    if (!layer_state) {
+      return;
+    }
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  const auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          now.time_since_epoch())
+                          .count();
+  auto* slab = new MediaRelaySlab();
+  slab->packet = std::move(packet);
+  slab->packet.created_at = now;
+  for (std::size_t w = 0; w < words; ++w) {
+    std::uint64_t bits = targets[w];
+    if (layer_state) {
+      bits &= SelectLayerWord(*layer_state, *layer, words, w);
+    }
+    while (bits != 0) {
+      const std::size_t idx = w * 64 + LowestBit(bits);
+      bits &= bits - 1;
+      if (idx < subs.size() && subs[idx]) {
+        Push(*subs[idx], AcquireSlab(slab), now_ns);
+      }
+    }
+  }
+  ReleaseSlab(slab);
 }
 
 void MediaRelay::Pull(const std::string& recipient,
                       const std::array<std::uint8_t, 16>& call_id,
                       std::size_t max_packets,
                       std::chrono::milliseconds wait,
-                      std::vector<MediaRelayPacket>& out) {
+                      std::vector<MediaRelayPacketRef>& out) {
   out.clear();
   if (recipient.empty() || max_packets == 0) {
     return;
   }
-  const auto deadline = std::chrono::steady_clock::now() + wait;
-  const std::string key = MakeKey(recipient, call_id);
-  auto& bucket = BucketForKey(key);
-  std::unique_lock<std::mutex> lock(bucket.mutex);
-  const auto has_data = [&]() {
-    const auto it = bucket.queues.find(key);
-    return it != bucket.queues.end() && !it->second.packets.empty();
+  auto sub = FindOrCreate(recipient, call_id);
+  if (!sub) {
+    return;
+  }
+  std::lock_guard<std::mutex> consumer(sub->consumer_mutex);
+  const auto drain = [&]() {
+    while (out.size() < max_packets) {
+      auto* slab = Pop(*sub);
+      if (!slab) {
+        break;
+      }
+      out.emplace_back(slab);
+    }
   };
-  if (!has_data() && wait.count() > 0) {
-    bucket.cv.wait_until(lock, deadline, has_data);
+  drain();
+  if (out.empty() && wait.count() > 0) {
+    const auto deadline = std::chrono::steady_clock::now() + wait;
+    std::unique_lock<std::mutex> lock(sub->wait_mutex);
+    sub->waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    sub->cv.wait_until(lock, deadline, [&]() { return HasReadable(*sub); });
+    sub->waiting.store(false, std::memory_order_relaxed);
+    lock.unlock();
+    drain();
+  }
+  sub->last_seen_ns.store(NowNs(), std::memory_order_relaxed);
+}
+
+void MediaRelay::Pull(const std::string& recipient,
+                      const std::array<std::uint8_t, 16>& call_id,
+                      std::size_t max_packets,
+                      std::chrono::milliseconds wait,
+                      std::vector<MediaRelayPacket>& out) {
+  out.clear();
+  std::vector<MediaRelayPacketRef> refs;
+  Pull(recipient, call_id, max_packets, wait, refs);
+  out.reserve(refs.size());
+  for (auto& ref : refs) {
+    out.push_back(ref.Detach());
   }
-  auto it = bucket.queues.find(key);
-  if (it == bucket.queues.end() || it->second.packets.empty()) {
+}
+
+void MediaRelay::SetSink(const std::string& participant,
+                         const std::array<std::uint8_t, 16>& call_id,
+                         std::shared_ptr<MediaRelaySink> sink) {
+  if (participant.empty()) {
     return;
   }
-  auto& q = it->second;
-  const std::size_t count =
-      std::min<std::size_t>(max_packets, q.packets.size());
-  out.reserve(count);
-  for (std::size_t i = 0; i < count; ++i) {
-    out.push_back(std::move(q.packets.front()));
-    q.packets.pop_front();
+  auto sub = FindOrCreate(participant, call_id);
+  if (!sub) {
+    return;
   }
-  q.last_seen = std::chrono::steady_clock::now();
+  const bool attached = sink != nullptr;
+  std::atomic_store(&sub->sink, std::move(sink));
+  sub->has_sink.store(attached, std::memory_order_release);
 }
 
 void MediaRelay::Cleanup() {
-  const auto now = std::chrono::steady_clock::now();
-  for (auto& bucket : buckets_) {
-    std::lock_guard<std::mutex> lock(bucket.mutex);
-    for (auto it = bucket.queues.begin(); it != bucket.queues.end();) {
-      auto& q = it->second;
-      while (!q.packets.empty()) {
-        const auto age = now - q.packets.front().created_at;
-        if (age <= ttl_) {
-          break;
+  const std::int64_t now_ns = NowNs();
+  const std::int64_t ttl_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(ttl_).count();
+  const std::int64_t cutoff = now_ns - ttl_ns;
+  for (auto& shard : shards_) {
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    for (auto call_it = shard.calls.begin(); call_it != shard.calls.end();) {
+      auto& call = call_it->second;
+      for (std::uint32_t id = 0; id < call.subscribers.size(); ++id) {
+        auto& sub = call.subscribers[id];
+        if (!sub) {
+          continue;
+        }
+        // A pull in progress drains the ring anyway.
+        if (sub->consumer_mutex.try_lock()) {
+          while (auto* slab = Pop(*sub, cutoff > 0 ? cutoff : 1)) {
+            ReleaseSlab(slab);
+          }
+          sub->consumer_mutex.unlock();
+        }
+        if (!sub->has_sink.load(std::memory_order_acquire) &&
+            QueuedPackets(*sub) == 0 &&
+            sub->last_seen_ns.load(std::memory_order_relaxed) < cutoff) {
+          call.ids.erase(call.names[id]);
+          call.names[id].clear();
+          sub.reset();
+          call.free_ids.push_back(id);
+          call.roster_stale = true;
         }
-        q.packets.pop_front();
       }
-      if (q.packets.empty() && now - q.last_seen > ttl_) {
-        it = bucket.queues.erase(it);
+      if (call.ids.empty()) {
+        call_it = shard.calls.erase(call_it);
         continue;
       }
-      ++it;
+      ++call_it;
     }
   }
 }
 
 MediaRelayStats MediaRelay::GetStats() {
   MediaRelayStats stats;
-  for (auto& bucket : buckets_) {
-    std::lock_guard<std::mutex> lock(bucket.mutex);
-    stats.queues += bucket.queues.size();
-    for (const auto& kv : bucket.queues) {
-      stats.packets += kv.second.packets.size();
+  for (auto& shard : shards_) {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    for (const auto& kv : shard.calls) {
+      stats.queues += kv.second.ids.size();
+      for (const auto& sub : kv.second.subscribers) {
+        if (sub) {
+          stats.packets += QueuedPackets(*sub);
+        }
+      }
     }
   }
+  stats.dropped = dropped_.load(std::memory_order_relaxed);
   return stats;
 }
 
@@ -0,0 +1,603 @@
+#include "media_udp_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX 1
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "crypto.h"
+#include "media_relay.h"
+#include "monocypher.h"
+#include "protocol.h"
+
+namespace mi::server {
+
+namespace {
+
+constexpr std::uint32_t kTickMs = 50;
+constexpr std::uint64_t kExpireEveryMs = 1000;
+constexpr std::uint64_t kReplayWindow = 64;
+
+std::uint64_t NowMs() {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+void WriteLe64(std::uint64_t v, std::uint8_t* out) {
+  for (int i = 0; i < 8; ++i) {
+    out[i] = static_cast<std::uint8_t>((v >> (i * 8)) & 0xFF);
+  }
+}
+
+std::uint64_t ReadLe64(const std::uint8_t* in) {
+  std::uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = (v << 8) | in[i];
+  }
+  return v;
+}
+
+bool SetNonBlocking(std::intptr_t sock) {
+#ifdef _WIN32
+  u_long mode = 1;
+  return ioctlsocket(static_cast<SOCKET>(sock), FIONBIO, &mode) == 0;
+#else
+  int flags = fcntl(static_cast<int>(sock), F_GETFL, 0);
+  if (flags < 0) {
+    return false;
+  }
+  return fcntl(static_cast<int>(sock), F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+bool WouldBlock() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+bool SendTo(std::intptr_t sock, const std::vector<std::uint8_t>& data,
+            const sockaddr_storage& addr, socklen_t addr_len) {
+  if (sock == -1) {
+    return false;
+  }
+#ifdef _WIN32
+  const int sent = sendto(static_cast<SOCKET>(sock),
+                          reinterpret_cast<const char*>(data.data()),
+                          static_cast<int>(data.size()), 0,
+                          reinterpret_cast<const sockaddr*>(&addr), addr_len);
+  return sent == static_cast<int>(data.size());
+#else
+  const ssize_t sent =
+      sendto(static_cast<int>(sock), data.data(), data.size(), 0,
+             reinterpret_cast<const sockaddr*>(&addr), addr_len);
+  return sent == static_cast<ssize_t>(data.size());
+#endif
+}
+
+void MakeNonce(MediaDatagramDirection direction, std::uint64_t flow_id,
+               std::uint64_t counter, std::uint8_t nonce[24]) {
+  std::memset(nonce, 0, 24);
+  nonce[0] = static_cast<std::uint8_t>(direction);
+  WriteLe64(flow_id, nonce + 8);
+  WriteLe64(counter, nonce + 16);
+}
+
+bool SameEndpoint(const sockaddr_storage& a, socklen_t a_len,
+                  const sockaddr_storage& b, socklen_t b_len) {
+  return a_len == b_len && std::memcmp(&a, &b, a_len) == 0;
+}
+
+}  // namespace
+
+bool EncodeMediaDatagram(const MediaDatagram& dgram,
+                         MediaDatagramDirection direction,
+                         const std::array<std::uint8_t, 32>& key,
+                         std::vector<std::uint8_t>& out) {
+  out.clear();
+  const std::size_t total = kMediaDatagramHeaderBytes + dgram.body.size() +
+                            kMediaDatagramTagBytes;
+  if (total > kMediaDatagramMaxBytes) {
+    return false;
+  }
+  out.resize(total);
+  out[0] = kMediaDatagramMagic;
+  out[1] = static_cast<std::uint8_t>(dgram.type);
+  WriteLe64(dgram.flow_id, out.data() + 2);
+  WriteLe64(dgram.counter, out.data() + 10);
+  std::uint8_t nonce[24];
+  MakeNonce(direction, dgram.flow_id, dgram.counter, nonce);
+  const std::size_t body_len = dgram.body.size();
+  crypto_aead_lock(out.data() + kMediaDatagramHeaderBytes,
+                   out.data() + kMediaDatagramHeaderBytes + body_len,
+                   key.data(), nonce, out.data(), kMediaDatagramHeaderBytes,
+                   dgram.body.data(), body_len);
+  return true;
+}
+
+bool DecodeMediaDatagram(const std::uint8_t* data, std::size_t len,
+                         MediaDatagramDirection direction,
+                         const std::array<std::uint8_t, 32>& key,
+                         MediaDatagram& out) {
+  if (!data || len < kMediaDatagramHeaderBytes + kMediaDatagramTagBytes ||
+      data[0] != kMediaDatagramMagic) {
+    return false;
+  }
+  const std::uint64_t flow_id = ReadLe64(data + 2);
+  const std::uint64_t counter = ReadLe64(data + 10);
+  const std::size_t body_len =
+      len - kMediaDatagramHeaderBytes - kMediaDatagramTagBytes;
+  std::uint8_t nonce[24];
+  MakeNonce(direction, flow_id, counter, nonce);
+  std::vector<std::uint8_t> body(body_len);
+  if (crypto_aead_unlock(body.data(),
+                         data + kMediaDatagramHeaderBytes + body_len,
+                         key.data(), nonce, data, kMediaDatagramHeaderBytes,
+                         data + kMediaDatagramHeaderBytes, body_len) != 0) {
+    return false;
+  }
+  out.type = static_cast<MediaDatagramType>(data[1]);
+  out.flow_id = flow_id;
+  out.counter = counter;
+  out.body = std::move(body);
+  return true;
+}
+
+bool PeekMediaDatagramFlow(const std::uint8_t* data, std::size_t len,
+                           std::uint64_t& out_flow_id) {
+  if (!data || len < kMediaDatagramHeaderBytes + kMediaDatagramTagBytes ||
+      data[0] != kMediaDatagramMagic) {
+    return false;
+  }
+  out_flow_id = ReadLe64(data + 2);
+  return true;
+}
+
+class MediaUdpServer::Flow : public MediaRelaySink {
+ public:
+  Flow(MediaFlowInfo flow_info, std::uint64_t id,
+       const std::array<std::uint8_t, 32>& flow_key, std::intptr_t socket,
+       const MediaUdpOptions& options, std::uint64_t now_ms)
+      : info(std::move(flow_info)),
+        flow_id(id),
+        key(flow_key),
+        sock(socket),
+        last_seen_ms(now_ms),
+        last_refill_ms(now_ms),
+        packet_tokens(static_cast<double>(options.max_pps)),
+        byte_tokens(static_cast<double>(options.max_kbps) * 1000.0 / 8.0) {}
+
+  bool Deliver(const MediaRelayPacket& packet) override {
+    if (!bound.load(std::memory_order_acquire)) {
+      return false;
+    }
+    MediaDatagram dgram;
+    dgram.type = MediaDatagramType::kMedia;
+    dgram.flow_id = flow_id;
+    dgram.counter = send_counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    dgram.body.reserve(2 + packet.sender.size() + packet.payload.size());
+    proto::WriteString(packet.sender, dgram.body);
+    dgram.body.insert(dgram.body.end(), packet.payload.begin(),
+                      packet.payload.end());
+    std::vector<std::uint8_t> wire;
+    if (!EncodeMediaDatagram(dgram, MediaDatagramDirection::kToClient, key,
+                             wire)) {
+      return false;  // too large for one datagram; leave it to pulls
+    }
+    sockaddr_storage addr{};
+    socklen_t addr_len = 0;
+    {
+      std::lock_guard<std::mutex> lock(endpoint_mutex);
+      addr = endpoint;
+      addr_len = endpoint_len;
+    }
+    return SendTo(sock, wire, addr, addr_len);
+  }
+
+  // Sliding window over the last kReplayWindow counters.
+  bool AcceptCounter(std::uint64_t counter) {
+    if (counter == 0) {
+      return false;
+    }
+    if (counter > recv_max) {
+      const std::uint64_t shift = counter - recv_max;
+      recv_window = shift >= kReplayWindow ? 0 : recv_window << shift;
+      recv_window |= 1;
+      recv_max = counter;
+      return true;
+    }
+    const std::uint64_t back = recv_max - counter;
+    if (back >= kReplayWindow) {
+      return false;
+    }
+    const std::uint64_t bit = 1ull << back;
+    if ((recv_window & bit) != 0) {
+      return false;
+    }
+    recv_window |= bit;
+    return true;
+  }
+
+  bool AllowRate(std::size_t bytes, const MediaUdpOptions& options,
+                 std::uint64_t now_ms) {
+    const double pps = static_cast<double>(options.max_pps);
+    const double bps = static_cast<double>(options.max_kbps) * 1000.0 / 8.0;
+    const double elapsed =
+        static_cast<double>(now_ms - last_refill_ms) / 1000.0;
+    last_refill_ms = now_ms;
+    packet_tokens = std::min(pps, packet_tokens + elapsed * pps);
+    byte_tokens = std::min(bps, byte_tokens + elapsed * bps);
+    if (packet_tokens < 1.0 || byte_tokens < static_cast<double>(bytes)) {
+      return false;
+    }
+    packet_tokens -= 1.0;
+    byte_tokens -= static_cast<double>(bytes);
+    return true;
+  }
+
+  const MediaFlowInfo info;
+  const std::uint64_t flow_id;
+  const std::array<std::uint8_t, 32> key;
+  const std::intptr_t sock;
+
+  std::mutex endpoint_mutex;
+  sockaddr_storage endpoint{};
+  socklen_t endpoint_len{0};
+  std::atomic<bool> bound{false};
+  std::atomic<std::uint64_t> send_counter{0};
+
+  // Receive side state, only touched by the worker thread.
+  std::uint64_t recv_max{0};
+  std::uint64_t recv_window{0};
+  std::uint64_t last_seen_ms{0};
+  std::uint64_t last_refill_ms{0};
+  double packet_tokens{0.0};
+  double byte_tokens{0.0};
+};
+
+MediaUdpServer::MediaUdpServer(MediaRelay* relay, std::uint16_t port,
+                               MediaUdpOptions options)
+    : relay_(relay), port_(port), options_(options) {}
+
+MediaUdpServer::~MediaUdpServer() { Stop(); }
+
+void MediaUdpServer::SetForwarder(Forwarder forwarder) {
+  forwarder_ = std::move(forwarder);
+}
+
+bool MediaUdpServer::Start(std::string& error) {
+  error.clear();
+  if (running_.load()) {
+    return true;
+  }
+  if (!relay_) {
+    error = "media relay unavailable";
+    return false;
+  }
+  if (!StartSocket(error)) {
+    return false;
+  }
+  running_.store(true);
+  worker_ = std::thread(&MediaUdpServer::Run, this);
+  return true;
+}
+
+void MediaUdpServer::Stop() {
+  running_.store(false);
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(flows_mutex_);
+    for (const auto& kv : flows_) {
+      relay_->SetSink(kv.second->info.username, kv.second->info.call_id,
+                      nullptr);
+    }
+    flows_.clear();
+    flow_by_call_.clear();
+  }
+  StopSocket();
+}
+
+bool MediaUdpServer::StartSocket(std::string& error) {
+  error.clear();
+#ifdef _WIN32
+  WSADATA wsa;
+  const int wsa_rc = WSAStartup(MAKEWORD(2, 2), &wsa);
+  if (wsa_rc != 0) {
+    error = "WSAStartup failed: " + std::to_string(wsa_rc);
+    return false;
+  }
+  const SOCKET sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock == INVALID_SOCKET) {
+    error = "media udp socket failed: " + std::to_string(WSAGetLastError());
+    WSACleanup();
+    return false;
+  }
+  sock_ = static_cast<std::intptr_t>(sock);
+#else
+  const int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    error = std::string("media udp socket failed: ") + std::strerror(errno);
+    return false;
+  }
+  sock_ = static_cast<std::intptr_t>(sock);
+#endif
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port_);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  sockaddr_in bound{};
+  socklen_t bound_len = sizeof(bound);
+#ifdef _WIN32
+  const bool bind_ok =
+      ::bind(static_cast<SOCKET>(sock_), reinterpret_cast<sockaddr*>(&addr),
+             sizeof(addr)) != SOCKET_ERROR &&
+      ::getsockname(static_cast<SOCKET>(sock_),
+                    reinterpret_cast<sockaddr*>(&bound), &bound_len) == 0;
+#else
+  const bool bind_ok =
+      ::bind(static_cast<int>(sock_), reinterpret_cast<sockaddr*>(&addr),
+             sizeof(addr)) == 0 &&
+      ::getsockname(static_cast<int>(sock_),
+                    reinterpret_cast<sockaddr*>(&bound), &bound_len) == 0;
+#endif
+  if (!bind_ok) {
+    error = "media udp bind(0.0.0.0:" + std::to_string(port_) + ") failed";
+    StopSocket();
+    return false;
+  }
+  bound_port_ = ntohs(bound.sin_port);
+
+  if (!SetNonBlocking(sock_)) {
+    error = "set non-blocking failed";
+    StopSocket();
+    return false;
+  }
+  return true;
+}
+
+void MediaUdpServer::StopSocket() {
+  if (sock_ != -1) {
+#ifdef _WIN32
+    closesocket(static_cast<SOCKET>(sock_));
+    WSACleanup();
+#else
+    ::close(static_cast<int>(sock_));
+#endif
+    sock_ = -1;
+  }
+}
+
+std::string MediaUdpServer::FlowKey(
+    const std::string& username, const std::array<std::uint8_t, 16>& call_id) {
+  std::string key(call_id.begin(), call_id.end());
+  key += username;
+  return key;
+}
+
+bool MediaUdpServer::OpenFlow(MediaFlowInfo info, MediaFlowGrant& out,
+                              std::string& error) {
+  error.clear();
+  out = MediaFlowGrant{};
+  if (!running_.load()) {
+    error = "media udp disabled";
+    return false;
+  }
+  if (info.username.empty()) {
+    error = "invalid params";
+    return false;
+  }
+  if (!crypto::RandomBytes(out.key.data(), out.key.size())) {
+    error = "rng failed";
+    return false;
+  }
+
+  std::shared_ptr<Flow> flow;
+  {
+    std::lock_guard<std::mutex> lock(flows_mutex_);
+    const std::string call_key = FlowKey(info.username, info.call_id);
+    const auto prev = flow_by_call_.find(call_key);
+    if (prev != flow_by_call_.end()) {
+      flows_.erase(prev->second);
+      flow_by_call_.erase(prev);
+    }
+    if (flows_.size() >= options_.max_flows) {
+      error = "too many media flows";
+      return false;
+    }
+    do {
+      std::uint8_t id_bytes[8];
+      if (!crypto::RandomBytes(id_bytes, sizeof(id_bytes))) {
+        error = "rng failed";
+        return false;
+      }
+      out.flow_id = ReadLe64(id_bytes);
+    } while (out.flow_id == 0 || flows_.count(out.flow_id) != 0);
+
+    flow = std::make_shared<Flow>(info, out.flow_id, out.key, sock_, options_,
+                                  NowMs());
+    flows_.emplace(out.flow_id, flow);
+    flow_by_call_.emplace(call_key, out.flow_id);
+    relay_->SetSink(info.username, info.call_id, flow);
+  }
+  out.port = bound_port_;
+  return true;
+}
+
+std::size_t MediaUdpServer::FlowCount() {
+  std::lock_guard<std::mutex> lock(flows_mutex_);
+  return flows_.size();
+}
+
+void MediaUdpServer::HandleDatagram(const std::uint8_t* data, std::size_t len,
+                                    const void* addr, int addr_len,
+                                    std::uint64_t now_ms) {
+  std::uint64_t flow_id = 0;
+  if (!PeekMediaDatagramFlow(data, len, flow_id)) {
+    return;
+  }
+  std::shared_ptr<Flow> flow;
+  {
+    std::lock_guard<std::mutex> lock(flows_mutex_);
+    const auto it = flows_.find(flow_id);
+    if (it == flows_.end()) {
+      return;
+    }
+    flow = it->second;
+  }
+  MediaDatagram dgram;
+  if (!DecodeMediaDatagram(data, len, MediaDatagramDirection::kToServer,
+                           flow->key, dgram) ||
+      !flow->AcceptCounter(dgram.counter) ||
+      !flow->AllowRate(len, options_, now_ms)) {
+    return;
+  }
+  flow->last_seen_ms = now_ms;
+
+  // Follow the client across NAT rebinding; only authenticated datagrams
+  // move the endpoint.
+  const auto& peer = *static_cast<const sockaddr_storage*>(addr);
+  const auto peer_len = static_cast<socklen_t>(addr_len);
+  {
+    std::lock_guard<std::mutex> lock(flow->endpoint_mutex);
+    if (!SameEndpoint(flow->endpoint, flow->endpoint_len, peer, peer_len)) {
+      flow->endpoint = peer;
+      flow->endpoint_len = peer_len;
+    }
+  }
+  flow->bound.store(true, std::memory_order_release);
+
+  switch (dgram.type) {
+    case MediaDatagramType::kBind: {
+      MediaDatagram ack;
+      ack.type = MediaDatagramType::kBindAck;
+      ack.flow_id = flow->flow_id;
+      ack.counter =
+          flow->send_counter.fetch_add(1, std::memory_order_relaxed) + 1;
+      std::vector<std::uint8_t> wire;
+      if (EncodeMediaDatagram(ack, MediaDatagramDirection::kToClient,
+                              flow->key, wire)) {
+        SendTo(sock_, wire, peer, peer_len);
+      }
+      break;
+    }
+    case MediaDatagramType::kMedia:
+      if (forwarder_ && !dgram.body.empty()) {
+        forwarder_(flow->info, std::move(dgram.body));
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void MediaUdpServer::ExpireFlows(std::uint64_t now_ms) {
+  const std::uint64_t idle_ms =
+      static_cast<std::uint64_t>(std::max<std::uint32_t>(
+          options_.flow_idle_sec, 1)) *
+      1000u;
+  // Detach under flows_mutex_ so a flow reopened by OpenFlow right after
+  // this one expired never has its new sink cleared here.
+  std::lock_guard<std::mutex> lock(flows_mutex_);
+  for (auto it = flows_.begin(); it != flows_.end();) {
+    const auto& flow = it->second;
+    if (now_ms - flow->last_seen_ms <= idle_ms) {
+      ++it;
+      continue;
+    }
+    const auto by_call =
+        flow_by_call_.find(FlowKey(flow->info.username, flow->info.call_id));
+    if (by_call != flow_by_call_.end() && by_call->second == flow->flow_id) {
+      flow_by_call_.erase(by_call);
+      relay_->SetSink(flow->info.username, flow->info.call_id, nullptr);
+    }
+    it = flows_.erase(it);
+  }
+}
+
+void MediaUdpServer::Run() {
+  std::vector<std::uint8_t> recv_buf(kMediaDatagramMaxBytes + 256u);
+  std::uint64_t next_expire_ms = NowMs() + kExpireEveryMs;
+  while (running_.load()) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+#ifdef _WIN32
+    FD_SET(static_cast<SOCKET>(sock_), &readfds);
+    TIMEVAL tv{};
+    tv.tv_usec = static_cast<long>(kTickMs) * 1000;
+    select(0, &readfds, nullptr, nullptr, &tv);
+#else
+    FD_SET(static_cast<int>(sock_), &readfds);
+    timeval tv{};
+    tv.tv_usec = static_cast<long>(kTickMs) * 1000;
+    select(static_cast<int>(sock_) + 1, &readfds, nullptr, nullptr, &tv);
+#endif
+
+    while (running_.load()) {
+      sockaddr_storage peer_addr{};
+      socklen_t peer_len = sizeof(peer_addr);
+#ifdef _WIN32
+      const int n = recvfrom(static_cast<SOCKET>(sock_),
+                             reinterpret_cast<char*>(recv_buf.data()),
+                             static_cast<int>(recv_buf.size()), 0,
+                             reinterpret_cast<sockaddr*>(&peer_addr),
+                             &peer_len);
+      if (n == SOCKET_ERROR) {
+        if (WouldBlock()) {
+          break;
+        }
+        continue;
+      }
+#else
+      const ssize_t n = recvfrom(static_cast<int>(sock_), recv_buf.data(),
+                                 recv_buf.size(), 0,
+                                 reinterpret_cast<sockaddr*>(&peer_addr),
+                                 &peer_len);
+      if (n < 0) {
+        if (WouldBlock()) {
+          break;
+        }
+        continue;
+      }
+#endif
+      if (n <= 0) {
+        break;
+      }
+      HandleDatagram(recv_buf.data(), static_cast<std::size_t>(n), &peer_addr,
+                     static_cast<int>(peer_len), NowMs());
+    }
+
+    const std::uint64_t now = NowMs();
+    if (now >= next_expire_ms) {
+      ExpireFlows(now);
+      next_expire_ms = now + kExpireEveryMs;
+    }
+  }
+}
+
+}  // namespace mi::server
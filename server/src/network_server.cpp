@@ -789,6 +789,9 @@ struct NetworkServer::Connection {
   std::vector<std::uint8_t> send_buf;
   std::size_t send_off{0};
   std::vector<std::uint8_t> response_buf;
+  // Set while a large upload chunk frame is being fed to the handler as it
+  // arrives instead of accumulating in recv_buf.
+  std::unique_ptr<ConnectionHandler::UploadChunkStream> upload_stream;
 #ifdef _WIN32
   std::mutex iocp_mutex;
   std::vector<std::uint8_t> iocp_recv_tmp;
@@ -806,6 +809,29 @@ struct NetworkServer::Connection {
   std::unique_ptr<TlsState> tls;
 #endif
   bool closed{false};
+
+  TransportKind transport() const {
+#ifdef _WIN32
+    if (tls) {
+      return TransportKind::kTls;
+    }
+#endif
+    return TransportKind::kTcp;
+  }
+
+  void ConsumeRecv(std::size_t n) {
+    recv_off += n;
+    if (recv_off >= recv_buf.size()) {
+      recv_buf.clear();
+      recv_off = 0;
+    } else if (recv_off > kReactorCompactThreshold) {
+      std::vector<std::uint8_t> compact(
+          recv_buf.begin() + static_cast<std::ptrdiff_t>(recv_off),
+          recv_buf.end());
+      recv_buf.swap(compact);
+      recv_off = 0;
+    }
+  }
 };
 
 class NetworkServer::Reactor {
@@ -914,16 +940,53 @@ class NetworkServer::Reactor {
     conn->bytes_total += len;
     auto& response = conn->response_buf;
     response.clear();
-    TransportKind kind = TransportKind::kTcp;
-#ifdef _WIN32
-    if (conn->tls) {
-      kind = TransportKind::kTls;
-    }
-#endif
     if (!server_->listener_->Process(data, len, response, conn->remote_ip,
-                                     kind)) {
+                                     conn->transport())) {
+      return false;
+    }
+    return QueueResponse(conn);
+  }
+
+  // Frames that do not fit the receive buffer yet may be streamed instead.
+  bool StartUploadStream(const std::shared_ptr<Connection>& conn,
+                         FrameType type, std::uint32_t payload_len) {
+    const std::size_t total = kFrameHeaderSize + payload_len;
+    if (conn->bytes_total + total > server_->limits_.max_connection_bytes) {
+      return false;
+    }
+    conn->upload_stream = server_->listener_->BeginUploadChunkStream(
+        type, payload_len, conn->transport());
+    if (!conn->upload_stream) {
       return false;
     }
+    conn->bytes_total += total;
+    conn->ConsumeRecv(kFrameHeaderSize);
+    return true;
+  }
+
+  bool PumpUploadStream(const std::shared_ptr<Connection>& conn,
+                        std::size_t avail) {
+    auto& stream = *conn->upload_stream;
+    const std::size_t n = static_cast<std::size_t>(
+        std::min<std::uint64_t>(avail, stream.remaining()));
+    if (n > 0) {
+      if (!stream.Feed(conn->recv_buf.data() + conn->recv_off, n)) {
+        return false;
+      }
+      conn->ConsumeRecv(n);
+    }
+    if (stream.remaining() != 0) {
+      return true;
+    }
+    auto& response = conn->response_buf;
+    response.clear();
+    const bool ok = stream.Finish(response);
+    conn->upload_stream.reset();
+    return ok && QueueResponse(conn);
+  }
+
+  bool QueueResponse(const std::shared_ptr<Connection>& conn) {
+    auto& response = conn->response_buf;
     if (conn->bytes_total + response.size() >
         server_->limits_.max_connection_bytes) {
       return false;
@@ -1243,6 +1306,16 @@ class NetworkServer::Reactor {
           conn->recv_buf.size() >= conn->recv_off
               ? (conn->recv_buf.size() - conn->recv_off)
               : 0;
+      if (conn->upload_stream) {
+        if (!PumpUploadStream(conn, avail)) {
+          CloseConnection(conn);
+          return;
+        }
+        if (conn->upload_stream) {
+          break;
+        }
+        continue;
+      }
       if (avail < kFrameHeaderSize) {
         break;
       }
@@ -1255,24 +1328,16 @@ class NetworkServer::Reactor {
       }
       const std::size_t total = kFrameHeaderSize + payload_len;
       if (avail < total) {
+        if (StartUploadStream(conn, type, payload_len)) {
+          continue;
+        }
         break;
       }
       if (!HandleFrame(conn, conn->recv_buf.data() + conn->recv_off, total)) {
         CloseConnection(conn);
         return;
       }
-      conn->recv_off += total;
-      if (conn->recv_off >= conn->recv_buf.size()) {
-        conn->recv_buf.clear();
-        conn->recv_off = 0;
-      } else if (conn->recv_off > kReactorCompactThreshold) {
-        std::vector<std::uint8_t> compact(
-            conn->recv_buf.begin() +
-                static_cast<std::ptrdiff_t>(conn->recv_off),
-            conn->recv_buf.end());
-        conn->recv_buf.swap(compact);
-        conn->recv_off = 0;
-      }
+      conn->ConsumeRecv(total);
     }
   }
 
@@ -1567,16 +1632,52 @@ class NetworkServer::IocpEngine {
     conn->bytes_total += len;
     auto& response = conn->response_buf;
     response.clear();
-    TransportKind kind = TransportKind::kTcp;
-#ifdef _WIN32
-    if (conn->tls) {
-      kind = TransportKind::kTls;
-    }
-#endif
     if (!server_->listener_->Process(data, len, response, conn->remote_ip,
-                                     kind)) {
+                                     conn->transport())) {
+      return false;
+    }
+    return QueueResponseLocked(conn);
+  }
+
+  bool StartUploadStreamLocked(const std::shared_ptr<Connection>& conn,
+                               FrameType type, std::uint32_t payload_len) {
+    const std::size_t total = kFrameHeaderSize + payload_len;
+    if (conn->bytes_total + total > server_->limits_.max_connection_bytes) {
+      return false;
+    }
+    conn->upload_stream = server_->listener_->BeginUploadChunkStream(
+        type, payload_len, conn->transport());
+    if (!conn->upload_stream) {
       return false;
     }
+    conn->bytes_total += total;
+    conn->ConsumeRecv(kFrameHeaderSize);
+    return true;
+  }
+
+  bool PumpUploadStreamLocked(const std::shared_ptr<Connection>& conn,
+                              std::size_t avail) {
+    auto& stream = *conn->upload_stream;
+    const std::size_t n = static_cast<std::size_t>(
+        std::min<std::uint64_t>(avail, stream.remaining()));
+    if (n > 0) {
+      if (!stream.Feed(conn->recv_buf.data() + conn->recv_off, n)) {
+        return false;
+      }
+      conn->ConsumeRecv(n);
+    }
+    if (stream.remaining() != 0) {
+      return true;
+    }
+    auto& response = conn->response_buf;
+    response.clear();
+    const bool ok = stream.Finish(response);
+    conn->upload_stream.reset();
+    return ok && QueueResponseLocked(conn);
+  }
+
+  bool QueueResponseLocked(const std::shared_ptr<Connection>& conn) {
+    auto& response = conn->response_buf;
     if (conn->bytes_total + response.size() >
         server_->limits_.max_connection_bytes) {
       return false;
@@ -1846,6 +1947,16 @@ class NetworkServer::IocpEngine {
           conn->recv_buf.size() >= conn->recv_off
               ? (conn->recv_buf.size() - conn->recv_off)
               : 0;
+      if (conn->upload_stream) {
+        if (!PumpUploadStreamLocked(conn, avail)) {
+          CloseConnection(conn);
+          return;
+        }
+        if (conn->upload_stream) {
+          break;
+        }
+        continue;
+      }
       if (avail < kFrameHeaderSize) {
         break;
       }
@@ -1858,6 +1969,9 @@ class NetworkServer::IocpEngine {
       }
       const std::size_t total = kFrameHeaderSize + payload_len;
       if (avail < total) {
+        if (StartUploadStreamLocked(conn, type, payload_len)) {
+          continue;
+        }
         break;
       }
       if (!HandleFrameLocked(conn, conn->recv_buf.data() + conn->recv_off,
@@ -1865,18 +1979,7 @@ class NetworkServer::IocpEngine {
         CloseConnection(conn);
         return;
       }
-      conn->recv_off += total;
-      if (conn->recv_off >= conn->recv_buf.size()) {
-        conn->recv_buf.clear();
-        conn->recv_off = 0;
-      } else if (conn->recv_off > kReactorCompactThreshold) {
-        std::vector<std::uint8_t> compact(
-            conn->recv_buf.begin() +
-                static_cast<std::ptrdiff_t>(conn->recv_off),
-            conn->recv_buf.end());
-        conn->recv_buf.swap(compact);
-        conn->recv_off = 0;
-      }
+      conn->ConsumeRecv(total);
     }
   }
 
@@ -5,6 +5,7 @@
 #include <cstring>
 #include <fstream>
 #include <limits>
+#include <thread>
 
 #ifdef _WIN32
 #ifndef NOMINMAX
@@ -12,7 +13,10 @@
 #endif
 #include <windows.h>
 #else
+#include <cerrno>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #include "buffer_pool.h"
@@ -25,6 +29,9 @@ namespace {
 
 constexpr std::uint64_t kMaxBlobBytes = 320u * 1024u * 1024u;
 constexpr std::uint32_t kMaxBlobChunkBytes = 4u * 1024u * 1024u;
+constexpr std::uint64_t kBlobUploadWindowBytes = 16ull * kMaxBlobChunkBytes;
+constexpr std::size_t kMaxBlobMissingRanges = 256;
+constexpr std::uint64_t kSpillCompactMinBytes = 64u * 1024u;
 constexpr std::size_t kOfflineFileAeadNonceBytes = 24;
 constexpr std::size_t kOfflineFileAeadTagBytes = 16;
 constexpr std::size_t kOfflineFileLegacyNonceBytes = 16;
@@ -122,6 +129,53 @@ std::array<std::uint8_t, kOfflineFileAeadNonceBytes> DeriveChunkNonce(
   return nonce;
 }
 
+// Interval set of received [start, end) byte ranges, kept merged.
+void AddReceivedRange(std::map<std::uint64_t, std::uint64_t>& ranges,
+                      std::uint64_t start, std::uint64_t end) {
+  auto it = ranges.upper_bound(start);
+  if (it != ranges.begin()) {
+    auto prev = std::prev(it);
+    if (prev->second >= start) {
+      start = prev->first;
+      end = std::max(end, prev->second);
+      it = ranges.erase(prev);
+    }
+  }
+  while (it != ranges.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    it = ranges.erase(it);
+  }
+  ranges.emplace(start, end);
+}
+
+bool RangeCovered(const std::map<std::uint64_t, std::uint64_t>& ranges,
+                  std::uint64_t start, std::uint64_t end) {
+  auto it = ranges.upper_bound(start);
+  if (it == ranges.begin()) {
+    return false;
+  }
+  --it;
+  return it->first <= start && it->second >= end;
+}
+
+bool RangeOverlaps(const std::map<std::uint64_t, std::uint64_t>& ranges,
+                   std::uint64_t start, std::uint64_t end) {
+  auto it = ranges.lower_bound(end);
+  if (it == ranges.begin()) {
+    return false;
+  }
+  --it;
+  return it->second > start;
+}
+
+std::uint64_t ContiguousPrefix(
+    const std::map<std::uint64_t, std::uint64_t>& ranges) {
+  if (ranges.empty() || ranges.begin()->first != 0) {
+    return 0;
+  }
+  return ranges.begin()->second;
+}
+
 bool IsValidFileId(const std::string& file_id) {
   if (file_id.size() != 32) {
     return false;
@@ -134,6 +188,97 @@ bool IsValidFileId(const std::string& file_id) {
   return true;
 }
 
+int HexNibble(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+bool IsFanoutComponent(const std::string& name) {
+  return name.size() == 2 && HexNibble(name[0]) >= 0 &&
+         HexNibble(name[1]) >= 0;
+}
+
+bool SyncDirectory(const std::filesystem::path& dir) {
+#ifdef _WIN32
+  // NTFS journals the rename itself; MoveFileEx write-through covers it.
+  (void)dir;
+  return true;
+#else
+  const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+#endif
+}
+
+// Writes |len| bytes to a new file and, when |sync| is set, flushes them to
+// stable storage before returning.
+bool WriteFileDurable(const std::filesystem::path& path,
+                      const std::uint8_t* data, std::size_t len, bool sync) {
+#ifdef _WIN32
+  HANDLE h = CreateFileW(path.wstring().c_str(), GENERIC_WRITE, 0, nullptr,
+                         CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (h == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  DWORD wrote = 0;
+  bool ok = WriteFile(h, data, static_cast<DWORD>(len), &wrote, nullptr) &&
+            wrote == len;
+  if (ok && sync) {
+    ok = FlushFileBuffers(h) != 0;
+  }
+  CloseHandle(h);
+  return ok;
+#else
+  const int fd =
+      ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = true;
+  while (ok && len > 0) {
+    const ssize_t rc = ::write(fd, data, len);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      ok = false;
+      break;
+    }
+    data += rc;
+    len -= static_cast<std::size_t>(rc);
+  }
+  if (ok && sync) {
+    ok = ::fsync(fd) == 0;
+  }
+  ::close(fd);
+  return ok;
+#endif
+}
+
+bool RenameDurable(const std::filesystem::path& from,
+                   const std::filesystem::path& to) {
+#ifdef _WIN32
+  return MoveFileExW(from.wstring().c_str(), to.wstring().c_str(),
+                     MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+  std::error_code ec;
+  std::filesystem::rename(from, to, ec);
+  return !ec;
+#endif
+}
+
 void DeriveBlock(const std::array<std::uint8_t, 32>& key,
                  const std::array<std::uint8_t, kOfflineFileLegacyNonceBytes>& nonce,
                  std::uint64_t counter,
@@ -151,12 +296,335 @@ void DeriveBlock(const std::array<std::uint8_t, 32>& key,
 
 }  // namespace
 
+// Session handles are opened lazily and may be closed by the CLOCK sweep in
+// AcquireBlobFile whenever no request is using them; the next Acquire
+// reopens the same path.
+class OfflineStorage::BlobFile {
+ public:
+  BlobFile(std::filesystem::path path, bool writable, bool truncate,
+           std::atomic<std::size_t>* open_count)
+      : path_(std::move(path)),
+        writable_(writable),
+        truncate_(truncate),
+        open_count_(open_count) {}
+
+  ~BlobFile() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CloseLocked();
+  }
+
+  BlobFile(const BlobFile&) = delete;
+  BlobFile& operator=(const BlobFile&) = delete;
+
+  // Pins the handle open until Release(); |opened| reports a fresh open.
+  bool Acquire(bool& opened) {
+    opened = false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!IsOpenLocked()) {
+      if (!OpenLocked()) {
+        return false;
+      }
+      opened = true;
+    }
+    users_++;
+    recently_used_.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  void Release() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (users_ > 0) {
+      users_--;
+    }
+  }
+
+  bool TryClose() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (users_ != 0 || !IsOpenLocked()) {
+      return false;
+    }
+    CloseLocked();
+    return true;
+  }
+
+  bool TakeRecentlyUsed() {
+    return recently_used_.exchange(false, std::memory_order_relaxed);
+  }
+
+  // Callers must hold an Acquire() pin.
+  bool WriteAt(std::uint64_t offset, const std::uint8_t* data,
+               std::size_t len) {
+    while (len > 0) {
+#ifdef _WIN32
+      OVERLAPPED ov{};
+      ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFFu);
+      ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      const DWORD want = static_cast<DWORD>(
+          std::min<std::size_t>(len, std::numeric_limits<DWORD>::max()));
+      DWORD wrote = 0;
+      if (!WriteFile(static_cast<HANDLE>(handle_), data, want, &wrote, &ov) ||
+          wrote == 0) {
+        return false;
+      }
+      const std::size_t n = wrote;
+#else
+      const ssize_t rc =
+          ::pwrite(fd_, data, len, static_cast<off_t>(offset));
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc <= 0) {
+        return false;
+      }
+      const std::size_t n = static_cast<std::size_t>(rc);
+#endif
+      data += n;
+      len -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+  bool ReadAt(std::uint64_t offset, std::uint8_t* data, std::size_t len) {
+    while (len > 0) {
+#ifdef _WIN32
+      OVERLAPPED ov{};
+      ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFFu);
+      ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      const DWORD want = static_cast<DWORD>(
+          std::min<std::size_t>(len, std::numeric_limits<DWORD>::max()));
+      DWORD got = 0;
+      if (!ReadFile(static_cast<HANDLE>(handle_), data, want, &got, &ov) ||
+          got == 0) {
+        return false;
+      }
+      const std::size_t n = got;
+#else
+      const ssize_t rc = ::pread(fd_, data, len, static_cast<off_t>(offset));
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc <= 0) {
+        return false;
+      }
+      const std::size_t n = static_cast<std::size_t>(rc);
+#endif
+      data += n;
+      len -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+ private:
+  bool IsOpenLocked() const {
+#ifdef _WIN32
+    return handle_ != nullptr;
+#else
+    return fd_ >= 0;
+#endif
+  }
+
+  bool OpenLocked() {
+#ifdef _WIN32
+    const DWORD access =
+        writable_ ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+    const DWORD disposition =
+        writable_ ? (truncate_ ? CREATE_ALWAYS : OPEN_ALWAYS) : OPEN_EXISTING;
+    handle_ = CreateFileW(path_.wstring().c_str(), access,
+                          FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                          disposition,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                          nullptr);
+    if (handle_ == INVALID_HANDLE_VALUE) {
+      handle_ = nullptr;
+    }
+#else
+    int flags = O_CLOEXEC;
+    if (writable_) {
+      flags |= O_RDWR | O_CREAT;
+      if (truncate_) {
+        flags |= O_TRUNC;
+      }
+    } else {
+      flags |= O_RDONLY;
+    }
+    fd_ = ::open(path_.c_str(), flags, 0600);
+#if defined(POSIX_FADV_SEQUENTIAL)
+    if (fd_ >= 0) {
+      (void)::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+#endif
+    if (!IsOpenLocked()) {
+      return false;
+    }
+    // Only the first open may truncate; reopens must keep written chunks.
+    truncate_ = false;
+    if (open_count_) {
+      open_count_->fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  void CloseLocked() {
+    if (!IsOpenLocked()) {
+      return;
+    }
+#ifdef _WIN32
+    CloseHandle(static_cast<HANDLE>(handle_));
+    handle_ = nullptr;
+#else
+    ::close(fd_);
+    fd_ = -1;
+#endif
+    if (open_count_) {
+      open_count_->fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  const std::filesystem::path path_;
+  const bool writable_;
+  bool truncate_;
+  std::atomic<std::size_t>* open_count_{nullptr};
+  std::mutex mutex_;
+  std::uint32_t users_{0};
+  std::atomic<bool> recently_used_{false};
+#ifdef _WIN32
+  void* handle_{nullptr};
+#else
+  int fd_{-1};
+#endif
+};
+
+// Group commit for directory fsyncs: whoever finds no sync running for a
+// directory performs one and every writer that arrived before it started is
+// covered; writers arriving during it wait for the next one.
+class OfflineStorage::DirSyncBatcher {
+ public:
+  explicit DirSyncBatcher(KeySyncPolicy policy) : policy_(policy) {}
+
+  bool SyncFiles() const { return policy_ != KeySyncPolicy::kNone; }
+
+  bool Sync(const std::filesystem::path& dir) {
+    if (policy_ == KeySyncPolicy::kNone) {
+      return true;
+    }
+    if (policy_ == KeySyncPolicy::kImmediate) {
+      return SyncDirectory(dir);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto& state = dirs_[dir.string()];
+    const std::uint64_t ticket = ++state.requested;
+    while (state.synced < ticket) {
+      if (state.syncing) {
+        cv_.wait(lock);
+        continue;
+      }
+      state.syncing = true;
+      const std::uint64_t upto = state.requested;
+      lock.unlock();
+      const bool ok = SyncDirectory(dir);
+      lock.lock();
+      state.syncing = false;
+      state.synced = upto;
+      state.ok = ok;
+      cv_.notify_all();
+    }
+    return state.ok;
+  }
+
+ private:
+  struct DirState {
+    std::uint64_t requested{0};
+    std::uint64_t synced{0};
+    bool syncing{false};
+    bool ok{true};
+  };
+
+  const KeySyncPolicy policy_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<std::string, DirState> dirs_;
+};
+
+std::shared_ptr<OfflineStorage::BlobFile> OfflineStorage::NewBlobFile(
+    const std::filesystem::path& path, bool writable, bool truncate) {
+  return std::make_shared<BlobFile>(path, writable, truncate,
+                                    &open_blob_files_);
+}
+
+bool OfflineStorage::AcquireBlobFile(const std::shared_ptr<BlobFile>& file) {
+  bool opened = false;
+  if (!file || !file->Acquire(opened)) {
+    return false;
+  }
+  if (!opened || max_open_blob_files_ == 0) {
+    return true;
+  }
+  // CLOCK over the handles opened so far: recently used files get a second
+  // chance, idle ones are closed until we are back under the cap.  Only
+  // blob_file_mutex_ is held; shard locks are never taken here.
+  std::vector<std::shared_ptr<BlobFile>> visited;
+  {
+    std::lock_guard<std::mutex> lock(blob_file_mutex_);
+    blob_file_ring_.push_front(file);
+    std::size_t budget = blob_file_ring_.size() * 2;
+    while (open_blob_files_.load(std::memory_order_relaxed) >
+               max_open_blob_files_ &&
+           budget-- > 0 && !blob_file_ring_.empty()) {
+      auto it = std::prev(blob_file_ring_.end());
+      auto victim = it->lock();
+      if (!victim) {
+        blob_file_ring_.erase(it);
+        continue;
+      }
+      if (victim == file || victim->TakeRecentlyUsed()) {
+        blob_file_ring_.splice(blob_file_ring_.begin(), blob_file_ring_, it);
+      } else if (victim->TryClose()) {
+        blob_file_ring_.erase(it);
+      } else {
+        blob_file_ring_.splice(blob_file_ring_.begin(), blob_file_ring_, it);
+      }
+      visited.push_back(std::move(victim));
+    }
+    if (blob_file_ring_.size() > max_open_blob_files_ * 2) {
+      blob_file_ring_.remove_if(
+          [](const std::weak_ptr<BlobFile>& w) { return w.expired(); });
+    }
+  }
+  // Sessions may have ended meanwhile; drop the last references unlocked.
+  visited.clear();
+  return true;
+}
+
+OfflineStorage::MetaShard& OfflineStorage::ShardFor(
+    const std::string& file_id) {
+  return shards_[std::hash<std::string>{}(file_id) % kMetaShardCount];
+}
+
+const OfflineStorage::MetaShard& OfflineStorage::ShardFor(
+    const std::string& file_id) const {
+  return shards_[std::hash<std::string>{}(file_id) % kMetaShardCount];
+}
+
+void OfflineStorage::InsertMetaLocked(MetaShard& shard,
+                                      const StoredFileMeta& meta) {
+  shard.metadata[meta.id] = meta;
+  shard.expiries.push(MetaExpiry{meta.created_at + ttl_, meta.id});
+}
+
 OfflineStorage::OfflineStorage(std::filesystem::path base_dir,
                                std::chrono::seconds ttl,
-                               SecureDeleteConfig secure_delete)
+                               SecureDeleteConfig secure_delete,
+                               std::size_t max_open_blob_files,
+                               KeySyncPolicy key_sync)
     : base_dir_(std::move(base_dir)),
       ttl_(ttl),
-      secure_delete_(std::move(secure_delete)) {
+      secure_delete_(std::move(secure_delete)),
+      max_open_blob_files_(max_open_blob_files),
+      dir_sync_(std::make_unique<DirSyncBatcher>(key_sync)),
+      fanout_ready_(new std::atomic<bool>[1u << 16]()) {
   std::error_code ec;
   std::filesystem::create_directories(base_dir_, ec);
   if (secure_delete_.enabled) {
@@ -169,9 +637,40 @@ OfflineStorage::OfflineStorage(std::filesystem::path base_dir,
       secure_delete_ready_ = true;
     }
   }
+  if (secure_delete_.workers > 0) {
+    pending_wipe_dir_ = base_dir_ / "pending_wipe";
+    std::filesystem::create_directories(pending_wipe_dir_, ec);
+    if (ec) {
+      pending_wipe_dir_.clear();
+    }
+  }
+  ResumePendingWipes();
+  RebuildFromDisk();
+  if (!pending_wipe_dir_.empty()) {
+    for (std::uint32_t i = 0; i < secure_delete_.workers; ++i) {
+      wipe_workers_.emplace_back([this] { WipeWorkerLoop(); });
+    }
+  }
 }
 
 OfflineStorage::~OfflineStorage() {
+  migration_stop_.store(true);
+  if (migration_thread_.joinable()) {
+    migration_thread_.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(wipe_mutex_);
+    wipe_stop_ = true;
+  }
+  wipe_cv_.notify_all();
+  // Anything still queued stays in pending_wipe/ and is resumed next start.
+  for (auto& t : wipe_workers_) {
+    t.join();
+  }
+  for (auto& shard : shards_) {
+    shard.uploads.clear();
+    shard.downloads.clear();
+  }
   if (secure_delete_handle_) {
 #ifdef _WIN32
     FreeLibrary(static_cast<HMODULE>(secure_delete_handle_));
@@ -183,10 +682,217 @@ OfflineStorage::~OfflineStorage() {
   secure_delete_fn_ = nullptr;
 }
 
+void OfflineStorage::RebuildFromDisk() {
+  // One work item for the flat base directory (stores written before the
+  // fan-out) plus one per top-level fan-out directory.
+  std::vector<std::filesystem::path> roots;
+  roots.push_back(base_dir_);
+  std::error_code ec;
+  for (const auto& entry :
+       std::filesystem::directory_iterator(base_dir_, ec)) {
+    std::error_code type_ec;
+    if (entry.is_directory(type_ec) && !type_ec &&
+        IsFanoutComponent(entry.path().filename().string())) {
+      roots.push_back(entry.path());
+    }
+  }
+
+  struct Scan {
+    std::vector<StoredFileMeta> files;
+    std::vector<std::filesystem::path> wipe;
+    std::vector<std::filesystem::path> remove;
+    std::vector<std::string> legacy;
+  };
+  const auto steady_now = std::chrono::steady_clock::now();
+  const auto file_now = std::filesystem::file_time_type::clock::now();
+  const auto classify = [&](const std::filesystem::path& path, bool legacy,
+                            Scan& out) {
+    const std::string name = path.filename().string();
+    const auto dot = name.find('.');
+    if (dot == std::string::npos || !IsValidFileId(name.substr(0, dot))) {
+      return;
+    }
+    const std::string id = name.substr(0, dot);
+    const std::string suffix = name.substr(dot);
+    std::error_code fec;
+    if (suffix == ".bin") {
+      const std::uint64_t size = std::filesystem::file_size(path, fec);
+      if (fec) {
+        return;
+      }
+      const auto mtime = std::filesystem::last_write_time(path, fec);
+      auto age = std::chrono::steady_clock::duration::zero();
+      if (!fec && mtime < file_now) {
+        age = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            file_now - mtime);
+      }
+      StoredFileMeta meta;
+      meta.id = id;
+      meta.size = size;
+      meta.created_at = steady_now - age;
+      out.files.push_back(std::move(meta));
+      if (legacy) {
+        out.legacy.push_back(id);
+      }
+    } else if (suffix == ".part") {
+      // Upload sessions do not survive a restart.
+      out.wipe.push_back(path);
+    } else if (suffix == ".key") {
+      // A migration interrupted between the key and the data rename leaves
+      // them in different layouts.
+      if (!std::filesystem::exists(ResolvePath(id), fec) &&
+          !std::filesystem::exists(LegacyPath(id, ".bin"), fec)) {
+        out.wipe.push_back(path);
+      } else if (legacy) {
+        out.legacy.push_back(id);
+      }
+    } else if (suffix == ".key.tmp") {
+      out.remove.push_back(path);
+    }
+  };
+  const auto scan_root = [&](std::size_t index, Scan& out) {
+    std::error_code dec;
+    if (index == 0) {
+      for (const auto& entry :
+           std::filesystem::directory_iterator(roots[0], dec)) {
+        std::error_code type_ec;
+        if (entry.is_regular_file(type_ec) && !type_ec) {
+          classify(entry.path(), true, out);
+        }
+      }
+      return;
+    }
+    for (const auto& sub :
+         std::filesystem::directory_iterator(roots[index], dec)) {
+      std::error_code type_ec;
+      if (!sub.is_directory(type_ec) || type_ec ||
+          !IsFanoutComponent(sub.path().filename().string())) {
+        continue;
+      }
+      std::error_code fec;
+      for (const auto& entry :
+           std::filesystem::directory_iterator(sub.path(), fec)) {
+        std::error_code file_ec;
+        if (entry.is_regular_file(file_ec) && !file_ec) {
+          classify(entry.path(), false, out);
+        }
+      }
+    }
+  };
+
+  std::size_t workers = std::thread::hardware_concurrency();
+  workers = std::max<std::size_t>(1, std::min<std::size_t>(workers, 8));
+  workers = std::min(workers, roots.size());
+  std::vector<Scan> scans(workers);
+  std::atomic<std::size_t> next{0};
+  const auto run = [&](std::size_t w) {
+    for (;;) {
+      const std::size_t index = next.fetch_add(1);
+      if (index >= roots.size()) {
+        return;
+      }
+      scan_root(index, scans[w]);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (std::size_t w = 1; w < workers; ++w) {
+    threads.emplace_back(run, w);
+  }
+  run(0);
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  std::vector<std::string> legacy;
+  for (auto& scan : scans) {
+    legacy.insert(legacy.end(), scan.legacy.begin(), scan.legacy.end());
+  }
+  std::sort(legacy.begin(), legacy.end());
+  legacy.erase(std::unique(legacy.begin(), legacy.end()), legacy.end());
+  if (!legacy.empty()) {
+    migration_pending_.store(true, std::memory_order_release);
+  }
+
+  for (auto& scan : scans) {
+    for (const auto& meta : scan.files) {
+      auto& shard = ShardFor(meta.id);
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      InsertMetaLocked(shard, meta);
+    }
+    for (const auto& path : scan.wipe) {
+      QueueWipe(path);
+    }
+    for (const auto& path : scan.remove) {
+      std::filesystem::remove(path, ec);
+    }
+  }
+
+  if (!legacy.empty()) {
+    migration_thread_ = std::thread(&OfflineStorage::MigrateLegacyLayout,
+                                    this, std::move(legacy));
+  }
+}
+
+void OfflineStorage::MigrateLegacyLayout(std::vector<std::string> ids) {
+  std::vector<std::string> deferred;
+  while (!ids.empty()) {
+    for (const auto& id : ids) {
+      if (migration_stop_.load()) {
+        return;  // the rest stays flat and is picked up on the next start
+      }
+      auto& shard = ShardFor(id);
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      // Download sessions keep the path they were opened with.
+      const bool busy = std::any_of(
+          shard.downloads.begin(), shard.downloads.end(),
+          [&](const auto& kv) { return kv.second.file_id == id; });
+      if (busy) {
+        deferred.push_back(id);
+        continue;
+      }
+      if (!EnsureFanoutDir(id)) {
+        continue;
+      }
+      // Key first: readers still holding the flat data path find the key
+      // through LocateKeyForData.
+      std::error_code ec;
+      const auto legacy_key = LegacyPath(id, ".key");
+      if (std::filesystem::exists(legacy_key, ec)) {
+        std::filesystem::rename(legacy_key, ResolveKeyPath(id), ec);
+      }
+      const auto legacy_bin = LegacyPath(id, ".bin");
+      if (std::filesystem::exists(legacy_bin, ec)) {
+        std::filesystem::rename(legacy_bin, ResolvePath(id), ec);
+      }
+    }
+    ids.swap(deferred);
+    deferred.clear();
+    if (!ids.empty()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+  migration_pending_.store(false, std::memory_order_release);
+}
+
 PutResult OfflineStorage::Put(const std::string& owner,
                               const std::vector<std::uint8_t>& plaintext) {
+  std::size_t pos = 0;
+  return PutStream(owner, static_cast<std::uint64_t>(plaintext.size()),
+                   [&](std::uint8_t* out, std::size_t len) {
+                     if (len > plaintext.size() - pos) {
+                       return false;
+                     }
+                     std::memcpy(out, plaintext.data() + pos, len);
+                     pos += len;
+                     return true;
+                   });
+}
+
+PutResult OfflineStorage::PutStream(const std::string& owner,
+                                    std::uint64_t size,
+                                    const OfflineChunkReader& read) {
   PutResult result;
-  if (plaintext.empty()) {
+  if (size == 0 || !read) {
     result.error = "empty payload";
     return result;
   }
@@ -198,8 +904,7 @@ PutResult OfflineStorage::Put(const std::string& owner,
       DeriveStorageKey(file_key, erase_key);
   const auto base_nonce = RandomAeadNonce();
   const std::uint32_t chunk_bytes = kOfflineFileStreamChunkBytes;
-  const std::uint64_t plain_size =
-      static_cast<std::uint64_t>(plaintext.size());
+  const std::uint64_t plain_size = size;
   std::array<std::uint8_t, kOfflineFileV3PrefixBytes> ad_prefix{};
   std::memcpy(ad_prefix.data(), kOfflineFileMagic.data(),
               kOfflineFileMagic.size());
@@ -210,7 +915,10 @@ PutResult OfflineStorage::Put(const std::string& owner,
                 ad_prefix.data() + kOfflineFileMagic.size() + 1 + 4);
 
   const auto path = ResolvePath(id);
-  std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+  std::ofstream ofs;
+  if (EnsureFanoutDir(id)) {
+    ofs.open(path, std::ios::binary | std::ios::trunc);
+  }
   if (!ofs) {
     result.error = "open file failed";
     crypto_wipe(storage_key.data(), storage_key.size());
@@ -231,7 +939,9 @@ PutResult OfflineStorage::Put(const std::string& owner,
   std::array<std::uint8_t, kOfflineFileV3AdBytes> ad{};
   std::memcpy(ad.data(), ad_prefix.data(), ad_prefix.size());
   auto& pool = OfflineStorageBufferPool();
+  mi::shard::ScopedBuffer plain_buf(pool, chunk_bytes, true);
   mi::shard::ScopedBuffer cipher_buf(pool, chunk_bytes, false);
+  auto& plain = plain_buf.get();
   auto& cipher = cipher_buf.get();
   std::array<std::uint8_t, kOfflineFileAeadTagBytes> tag{};
   std::uint64_t offset = 0;
@@ -239,19 +949,22 @@ PutResult OfflineStorage::Put(const std::string& owner,
   while (offset < plain_size) {
     const std::size_t to_copy = static_cast<std::size_t>(
         std::min<std::uint64_t>(plain_size - offset, chunk_bytes));
+    plain.resize(to_copy);
     cipher.resize(to_copy);
-    WriteUint64Le(chunk_index, ad.data() + kOfflineFileV3PrefixBytes);
-    const auto nonce = DeriveChunkNonce(base_nonce, chunk_index);
-    crypto_aead_lock(cipher.data(), tag.data(), storage_key.data(),
-                     nonce.data(), ad.data(), ad.size(),
-                     plaintext.data() + static_cast<std::size_t>(offset),
-                     to_copy);
-    ofs.write(reinterpret_cast<const char*>(cipher.data()),
-              static_cast<std::streamsize>(cipher.size()));
-    ofs.write(reinterpret_cast<const char*>(tag.data()),
-              static_cast<std::streamsize>(tag.size()));
-    if (!ofs) {
-      result.error = "write file failed";
+    const bool got = read(plain.data(), to_copy);
+    if (got) {
+      WriteUint64Le(chunk_index, ad.data() + kOfflineFileV3PrefixBytes);
+      const auto nonce = DeriveChunkNonce(base_nonce, chunk_index);
+      crypto_aead_lock(cipher.data(), tag.data(), storage_key.data(),
+                       nonce.data(), ad.data(), ad.size(), plain.data(),
+                       to_copy);
+      ofs.write(reinterpret_cast<const char*>(cipher.data()),
+                static_cast<std::streamsize>(cipher.size()));
+      ofs.write(reinterpret_cast<const char*>(tag.data()),
+                static_cast<std::streamsize>(tag.size()));
+    }
+    if (!got || !ofs) {
+      result.error = got ? "write file failed" : "read payload failed";
       crypto_wipe(storage_key.data(), storage_key.size());
       crypto_wipe(erase_key.data(), erase_key.size());
       crypto_wipe(file_key.data(), file_key.size());
@@ -286,12 +999,13 @@ PutResult OfflineStorage::Put(const std::string& owner,
   StoredFileMeta meta;
   meta.id = id;
   meta.owner = owner;
-  meta.size = static_cast<std::uint64_t>(plaintext.size());
+  meta.size = plain_size;
   meta.created_at = std::chrono::steady_clock::now();
 
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    metadata_[id] = meta;
+    auto& shard = ShardFor(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    InsertMetaLocked(shard, meta);
   }
 
   result.success = true;
@@ -304,32 +1018,78 @@ PutResult OfflineStorage::Put(const std::string& owner,
 
 PutBlobResult OfflineStorage::PutBlob(const std::string& owner,
                                       const std::vector<std::uint8_t>& blob) {
+  std::size_t pos = 0;
+  return PutBlobStream(owner, static_cast<std::uint64_t>(blob.size()),
+                       [&](std::uint8_t* out, std::size_t len) {
+                         if (len > blob.size() - pos) {
+                           return false;
+                         }
+                         std::memcpy(out, blob.data() + pos, len);
+                         pos += len;
+                         return true;
+                       });
+}
+
+PutBlobResult OfflineStorage::PutBlobStream(const std::string& owner,
+                                            std::uint64_t size,
+                                            const OfflineChunkReader& read) {
   PutBlobResult result;
-  if (blob.empty()) {
+  if (size == 0 || !read) {
     result.error = "empty payload";
     return result;
   }
 
   const std::string id = GenerateId();
   const auto path = ResolvePath(id);
-  std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+  std::ofstream ofs;
+  if (EnsureFanoutDir(id)) {
+    ofs.open(path, std::ios::binary | std::ios::trunc);
+  }
   if (!ofs) {
     result.error = "open file failed";
     return result;
   }
-  ofs.write(reinterpret_cast<const char*>(blob.data()),
-            static_cast<std::streamsize>(blob.size()));
+  mi::shard::ScopedBuffer chunk_buf(OfflineStorageBufferPool(),
+                                    kOfflineFileStreamChunkBytes, false);
+  auto& chunk = chunk_buf.get();
+  std::uint64_t offset = 0;
+  while (offset < size) {
+    const std::size_t len = static_cast<std::size_t>(
+        std::min<std::uint64_t>(size - offset, kOfflineFileStreamChunkBytes));
+    chunk.resize(len);
+    if (!read(chunk.data(), len)) {
+      result.error = "read payload failed";
+      ofs.close();
+      WipeFile(path);
+      return result;
+    }
+    ofs.write(reinterpret_cast<const char*>(chunk.data()),
+              static_cast<std::streamsize>(len));
+    if (!ofs) {
+      result.error = "write file failed";
+      ofs.close();
+      WipeFile(path);
+      return result;
+    }
+    offset += len;
+  }
   ofs.close();
+  if (!ofs.good()) {
+    result.error = "write file failed";
+    WipeFile(path);
+    return result;
+  }
 
   StoredFileMeta meta;
   meta.id = id;
   meta.owner = owner;
-  meta.size = static_cast<std::uint64_t>(blob.size());
+  meta.size = size;
   meta.created_at = std::chrono::steady_clock::now();
 
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    metadata_[id] = meta;
+    auto& shard = ShardFor(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    InsertMetaLocked(shard, meta);
   }
 
   result.success = true;
@@ -345,52 +1105,239 @@ BlobUploadStartResult OfflineStorage::BeginBlobUpload(const std::string& owner,
     result.error = "owner empty";
     return result;
   }
-  if (expected_size > 0 && expected_size > kMaxBlobBytes) {
-    result.error = "payload too large";
+  if (expected_size > 0 && expected_size > kMaxBlobBytes) {
+    result.error = "payload too large";
+    return result;
+  }
+
+  const std::string file_id = GenerateId();
+  const std::string upload_id = GenerateSessionId();
+  const auto temp_path = ResolveUploadTempPath(file_id);
+  if (!EnsureFanoutDir(file_id)) {
+    result.error = "open file failed";
+    return result;
+  }
+
+  BlobUploadSession sess;
+  sess.upload_id = upload_id;
+  sess.owner = owner;
+  sess.expected_size = expected_size;
+  sess.bytes_received = 0;
+  sess.temp_path = temp_path;
+  sess.created_at = std::chrono::steady_clock::now();
+  sess.last_activity = sess.created_at;
+
+  {
+    auto& shard = ShardFor(file_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.metadata.find(file_id) != shard.metadata.end() ||
+        shard.uploads.find(file_id) != shard.uploads.end()) {
+      result.error = "id collision";
+      return result;
+    }
+    sess.file = NewBlobFile(temp_path, true, true);
+    if (!AcquireBlobFile(sess.file)) {
+      result.error = "open file failed";
+      return result;
+    }
+    sess.file->Release();
+    shard.uploads[file_id] = std::move(sess);
+  }
+
+  result.success = true;
+  result.file_id = file_id;
+  result.upload_id = upload_id;
+  return result;
+}
+
+BlobUploadChunkResult OfflineStorage::AppendBlobUploadChunk(
+    const std::string& owner, const std::string& file_id,
+    const std::string& upload_id, std::uint64_t offset,
+    const std::vector<std::uint8_t>& chunk) {
+  return AppendBlobUploadChunk(owner, file_id, upload_id, offset, chunk.data(),
+                               chunk.size());
+}
+
+BlobUploadChunkResult OfflineStorage::AppendBlobUploadChunk(
+    const std::string& owner, const std::string& file_id,
+    const std::string& upload_id, std::uint64_t offset,
+    const std::uint8_t* chunk, std::size_t len) {
+  BlobChunkStream stream;
+  auto result =
+      BeginBlobUploadChunk(owner, file_id, upload_id, offset, len, stream);
+  if (!result.success || !stream.open()) {
+    return result;
+  }
+  WriteBlobUploadChunk(stream, chunk, len);
+  return EndBlobUploadChunk(stream, true);
+}
+
+BlobUploadChunkResult OfflineStorage::BeginBlobUploadChunk(
+    const std::string& owner, const std::string& file_id,
+    const std::string& upload_id, std::uint64_t offset, std::uint64_t size,
+    BlobChunkStream& stream) {
+  BlobUploadChunkResult result;
+  if (owner.empty()) {
+    result.error = "owner empty";
+    return result;
+  }
+  if (file_id.empty() || upload_id.empty()) {
+    result.error = "invalid session";
+    return result;
+  }
+  if (size == 0) {
+    result.error = "empty payload";
+    return result;
+  }
+  if (size > kMaxBlobChunkBytes) {
+    result.error = "chunk too large";
+    return result;
+  }
+
+  if (offset > kMaxBlobBytes || size > kMaxBlobBytes - offset) {
+    result.error = "payload too large";
+    return result;
+  }
+  const std::uint64_t end = offset + size;
+  auto& shard = ShardFor(file_id);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  const auto it = shard.uploads.find(file_id);
+  if (it == shard.uploads.end()) {
+    result.error = "upload session not found";
+    return result;
+  }
+  auto& sess = it->second;
+  if (sess.upload_id != upload_id || sess.owner != owner) {
+    result.error = "unauthorized";
+    return result;
+  }
+  if (end > kMaxBlobBytes ||
+      (sess.expected_size > 0 && end > sess.expected_size)) {
+    result.error = "payload too large";
+    return result;
+  }
+  if (end > sess.bytes_received + kBlobUploadWindowBytes) {
+    result.error = "invalid offset";
+    return result;
+  }
+  if (RangeCovered(sess.received, offset, end)) {
+    // Retransmission of a chunk that already landed; its bytes are dropped.
+    sess.last_activity = std::chrono::steady_clock::now();
+    stream.file_id_ = file_id;
+    stream.size_ = size;
+    stream.duplicate_ = true;
+    result.success = true;
+    result.bytes_received = sess.bytes_received;
+    return result;
+  }
+  if (RangeOverlaps(sess.received, offset, end) ||
+      RangeOverlaps(sess.writing, offset, end)) {
+    result.error = "invalid offset";
+    return result;
+  }
+  sess.writing.emplace(offset, end);
+  sess.inflight++;
+  stream.file_id_ = file_id;
+  stream.offset_ = offset;
+  stream.size_ = size;
+  stream.written_ = 0;
+  stream.file_ = sess.file;
+  stream.duplicate_ = false;
+  stream.failed_ = false;
+  stream.open_ = true;
+  result.success = true;
+  result.bytes_received = sess.bytes_received;
+  return result;
+}
+
+bool OfflineStorage::WriteBlobUploadChunk(BlobChunkStream& stream,
+                                          const std::uint8_t* data,
+                                          std::size_t len) {
+  if (stream.duplicate_) {
+    return true;
+  }
+  if (!stream.open_ || stream.failed_ || len > stream.remaining()) {
+    stream.failed_ = true;
+    return false;
+  }
+  if (len == 0) {
+    return true;
+  }
+  bool wrote = false;
+  if (data && AcquireBlobFile(stream.file_)) {
+    wrote = stream.file_->WriteAt(stream.offset_ + stream.written_, data, len);
+    stream.file_->Release();
+  }
+  if (!wrote) {
+    stream.failed_ = true;
+    return false;
+  }
+  stream.written_ += len;
+  return true;
+}
+
+BlobUploadChunkResult OfflineStorage::EndBlobUploadChunk(
+    BlobChunkStream& stream, bool commit) {
+  BlobUploadChunkResult result;
+  auto& shard = ShardFor(stream.file_id_);
+  const bool was_open = stream.open_;
+  if (was_open && !commit && stream.written_ > 0) {
+    // An uncommitted chunk may hold unauthenticated bytes; they are zeroed
+    // while the range is still reserved.
+    static const std::array<std::uint8_t, 64u * 1024u> kZeros{};
+    if (AcquireBlobFile(stream.file_)) {
+      for (std::uint64_t pos = 0; pos < stream.written_;) {
+        const std::size_t len = static_cast<std::size_t>(
+            std::min<std::uint64_t>(stream.written_ - pos, kZeros.size()));
+        if (!stream.file_->WriteAt(stream.offset_ + pos, kZeros.data(), len)) {
+          break;
+        }
+        pos += len;
+      }
+      stream.file_->Release();
+    }
+  }
+  stream.open_ = false;
+  stream.file_.reset();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.uploads.find(stream.file_id_);
+  if (it == shard.uploads.end()) {
+    result.error = "upload session not found";
+    return result;
+  }
+  auto& sess = it->second;
+  if (stream.duplicate_) {
+    result.success = true;
+    result.bytes_received = sess.bytes_received;
     return result;
   }
-
-  const std::string file_id = GenerateId();
-  const std::string upload_id = GenerateSessionId();
-  const auto temp_path = ResolveUploadTempPath(file_id);
-
-  std::ofstream ofs(temp_path, std::ios::binary | std::ios::trunc);
-  if (!ofs) {
-    result.error = "open file failed";
+  if (!was_open) {
+    result.error = "invalid session";
     return result;
   }
-  ofs.close();
-
-  BlobUploadSession sess;
-  sess.upload_id = upload_id;
-  sess.owner = owner;
-  sess.expected_size = expected_size;
-  sess.bytes_received = 0;
-  sess.temp_path = temp_path;
-  sess.created_at = std::chrono::steady_clock::now();
-  sess.last_activity = sess.created_at;
-
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (metadata_.find(file_id) != metadata_.end() ||
-        blob_uploads_.find(file_id) != blob_uploads_.end()) {
-      result.error = "id collision";
-      return result;
-    }
-    blob_uploads_[file_id] = std::move(sess);
+  sess.inflight--;
+  sess.writing.erase(stream.offset_);
+  sess.last_activity = std::chrono::steady_clock::now();
+  if (!commit) {
+    result.error = "chunk discarded";
+    return result;
   }
-
+  if (stream.failed_ || stream.written_ != stream.size_) {
+    result.error = "write failed";
+    return result;
+  }
+  AddReceivedRange(sess.received, stream.offset_,
+                   stream.offset_ + stream.size_);
+  sess.bytes_received = ContiguousPrefix(sess.received);
   result.success = true;
-  result.file_id = file_id;
-  result.upload_id = upload_id;
+  result.bytes_received = sess.bytes_received;
   return result;
 }
 
-BlobUploadChunkResult OfflineStorage::AppendBlobUploadChunk(
+BlobUploadStatusResult OfflineStorage::QueryBlobUpload(
     const std::string& owner, const std::string& file_id,
-    const std::string& upload_id, std::uint64_t offset,
-    const std::vector<std::uint8_t>& chunk) {
-  BlobUploadChunkResult result;
+    const std::string& upload_id) {
+  BlobUploadStatusResult result;
   if (owner.empty()) {
     result.error = "owner empty";
     return result;
@@ -399,80 +1346,40 @@ BlobUploadChunkResult OfflineStorage::AppendBlobUploadChunk(
     result.error = "invalid session";
     return result;
   }
-  if (chunk.empty()) {
-    result.error = "empty payload";
-    return result;
-  }
-  if (chunk.size() > kMaxBlobChunkBytes) {
-    result.error = "chunk too large";
-    return result;
-  }
-
-  std::filesystem::path temp_path;
-  std::uint64_t expected = 0;
-  std::uint64_t received = 0;
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    const auto it = blob_uploads_.find(file_id);
-    if (it == blob_uploads_.end()) {
-      result.error = "upload session not found";
-      return result;
-    }
-    if (it->second.upload_id != upload_id || it->second.owner != owner) {
-      result.error = "unauthorized";
-      return result;
-    }
-    if (offset != it->second.bytes_received) {
-      result.error = "invalid offset";
-      return result;
-    }
-    if (it->second.expected_size > 0) {
-      expected = it->second.expected_size;
-    }
-    if (it->second.bytes_received + chunk.size() > kMaxBlobBytes) {
-      result.error = "payload too large";
-      return result;
-    }
-    if (expected > 0 &&
-        it->second.bytes_received + chunk.size() > expected) {
-      result.error = "payload too large";
-      return result;
-    }
-    temp_path = it->second.temp_path;
-    received = it->second.bytes_received;
-  }
 
-  std::ofstream ofs(temp_path, std::ios::binary | std::ios::app);
-  if (!ofs) {
-    result.error = "open file failed";
+  const auto& shard = ShardFor(file_id);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  const auto it = shard.uploads.find(file_id);
+  if (it == shard.uploads.end()) {
+    result.error = "upload session not found";
     return result;
   }
-  ofs.write(reinterpret_cast<const char*>(chunk.data()),
-            static_cast<std::streamsize>(chunk.size()));
-  ofs.close();
-  if (!ofs.good()) {
-    result.error = "write failed";
+  const auto& sess = it->second;
+  if (sess.upload_id != upload_id || sess.owner != owner) {
+    result.error = "unauthorized";
     return result;
   }
-
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = blob_uploads_.find(file_id);
-    if (it == blob_uploads_.end()) {
-      result.error = "upload session not found";
-      return result;
+  std::uint64_t limit = sess.expected_size;
+  if (limit == 0 && !sess.received.empty()) {
+    limit = sess.received.rbegin()->second;
+  }
+  std::uint64_t cursor = 0;
+  for (const auto& range : sess.received) {
+    if (result.missing.size() >= kMaxBlobMissingRanges || cursor >= limit) {
+      break;
     }
-    if (it->second.upload_id != upload_id || it->second.owner != owner) {
-      result.error = "unauthorized";
-      return result;
+    if (range.first > cursor) {
+      result.missing.emplace_back(cursor,
+                                  std::min(range.first, limit) - cursor);
     }
-    it->second.bytes_received += static_cast<std::uint64_t>(chunk.size());
-    it->second.last_activity = std::chrono::steady_clock::now();
-    received = it->second.bytes_received;
+    cursor = std::max(cursor, range.second);
+  }
+  if (cursor < limit && result.missing.size() < kMaxBlobMissingRanges) {
+    result.missing.emplace_back(cursor, limit - cursor);
   }
-
   result.success = true;
-  result.bytes_received = received;
+  result.bytes_received = sess.bytes_received;
+  result.expected_size = sess.expected_size;
   return result;
 }
 
@@ -493,11 +1400,12 @@ BlobUploadFinishResult OfflineStorage::FinishBlobUpload(
     return result;
   }
 
+  auto& shard = ShardFor(file_id);
   BlobUploadSession sess;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    const auto it = blob_uploads_.find(file_id);
-    if (it == blob_uploads_.end()) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.uploads.find(file_id);
+    if (it == shard.uploads.end()) {
       result.error = "upload session not found";
       return result;
     }
@@ -505,18 +1413,30 @@ BlobUploadFinishResult OfflineStorage::FinishBlobUpload(
       result.error = "unauthorized";
       return result;
     }
-    if (it->second.bytes_received != total_size) {
+    if (it->second.inflight != 0) {
+      result.error = "upload busy";
+      return result;
+    }
+    // Out-of-order chunks are only complete once [0, total_size) is a single
+    // received range with nothing beyond it.
+    if (it->second.bytes_received != total_size ||
+        it->second.received.size() != 1) {
       result.error = "size mismatch";
       return result;
     }
-    sess = it->second;
-    blob_uploads_.erase(it);
+    sess = std::move(it->second);
+    shard.uploads.erase(it);
   }
+  // The handle must be closed before the rename on Windows; the CLOCK sweep
+  // may still hold a reference for a moment.
+  sess.file->TryClose();
+  sess.file.reset();
 
   const auto final_path = ResolvePath(file_id);
   std::error_code ec;
   std::filesystem::rename(sess.temp_path, final_path, ec);
   if (ec) {
+    QueueWipe(sess.temp_path);
     result.error = "finalize failed";
     return result;
   }
@@ -528,8 +1448,8 @@ BlobUploadFinishResult OfflineStorage::FinishBlobUpload(
   meta.created_at = sess.created_at;
 
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    metadata_[file_id] = meta;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    InsertMetaLocked(shard, meta);
   }
 
   result.success = true;
@@ -537,6 +1457,46 @@ BlobUploadFinishResult OfflineStorage::FinishBlobUpload(
   return result;
 }
 
+bool OfflineStorage::AbortBlobUpload(const std::string& owner,
+                                     const std::string& file_id,
+                                     const std::string& upload_id,
+                                     std::string& error) {
+  error.clear();
+  if (owner.empty()) {
+    error = "owner empty";
+    return false;
+  }
+  if (file_id.empty() || upload_id.empty()) {
+    error = "invalid session";
+    return false;
+  }
+
+  auto& shard = ShardFor(file_id);
+  BlobUploadSession sess;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.uploads.find(file_id);
+    if (it == shard.uploads.end()) {
+      error = "upload session not found";
+      return false;
+    }
+    if (it->second.upload_id != upload_id || it->second.owner != owner) {
+      error = "unauthorized";
+      return false;
+    }
+    if (it->second.inflight != 0) {
+      error = "upload busy";
+      return false;
+    }
+    sess = std::move(it->second);
+    shard.uploads.erase(it);
+  }
+  sess.file->TryClose();
+  sess.file.reset();
+  QueueWipe(sess.temp_path);
+  return true;
+}
+
 BlobDownloadStartResult OfflineStorage::BeginBlobDownload(
     const std::string& owner, const std::string& file_id, bool wipe_after_read) {
   BlobDownloadStartResult result;
@@ -552,7 +1512,7 @@ BlobDownloadStartResult OfflineStorage::BeginBlobDownload(
     result.error = "file id empty";
     return result;
   }
-  const auto path = ResolvePath(file_id);
+  const auto path = ResolveExistingPath(file_id);
   std::error_code ec;
   if (!std::filesystem::exists(path, ec) || ec) {
     result.error = "file not found";
@@ -569,17 +1529,26 @@ BlobDownloadStartResult OfflineStorage::BeginBlobDownload(
   sess.download_id = download_id;
   sess.file_id = file_id;
   sess.owner = owner;
+  sess.path = path;
   sess.total_size = size;
   sess.next_offset = 0;
   sess.wipe_after_read = wipe_after_read;
   sess.created_at = std::chrono::steady_clock::now();
   sess.last_activity = sess.created_at;
 
+  sess.file = NewBlobFile(path, false, false);
+  if (!AcquireBlobFile(sess.file)) {
+    result.error = "file not found";
+    return result;
+  }
+  sess.file->Release();
+
   StoredFileMeta meta;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    const auto it = metadata_.find(file_id);
-    if (it != metadata_.end()) {
+    auto& shard = ShardFor(file_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.metadata.find(file_id);
+    if (it != shard.metadata.end()) {
       meta = it->second;
     } else {
       meta.id = file_id;
@@ -587,7 +1556,7 @@ BlobDownloadStartResult OfflineStorage::BeginBlobDownload(
       meta.owner.clear();
       meta.created_at = std::chrono::steady_clock::now();
     }
-    blob_downloads_[download_id] = std::move(sess);
+    shard.downloads[download_id] = std::move(sess);
   }
 
   result.success = true;
@@ -617,78 +1586,85 @@ BlobDownloadChunkResult OfflineStorage::ReadBlobDownloadChunk(
     max_len = kMaxBlobChunkBytes;
   }
 
-  BlobDownloadSession sess;
+  auto& shard = ShardFor(file_id);
+  std::filesystem::path path;
+  std::shared_ptr<BlobFile> file;
+  std::uint64_t total_size = 0;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    const auto it = blob_downloads_.find(download_id);
-    if (it == blob_downloads_.end()) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.downloads.find(download_id);
+    if (it == shard.downloads.end()) {
       result.error = "download session not found";
       return result;
     }
-    if (it->second.owner != owner || it->second.file_id != file_id) {
+    auto& sess = it->second;
+    if (sess.owner != owner || sess.file_id != file_id) {
       result.error = "unauthorized";
       return result;
     }
-    if (offset != it->second.next_offset) {
-      result.error = "invalid offset";
+    if (sess.busy) {
+      result.error = "download busy";
       return result;
     }
-    sess = it->second;
-  }
-
-  if (sess.total_size == 0 || offset >= sess.total_size) {
-    result.error = "invalid offset";
-    return result;
-  }
-
-  const auto path = ResolvePath(file_id);
-  std::vector<std::uint8_t> buf;
-  {
-    std::ifstream ifs(path, std::ios::binary);
-    if (!ifs) {
-      result.error = "file not found";
+    if (offset != sess.next_offset) {
+      result.error = "invalid offset";
       return result;
     }
-    ifs.seekg(static_cast<std::streamoff>(offset));
-    const std::uint64_t remaining64 = sess.total_size - offset;
-    const std::size_t to_read =
-        static_cast<std::size_t>(std::min<std::uint64_t>(remaining64, max_len));
-    buf.resize(to_read);
-    ifs.read(reinterpret_cast<char*>(buf.data()),
-             static_cast<std::streamsize>(buf.size()));
-    if (!ifs) {
-      result.error = "read failed";
+    if (sess.total_size == 0 || offset >= sess.total_size) {
+      result.error = "invalid offset";
       return result;
     }
+    file = sess.file;
+    total_size = sess.total_size;
+    sess.busy = true;
+  }
+
+  const std::size_t to_read = static_cast<std::size_t>(
+      std::min<std::uint64_t>(total_size - offset, max_len));
+  std::vector<std::uint8_t> buf(to_read);
+  bool read_ok = false;
+  if (AcquireBlobFile(file)) {
+    read_ok = file->ReadAt(offset, buf.data(), buf.size());
+    file->Release();
   }
+  file.reset();
 
   const std::uint64_t next_off = offset + static_cast<std::uint64_t>(buf.size());
-  const bool eof = (next_off >= sess.total_size);
+  const bool eof = (next_off >= total_size);
 
   bool wipe = false;
+  std::shared_ptr<BlobFile> closing;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = blob_downloads_.find(download_id);
-    if (it == blob_downloads_.end()) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.downloads.find(download_id);
+    if (it == shard.downloads.end()) {
       result.error = "download session not found";
       return result;
     }
-    if (it->second.owner != owner || it->second.file_id != file_id) {
-      result.error = "unauthorized";
+    auto& sess = it->second;
+    sess.busy = false;
+    sess.last_activity = std::chrono::steady_clock::now();
+    if (!read_ok) {
+      result.error = "read failed";
       return result;
     }
-    it->second.next_offset = next_off;
-    it->second.last_activity = std::chrono::steady_clock::now();
+    sess.next_offset = next_off;
     if (eof) {
-      wipe = it->second.wipe_after_read;
-      blob_downloads_.erase(it);
+      wipe = sess.wipe_after_read;
+      path = sess.path;
+      closing = std::move(sess.file);
+      shard.downloads.erase(it);
       if (wipe) {
-        metadata_.erase(file_id);
+        shard.metadata.erase(file_id);
       }
     }
   }
+  if (closing) {
+    closing->TryClose();
+    closing.reset();
+  }
   if (wipe) {
-    WipeFile(path);
+    QueueWipe(path);
   }
 
   result.success = true;
@@ -701,22 +1677,44 @@ BlobDownloadChunkResult OfflineStorage::ReadBlobDownloadChunk(
 std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
     const std::string& file_id, const std::array<std::uint8_t, 32>& file_key,
     bool wipe_after_read, std::string& error) {
+  std::vector<std::uint8_t> plaintext;
+  const bool ok = FetchStream(
+      file_id, file_key, wipe_after_read,
+      [&](std::uint64_t total, const std::uint8_t* data, std::size_t len) {
+        if (plaintext.empty()) {
+          plaintext.reserve(static_cast<std::size_t>(total));
+        }
+        plaintext.insert(plaintext.end(), data, data + len);
+        return true;
+      },
+      error);
+  if (!ok) {
+    return std::nullopt;
+  }
+  return plaintext;
+}
+
+bool OfflineStorage::FetchStream(const std::string& file_id,
+                                 const std::array<std::uint8_t, 32>& file_key,
+                                 bool wipe_after_read,
+                                 const OfflineChunkWriter& write,
+                                 std::string& error) {
   if (!IsValidFileId(file_id)) {
     error = "invalid file id";
-    return std::nullopt;
+    return false;
   }
-  const auto path = ResolvePath(file_id);
+  const auto path = ResolveExistingPath(file_id);
   std::ifstream ifs(path, std::ios::binary);
   if (!ifs) {
     error = "file not found";
-    return std::nullopt;
+    return false;
   }
 
   std::vector<std::uint8_t> plaintext;
   std::array<std::uint8_t, kOfflineFileMagic.size()> magic{};
   if (!ReadExact(ifs, magic.data(), magic.size())) {
     error = "file truncated";
-    return std::nullopt;
+    return false;
   }
 
   if (std::equal(kOfflineFileMagic.begin(), kOfflineFileMagic.end(),
@@ -724,7 +1722,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
     std::uint8_t version = 0;
     if (!ReadExact(ifs, &version, 1)) {
       error = "file truncated";
-      return std::nullopt;
+      return false;
     }
 
     if (version == kOfflineFileMagicVersionV3) {
@@ -735,18 +1733,18 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
           !ReadExact(ifs, size_buf.data(), size_buf.size()) ||
           !ReadExact(ifs, base_nonce.data(), base_nonce.size())) {
         error = "file truncated";
-        return std::nullopt;
+        return false;
       }
 
       const std::uint32_t chunk_bytes = ReadUint32Le(chunk_buf.data());
       const std::uint64_t plain_size = ReadUint64Le(size_buf.data());
       if (chunk_bytes == 0 || chunk_bytes > kOfflineFileStreamMaxChunkBytes) {
         error = "chunk size invalid";
-        return std::nullopt;
+        return false;
       }
       if (plain_size == 0) {
         error = "plain size invalid";
-        return std::nullopt;
+        return false;
       }
 
       std::error_code ec;
@@ -754,7 +1752,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
           std::filesystem::file_size(path, ec);
       if (ec) {
         error = "file size failed";
-        return std::nullopt;
+        return false;
       }
       const std::uint64_t chunk_count =
           (plain_size + chunk_bytes - 1) / chunk_bytes;
@@ -763,7 +1761,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
               (std::numeric_limits<std::uint64_t>::max)() /
                   static_cast<std::uint64_t>(kOfflineFileAeadTagBytes)) {
         error = "file size invalid";
-        return std::nullopt;
+        return false;
       }
       const std::uint64_t tag_overhead =
           chunk_count * static_cast<std::uint64_t>(kOfflineFileAeadTagBytes);
@@ -771,19 +1769,19 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
           (std::numeric_limits<std::uint64_t>::max)() -
               kOfflineFileV3HeaderBytes - plain_size) {
         error = "file size invalid";
-        return std::nullopt;
+        return false;
       }
       const std::uint64_t expected_size =
           kOfflineFileV3HeaderBytes + plain_size + tag_overhead;
       if (file_size != expected_size) {
         error = "file truncated";
-        return std::nullopt;
+        return false;
       }
 
       if (plain_size > static_cast<std::uint64_t>(
                            (std::numeric_limits<std::size_t>::max)())) {
         error = "plain size invalid";
-        return std::nullopt;
+        return false;
       }
 
       std::array<std::uint8_t, 32> file_key_copy = file_key;
@@ -794,11 +1792,10 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
         error = key_err.empty() ? "erase key missing" : key_err;
         crypto_wipe(file_key_copy.data(), file_key_copy.size());
         crypto_wipe(erase_key.data(), erase_key.size());
-        return std::nullopt;
+        return false;
       }
       storage_key = DeriveStorageKey(file_key_copy, erase_key);
 
-      plaintext.resize(static_cast<std::size_t>(plain_size));
       std::array<std::uint8_t, kOfflineFileV3PrefixBytes> ad_prefix{};
       std::memcpy(ad_prefix.data(), kOfflineFileMagic.data(),
                   kOfflineFileMagic.size());
@@ -810,7 +1807,9 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
       std::array<std::uint8_t, kOfflineFileV3AdBytes> ad{};
       std::memcpy(ad.data(), ad_prefix.data(), ad_prefix.size());
       auto& pool = OfflineStorageBufferPool();
+      mi::shard::ScopedBuffer plain_buf(pool, chunk_bytes, true);
       mi::shard::ScopedBuffer cipher_buf(pool, chunk_bytes, false);
+      auto& plain = plain_buf.get();
       auto& cipher = cipher_buf.get();
       std::array<std::uint8_t, kOfflineFileAeadTagBytes> tag{};
       std::uint64_t offset = 0;
@@ -818,6 +1817,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
       while (offset < plain_size) {
         const std::size_t to_read = static_cast<std::size_t>(
             std::min<std::uint64_t>(plain_size - offset, chunk_bytes));
+        plain.resize(to_read);
         cipher.resize(to_read);
         if (!ReadExact(ifs, cipher.data(), cipher.size()) ||
             !ReadExact(ifs, tag.data(), tag.size())) {
@@ -825,20 +1825,19 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
           crypto_wipe(file_key_copy.data(), file_key_copy.size());
           crypto_wipe(erase_key.data(), erase_key.size());
           error = "file truncated";
-          return std::nullopt;
+          return false;
         }
         WriteUint64Le(chunk_index, ad.data() + kOfflineFileV3PrefixBytes);
         const auto nonce = DeriveChunkNonce(base_nonce, chunk_index);
         const int ok = crypto_aead_unlock(
-            plaintext.data() + static_cast<std::size_t>(offset), tag.data(),
-            storage_key.data(), nonce.data(), ad.data(), ad.size(),
-            cipher.data(), cipher.size());
-        if (ok != 0) {
+            plain.data(), tag.data(), storage_key.data(), nonce.data(),
+            ad.data(), ad.size(), cipher.data(), cipher.size());
+        if (ok != 0 || !write(plain_size, plain.data(), to_read)) {
           crypto_wipe(storage_key.data(), storage_key.size());
           crypto_wipe(file_key_copy.data(), file_key_copy.size());
           crypto_wipe(erase_key.data(), erase_key.size());
-          error = "auth failed";
-          return std::nullopt;
+          error = ok != 0 ? "auth failed" : "write failed";
+          return false;
         }
         offset += to_read;
         ++chunk_index;
@@ -857,7 +1856,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
           file_size2 > static_cast<std::uint64_t>(
                             (std::numeric_limits<std::size_t>::max)())) {
         error = "file truncated";
-        return std::nullopt;
+        return false;
       }
       auto& pool = OfflineStorageBufferPool();
       mi::shard::ScopedBuffer content_buf(
@@ -866,14 +1865,14 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
       content.resize(static_cast<std::size_t>(file_size2));
       if (!ReadExact(ifs, content.data(), content.size())) {
         error = "file truncated";
-        return std::nullopt;
+        return false;
       }
       ifs.close();
       if (content.size() <
           (kOfflineFileHeaderBytes + kOfflineFileAeadNonceBytes +
            kOfflineFileAeadTagBytes)) {
         error = "file truncated";
-        return std::nullopt;
+        return false;
       }
 
       const auto nonce = [&]() {
@@ -888,7 +1887,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
           kOfflineFileAeadTagBytes;
       if (cipher_len == 0) {
         error = "cipher empty";
-        return std::nullopt;
+        return false;
       }
 
       const auto tag = [&]() {
@@ -921,7 +1920,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
           error = key_err.empty() ? "erase key missing" : key_err;
           crypto_wipe(file_key_copy.data(), file_key_copy.size());
           crypto_wipe(erase_key.data(), erase_key.size());
-          return std::nullopt;
+          return false;
         }
         storage_key = DeriveStorageKey(file_key_copy, erase_key);
       }
@@ -932,14 +1931,22 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
         crypto_wipe(file_key_copy.data(), file_key_copy.size());
         crypto_wipe(erase_key.data(), erase_key.size());
         error = "auth failed";
-        return std::nullopt;
+        return false;
       }
       crypto_wipe(storage_key.data(), storage_key.size());
       crypto_wipe(file_key_copy.data(), file_key_copy.size());
       crypto_wipe(erase_key.data(), erase_key.size());
+      // V1/V2 carry one tag over the whole file, so they cannot be streamed.
+      const bool wrote =
+          write(plaintext.size(), plaintext.data(), plaintext.size());
+      crypto_wipe(plaintext.data(), plaintext.size());
+      if (!wrote) {
+        error = "write failed";
+        return false;
+      }
     } else {
       error = "unsupported format";
-      return std::nullopt;
+      return false;
     }
   } else {
     ifs.clear();
@@ -951,7 +1958,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
         file_size2 > static_cast<std::uint64_t>(
                           (std::numeric_limits<std::size_t>::max)())) {
       error = "file truncated";
-      return std::nullopt;
+      return false;
     }
     auto& pool = OfflineStorageBufferPool();
     mi::shard::ScopedBuffer content_buf(
@@ -960,13 +1967,13 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
     content.resize(static_cast<std::size_t>(file_size2));
     if (!ReadExact(ifs, content.data(), content.size())) {
       error = "file truncated";
-      return std::nullopt;
+      return false;
     }
     ifs.close();
     if (content.size() <
         (kOfflineFileLegacyNonceBytes + kOfflineFileLegacyTagBytes)) {
       error = "file truncated";
-      return std::nullopt;
+      return false;
     }
 
     const auto nonce = [&]() {
@@ -979,7 +1986,7 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
         content.size() - nonce.size() - kOfflineFileLegacyTagBytes;
     if (cipher_len == 0) {
       error = "cipher empty";
-      return std::nullopt;
+      return false;
     }
 
     const auto tag = [&]() {
@@ -996,118 +2003,269 @@ std::optional<std::vector<std::uint8_t>> OfflineStorage::Fetch(
 
     if (!DecryptLegacy(cipher, file_key, nonce, tag, plaintext)) {
       error = "auth failed";
-      return std::nullopt;
+      return false;
+    }
+    const bool wrote =
+        write(plaintext.size(), plaintext.data(), plaintext.size());
+    crypto_wipe(plaintext.data(), plaintext.size());
+    if (!wrote) {
+      error = "write failed";
+      return false;
     }
   }
 
   ifs.close();
   if (wipe_after_read) {
-    WipeFile(path);
-    std::lock_guard<std::mutex> lock(mutex_);
-    metadata_.erase(file_id);
+    QueueWipe(path);
+    auto& shard = ShardFor(file_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.metadata.erase(file_id);
   }
 
   error.clear();
-  return plaintext;
+  return true;
 }
 
 std::optional<std::vector<std::uint8_t>> OfflineStorage::FetchBlob(
     const std::string& file_id, bool wipe_after_read, std::string& error) {
+  std::vector<std::uint8_t> content;
+  const bool ok = FetchBlobStream(
+      file_id, wipe_after_read,
+      [&](std::uint64_t total, const std::uint8_t* data, std::size_t len) {
+        if (content.empty()) {
+          content.reserve(static_cast<std::size_t>(total));
+        }
+        content.insert(content.end(), data, data + len);
+        return true;
+      },
+      error);
+  if (!ok) {
+    return std::nullopt;
+  }
+  return content;
+}
+
+bool OfflineStorage::FetchBlobStream(const std::string& file_id,
+                                     bool wipe_after_read,
+                                     const OfflineChunkWriter& write,
+                                     std::string& error) {
   if (!IsValidFileId(file_id)) {
     error = "invalid file id";
-    return std::nullopt;
+    return false;
   }
-  const auto path = ResolvePath(file_id);
+  const auto path = ResolveExistingPath(file_id);
   std::ifstream ifs(path, std::ios::binary);
   if (!ifs) {
     error = "file not found";
-    return std::nullopt;
+    return false;
   }
-  std::vector<std::uint8_t> content((std::istreambuf_iterator<char>(ifs)),
-                                    std::istreambuf_iterator<char>());
-  ifs.close();
-  if (content.empty()) {
+  std::error_code ec;
+  const std::uint64_t size = std::filesystem::file_size(path, ec);
+  if (ec || size == 0) {
     error = "empty file";
-    return std::nullopt;
+    return false;
+  }
+  mi::shard::ScopedBuffer chunk_buf(OfflineStorageBufferPool(),
+                                    kOfflineFileStreamChunkBytes, false);
+  auto& chunk = chunk_buf.get();
+  std::uint64_t offset = 0;
+  while (offset < size) {
+    const std::size_t len = static_cast<std::size_t>(
+        std::min<std::uint64_t>(size - offset, kOfflineFileStreamChunkBytes));
+    chunk.resize(len);
+    if (!ReadExact(ifs, chunk.data(), len)) {
+      error = "file truncated";
+      return false;
+    }
+    if (!write(size, chunk.data(), len)) {
+      error = "write failed";
+      return false;
+    }
+    offset += len;
   }
+  ifs.close();
 
   if (wipe_after_read) {
-    WipeFile(path);
-    std::lock_guard<std::mutex> lock(mutex_);
-    metadata_.erase(file_id);
+    QueueWipe(path);
+    auto& shard = ShardFor(file_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.metadata.erase(file_id);
   }
 
   error.clear();
-  return content;
+  return true;
+}
+
+std::optional<StoredFileMeta> OfflineStorage::Meta(
+    const std::string& file_id) const {
+  if (!IsValidFileId(file_id)) {
+    return std::nullopt;
+  }
+  const auto& shard = ShardFor(file_id);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  const auto it = shard.metadata.find(file_id);
+  if (it == shard.metadata.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+OfflineStorageStats OfflineStorage::GetStats() const {
+  OfflineStorageStats stats;
+  for (const auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    stats.files += static_cast<std::uint64_t>(shard.metadata.size());
+    for (const auto& kv : shard.metadata) {
+      stats.bytes += kv.second.size;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(wipe_mutex_);
+    stats.pending_wipes =
+        static_cast<std::uint64_t>(wipe_queue_.size() + wipes_in_progress_);
+    stats.pending_wipe_bytes = wipe_queue_bytes_;
+  }
+  return stats;
+}
+
+void OfflineStorage::CleanupExpired() {
+  const auto now = std::chrono::steady_clock::now();
+  const auto sess_ttl = std::chrono::minutes(15);
+  std::vector<std::filesystem::path> wipe;
+  std::vector<std::shared_ptr<BlobFile>> closing;
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // Heap entries go stale when a file is fetched-and-wiped or re-inserted;
+    // only act on the ones that still describe the live metadata.
+    while (!shard.expiries.empty() && shard.expiries.top().expires_at < now) {
+      const MetaExpiry top = shard.expiries.top();
+      shard.expiries.pop();
+      const auto it = shard.metadata.find(top.file_id);
+      if (it == shard.metadata.end() ||
+          it->second.created_at + ttl_ != top.expires_at) {
+        continue;
+      }
+      wipe.push_back(ResolveExistingPath(top.file_id));
+      shard.metadata.erase(it);
+    }
+
+    // Sessions are few and short-lived, so a scan is cheap enough here.
+    for (auto it = shard.uploads.begin(); it != shard.uploads.end();) {
+      if (now - it->second.last_activity > sess_ttl &&
+          it->second.inflight == 0) {
+        closing.push_back(std::move(it->second.file));
+        wipe.push_back(it->second.temp_path);
+        it = shard.uploads.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (auto it = shard.downloads.begin(); it != shard.downloads.end();) {
+      if (now - it->second.last_activity > sess_ttl && !it->second.busy) {
+        closing.push_back(std::move(it->second.file));
+        it = shard.downloads.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (auto& file : closing) {
+    if (file) {
+      file->TryClose();
+    }
+  }
+  closing.clear();
+  for (const auto& path : wipe) {
+    QueueWipe(path);
+  }
+}
+
+std::filesystem::path OfflineStorage::FanoutDir(
+    const std::string& file_id) const {
+  if (file_id.size() < 4) {
+    return base_dir_;
+  }
+  return base_dir_ / file_id.substr(0, 2) / file_id.substr(2, 2);
+}
+
+std::filesystem::path OfflineStorage::LegacyPath(const std::string& file_id,
+                                                 const char* ext) const {
+  return base_dir_ / (file_id + ext);
+}
+
+bool OfflineStorage::EnsureFanoutDir(const std::string& file_id) {
+  std::size_t index = 0;
+  for (std::size_t i = 0; i < 4 && i < file_id.size(); ++i) {
+    const int v = HexNibble(file_id[i]);
+    if (v < 0) {
+      return false;
+    }
+    index = (index << 4) | static_cast<std::size_t>(v);
+  }
+  if (fanout_ready_[index].load(std::memory_order_acquire)) {
+    return true;
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(FanoutDir(file_id), ec);
+  if (ec) {
+    return false;
+  }
+  fanout_ready_[index].store(true, std::memory_order_release);
+  return true;
 }
 
-std::optional<StoredFileMeta> OfflineStorage::Meta(
+std::filesystem::path OfflineStorage::ResolveExistingPath(
     const std::string& file_id) const {
-  if (!IsValidFileId(file_id)) {
-    return std::nullopt;
+  auto path = ResolvePath(file_id);
+  if (!migration_pending_.load(std::memory_order_acquire)) {
+    return path;
   }
-  std::lock_guard<std::mutex> lock(mutex_);
-  const auto it = metadata_.find(file_id);
-  if (it == metadata_.end()) {
-    return std::nullopt;
+  // The migrator may move the file between the two checks, so look at the
+  // fan-out location again before giving up on it.
+  std::error_code ec;
+  if (std::filesystem::exists(path, ec)) {
+    return path;
   }
-  return it->second;
-}
-
-OfflineStorageStats OfflineStorage::GetStats() const {
-  OfflineStorageStats stats;
-  std::lock_guard<std::mutex> lock(mutex_);
-  stats.files = static_cast<std::uint64_t>(metadata_.size());
-  for (const auto& kv : metadata_) {
-    stats.bytes += kv.second.size;
+  auto legacy = LegacyPath(file_id, ".bin");
+  if (std::filesystem::exists(legacy, ec)) {
+    return legacy;
   }
-  return stats;
+  return path;
 }
 
-void OfflineStorage::CleanupExpired() {
-  const auto now = std::chrono::steady_clock::now();
-  std::lock_guard<std::mutex> lock(mutex_);
-  for (auto it = metadata_.begin(); it != metadata_.end();) {
-    if (now - it->second.created_at > ttl_) {
-      const auto path = ResolvePath(it->first);
-      WipeFile(path);
-      it = metadata_.erase(it);
-    } else {
-      ++it;
-    }
+std::optional<std::filesystem::path> OfflineStorage::LocateKeyForData(
+    const std::filesystem::path& data_path) const {
+  auto key_path = ResolveKeyPathForData(data_path);
+  if (!key_path.has_value()) {
+    return std::nullopt;
   }
-
-  const auto sess_ttl = std::chrono::minutes(15);
-  for (auto it = blob_uploads_.begin(); it != blob_uploads_.end();) {
-    if (now - it->second.last_activity > sess_ttl) {
-      WipeFile(it->second.temp_path);
-      it = blob_uploads_.erase(it);
-    } else {
-      ++it;
-    }
+  std::error_code ec;
+  if (std::filesystem::exists(*key_path, ec) ||
+      !migration_pending_.load(std::memory_order_acquire)) {
+    return key_path;
   }
-  for (auto it = blob_downloads_.begin(); it != blob_downloads_.end();) {
-    if (now - it->second.last_activity > sess_ttl) {
-      it = blob_downloads_.erase(it);
-    } else {
-      ++it;
+  const auto stem = data_path.stem().string();
+  for (auto candidate : {ResolveKeyPath(stem), LegacyPath(stem, ".key")}) {
+    if (std::filesystem::exists(candidate, ec)) {
+      return candidate;
     }
   }
+  return key_path;
 }
 
 std::filesystem::path OfflineStorage::ResolvePath(
     const std::string& file_id) const {
-  return base_dir_ / (file_id + ".bin");
+  return FanoutDir(file_id) / (file_id + ".bin");
 }
 
 std::filesystem::path OfflineStorage::ResolveUploadTempPath(
     const std::string& file_id) const {
-  return base_dir_ / (file_id + ".part");
+  return FanoutDir(file_id) / (file_id + ".part");
 }
 
 std::filesystem::path OfflineStorage::ResolveKeyPath(
     const std::string& file_id) const {
-  return base_dir_ / (file_id + ".key");
+  return FanoutDir(file_id) / (file_id + ".key");
 }
 
 std::optional<std::filesystem::path> OfflineStorage::ResolveKeyPathForData(
@@ -1154,26 +2312,23 @@ bool OfflineStorage::SaveEraseKey(const std::filesystem::path& data_path,
     return false;
   }
   const auto tmp = key_path->string() + ".tmp";
-  {
-    std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
-    if (!ofs) {
-      error = "key write failed";
-      return false;
-    }
-    ofs.write(reinterpret_cast<const char*>(erase_key.data()),
-              static_cast<std::streamsize>(erase_key.size()));
-    if (!ofs) {
-      error = "key write failed";
-      return false;
-    }
+  if (!WriteFileDurable(tmp, erase_key.data(), erase_key.size(),
+                        dir_sync_->SyncFiles())) {
+    std::error_code ec;
+    std::filesystem::remove(tmp, ec);
+    error = "key write failed";
+    return false;
   }
-  std::error_code ec;
-  std::filesystem::rename(tmp, *key_path, ec);
-  if (ec) {
+  if (!RenameDurable(tmp, *key_path)) {
+    std::error_code ec;
     std::filesystem::remove(tmp, ec);
     error = "key write failed";
     return false;
   }
+  if (!dir_sync_->Sync(key_path->parent_path())) {
+    error = "key sync failed";
+    return false;
+  }
   return true;
 }
 
@@ -1182,7 +2337,7 @@ bool OfflineStorage::LoadEraseKey(const std::filesystem::path& data_path,
                                   std::string& error) const {
   error.clear();
   erase_key.fill(0);
-  const auto key_path = ResolveKeyPathForData(data_path);
+  const auto key_path = LocateKeyForData(data_path);
   if (!key_path.has_value()) {
     error = "key path invalid";
     return false;
@@ -1378,66 +2533,238 @@ bool OfflineStorage::CallSecureDeletePlugin(
   return rc != 0;
 }
 
-void OfflineStorage::BestEffortWipe(const std::filesystem::path& path) const {
+std::uint64_t OfflineStorage::BestEffortWipe(
+    const std::filesystem::path& path) const {
   std::error_code ec;
   if (!std::filesystem::exists(path, ec)) {
-    return;
+    return 0;
   }
   const auto size = std::filesystem::file_size(path, ec);
   if (ec) {
     std::filesystem::remove(path, ec);
-    return;
+    return 0;
   }
   std::fstream fs(path, std::ios::binary | std::ios::in | std::ios::out);
   if (!fs) {
     std::filesystem::remove(path, ec);
-    return;
+    return 0;
   }
   const std::size_t wipe_len = size < 16 ? static_cast<std::size_t>(size) : 16;
   const std::vector<std::uint8_t> ff(wipe_len, 0xFF);
+  std::uint64_t written = wipe_len;
   fs.seekp(0);
   fs.write(reinterpret_cast<const char*>(ff.data()),
            static_cast<std::streamsize>(wipe_len));
   if (size > wipe_len) {
     const std::size_t mid = static_cast<std::size_t>(size / 2);
+    const std::size_t mid_len =
+        std::min(wipe_len, static_cast<std::size_t>(size - mid));
     fs.seekp(static_cast<std::streamoff>(mid));
     fs.write(reinterpret_cast<const char*>(ff.data()),
-             static_cast<std::streamsize>(
-                 std::min(wipe_len, static_cast<std::size_t>(size - mid))));
+             static_cast<std::streamsize>(mid_len));
+    written += mid_len;
     if (size > wipe_len * 2) {
       const auto tail_pos =
           static_cast<std::streamoff>(size > wipe_len ? size - wipe_len : 0);
       fs.seekp(tail_pos);
       fs.write(reinterpret_cast<const char*>(ff.data()),
                static_cast<std::streamsize>(wipe_len));
+      written += wipe_len;
     }
   }
   fs.flush();
   fs.close();
   std::filesystem::remove(path, ec);
+  return written;
 }
 
-void OfflineStorage::WipeFile(const std::filesystem::path& path) const {
+std::uint64_t OfflineStorage::WipeFile(const std::filesystem::path& path) const {
+  // The plugin does not report its I/O; it is charged the size of the file it
+  // was handed.
+  const auto plugin_wipe = [this](const std::filesystem::path& p,
+                                  std::uint64_t& written) {
+    std::error_code size_ec;
+    const auto size = std::filesystem::file_size(p, size_ec);
+    if (!CallSecureDeletePlugin(p)) {
+      return false;
+    }
+    written += size_ec ? 0 : size;
+    std::error_code rm_ec;
+    std::filesystem::remove(p, rm_ec);
+    return true;
+  };
+  std::uint64_t written = 0;
   std::error_code ec;
   const auto key_path = ResolveKeyPathForData(path);
   if (key_path.has_value() && std::filesystem::exists(*key_path, ec) && !ec) {
-    if (!CallSecureDeletePlugin(*key_path)) {
-      BestEffortWipe(*key_path);
+    if (!plugin_wipe(*key_path, written)) {
+      written += BestEffortWipe(*key_path);
+    }
+  }
+  if (!plugin_wipe(path, written)) {
+    written += BestEffortWipe(path);
+  }
+  return written;
+}
+
+void OfflineStorage::QueueWipe(const std::filesystem::path& path) {
+  if (pending_wipe_dir_.empty()) {
+    WipeFile(path);
+    return;
+  }
+  std::error_code ec;
+  if (!std::filesystem::exists(path, ec)) {
+    WipeFile(path);
+    return;
+  }
+  // Same stem for data and key so WipeFile still finds the erase key.
+  const std::string stem = GenerateId();
+  std::optional<std::filesystem::path> moved_key;
+  const auto key_path = LocateKeyForData(path);
+  if (key_path.has_value() && std::filesystem::exists(*key_path, ec)) {
+    const auto target = pending_wipe_dir_ / (stem + ".key");
+    std::filesystem::rename(*key_path, target, ec);
+    if (ec) {
+      WipeFile(*key_path);
     } else {
-      std::filesystem::remove(*key_path, ec);
+      moved_key = target;
     }
   }
-  if (!CallSecureDeletePlugin(path)) {
-    BestEffortWipe(path);
-  } else {
-    std::filesystem::remove(path, ec);
+  const auto target = pending_wipe_dir_ / (stem + path.extension().string());
+  std::filesystem::rename(path, target, ec);
+  if (ec) {
+    if (moved_key.has_value()) {
+      EnqueuePendingWipe(*moved_key);
+    }
+    WipeFile(path);
+    return;
+  }
+  EnqueuePendingWipe(target);
+}
+
+void OfflineStorage::EnqueuePendingWipe(const std::filesystem::path& path) {
+  std::error_code ec;
+  std::uint64_t bytes = std::filesystem::file_size(path, ec);
+  if (ec) {
+    bytes = 0;
+  }
+  {
+    std::lock_guard<std::mutex> lock(wipe_mutex_);
+    wipe_queue_.push_back(PendingWipe{path, bytes});
+    wipe_queue_bytes_ += bytes;
+  }
+  wipe_cv_.notify_one();
+}
+
+void OfflineStorage::ResumePendingWipes() {
+  // Leftovers from an earlier run are picked up even when this one has no
+  // wipe workers; then they are wiped inline.
+  const auto dir = base_dir_ / "pending_wipe";
+  std::error_code ec;
+  if (!std::filesystem::is_directory(dir, ec)) {
+    return;
+  }
+  std::vector<std::filesystem::path> leftovers;
+  for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::error_code type_ec;
+    if (!entry.is_regular_file(type_ec) || type_ec) {
+      continue;
+    }
+    const auto& path = entry.path();
+    if (path.extension() == ".key") {
+      auto data = path;
+      data.replace_extension(".bin");
+      std::error_code fec;
+      if (std::filesystem::exists(data, fec)) {
+        continue;  // wiped together with its data file
+      }
+    }
+    leftovers.push_back(path);
+  }
+  for (const auto& path : leftovers) {
+    if (pending_wipe_dir_.empty()) {
+      WipeFile(path);
+    } else {
+      EnqueuePendingWipe(path);
+    }
+  }
+}
+
+void OfflineStorage::WipeWorkerLoop() {
+  const std::uint64_t rate = secure_delete_.max_bytes_per_sec;
+  for (;;) {
+    PendingWipe job;
+    {
+      std::unique_lock<std::mutex> lock(wipe_mutex_);
+      wipe_cv_.wait(lock, [this] { return wipe_stop_ || !wipe_queue_.empty(); });
+      if (wipe_stop_) {
+        return;
+      }
+      job = std::move(wipe_queue_.front());
+      wipe_queue_.pop_front();
+      // Wait out the I/O budget already spent by earlier wipes.
+      const auto slot = next_wipe_slot_;
+      if (rate > 0 && slot > std::chrono::steady_clock::now() &&
+          wipe_cv_.wait_until(lock, slot, [this] { return wipe_stop_; })) {
+        wipe_queue_.push_front(std::move(job));
+        return;
+      }
+      wipes_in_progress_++;
+    }
+    const std::uint64_t written = WipeFile(job.path);
+    {
+      std::lock_guard<std::mutex> lock(wipe_mutex_);
+      wipes_in_progress_--;
+      wipe_queue_bytes_ -= std::min(wipe_queue_bytes_, job.bytes);
+      if (rate > 0) {
+        // Charged by the bytes actually overwritten, not the file size.
+        next_wipe_slot_ =
+            std::max(std::chrono::steady_clock::now(), next_wipe_slot_) +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(written) /
+                                              static_cast<double>(rate)));
+      }
+    }
   }
 }
 
-OfflineQueue::OfflineQueue(std::chrono::seconds default_ttl)
+OfflineQueue::OfflineQueue(std::chrono::seconds default_ttl,
+                           OfflineQueueLimits limits)
     : default_ttl_(default_ttl == std::chrono::seconds::zero()
                        ? std::chrono::hours(24)
-                       : default_ttl) {}
+                       : default_ttl),
+      limits_(std::move(limits)) {
+  if (limits_.spill_dir.empty()) {
+    return;
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(limits_.spill_dir, ec);
+  if (ec) {
+    limits_.spill_dir.clear();
+    return;
+  }
+  // The queue itself is not persistent, so spill files left behind by a
+  // previous process are unreachable.
+  for (const auto& entry :
+       std::filesystem::directory_iterator(limits_.spill_dir, ec)) {
+    if (entry.path().extension() == ".spill") {
+      std::error_code rm_ec;
+      std::filesystem::remove(entry.path(), rm_ec);
+    }
+  }
+}
+
+OfflineQueue::~OfflineQueue() {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (auto& entry : shard.recipients) {
+      if (!entry.second.spill_path.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(entry.second.spill_path, ec);
+      }
+    }
+  }
+}
 
 std::size_t OfflineQueue::ShardIndexFor(const std::string& recipient) const {
   if (recipient.empty()) {
@@ -1446,6 +2773,276 @@ std::size_t OfflineQueue::ShardIndexFor(const std::string& recipient) const {
   return std::hash<std::string>{}(recipient) % kShardCount;
 }
 
+OfflineQueue::MessageIter OfflineQueue::EraseLocked(RecipientQueue& queue,
+                                                    MessageIter it) {
+  if (it->spilled) {
+    queue.spilled_bytes -= it->bytes;
+    queue.spilled_messages--;
+  } else {
+    queue.resident_bytes -= it->bytes;
+    resident_bytes_.fetch_sub(it->bytes, std::memory_order_relaxed);
+  }
+  queue.by_id.erase(it->message_id);
+  queue.by_kind[static_cast<std::size_t>(it->msg.kind)].erase(it->message_id);
+  return queue.messages.erase(it);
+}
+
+void OfflineQueue::ReleaseSpillLocked(RecipientQueue& queue) {
+  if (queue.spilled_messages != 0 || queue.spill_path.empty() ||
+      queue.spill_ticket != 0) {
+    return;
+  }
+  std::error_code ec;
+  std::filesystem::remove(queue.spill_path, ec);
+  queue.spill_path.clear();
+  queue.spill_end = 0;
+}
+
+void OfflineQueue::EnforceLimits(const std::string& recipient,
+                                 std::uint64_t own_excess) {
+  if (limits_.spill_dir.empty()) {
+    return;
+  }
+  if (own_excess != 0) {
+    SpillOldest(recipient, own_excess);
+  }
+  const std::uint64_t cap = limits_.max_resident_bytes;
+  if (cap == 0 || resident_bytes_.load(std::memory_order_relaxed) <= cap) {
+    return;
+  }
+  // One thread evicts for everyone; the others just enqueue.
+  std::unique_lock<std::mutex> evict(evict_mutex_, std::try_to_lock);
+  if (!evict.owns_lock()) {
+    return;
+  }
+  const std::uint64_t low = cap - cap / 8;
+  std::string victim;
+  for (;;) {
+    const std::uint64_t resident =
+        resident_bytes_.load(std::memory_order_relaxed);
+    if (resident <= low || !LargestResidentQueue(victim) ||
+        SpillOldest(victim, resident - low) == 0) {
+      break;
+    }
+  }
+}
+
+bool OfflineQueue::LargestResidentQueue(std::string& out) const {
+  std::uint64_t best = 0;
+  for (const auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (const auto& entry : shard.recipients) {
+      if (entry.second.resident_bytes > best &&
+          entry.second.spill_ticket == 0) {
+        best = entry.second.resident_bytes;
+        out = entry.first;
+      }
+    }
+  }
+  return best != 0;
+}
+
+// Spills up to |want| bytes of the recipient's oldest resident payloads.
+// They are copied out under the shard lock and written without it; one
+// drained meanwhile only leaves dead bytes in the file. A file that is
+// mostly dead is first rewritten with just its live records.
+std::uint64_t OfflineQueue::SpillOldest(const std::string& recipient,
+                                        std::uint64_t want) {
+  struct Record {
+    std::uint64_t message_id{0};
+    std::uint64_t from{0};
+    std::uint64_t offset{0};
+    std::uint64_t bytes{0};
+    std::vector<std::uint8_t> payload;
+  };
+  std::vector<Record> batch;
+  std::vector<Record> live;
+  std::filesystem::path old_path;
+  std::filesystem::path path;
+  std::uint64_t end = 0;
+  std::uint64_t ticket = 0;
+  bool fresh = true;
+  auto& shard = shards_[ShardIndexFor(recipient)];
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.recipients.find(recipient);
+    if (it == shard.recipients.end() || it->second.spill_ticket != 0) {
+      return 0;
+    }
+    auto& queue = it->second;
+    std::uint64_t picked = 0;
+    for (const auto& stored : queue.messages) {
+      if (picked >= want) {
+        break;
+      }
+      if (stored.spilled || stored.bytes == 0) {
+        continue;
+      }
+      Record rec;
+      rec.message_id = stored.message_id;
+      rec.bytes = stored.bytes;
+      rec.payload = stored.msg.payload;
+      batch.push_back(std::move(rec));
+      picked += stored.bytes;
+    }
+    if (batch.empty()) {
+      return 0;
+    }
+    const std::uint64_t dead = queue.spill_end - queue.spilled_bytes;
+    if (!queue.spill_path.empty() && queue.spill_end >= kSpillCompactMinBytes &&
+        dead * 2 > queue.spill_end) {
+      old_path = queue.spill_path;
+      for (const auto& stored : queue.messages) {
+        if (stored.spilled) {
+          Record rec;
+          rec.message_id = stored.message_id;
+          rec.from = stored.spill_offset;
+          rec.bytes = stored.bytes;
+          live.push_back(std::move(rec));
+        }
+      }
+    }
+    ticket = next_spill_file_.fetch_add(1);
+    if (queue.spill_path.empty() || !old_path.empty()) {
+      path = limits_.spill_dir / ("q" + std::to_string(ticket) + ".spill");
+    } else {
+      path = queue.spill_path;
+      end = queue.spill_end;
+      fresh = false;
+    }
+    queue.spill_ticket = ticket;
+  }
+
+  bool ok = true;
+  {
+    std::ofstream out(path, fresh ? std::ios::binary | std::ios::trunc
+                                  : std::ios::binary | std::ios::in |
+                                        std::ios::out);
+    out.seekp(static_cast<std::streamoff>(end));
+    if (!out) {
+      ok = false;
+    }
+    if (ok && !live.empty()) {
+      std::ifstream in(old_path, std::ios::binary);
+      std::vector<std::uint8_t> buf;
+      for (auto& rec : live) {
+        buf.resize(static_cast<std::size_t>(rec.bytes));
+        in.seekg(static_cast<std::streamoff>(rec.from));
+        in.read(reinterpret_cast<char*>(buf.data()),
+                static_cast<std::streamsize>(buf.size()));
+        out.write(reinterpret_cast<const char*>(buf.data()),
+                  static_cast<std::streamsize>(buf.size()));
+        if (!in || !out) {
+          ok = false;
+          break;
+        }
+        rec.offset = end;
+        end += rec.bytes;
+      }
+    }
+    for (auto& rec : batch) {
+      if (!ok) {
+        break;
+      }
+      out.write(reinterpret_cast<const char*>(rec.payload.data()),
+                static_cast<std::streamsize>(rec.payload.size()));
+      if (!out) {
+        ok = false;
+        break;
+      }
+      std::vector<std::uint8_t>().swap(rec.payload);
+      rec.offset = end;
+      end += rec.bytes;
+    }
+    out.flush();
+    ok = ok && static_cast<bool>(out);
+  }
+
+  std::uint64_t spilled = 0;
+  std::error_code ec;
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  const auto it = shard.recipients.find(recipient);
+  if (it == shard.recipients.end() || it->second.spill_ticket != ticket) {
+    // Drained and dropped meanwhile; nobody else removes these files.
+    std::filesystem::remove(path, ec);
+    if (!old_path.empty()) {
+      std::filesystem::remove(old_path, ec);
+    }
+    return 0;
+  }
+  auto& queue = it->second;
+  queue.spill_ticket = 0;
+  if (!ok) {
+    if (fresh) {
+      std::filesystem::remove(path, ec);
+    }
+    ReleaseSpillLocked(queue);
+    return 0;
+  }
+  for (const auto& rec : live) {
+    const auto found = queue.by_id.find(rec.message_id);
+    if (found != queue.by_id.end()) {
+      found->second->spill_offset = rec.offset;
+    }
+  }
+  if (!old_path.empty()) {
+    std::filesystem::remove(old_path, ec);
+  }
+  queue.spill_path = path;
+  queue.spill_end = end;
+  for (const auto& rec : batch) {
+    const auto found = queue.by_id.find(rec.message_id);
+    if (found == queue.by_id.end() || found->second->spilled) {
+      continue;
+    }
+    auto& stored = *found->second;
+    stored.spilled = true;
+    stored.spill_offset = rec.offset;
+    std::vector<std::uint8_t>().swap(stored.msg.payload);
+    queue.resident_bytes -= stored.bytes;
+    queue.spilled_bytes += stored.bytes;
+    queue.spilled_messages++;
+    resident_bytes_.fetch_sub(stored.bytes, std::memory_order_relaxed);
+    spill_count_.fetch_add(1, std::memory_order_relaxed);
+    spilled += stored.bytes;
+  }
+  ReleaseSpillLocked(queue);
+  return spilled;
+}
+
+bool OfflineQueue::ReadSpilledLocked(const RecipientQueue& queue,
+                                     const StoredMessage& stored,
+                                     std::ifstream& in,
+                                     std::vector<std::uint8_t>& out) {
+  if (!in.is_open()) {
+    in.open(queue.spill_path, std::ios::binary | std::ios::in);
+    if (!in) {
+      return false;
+    }
+  }
+  in.clear();
+  in.seekg(static_cast<std::streamoff>(stored.spill_offset), std::ios::beg);
+  out.resize(static_cast<std::size_t>(stored.bytes));
+  in.read(reinterpret_cast<char*>(out.data()),
+          static_cast<std::streamsize>(out.size()));
+  if (!in || in.gcount() != static_cast<std::streamsize>(out.size())) {
+    out.clear();
+    return false;
+  }
+  restore_count_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool OfflineQueue::TakePayloadLocked(RecipientQueue& queue,
+                                     StoredMessage& stored, std::ifstream& in,
+                                     std::vector<std::uint8_t>& out) {
+  if (stored.spilled) {
+    return ReadSpilledLocked(queue, stored, in, out);
+  }
+  out = std::move(stored.msg.payload);
+  return true;
+}
+
 void OfflineQueue::CleanupExpiredLocked(Shard& shard,
                                        std::chrono::steady_clock::time_point now) {
   while (!shard.expiries.empty()) {
@@ -1471,14 +3068,42 @@ void OfflineQueue::CleanupExpiredLocked(Shard& shard,
       continue;
     }
 
-    queue.messages.erase(list_it);
-    queue.by_id.erase(mit);
+    EraseLocked(queue, list_it);
+    ReleaseSpillLocked(queue);
     if (queue.messages.empty()) {
       shard.recipients.erase(rit);
     }
   }
 }
 
+void OfflineQueue::EnqueueStored(const std::string& recipient,
+                                 StoredMessage stored) {
+  const auto now = stored.msg.created_at;
+  stored.bytes = static_cast<std::uint64_t>(stored.msg.payload.size());
+
+  auto& shard = shards_[ShardIndexFor(recipient)];
+  std::uint64_t own_excess = 0;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    CleanupExpiredLocked(shard, now);
+    stored.message_id = shard.next_id++;
+    auto& queue = shard.recipients[recipient];
+    queue.messages.push_back(std::move(stored));
+    const auto it = std::prev(queue.messages.end());
+    queue.by_id.emplace(it->message_id, it);
+    queue.by_kind[static_cast<std::size_t>(it->msg.kind)].emplace(
+        it->message_id, it);
+    queue.resident_bytes += it->bytes;
+    resident_bytes_.fetch_add(it->bytes, std::memory_order_relaxed);
+    shard.expiries.push(ExpiryItem{it->expires_at, recipient, it->message_id});
+    const std::uint64_t own_cap = limits_.max_recipient_resident_bytes;
+    if (own_cap != 0 && queue.resident_bytes > own_cap) {
+      own_excess = queue.resident_bytes - own_cap;
+    }
+  }
+  EnforceLimits(recipient, own_excess);
+}
+
 void OfflineQueue::Enqueue(const std::string& recipient,
                            std::vector<std::uint8_t> payload,
                            std::chrono::seconds ttl) {
@@ -1490,16 +3115,7 @@ void OfflineQueue::Enqueue(const std::string& recipient,
   stored.msg.created_at = now;
   stored.msg.ttl = (ttl == std::chrono::seconds::zero()) ? default_ttl_ : ttl;
   stored.expires_at = stored.msg.created_at + stored.msg.ttl;
-
-  auto& shard = shards_[ShardIndexFor(recipient)];
-  std::lock_guard<std::mutex> lock(shard.mutex);
-  CleanupExpiredLocked(shard, now);
-  stored.message_id = shard.next_id++;
-  auto& queue = shard.recipients[recipient];
-  queue.messages.push_back(std::move(stored));
-  const auto it = std::prev(queue.messages.end());
-  queue.by_id.emplace(it->message_id, it);
-  shard.expiries.push(ExpiryItem{it->expires_at, recipient, it->message_id});
+  EnqueueStored(recipient, std::move(stored));
 }
 
 void OfflineQueue::EnqueuePrivate(const std::string& recipient,
@@ -1515,16 +3131,7 @@ void OfflineQueue::EnqueuePrivate(const std::string& recipient,
   stored.msg.created_at = now;
   stored.msg.ttl = (ttl == std::chrono::seconds::zero()) ? default_ttl_ : ttl;
   stored.expires_at = stored.msg.created_at + stored.msg.ttl;
-
-  auto& shard = shards_[ShardIndexFor(recipient)];
-  std::lock_guard<std::mutex> lock(shard.mutex);
-  CleanupExpiredLocked(shard, now);
-  stored.message_id = shard.next_id++;
-  auto& queue = shard.recipients[recipient];
-  queue.messages.push_back(std::move(stored));
-  const auto it = std::prev(queue.messages.end());
-  queue.by_id.emplace(it->message_id, it);
-  shard.expiries.push(ExpiryItem{it->expires_at, recipient, it->message_id});
+  EnqueueStored(recipient, std::move(stored));
 }
 
 void OfflineQueue::EnqueueGroupCipher(const std::string& recipient,
@@ -1542,16 +3149,7 @@ void OfflineQueue::EnqueueGroupCipher(const std::string& recipient,
   stored.msg.created_at = now;
   stored.msg.ttl = (ttl == std::chrono::seconds::zero()) ? default_ttl_ : ttl;
   stored.expires_at = stored.msg.created_at + stored.msg.ttl;
-
-  auto& shard = shards_[ShardIndexFor(recipient)];
-  std::lock_guard<std::mutex> lock(shard.mutex);
-  CleanupExpiredLocked(shard, now);
-  stored.message_id = shard.next_id++;
-  auto& queue = shard.recipients[recipient];
-  queue.messages.push_back(std::move(stored));
-  const auto it = std::prev(queue.messages.end());
-  queue.by_id.emplace(it->message_id, it);
-  shard.expiries.push(ExpiryItem{it->expires_at, recipient, it->message_id});
+  EnqueueStored(recipient, std::move(stored));
 }
 
 void OfflineQueue::EnqueueGroupNotice(const std::string& recipient,
@@ -1569,16 +3167,7 @@ void OfflineQueue::EnqueueGroupNotice(const std::string& recipient,
   stored.msg.created_at = now;
   stored.msg.ttl = (ttl == std::chrono::seconds::zero()) ? default_ttl_ : ttl;
   stored.expires_at = stored.msg.created_at + stored.msg.ttl;
-
-  auto& shard = shards_[ShardIndexFor(recipient)];
-  std::lock_guard<std::mutex> lock(shard.mutex);
-  CleanupExpiredLocked(shard, now);
-  stored.message_id = shard.next_id++;
-  auto& queue = shard.recipients[recipient];
-  queue.messages.push_back(std::move(stored));
-  const auto it = std::prev(queue.messages.end());
-  queue.by_id.emplace(it->message_id, it);
-  shard.expiries.push(ExpiryItem{it->expires_at, recipient, it->message_id});
+  EnqueueStored(recipient, std::move(stored));
 }
 
 void OfflineQueue::EnqueueDeviceSync(const std::string& recipient,
@@ -1592,16 +3181,7 @@ void OfflineQueue::EnqueueDeviceSync(const std::string& recipient,
   stored.msg.created_at = now;
   stored.msg.ttl = (ttl == std::chrono::seconds::zero()) ? default_ttl_ : ttl;
   stored.expires_at = stored.msg.created_at + stored.msg.ttl;
-
-  auto& shard = shards_[ShardIndexFor(recipient)];
-  std::lock_guard<std::mutex> lock(shard.mutex);
-  CleanupExpiredLocked(shard, now);
-  stored.message_id = shard.next_id++;
-  auto& queue = shard.recipients[recipient];
-  queue.messages.push_back(std::move(stored));
-  const auto it = std::prev(queue.messages.end());
-  queue.by_id.emplace(it->message_id, it);
-  shard.expiries.push(ExpiryItem{it->expires_at, recipient, it->message_id});
+  EnqueueStored(recipient, std::move(stored));
 }
 
 std::vector<std::vector<std::uint8_t>> OfflineQueue::Drain(
@@ -1617,21 +3197,25 @@ std::vector<std::vector<std::uint8_t>> OfflineQueue::Drain(
     return out;
   }
   auto& queue = it->second;
+  std::ifstream spill;
   out.reserve(queue.messages.size());
   for (auto msg_it = queue.messages.begin(); msg_it != queue.messages.end();) {
     if (msg_it->expires_at <= now) {
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     if (msg_it->msg.kind == QueueMessageKind::kGeneric) {
-      out.push_back(std::move(msg_it->msg.payload));
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      std::vector<std::uint8_t> payload;
+      if (TakePayloadLocked(queue, *msg_it, spill, payload)) {
+        out.push_back(std::move(payload));
+      }
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     ++msg_it;
   }
+  spill.close();
+  ReleaseSpillLocked(queue);
   if (queue.messages.empty()) {
     shard.recipients.erase(it);
   }
@@ -1651,21 +3235,26 @@ std::vector<OfflineMessage> OfflineQueue::DrainPrivate(
     return out;
   }
   auto& queue = it->second;
+  std::ifstream spill;
   out.reserve(queue.messages.size());
   for (auto msg_it = queue.messages.begin(); msg_it != queue.messages.end();) {
     if (msg_it->expires_at <= now) {
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     if (msg_it->msg.kind == QueueMessageKind::kPrivate) {
-      out.push_back(std::move(msg_it->msg));
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      std::vector<std::uint8_t> payload;
+      if (TakePayloadLocked(queue, *msg_it, spill, payload)) {
+        out.push_back(std::move(msg_it->msg));
+        out.back().payload = std::move(payload);
+      }
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     ++msg_it;
   }
+  spill.close();
+  ReleaseSpillLocked(queue);
   if (queue.messages.empty()) {
     shard.recipients.erase(it);
   }
@@ -1685,21 +3274,26 @@ std::vector<OfflineMessage> OfflineQueue::DrainGroupCipher(
     return out;
   }
   auto& queue = it->second;
+  std::ifstream spill;
   out.reserve(queue.messages.size());
   for (auto msg_it = queue.messages.begin(); msg_it != queue.messages.end();) {
     if (msg_it->expires_at <= now) {
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     if (msg_it->msg.kind == QueueMessageKind::kGroupCipher) {
-      out.push_back(std::move(msg_it->msg));
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      std::vector<std::uint8_t> payload;
+      if (TakePayloadLocked(queue, *msg_it, spill, payload)) {
+        out.push_back(std::move(msg_it->msg));
+        out.back().payload = std::move(payload);
+      }
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     ++msg_it;
   }
+  spill.close();
+  ReleaseSpillLocked(queue);
   if (queue.messages.empty()) {
     shard.recipients.erase(it);
   }
@@ -1719,21 +3313,26 @@ std::vector<OfflineMessage> OfflineQueue::DrainGroupNotice(
     return out;
   }
   auto& queue = it->second;
+  std::ifstream spill;
   out.reserve(queue.messages.size());
   for (auto msg_it = queue.messages.begin(); msg_it != queue.messages.end();) {
     if (msg_it->expires_at <= now) {
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     if (msg_it->msg.kind == QueueMessageKind::kGroupNotice) {
-      out.push_back(std::move(msg_it->msg));
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      std::vector<std::uint8_t> payload;
+      if (TakePayloadLocked(queue, *msg_it, spill, payload)) {
+        out.push_back(std::move(msg_it->msg));
+        out.back().payload = std::move(payload);
+      }
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     ++msg_it;
   }
+  spill.close();
+  ReleaseSpillLocked(queue);
   if (queue.messages.empty()) {
     shard.recipients.erase(it);
   }
@@ -1753,37 +3352,108 @@ std::vector<std::vector<std::uint8_t>> OfflineQueue::DrainDeviceSync(
     return out;
   }
   auto& queue = it->second;
+  std::ifstream spill;
   out.reserve(queue.messages.size());
   for (auto msg_it = queue.messages.begin(); msg_it != queue.messages.end();) {
     if (msg_it->expires_at <= now) {
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     if (msg_it->msg.kind == QueueMessageKind::kDeviceSync) {
-      out.push_back(std::move(msg_it->msg.payload));
-      queue.by_id.erase(msg_it->message_id);
-      msg_it = queue.messages.erase(msg_it);
+      std::vector<std::uint8_t> payload;
+      if (TakePayloadLocked(queue, *msg_it, spill, payload)) {
+        out.push_back(std::move(payload));
+      }
+      msg_it = EraseLocked(queue, msg_it);
       continue;
     }
     ++msg_it;
   }
+  spill.close();
+  ReleaseSpillLocked(queue);
   if (queue.messages.empty()) {
     shard.recipients.erase(it);
   }
   return out;
 }
 
+OfflinePage OfflineQueue::FetchPage(const std::string& recipient,
+                                    QueueMessageKind kind,
+                                    const OfflinePageRequest& request) {
+  OfflinePage page;
+  page.cursor = request.ack_cursor;
+  const auto now = std::chrono::steady_clock::now();
+  auto& shard = shards_[ShardIndexFor(recipient)];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  CleanupExpiredLocked(shard, now);
+
+  auto it = shard.recipients.find(recipient);
+  if (it == shard.recipients.end()) {
+    return page;
+  }
+  auto& queue = it->second;
+  auto& index = queue.by_kind[static_cast<std::size_t>(kind)];
+  while (!index.empty() && index.begin()->first <= request.ack_cursor) {
+    EraseLocked(queue, index.begin()->second);
+  }
+  std::ifstream spill;
+  std::uint64_t page_bytes = 0;
+  for (auto pos = index.begin(); pos != index.end();) {
+    const MessageIter msg_it = pos->second;
+    ++pos;
+    if (msg_it->expires_at <= now) {
+      EraseLocked(queue, msg_it);
+      continue;
+    }
+    const bool count_full =
+        request.max_messages != 0 &&
+        page.messages.size() >= request.max_messages;
+    const bool bytes_full = request.max_bytes != 0 &&
+                            !page.messages.empty() &&
+                            page_bytes + msg_it->bytes > request.max_bytes;
+    if (count_full || bytes_full) {
+      page.has_more = true;
+      break;
+    }
+    if (msg_it->spilled) {
+      OfflineMessage copy;
+      copy.kind = msg_it->msg.kind;
+      copy.sender = msg_it->msg.sender;
+      copy.recipient = msg_it->msg.recipient;
+      copy.group_id = msg_it->msg.group_id;
+      copy.created_at = msg_it->msg.created_at;
+      copy.ttl = msg_it->msg.ttl;
+      if (!ReadSpilledLocked(queue, *msg_it, spill, copy.payload)) {
+        EraseLocked(queue, msg_it);
+        continue;
+      }
+      page.messages.push_back(std::move(copy));
+    } else {
+      page.messages.push_back(msg_it->msg);
+    }
+    page.cursor = msg_it->message_id;
+    page_bytes += msg_it->bytes;
+  }
+  spill.close();
+  ReleaseSpillLocked(queue);
+  if (queue.messages.empty()) {
+    shard.recipients.erase(it);
+  }
+  return page;
+}
+
 OfflineQueueStats OfflineQueue::GetStats() const {
   OfflineQueueStats stats;
   for (const auto& shard : shards_) {
     std::lock_guard<std::mutex> lock(shard.mutex);
     stats.recipients += static_cast<std::uint64_t>(shard.recipients.size());
     for (const auto& entry : shard.recipients) {
+      stats.resident_bytes += entry.second.resident_bytes;
+      stats.spilled_bytes += entry.second.spilled_bytes;
+      stats.spilled_messages += entry.second.spilled_messages;
       for (const auto& stored : entry.second.messages) {
         stats.messages++;
-        stats.bytes +=
-            static_cast<std::uint64_t>(stored.msg.payload.size());
+        stats.bytes += stored.bytes;
         switch (stored.msg.kind) {
           case QueueMessageKind::kGeneric:
             stats.generic_messages++;
@@ -1804,6 +3474,8 @@ OfflineQueueStats OfflineQueue::GetStats() const {
       }
     }
   }
+  stats.spill_count = spill_count_.load(std::memory_order_relaxed);
+  stats.restore_count = restore_count_.load(std::memory_order_relaxed);
   return stats;
 }
 
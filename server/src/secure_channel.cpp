@@ -49,6 +49,12 @@ void DeriveDirectionalKey(const std::array<std::uint8_t, 32>& base_key,
                        std::strlen(label));
 }
 
+constexpr std::uint8_t kZeroPad[16] = {};
+
+std::size_t PadTo16(std::uint64_t size) {
+  return static_cast<std::size_t>((16 - (size & 15)) & 15);
+}
+
 }  // namespace
 
 SecureChannel::SecureChannel(const DerivedKeys& keys, SecureChannelRole role) {
@@ -159,4 +165,110 @@ bool SecureChannel::Decrypt(const std::uint8_t* input, std::size_t len,
   return true;
 }
 
+// Mirrors crypto_aead_unlock (XChaCha20-Poly1305): the tag covers the
+// ciphertext, so it is fed to Poly1305 before being decrypted.
+bool SecureChannel::BeginDecrypt(const std::uint8_t* header,
+                                 std::uint64_t cipher_len,
+                                 FrameType frame_type,
+                                 DecryptStream& stream) const {
+  if (!header) {
+    return false;
+  }
+  const std::uint64_t seq = LoadLe64(header);
+  if (!CanAcceptSeq(seq)) {
+    return false;
+  }
+  std::uint8_t nonce[kNonceSize];
+  BuildNonce(seq, nonce);
+  std::uint8_t ad[2 + kSeqHeaderSize];
+  BuildAd(frame_type, seq, ad);
+
+  crypto_chacha20_h(stream.key_.data(), rx_key_.data(), nonce);
+  std::memcpy(stream.nonce_.data(), nonce + 16, stream.nonce_.size());
+  std::uint8_t auth_key[64];
+  crypto_chacha20_djb(auth_key, nullptr, sizeof(auth_key), stream.key_.data(),
+                      stream.nonce_.data(), 0);
+  crypto_poly1305_init(&stream.poly_, auth_key);
+  crypto_wipe(auth_key, sizeof(auth_key));
+  crypto_poly1305_update(&stream.poly_, ad, sizeof(ad));
+  crypto_poly1305_update(&stream.poly_, kZeroPad, PadTo16(sizeof(ad)));
+
+  stream.keystream_used_ = stream.keystream_.size();
+  stream.counter_ = 1;
+  stream.seq_ = seq;
+  stream.cipher_len_ = cipher_len;
+  stream.processed_ = 0;
+  stream.active_ = true;
+  return true;
+}
+
+bool SecureChannel::DecryptStream::Update(const std::uint8_t* cipher,
+                                          std::size_t len,
+                                          std::uint8_t* out_plain) {
+  if (!active_ || len > cipher_len_ - processed_) {
+    return false;
+  }
+  if (len == 0) {
+    return true;
+  }
+  if (!cipher || !out_plain) {
+    return false;
+  }
+  crypto_poly1305_update(&poly_, cipher, len);
+  processed_ += len;
+
+  std::size_t pos = 0;
+  while (pos < len && keystream_used_ < keystream_.size()) {
+    out_plain[pos] = cipher[pos] ^ keystream_[keystream_used_++];
+    ++pos;
+  }
+  const std::size_t whole = (len - pos) & ~static_cast<std::size_t>(63);
+  if (whole > 0) {
+    counter_ = crypto_chacha20_djb(out_plain + pos, cipher + pos, whole,
+                                   key_.data(), nonce_.data(), counter_);
+    pos += whole;
+  }
+  if (pos < len) {
+    counter_ = crypto_chacha20_djb(keystream_.data(), nullptr,
+                                   keystream_.size(), key_.data(),
+                                   nonce_.data(), counter_);
+    keystream_used_ = 0;
+    while (pos < len) {
+      out_plain[pos] = cipher[pos] ^ keystream_[keystream_used_++];
+      ++pos;
+    }
+  }
+  return true;
+}
+
+SecureChannel::DecryptStream::~DecryptStream() {
+  crypto_wipe(key_.data(), key_.size());
+  crypto_wipe(keystream_.data(), keystream_.size());
+  crypto_wipe(&poly_, sizeof(poly_));
+}
+
+bool SecureChannel::FinishDecrypt(DecryptStream& stream,
+                                  const std::uint8_t* mac) {
+  if (!stream.active_ || !mac || stream.processed_ != stream.cipher_len_) {
+    return false;
+  }
+  stream.active_ = false;
+  std::uint8_t sizes[16];
+  StoreLe64(2 + kSeqHeaderSize, sizes);
+  StoreLe64(stream.cipher_len_, sizes + 8);
+  crypto_poly1305_update(&stream.poly_, kZeroPad,
+                         PadTo16(stream.cipher_len_));
+  crypto_poly1305_update(&stream.poly_, sizes, sizeof(sizes));
+  std::uint8_t real_mac[kTagSize];
+  crypto_poly1305_final(&stream.poly_, real_mac);
+  const bool match = crypto_verify16(mac, real_mac) == 0;
+  crypto_wipe(real_mac, sizeof(real_mac));
+  // Another frame with the same sequence may have landed meanwhile.
+  if (!match || !CanAcceptSeq(stream.seq_)) {
+    return false;
+  }
+  MarkSeqReceived(stream.seq_);
+  return true;
+}
+
 }  // namespace mi::server
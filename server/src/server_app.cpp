@@ -703,6 +703,10 @@ bool ServerApp::Init(const std::string& config_path, std::string& error) {
   const bool require_secure_delete = config_.server.secure_delete_required;
   SecureDeleteConfig secure_delete;
   secure_delete.enabled = config_.server.secure_delete_enabled;
+  secure_delete.workers = config_.server.secure_delete_workers;
+  secure_delete.max_bytes_per_sec =
+      static_cast<std::uint64_t>(config_.server.secure_delete_mb_per_sec) *
+      1024u * 1024u;
   if (secure_delete.enabled) {
     secure_delete.plugin_path = config_.server.secure_delete_plugin;
     if (!secure_delete.plugin_path.is_absolute()) {
@@ -742,10 +746,14 @@ bool ServerApp::Init(const std::string& config_path, std::string& error) {
   call_cfg.idle_timeout_sec = config_.call.idle_timeout_sec;
   call_cfg.call_timeout_sec = config_.call.call_timeout_sec;
   call_cfg.max_subscriptions = config_.call.max_subscriptions;
+  call_cfg.roster_coalesce_ms = config_.call.roster_coalesce_ms;
   group_calls_ = std::make_unique<GroupCallManager>(call_cfg);
   directory_ = std::make_unique<GroupDirectory>();
   offline_storage_ = std::make_unique<OfflineStorage>(
-      storage_dir, std::chrono::hours(12), secure_delete);
+      storage_dir, std::chrono::hours(12), secure_delete,
+      config_.server.offline_blob_open_files,
+      static_cast<KeySyncPolicy>(
+          std::min<std::uint32_t>(config_.server.offline_key_sync, 2)));
   if ((secure_delete.enabled || require_secure_delete) &&
       !offline_storage_->SecureDeleteReady()) {
     error = offline_storage_->SecureDeleteError().empty()
@@ -753,7 +761,16 @@ bool ServerApp::Init(const std::string& config_path, std::string& error) {
                 : offline_storage_->SecureDeleteError();
     return false;
   }
-  offline_queue_ = std::make_unique<OfflineQueue>();
+  OfflineQueueLimits queue_limits;
+  queue_limits.max_resident_bytes =
+      static_cast<std::uint64_t>(config_.server.offline_queue_memory_mb) *
+      1024u * 1024u;
+  queue_limits.max_recipient_resident_bytes =
+      static_cast<std::uint64_t>(config_.server.offline_queue_recipient_mb) *
+      1024u * 1024u;
+  queue_limits.spill_dir = storage_dir / "queue_spill";
+  offline_queue_ = std::make_unique<OfflineQueue>(std::chrono::hours(24),
+                                                  queue_limits);
   media_relay_ = std::make_unique<MediaRelay>(
       2048, std::chrono::milliseconds(config_.call.media_ttl_ms));
   api_ = std::make_unique<ApiService>(sessions_.get(), groups_.get(),
@@ -766,7 +783,13 @@ bool ServerApp::Init(const std::string& config_path, std::string& error) {
                                                 config_.mysql)
                                           : std::nullopt,
                                       storage_dir,
-                                      kt_signing_key);
+                                      kt_signing_key,
+                                      KtEpochOptions{
+                                          config_.server.kt_epoch_ms,
+                                          config_.server.kt_epoch_leaves},
+                                      KtCheckpointOptions{
+                                          config_.server.kt_checkpoint_ms,
+                                          config_.server.kt_checkpoint_leaves});
   router_ = std::make_unique<FrameRouter>(api_.get());
   last_cleanup_ = std::chrono::steady_clock::now();
   return true;
@@ -102,6 +102,21 @@ int main() {
     return 1;
   }
 
+  // A one-shot upload larger than one session piece lands intact.
+  std::vector<std::uint8_t> big_blob(2u * 1024u * 1024u + 4096u);
+  for (std::size_t i = 0; i < big_blob.size(); ++i) {
+    big_blob[i] = static_cast<std::uint8_t>(i * 31u);
+  }
+  auto big_upload = api.StoreE2eeFileBlob(login_ok.token, big_blob);
+  if (!big_upload.success || big_upload.meta.size != big_blob.size()) {
+    return 1;
+  }
+  auto big_download =
+      api.LoadE2eeFileBlob(login_ok.token, big_upload.file_id, true);
+  if (!big_download.success || big_download.blob != big_blob) {
+    return 1;
+  }
+
   queue.Enqueue("alice", {9, 9, 9});
   auto offline = api.PullOffline(login_ok.token);
   if (!offline.success || offline.messages.size() != 1) {
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <string>
@@ -248,5 +249,76 @@ int main() {
     return 1;
   }
 
+  // A large upload chunk streams through a fixed window: its bytes land in
+  // the upload file uncommitted and count only once the tag verifies.
+  auto* storage = app.offline_storage();
+  const std::uint32_t chunk_len = 1024u * 1024u;
+  const auto up = storage->BeginBlobUpload("u1", chunk_len);
+  if (!up.success) {
+    return 1;
+  }
+  const std::vector<std::uint8_t> chunk(chunk_len, 0x5A);
+  std::vector<std::uint8_t> plain_chunk;
+  WriteString(up.file_id, plain_chunk);
+  WriteString(up.upload_id, plain_chunk);
+  mi::server::proto::WriteUint64(0, plain_chunk);
+  mi::server::proto::WriteBytes(chunk, plain_chunk);
+  const auto stream_chunk = [&](std::uint64_t seq, bool corrupt,
+                                std::size_t& peak) {
+    std::vector<std::uint8_t> cipher;
+    if (!ch.Encrypt(seq, FrameType::kE2eeFileUploadChunk, plain_chunk,
+                    cipher)) {
+      return false;
+    }
+    if (corrupt) {
+      cipher.back() ^= 0x01;
+    }
+    Frame frame;
+    frame.type = FrameType::kE2eeFileUploadChunk;
+    WriteString(token, frame.payload);
+    frame.payload.insert(frame.payload.end(), cipher.begin(), cipher.end());
+    const auto frame_bytes = mi::server::EncodeFrame(frame);
+    const std::size_t header = mi::server::kFrameHeaderSize;
+    auto stream = handler.BeginUploadChunkStream(
+        frame.type, static_cast<std::uint32_t>(frame_bytes.size() - header),
+        mi::server::TransportKind::kLocal);
+    if (!stream) {
+      return false;
+    }
+    for (std::size_t pos = header; pos < frame_bytes.size(); pos += 4096) {
+      const std::size_t len = std::min<std::size_t>(
+          4096, frame_bytes.size() - pos);
+      if (!stream->Feed(frame_bytes.data() + pos, len)) {
+        return false;
+      }
+      peak = std::max(peak, stream->buffered_bytes());
+    }
+    if (storage->QueryBlobUpload("u1", up.file_id, up.upload_id)
+            .bytes_received != 0) {
+      return false;
+    }
+    resp_bytes.clear();
+    return stream->Finish(resp_bytes);
+  };
+  std::size_t peak = 0;
+  if (!stream_chunk(4, true, peak) ||
+      storage->QueryBlobUpload("u1", up.file_id, up.upload_id)
+              .bytes_received != 0) {
+    return 1;
+  }
+  if (!stream_chunk(5, false, peak) || peak >= chunk_len / 8 ||
+      storage->QueryBlobUpload("u1", up.file_id, up.upload_id)
+              .bytes_received != chunk_len) {
+    return 1;
+  }
+  if (!storage->FinishBlobUpload("u1", up.file_id, up.upload_id, chunk_len)
+           .success) {
+    return 1;
+  }
+  const auto stored = storage->FetchBlob(up.file_id, false, err);
+  if (!stored.has_value() || *stored != chunk) {
+    return 1;
+  }
+
   return 0;
 }
@@ -1,13 +1,22 @@
 #include <array>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
+#include <vector>
 
 #include "crypto.h"
 
+using mi::server::crypto::ForceSha256Backend;
 using mi::server::crypto::HmacSha256;
+using mi::server::crypto::ResetSha256Backend;
 using mi::server::crypto::Sha256;
+using mi::server::crypto::Sha256Backend;
+using mi::server::crypto::Sha256BackendSupported;
+using mi::server::crypto::Sha256Batch;
 using mi::server::crypto::Sha256Digest;
 
 namespace {
@@ -40,19 +49,154 @@ void ExpectHmacSha256(const std::string& key, const std::string& message,
   assert(ToHex(digest) == expected_hex);
 }
 
-}  // namespace
+constexpr Sha256Backend kBackends[] = {
+    Sha256Backend::kPortable, Sha256Backend::kShaNi, Sha256Backend::kArmSha2,
+    Sha256Backend::kAvx2x8};
 
-int main() {
+const char* BackendName(Sha256Backend backend) {
+  switch (backend) {
+    case Sha256Backend::kPortable:
+      return "portable";
+    case Sha256Backend::kShaNi:
+      return "sha-ni";
+    case Sha256Backend::kArmSha2:
+      return "armv8-sha2";
+    case Sha256Backend::kAvx2x8:
+      return "avx2-x8";
+  }
+  return "?";
+}
+
+// FIPS 180-2 vectors, covering one, two and many blocks.
+void ExpectVectors() {
   ExpectSha256(
       "",
       "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
   ExpectSha256(
       "abc",
       "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  ExpectSha256(
+      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  ExpectSha256(
+      std::string(1000000, 'a'),
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
 
   ExpectHmacSha256(
       "key", "The quick brown fox jumps over the lazy dog",
       "f7bc83f430538424b13298e6aa6fb143ef4d59a14946175997479dbc2d1a3cd8");
+}
+
+std::vector<std::uint8_t> Pattern(std::size_t len, std::uint32_t seed) {
+  std::vector<std::uint8_t> out(len);
+  std::uint32_t x = seed * 2654435761u + 1;
+  for (auto& b : out) {
+    x = x * 1103515245u + 12345u;
+    b = static_cast<std::uint8_t>(x >> 24);
+  }
+  return out;
+}
+
+// Every length around the padding boundaries, in one mixed-length batch and
+// in uniform ones, against the portable single-message digests.
+void ExpectBatchMatchesPortable(Sha256Backend backend) {
+  std::vector<std::vector<std::uint8_t>> msgs;
+  for (std::size_t len = 0; len <= 200; ++len) {
+    msgs.push_back(Pattern(len, static_cast<std::uint32_t>(len)));
+  }
+  for (std::size_t i = 0; i < 11; ++i) {
+    msgs.push_back(Pattern(65, static_cast<std::uint32_t>(1000 + i)));
+  }
+  std::vector<Sha256Digest> expected(msgs.size());
+  assert(ForceSha256Backend(Sha256Backend::kPortable));
+  for (std::size_t i = 0; i < msgs.size(); ++i) {
+    Sha256(msgs[i].data(), msgs[i].size(), expected[i]);
+  }
+
+  assert(ForceSha256Backend(backend));
+  std::vector<const std::uint8_t*> ptrs;
+  std::vector<std::size_t> lens;
+  for (const auto& m : msgs) {
+    ptrs.push_back(m.data());
+    lens.push_back(m.size());
+  }
+  for (std::size_t count = 0; count <= msgs.size(); count += 13) {
+    std::vector<Sha256Digest> got(count);
+    Sha256Batch(ptrs.data(), lens.data(), count, got.data());
+    for (std::size_t i = 0; i < count; ++i) {
+      assert(got[i].bytes == expected[i].bytes);
+    }
+  }
+  std::vector<Sha256Digest> got(msgs.size());
+  Sha256Batch(ptrs.data(), lens.data(), msgs.size(), got.data());
+  for (std::size_t i = 0; i < msgs.size(); ++i) {
+    assert(got[i].bytes == expected[i].bytes);
+    Sha256Digest single;
+    Sha256(msgs[i].data(), msgs[i].size(), single);
+    assert(single.bytes == expected[i].bytes);
+  }
+}
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Merkle node sized messages (65 bytes), one at a time and batched.
+void Bench(Sha256Backend backend, std::size_t messages) {
+  std::vector<std::uint8_t> buf(messages * 65);
+  for (std::size_t i = 0; i < buf.size(); ++i) {
+    buf[i] = static_cast<std::uint8_t>(i * 131);
+  }
+  std::vector<const std::uint8_t*> ptrs(messages);
+  std::vector<std::size_t> lens(messages, 65);
+  for (std::size_t i = 0; i < messages; ++i) {
+    ptrs[i] = buf.data() + i * 65;
+  }
+  std::vector<Sha256Digest> out(messages);
+
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < messages; ++i) {
+    Sha256(ptrs[i], 65, out[i]);
+  }
+  const double single_s = Seconds(start);
+  start = std::chrono::steady_clock::now();
+  Sha256Batch(ptrs.data(), lens.data(), messages, out.data());
+  const double batch_s = Seconds(start);
+
+  std::printf("sha256 %-10s %zu x 65 B: single %.2f M/s, batch %.2f M/s\n",
+              BackendName(backend), messages, messages / single_s / 1e6,
+              messages / batch_s / 1e6);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  ExpectVectors();
+  std::size_t bench_messages = 1'000'000;
+  if (argc > 1) {
+    bench_messages =
+        static_cast<std::size_t>(std::strtoull(argv[1], nullptr, 10));
+  }
+
+  assert(Sha256BackendSupported(Sha256Backend::kPortable));
+  for (const auto backend : kBackends) {
+    if (!Sha256BackendSupported(backend)) {
+      assert(!ForceSha256Backend(backend));
+      std::printf("sha256 %-10s not supported here\n", BackendName(backend));
+      continue;
+    }
+    assert(ForceSha256Backend(backend));
+    ExpectVectors();
+    ExpectBatchMatchesPortable(backend);
+    if (bench_messages > 0) {
+      assert(ForceSha256Backend(backend));
+      Bench(backend, bench_messages);
+    }
+  }
+  ResetSha256Backend();
+  ExpectVectors();
 
   return 0;
 }
@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "group_call_manager.h"
+
+using mi::server::GroupCallConfig;
+using mi::server::GroupCallEvent;
+using mi::server::GroupCallManager;
+using mi::server::GroupCallOp;
+using mi::server::GroupCallSnapshot;
+
+namespace {
+
+std::string UserName(std::size_t i) {
+  char buf[16];
+  std::snprintf(buf, sizeof(buf), "u%04zu", i);
+  return buf;
+}
+
+GroupCallConfig MakeConfig(std::uint32_t coalesce_ms) {
+  GroupCallConfig cfg;
+  cfg.enable_group_call = true;
+  cfg.max_room_size = 1000;
+  cfg.roster_coalesce_ms = coalesce_ms;
+  return cfg;
+}
+
+bool Join(GroupCallManager& mgr, const std::array<std::uint8_t, 16>& call_id,
+          const std::string& group, const std::string& user) {
+  GroupCallSnapshot snap;
+  std::string err;
+  if (!mgr.JoinCall(group, call_id, user, 1, snap, err)) {
+    return false;
+  }
+  GroupCallEvent ev;
+  ev.op = GroupCallOp::kJoin;
+  ev.group_id = group;
+  ev.call_id = call_id;
+  ev.key_id = snap.key_id;
+  ev.sender = user;
+  ev.media_flags = 1;
+  mgr.PublishMemberEvent(ev);
+  return true;
+}
+
+struct LoadResult {
+  std::uint64_t deliveries{0};
+  std::uint64_t queued{0};
+  std::uint64_t flushes{0};
+  double cpu_ms{0.0};
+  double wall_ms{0.0};
+};
+
+// A room filling to max_room_size with the joins spread evenly over
+// |span_ms|.
+LoadResult FillRoom(std::uint32_t coalesce_ms, std::uint32_t span_ms) {
+  GroupCallManager mgr(MakeConfig(coalesce_ms));
+  std::array<std::uint8_t, 16> call_id{};
+  GroupCallSnapshot snap;
+  std::string err;
+  bool ok = mgr.CreateCall("g", "owner", 1, call_id, snap, err);
+  assert(ok);
+
+  const std::size_t joins = 999;
+  const auto start = std::chrono::steady_clock::now();
+  const std::clock_t cpu_start = std::clock();
+  for (std::size_t i = 0; i < joins; ++i) {
+    std::this_thread::sleep_until(
+        start + std::chrono::microseconds(std::uint64_t{span_ms} * 1000 * i /
+                                          joins));
+    ok = Join(mgr, call_id, "g", UserName(i));
+    assert(ok);
+  }
+  const std::clock_t cpu_end = std::clock();
+  const auto wall = std::chrono::steady_clock::now() - start;
+
+  LoadResult res;
+  const auto stats = mgr.GetStats();
+  assert(stats.participants == joins + 1);
+  res.queued = stats.events_queued;
+  res.deliveries = stats.events_queued + stats.events_merged;
+  res.flushes = stats.roster_flushes;
+  res.cpu_ms = 1000.0 * static_cast<double>(cpu_end - cpu_start) /
+               CLOCKS_PER_SEC;
+  res.wall_ms =
+      std::chrono::duration<double, std::milli>(wall).count();
+  std::printf(
+      "coalesce=%3u ms: %zu joins in %6.0f ms, %7llu deliveries, %6llu "
+      "queue entries, %4llu flushes, cpu %6.1f ms\n",
+      coalesce_ms, joins, res.wall_ms,
+      static_cast<unsigned long long>(res.deliveries),
+      static_cast<unsigned long long>(res.queued),
+      static_cast<unsigned long long>(res.flushes), res.cpu_ms);
+  return res;
+}
+
+void TestRosterFolding() {
+  GroupCallManager mgr(MakeConfig(50));
+  std::array<std::uint8_t, 16> call_id{};
+  GroupCallSnapshot snap;
+  std::string err;
+  bool ok = mgr.CreateCall("g", "alice", 1, call_id, snap, err);
+  assert(ok);
+  ok = Join(mgr, call_id, "g", "bob");
+  assert(ok);
+  ok = Join(mgr, call_id, "g", "carol");
+  assert(ok);
+  bool ended = false;
+  ok = mgr.LeaveCall("g", call_id, "carol", snap, ended, err);
+  assert(ok && !ended);
+  GroupCallEvent leave;
+  leave.op = GroupCallOp::kLeave;
+  leave.group_id = "g";
+  leave.call_id = call_id;
+  leave.sender = "carol";
+  mgr.PublishMemberEvent(leave);
+  GroupCallEvent update;
+  update.op = GroupCallOp::kUpdate;
+  update.group_id = "g";
+  update.call_id = call_id;
+  update.sender = "bob";
+  update.media_flags = 3;
+  mgr.PublishMemberEvent(update);
+
+  // Nothing is delivered inside the window; the waiting pull flushes it.
+  std::vector<GroupCallEvent> events;
+  mgr.PullEvents("alice", 8, std::chrono::milliseconds(0), events);
+  assert(events.empty());
+  mgr.PullEvents("alice", 8, std::chrono::milliseconds(1000), events);
+  assert(events.size() == 1);
+  const GroupCallEvent& ev = events[0];
+  assert(ev.op == GroupCallOp::kRoster);
+  assert(ev.key_id == snap.key_id);
+  assert(ev.roster.size() == 2);
+  assert(ev.roster[0].username == "bob");
+  assert(ev.roster[0].op == GroupCallOp::kJoin);
+  assert(ev.roster[0].media_flags == 3);
+  assert(ev.roster[1].username == "carol");
+  assert(ev.roster[1].op == GroupCallOp::kLeave);
+
+  // bob got the same diff; carol had left before the flush.
+  mgr.PullEvents("bob", 8, std::chrono::milliseconds(0), events);
+  assert(events.size() == 1 && events[0].roster.size() == 2);
+  mgr.PullEvents("carol", 8, std::chrono::milliseconds(0), events);
+  assert(events.empty());
+
+  std::array<std::uint8_t, 16> user_call{};
+  ok = mgr.GetUserCallId("bob", user_call);
+  assert(ok && user_call == call_id);
+  ok = mgr.GetUserCallId("carol", user_call);
+  assert(!ok);
+  ok = mgr.LeaveCall("g", call_id, "alice", snap, ended, err);
+  assert(ok && ended);
+  ok = mgr.GetUserCallId("bob", user_call);
+  assert(!ok);
+  (void)ok;
+}
+
+// Joins racing across calls: every user ends up in exactly one of them.
+void TestConcurrentCalls() {
+  GroupCallManager mgr(MakeConfig(20));
+  constexpr std::size_t kCalls = 8;
+  constexpr std::size_t kUsers = 800;
+  std::vector<std::array<std::uint8_t, 16>> ids(kCalls);
+  for (std::size_t c = 0; c < kCalls; ++c) {
+    GroupCallSnapshot snap;
+    std::string err;
+    const bool ok = mgr.CreateCall("g" + std::to_string(c),
+                                   "owner" + std::to_string(c), 1, ids[c],
+                                   snap, err);
+    assert(ok);
+    (void)ok;
+  }
+  std::atomic<std::size_t> joined{0};
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < kCalls; ++t) {
+    threads.emplace_back([&, t]() {
+      // Every thread tries every user, starting at a different offset.
+      for (std::size_t i = 0; i < kUsers; ++i) {
+        const std::size_t u = (i + t * kUsers / kCalls) % kUsers;
+        if (Join(mgr, ids[t], "g" + std::to_string(t), UserName(u))) {
+          joined.fetch_add(1);
+        }
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  assert(joined.load() == kUsers);
+  const auto stats = mgr.GetStats();
+  assert(stats.active_calls == kCalls);
+  assert(stats.participants == kUsers + kCalls);
+
+  std::size_t members = 0;
+  std::unordered_set<std::string> seen;
+  for (const auto& id : ids) {
+    GroupCallSnapshot snap;
+    const bool ok = mgr.GetCall(id, snap);
+    assert(ok);
+    (void)ok;
+    members += snap.members.size();
+    seen.insert(snap.members.begin(), snap.members.end());
+  }
+  assert(members == kUsers + kCalls && seen.size() == members);
+}
+
+}  // namespace
+
+int main() {
+  TestRosterFolding();
+  TestConcurrentCalls();
+
+  // 1000 joins in 10 s against a 200 ms window, time-compressed 10x to keep
+  // the test short: the ratio of window to join rate is what matters.
+  const LoadResult legacy = FillRoom(0, 0);
+  const LoadResult coalesced = FillRoom(20, 1000);
+
+  // Without coalescing join k reaches all k+1 members: O(N^2).
+  std::uint64_t expected_legacy = 0;
+  for (std::uint64_t k = 1; k <= 999; ++k) {
+    expected_legacy += k + 1;
+  }
+  assert(legacy.deliveries == expected_legacy);
+  assert(legacy.queued == expected_legacy);
+
+  // With it, at most one flush per window reaches the room, and members
+  // that do not pull hold a single merged event instead of a queue.
+  const std::uint64_t windows =
+      static_cast<std::uint64_t>(coalesced.wall_ms / 20.0) + 2;
+  assert(coalesced.flushes <= windows);
+  assert(coalesced.deliveries <= windows * 1000);
+  assert(coalesced.queued <= 1000);
+  assert(coalesced.deliveries * 4 < legacy.deliveries);
+  return 0;
+}
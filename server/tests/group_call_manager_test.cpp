@@ -61,6 +61,30 @@ int main() {
   assert(!alice_carol);
   assert(bob_audio);
 
+  // Members are sorted: alice=0, bob=1, carol=2.
+  const auto fanout = mgr.GetFanout(call_id);
+  assert(fanout);
+  assert(fanout->members.size() == 3 && fanout->words == 1);
+  const std::uint32_t bob_idx = fanout->index.at("bob");
+  const std::uint32_t carol_idx = fanout->index.at("carol");
+  assert(*fanout->Targets(bob_idx, mi::server::kGroupCallMediaAudio) == 0x5);
+  assert(*fanout->Targets(bob_idx, mi::server::kGroupCallMediaVideo) == 0x4);
+  assert(*fanout->Targets(carol_idx, mi::server::kGroupCallMediaAudio) == 0x2);
+  assert(!fanout->Targets(bob_idx, 0));
+  assert(fanout->PreferredLayers(bob_idx)[2] & 0x1);
+
+  subs[0].media_flags = mi::server::kGroupCallMediaAudio |
+                        mi::server::kGroupCallMediaVideo;
+  subs[0].video_layer = 0;
+  const bool layer_ok = mgr.UpdateSubscriptions(call_id, "alice", subs, err);
+  assert(layer_ok);
+  const auto layered = mgr.GetFanout(call_id);
+  assert(layered->version > fanout->version);
+  const std::uint64_t* bob_layers = layered->PreferredLayers(bob_idx);
+  assert((bob_layers[0] & 0x1) && !(bob_layers[2] & 0x1));
+  assert(bob_layers[2] & 0x4);
+  assert(*layered->Targets(bob_idx, mi::server::kGroupCallMediaVideo) == 0x5);
+
   // Room full after 3 members.
   const bool join_dave = mgr.JoinCall("g1", call_id, "dave", 1, snap, err);
   assert(!join_dave);
@@ -71,6 +95,10 @@ int main() {
   assert(leave_bob);
   assert(!ended);
   assert(snap.key_id == 4);
+  const auto after_leave = mgr.GetFanout(call_id);
+  assert(after_leave && after_leave->version > fanout->version);
+  assert(after_leave->members.size() == 2);
+  assert(fanout->members.size() == 3);
 
   ended = false;
   const bool leave_alice = mgr.LeaveCall("g1", call_id, "alice", snap, ended, err);
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "api_service.h"
@@ -26,6 +27,8 @@ using mi::server::GroupCallManager;
 using mi::server::GroupDirectory;
 using mi::server::GroupManager;
 using mi::server::MediaRelay;
+using mi::server::MediaRelayPacket;
+using mi::server::MediaRelayPacketRef;
 using mi::server::SessionManager;
 using mi::server::proto::ReadBytes;
 using mi::server::proto::ReadString;
@@ -80,9 +83,153 @@ Frame MakeGroupCallSignal(std::uint8_t op,
   return f;
 }
 
+MediaRelayPacket MakeMediaPacket(std::uint8_t tag) {
+  MediaRelayPacket pkt;
+  pkt.sender = "alice";
+  pkt.payload = {tag};
+  return pkt;
+}
+
+void TestMediaRelayRing() {
+  std::array<std::uint8_t, 16> call_id{};
+  call_id[0] = 7;
+
+  MediaRelay relay(4, std::chrono::milliseconds(50));
+  for (std::uint8_t i = 0; i < 10; ++i) {
+    relay.Enqueue("bob", call_id, MakeMediaPacket(i));
+  }
+  auto stats = relay.GetStats();
+  assert(stats.queues == 1);
+  assert(stats.packets == 4);
+  assert(stats.dropped == 6);
+  std::vector<MediaRelayPacket> pulled;
+  relay.Pull("bob", call_id, 16, std::chrono::milliseconds(0), pulled);
+  assert(pulled.size() == 4);
+  for (std::size_t i = 0; i < pulled.size(); ++i) {
+    assert(pulled[i].payload[0] == 6 + i);
+  }
+
+  relay.EnqueueMany({"bob", "carol"}, call_id, MakeMediaPacket(42));
+  std::vector<MediaRelayPacketRef> bob_refs;
+  std::vector<MediaRelayPacketRef> carol_refs;
+  relay.Pull("bob", call_id, 16, std::chrono::milliseconds(0), bob_refs);
+  relay.Pull("carol", call_id, 16, std::chrono::milliseconds(0), carol_refs);
+  assert(bob_refs.size() == 1 && carol_refs.size() == 1);
+  assert(bob_refs[0].get() == carol_refs[0].get());
+  const MediaRelayPacket copied = bob_refs[0].Detach();
+  assert(copied.payload[0] == 42);
+  assert(carol_refs[0]->payload[0] == 42);
+
+  const std::vector<std::string> roster = {"alice", "bob", "carol"};
+  const std::uint64_t to_bob_and_carol = 0x6;
+  relay.EnqueueFanout(call_id, 1, roster, &to_bob_and_carol, 1,
+                      MakeMediaPacket(43));
+  relay.Pull("bob", call_id, 16, std::chrono::milliseconds(0), bob_refs);
+  relay.Pull("carol", call_id, 16, std::chrono::milliseconds(0), carol_refs);
+  relay.Pull("alice", call_id, 16, std::chrono::milliseconds(0), pulled);
+  assert(bob_refs.size() == 1 && carol_refs.size() == 1 && pulled.empty());
+  assert(bob_refs[0].get() == carol_refs[0].get());
+  assert(bob_refs[0]->payload[0] == 43);
+
+  // Simulcast: bob wants layer 0 of alice, carol layer 2. Nobody gets video
+  // before a keyframe, then each follows its own layer.
+  const std::uint64_t preferred[3] = {0x2, 0x0, 0x4};
+  mi::server::MediaRelayLayerSelect select;
+  select.sender = 0;
+  select.preferred = preferred;
+  const auto send_layer = [&](std::uint8_t layer, bool keyframe,
+                              std::uint8_t tag) {
+    select.layer = layer;
+    select.keyframe = keyframe;
+    relay.EnqueueFanout(call_id, 1, roster, &to_bob_and_carol, 1,
+                        MakeMediaPacket(tag), &select);
+  };
+  const auto pulled_tags = [&](const std::string& who) {
+    std::vector<std::uint8_t> tags;
+    relay.Pull(who, call_id, 16, std::chrono::milliseconds(0), pulled);
+    for (const auto& pkt : pulled) {
+      tags.push_back(pkt.payload[0]);
+    }
+    return tags;
+  };
+  send_layer(2, false, 10);
+  send_layer(0, true, 11);
+  send_layer(2, false, 12);
+  send_layer(2, true, 13);
+  send_layer(0, false, 14);
+  assert((pulled_tags("bob") == std::vector<std::uint8_t>{11, 14}));
+  assert((pulled_tags("carol") == std::vector<std::uint8_t>{11, 13}));
+
+  std::thread producer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    relay.Enqueue("bob", call_id, MakeMediaPacket(99));
+  });
+  relay.Pull("bob", call_id, 16, std::chrono::milliseconds(2000), pulled);
+  producer.join();
+  assert(pulled.size() == 1);
+  assert(pulled[0].payload[0] == 99);
+
+  relay.Enqueue("bob", call_id, MakeMediaPacket(1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(80));
+  relay.Cleanup();
+  stats = relay.GetStats();
+  assert(stats.packets == 0);
+  assert(stats.queues == 0);
+}
+
+void TestMediaRelayLayersSurviveExpiry() {
+  std::array<std::uint8_t, 16> call_id{};
+  call_id[0] = 8;
+
+  MediaRelay relay(16, std::chrono::milliseconds(100));
+  const std::vector<std::string> roster = {"alice", "bob", "carol", "dave"};
+  const std::uint64_t to_bob_and_carol = 0x6;
+  const std::uint64_t preferred[3] = {0x2, 0x0, 0x4};
+  mi::server::MediaRelayLayerSelect select;
+  select.sender = 0;
+  select.preferred = preferred;
+  std::vector<MediaRelayPacket> pulled;
+  const auto send_layer = [&](std::uint8_t layer, bool keyframe,
+                              std::uint8_t tag) {
+    select.layer = layer;
+    select.keyframe = keyframe;
+    relay.EnqueueFanout(call_id, 1, roster, &to_bob_and_carol, 1,
+                        MakeMediaPacket(tag), &select);
+  };
+  const auto pulled_tags = [&](const std::string& who) {
+    std::vector<std::uint8_t> tags;
+    relay.Pull(who, call_id, 16, std::chrono::milliseconds(0), pulled);
+    for (const auto& pkt : pulled) {
+      tags.push_back(pkt.payload[0]);
+    }
+    return tags;
+  };
+  send_layer(0, true, 1);
+  send_layer(2, true, 2);
+  assert((pulled_tags("bob") == std::vector<std::uint8_t>{1}));
+  assert((pulled_tags("carol") == std::vector<std::uint8_t>{1, 2}));
+
+  // Alice and dave never pull and expire; bob and carol keep their layers
+  // without waiting for another keyframe.
+  for (int i = 0; i < 2; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    pulled_tags("bob");
+    pulled_tags("carol");
+  }
+  relay.Cleanup();
+  assert(relay.GetStats().queues == 2);
+  send_layer(0, false, 3);
+  send_layer(2, false, 4);
+  assert((pulled_tags("bob") == std::vector<std::uint8_t>{3}));
+  assert((pulled_tags("carol") == std::vector<std::uint8_t>{4}));
+}
+
 }  // namespace
 
 int main() {
+  TestMediaRelayRing();
+  TestMediaRelayLayersSurviveExpiry();
+
   DemoUserTable table;
   DemoUser alice;
   alice.username.set("alice");
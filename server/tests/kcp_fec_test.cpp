@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "ikcp.h"
+#include "kcp_fec.h"
+
+using mi::shard::FecConfig;
+using mi::shard::KcpFec;
+
+namespace {
+
+std::uint32_t g_now = 0;
+
+std::uint32_t NextRandom(std::uint32_t& state) {
+  state = state * 1664525u + 1013904223u;
+  return state >> 8;
+}
+
+void TestGf256() {
+  std::uint32_t rng = 7;
+  std::vector<std::uint8_t> src(101);
+  for (auto& b : src) {
+    b = static_cast<std::uint8_t>(NextRandom(rng));
+  }
+  for (unsigned c = 0; c < 256; ++c) {
+    const auto coef = static_cast<std::uint8_t>(c);
+    if (c != 0) {
+      assert(mi::shard::gf256::Mul(coef, mi::shard::gf256::Inv(coef)) == 1);
+    }
+    // Odd length: vector body plus scalar tail.
+    std::vector<std::uint8_t> dst(src.size(), 0x5A);
+    mi::shard::gf256::MulAddRegion(coef, src.data(), dst.data(), dst.size());
+    for (std::size_t i = 0; i < src.size(); ++i) {
+      assert(dst[i] == (0x5A ^ mi::shard::gf256::Mul(coef, src[i])));
+    }
+  }
+}
+
+// Every way of losing up to |parity| of the shards is repaired.
+void TestReedSolomon() {
+  constexpr std::size_t kData = 8;
+  constexpr std::size_t kParity = 3;
+  constexpr std::size_t kLen = 77;
+  std::uint32_t rng = 99;
+  std::vector<std::vector<std::uint8_t>> shards(kData + kParity,
+                                                std::vector<std::uint8_t>(kLen));
+  std::vector<const std::uint8_t*> data_ptrs;
+  std::vector<std::uint8_t*> parity_ptrs;
+  for (std::size_t i = 0; i < kData; ++i) {
+    for (auto& b : shards[i]) {
+      b = static_cast<std::uint8_t>(NextRandom(rng));
+    }
+    data_ptrs.push_back(shards[i].data());
+  }
+  for (std::size_t p = 0; p < kParity; ++p) {
+    parity_ptrs.push_back(shards[kData + p].data());
+  }
+  mi::shard::RsEncode(kData, kParity, data_ptrs, parity_ptrs, kLen);
+
+  const std::size_t n = kData + kParity;
+  std::size_t cases = 0;
+  for (std::size_t a = 0; a < n; ++a) {
+    for (std::size_t b = a; b < n; ++b) {
+      for (std::size_t c = b; c < n; ++c) {
+        auto copy = shards;
+        std::vector<bool> present(n, true);
+        for (const std::size_t lost : {a, b, c}) {
+          present[lost] = false;
+          copy[lost].assign(kLen, 0);
+        }
+        const bool ok =
+            mi::shard::RsReconstruct(kData, kParity, copy, present, kLen);
+        assert(ok);
+        (void)ok;
+        for (std::size_t i = 0; i < kData; ++i) {
+          assert(copy[i] == shards[i]);
+        }
+        ++cases;
+      }
+    }
+  }
+  assert(cases > 200);
+  (void)cases;
+
+  // One shard short of |data| cannot be repaired.
+  std::vector<bool> present(n, true);
+  for (std::size_t i = 0; i < kParity + 1; ++i) {
+    present[i] = false;
+  }
+  assert(!mi::shard::RsReconstruct(kData, kParity, shards, present, kLen));
+
+  assert(mi::shard::FecParityForLoss(8, 4, 0.0) == 0);
+  const std::uint32_t at10 = mi::shard::FecParityForLoss(8, 6, 0.10);
+  const std::uint32_t at2 = mi::shard::FecParityForLoss(8, 6, 0.02);
+  assert(at10 > at2 && at10 <= 6);
+  (void)at10;
+  (void)at2;
+}
+
+// One direction of a link: fixed delay, random loss from a fixed seed.
+struct Link {
+  Link(std::uint32_t delay, double loss_rate, std::uint32_t seed)
+      : delay_ms(delay), loss(loss_rate), rng(seed) {}
+
+  std::uint32_t delay_ms{0};
+  double loss{0.0};
+  std::uint32_t rng{0};
+  std::uint64_t bytes{0};
+  std::deque<std::pair<std::uint32_t, std::vector<std::uint8_t>>> queue;
+
+  void Send(const std::uint8_t* data, std::size_t len) {
+    bytes += len;
+    if (NextRandom(rng) / static_cast<double>(1u << 24) < loss) {
+      return;
+    }
+    queue.emplace_back(g_now + delay_ms,
+                       std::vector<std::uint8_t>(data, data + len));
+  }
+};
+
+struct Endpoint {
+  ikcpcb* kcp{nullptr};
+  std::unique_ptr<KcpFec> fec;
+  Link* out{nullptr};
+
+  ~Endpoint() { ikcp_release(kcp); }
+};
+
+void WireOutput(const std::uint8_t* data, std::size_t len, void* user) {
+  static_cast<Endpoint*>(user)->out->Send(data, len);
+}
+
+void KcpInput(const std::uint8_t* data, std::size_t len, void* user) {
+  ikcp_input(static_cast<Endpoint*>(user)->kcp,
+             reinterpret_cast<const char*>(data), static_cast<long>(len));
+}
+
+int KcpOutput(const char* buf, int len, ikcpcb* /*kcp*/, void* user) {
+  auto* ep = static_cast<Endpoint*>(user);
+  const auto* data = reinterpret_cast<const std::uint8_t*>(buf);
+  if (ep->fec) {
+    ep->fec->Send(data, static_cast<std::size_t>(len), g_now);
+  } else {
+    ep->out->Send(data, static_cast<std::size_t>(len));
+  }
+  return 0;
+}
+
+void SetupEndpoint(Endpoint& ep, Link* out, bool fec) {
+  ep.kcp = ikcp_create(0x1234, &ep);
+  ep.kcp->output = KcpOutput;
+  ep.out = out;
+  // Server defaults.
+  ikcp_nodelay(ep.kcp, 1, 10, 2, 1);
+  ep.kcp->rx_minrto = 30;
+  if (fec) {
+    ikcp_setmtu(ep.kcp, 1400 - static_cast<int>(mi::shard::kFecOverhead));
+    FecConfig cfg;
+    ep.fec = std::make_unique<KcpFec>(0x1234, cfg, WireOutput, KcpInput, &ep);
+  }
+}
+
+void Deliver(Link& link, Endpoint& to) {
+  while (!link.queue.empty() && link.queue.front().first <= g_now) {
+    const auto& pkt = link.queue.front().second;
+    if (!to.fec || !to.fec->Receive(pkt.data(), pkt.size())) {
+      ikcp_input(to.kcp, reinterpret_cast<const char*>(pkt.data()),
+                 static_cast<long>(pkt.size()));
+    }
+    link.queue.pop_front();
+  }
+}
+
+struct LatencyResult {
+  std::size_t delivered{0};
+  std::uint32_t p50{0};
+  std::uint32_t p99{0};
+  std::uint32_t max{0};
+  std::uint64_t wire_bytes{0};
+  std::uint64_t recovered{0};
+};
+
+// 20 ms voice frames over a 40 ms each-way link with |loss| in both
+// directions, on a simulated millisecond clock.
+LatencyResult RunVoice(bool fec, double loss) {
+  constexpr std::uint32_t kFrames = 1500;
+  constexpr std::uint32_t kFrameMs = 20;
+  constexpr std::size_t kFrameBytes = 160;
+  g_now = 0;
+  Link up{40, loss, 12345};
+  Link down{40, loss, 54321};
+  Endpoint sender;
+  Endpoint receiver;
+  SetupEndpoint(sender, &up, fec);
+  SetupEndpoint(receiver, &down, fec);
+
+  std::vector<std::uint32_t> latency;
+  std::uint32_t sent = 0;
+  std::vector<char> buf(4096);
+  for (; g_now < kFrames * kFrameMs + 5000; ++g_now) {
+    if (sent < kFrames && g_now % kFrameMs == 0) {
+      std::vector<char> frame(kFrameBytes, 0);
+      std::memcpy(frame.data(), &g_now, sizeof(g_now));
+      ikcp_send(sender.kcp, frame.data(), static_cast<int>(frame.size()));
+      ikcp_flush(sender.kcp);
+      ++sent;
+    }
+    Deliver(up, receiver);
+    Deliver(down, sender);
+    for (Endpoint* ep : {&sender, &receiver}) {
+      ikcp_update(ep->kcp, g_now);
+      if (ep->fec) {
+        ep->fec->Poll(g_now);
+      }
+    }
+    for (;;) {
+      const int n = ikcp_recv(receiver.kcp, buf.data(),
+                              static_cast<int>(buf.size()));
+      if (n <= 0) {
+        break;
+      }
+      std::uint32_t stamp = 0;
+      std::memcpy(&stamp, buf.data(), sizeof(stamp));
+      latency.push_back(g_now - stamp);
+    }
+  }
+
+  LatencyResult res;
+  res.delivered = latency.size();
+  std::sort(latency.begin(), latency.end());
+  if (!latency.empty()) {
+    res.p50 = latency[latency.size() / 2];
+    res.p99 = latency[latency.size() * 99 / 100];
+    res.max = latency.back();
+  }
+  res.wire_bytes = up.bytes + down.bytes;
+  res.recovered = fec ? receiver.fec->stats().recovered : 0;
+  std::printf(
+      "%s loss=%2.0f%%: p50=%3u ms p99=%3u ms max=%3u ms, wire %6llu bytes, "
+      "%llu recovered\n",
+      fec ? "fec " : "arq ", loss * 100.0, res.p50, res.p99, res.max,
+      static_cast<unsigned long long>(res.wire_bytes),
+      static_cast<unsigned long long>(res.recovered));
+  assert(res.delivered == kFrames);
+  return res;
+}
+
+}  // namespace
+
+int main() {
+  TestGf256();
+  TestReedSolomon();
+
+  const LatencyResult clean = RunVoice(true, 0.0);
+  // Adaptive parity: on a clean link the peer reports no loss and parity
+  // stops after the first groups.
+  const LatencyResult clean_arq = RunVoice(false, 0.0);
+  assert(clean.wire_bytes < clean_arq.wire_bytes * 3 / 2);
+
+  for (const double loss : {0.05, 0.10}) {
+    const LatencyResult arq = RunVoice(false, loss);
+    const LatencyResult fec = RunVoice(true, loss);
+    // Repairs land within a group delay instead of an RTO or fast resend.
+    assert(fec.recovered > 0);
+    assert(fec.p99 * 3 <= arq.p99 * 2);
+    (void)arq;
+    (void)fec;
+  }
+  (void)clean;
+  (void)clean_arq;
+  return 0;
+}
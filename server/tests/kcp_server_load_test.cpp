@@ -0,0 +1,627 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX 1
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "ikcp.h"
+#include "kcp_server.h"
+// After kcp_server.h: config.h names the top-level ::shard as "shard".
+#include "kcp_fec.h"
+
+using mi::server::KcpOptions;
+using mi::server::KcpServer;
+using mi::server::KcpWorkerStats;
+using mi::server::NetworkServerLimits;
+
+namespace {
+
+#ifdef _WIN32
+using Socket = SOCKET;
+void CloseSocket(Socket s) { closesocket(s); }
+void SetNonBlocking(Socket s) {
+  u_long mode = 1;
+  ioctlsocket(s, FIONBIO, &mode);
+}
+#else
+using Socket = int;
+void CloseSocket(Socket s) { close(s); }
+void SetNonBlocking(Socket s) {
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+}
+#endif
+
+constexpr std::size_t kClients = 16;
+constexpr std::size_t kClientThreads = 4;
+constexpr std::uint32_t kMessagesPerClient = 600;
+constexpr std::size_t kMessageBytes = 96;
+constexpr std::size_t kCookieBytes = 24;
+constexpr std::uint32_t kIdleSessions = 10000;
+constexpr std::size_t kHandshakeChunk = 128;
+constexpr char kSlow = 'S';
+constexpr std::uint32_t kSlowMs = 1500;
+
+std::uint32_t NowMs() {
+  static const auto kStart = std::chrono::steady_clock::now();
+  return static_cast<std::uint32_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - kStart)
+          .count());
+}
+
+// User + system CPU of the whole process; the clients sleep while it is
+// sampled, so this is the server's.
+double ProcessCpuMs() {
+#ifdef _WIN32
+  FILETIME created, exited, kernel, user;
+  GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+  const auto ticks = [](const FILETIME& ft) {
+    return (static_cast<std::uint64_t>(ft.dwHighDateTime) << 32) |
+           ft.dwLowDateTime;
+  };
+  return static_cast<double>(ticks(kernel) + ticks(user)) / 10000.0;
+#else
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+         usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+#endif
+}
+
+// One KCP client: cookie handshake, then |kMessagesPerClient| pipelined
+// requests, counting the echoes.
+struct Client {
+  Socket sock{};
+  std::uint32_t conv{0};
+  ikcpcb* kcp{nullptr};
+  std::unique_ptr<mi::shard::KcpFec> fec;
+  std::uint32_t sent{0};
+  std::uint32_t echoed{0};
+
+  ~Client() {
+    if (kcp) {
+      ikcp_release(kcp);
+    }
+    CloseSocket(sock);
+  }
+
+  static int Output(const char* buf, int len, ikcpcb* kcp, void* user) {
+    auto* self = static_cast<Client*>(user);
+    if (self->fec) {
+      self->fec->Send(reinterpret_cast<const std::uint8_t*>(buf),
+                      static_cast<std::size_t>(len), kcp->current);
+    } else {
+      send(self->sock, buf, len, 0);
+    }
+    return 0;
+  }
+  static void FecOutput(const std::uint8_t* data, std::size_t len,
+                        void* user) {
+    send(static_cast<Client*>(user)->sock,
+         reinterpret_cast<const char*>(data), static_cast<int>(len), 0);
+  }
+  static void FecInput(const std::uint8_t* data, std::size_t len, void* user) {
+    ikcp_input(static_cast<Client*>(user)->kcp,
+               reinterpret_cast<const char*>(data), static_cast<long>(len));
+  }
+
+  void Input(const char* buf, int n) {
+    if (!fec || !fec->Receive(reinterpret_cast<const std::uint8_t*>(buf),
+                              static_cast<std::size_t>(n))) {
+      ikcp_input(kcp, buf, n);
+    }
+  }
+
+  void Update(std::uint32_t now) {
+    ikcp_update(kcp, now);
+    if (fec) {
+      fec->Poll(now);
+    }
+  }
+
+  // |want_fec| asks for FEC in the hello; it is used only if the server's
+  // challenge grants it.
+  bool Connect(std::uint16_t port, std::uint32_t conv_id,
+               bool want_fec = false) {
+    conv = conv_id;
+    sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) !=
+        0) {
+      return false;
+    }
+    std::array<std::uint8_t, kCookieBytes> pkt{};
+    std::memcpy(pkt.data(), &conv, 4);  // little-endian hosts only
+    pkt[4] = 0xFF;
+    pkt[5] = 1;
+    pkt[6] = want_fec ? 1 : 0;
+    std::array<std::uint8_t, kCookieBytes> challenge{};
+    bool got = false;
+    for (int attempt = 0; attempt < 50 && !got; ++attempt) {
+      send(sock, reinterpret_cast<const char*>(pkt.data()),
+           static_cast<int>(pkt.size()), 0);
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(sock, &fds);
+      timeval tv{0, 100000};
+      if (select(static_cast<int>(sock) + 1, &fds, nullptr, nullptr, &tv) >
+          0) {
+        got = recv(sock, reinterpret_cast<char*>(challenge.data()),
+                   static_cast<int>(challenge.size()), 0) ==
+                  static_cast<int>(challenge.size()) &&
+              challenge[5] == 2;
+      }
+    }
+    if (!got) {
+      return false;
+    }
+    challenge[5] = 3;
+    challenge[6] &= pkt[6];
+    send(sock, reinterpret_cast<const char*>(challenge.data()),
+         static_cast<int>(challenge.size()), 0);
+    SetNonBlocking(sock);
+
+    kcp = ikcp_create(conv, this);
+    kcp->output = Output;
+    int mtu = 1400;
+    if (challenge[6] != 0) {
+      fec = std::make_unique<mi::shard::KcpFec>(
+          conv, mi::shard::FecConfig{}, FecOutput, FecInput, this);
+      mtu -= static_cast<int>(mi::shard::kFecOverhead);
+    }
+    ikcp_setmtu(kcp, mtu);
+    ikcp_wndsize(kcp, 256, 256);
+    ikcp_nodelay(kcp, 1, 10, 2, 1);
+    return true;
+  }
+
+  void Step(std::uint32_t now) {
+    char buf[2048];
+    for (;;) {
+      const int n = recv(sock, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        break;
+      }
+      Input(buf, n);
+    }
+    std::array<char, kMessageBytes> msg{};
+    while (sent < kMessagesPerClient && ikcp_waitsnd(kcp) < 128) {
+      std::memcpy(msg.data(), &sent, sizeof(sent));
+      ikcp_send(kcp, msg.data(), static_cast<int>(msg.size()));
+      ++sent;
+    }
+    Update(now);
+    for (;;) {
+      const int n = ikcp_recv(kcp, buf, sizeof(buf));
+      if (n <= 0) {
+        break;
+      }
+      std::uint32_t seq = 0;
+      std::memcpy(&seq, buf, sizeof(seq));
+      assert(n == static_cast<int>(kMessageBytes) && seq == echoed);
+      ++echoed;
+    }
+  }
+
+  bool done() const { return echoed == kMessagesPerClient; }
+
+  // Feeds received datagrams to KCP and collects whole messages.
+  void Pump(std::uint32_t now, std::vector<std::vector<char>>& out) {
+    char buf[2048];
+    for (;;) {
+      const int n = recv(sock, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        break;
+      }
+      Input(buf, n);
+    }
+    Update(now);
+    for (;;) {
+      const int n = ikcp_recv(kcp, buf, sizeof(buf));
+      if (n <= 0) {
+        break;
+      }
+      out.emplace_back(buf, buf + n);
+    }
+  }
+};
+
+struct RunResult {
+  double seconds{0.0};
+  std::uint64_t echoed{0};
+  std::vector<KcpWorkerStats> stats;
+};
+
+RunResult RunLoad(std::uint32_t workers, std::uint32_t conv_base) {
+  KcpOptions options;
+  options.workers = workers;
+  NetworkServerLimits limits;
+  limits.max_connections = 1024;
+  limits.max_connections_per_ip = 1024;
+  std::atomic<std::uint64_t> requests{0};
+  KcpServer server(
+      [&requests](const std::vector<std::uint8_t>& request,
+                  std::vector<std::uint8_t>& response, const std::string&) {
+        requests.fetch_add(1, std::memory_order_relaxed);
+        response = request;
+        return true;
+      },
+      0, options, limits);
+  std::string err;
+  const bool started = server.Start(err);
+  assert(started);
+  (void)started;
+
+  std::vector<std::unique_ptr<Client>> clients;
+  for (std::size_t i = 0; i < kClients; ++i) {
+    clients.push_back(std::make_unique<Client>());
+    const bool connected = clients.back()->Connect(
+        server.port(), conv_base + static_cast<std::uint32_t>(i));
+    assert(connected);
+    (void)connected;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < kClientThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      const auto deadline = start + std::chrono::seconds(20);
+      for (;;) {
+        bool all_done = true;
+        const std::uint32_t now = NowMs();
+        for (std::size_t i = t; i < clients.size(); i += kClientThreads) {
+          clients[i]->Step(now);
+          all_done = all_done && clients[i]->done();
+        }
+        if (all_done || std::chrono::steady_clock::now() > deadline) {
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  RunResult res;
+  res.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  for (const auto& c : clients) {
+    res.echoed += c->echoed;
+  }
+  // Let the workers publish their last tick.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  res.stats = server.GetWorkerStats();
+  assert(res.stats.size() == server.worker_count());
+  server.Stop();
+
+  std::uint64_t rx = 0;
+  std::uint64_t tx = 0;
+  std::uint64_t rx_calls = 0;
+  std::uint64_t tx_calls = 0;
+  for (const auto& s : res.stats) {
+    rx += s.rx_packets;
+    tx += s.tx_packets;
+    rx_calls += s.rx_calls;
+    tx_calls += s.tx_calls;
+  }
+  std::printf(
+      "workers=%zu: %llu echoes in %.2f s, %.0f msg/s, rx %.0f pkt/s "
+      "(%.1f/call), tx %.0f pkt/s (%.1f/call)\n",
+      res.stats.size(), static_cast<unsigned long long>(res.echoed),
+      res.seconds, res.echoed / res.seconds, rx / res.seconds,
+      rx_calls ? static_cast<double>(rx) / rx_calls : 0.0, tx / res.seconds,
+      tx_calls ? static_cast<double>(tx) / tx_calls : 0.0);
+  for (std::size_t i = 0; i < res.stats.size(); ++i) {
+    std::printf("  worker %zu: sessions=%llu rx=%llu tx=%llu\n", i,
+                static_cast<unsigned long long>(res.stats[i].sessions),
+                static_cast<unsigned long long>(res.stats[i].rx_packets),
+                static_cast<unsigned long long>(res.stats[i].tx_packets));
+  }
+  assert(requests.load() == kClients * kMessagesPerClient);
+  return res;
+}
+
+// A request that blocks its handler for 1.5 s (a slow signature or database
+// call) must not hold up round trips of other sessions on the same worker,
+// and the slow session still gets its responses in order.
+void TestSlowRequestIsolation() {
+  KcpOptions options;
+  options.workers = 1;
+  options.handler_threads = 4;
+  NetworkServerLimits limits;
+  KcpServer server(
+      [](const std::vector<std::uint8_t>& request,
+         std::vector<std::uint8_t>& response, const std::string&) {
+        if (!request.empty() && request[0] == kSlow) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(kSlowMs));
+        }
+        response = request;
+        return true;
+      },
+      0, options, limits);
+  std::string err;
+  const bool started = server.Start(err);
+  assert(started);
+  (void)started;
+
+  Client slow;
+  Client fast;
+  bool connected = slow.Connect(server.port(), 7001);
+  connected = connected && fast.Connect(server.port(), 7002);
+  assert(connected);
+  (void)connected;
+
+  const auto start = std::chrono::steady_clock::now();
+  ikcp_send(slow.kcp, &kSlow, 1);
+  const char after = 'a';
+  ikcp_send(slow.kcp, &after, 1);
+  std::vector<std::vector<char>> slow_out;
+  double slow_ms = 0.0;
+  double max_rtt_ms = 0.0;
+  std::uint32_t pings = 0;
+  while (slow_out.size() < 2 || pings < 20) {
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(10));
+    if (pings < 20) {
+      const char ping = 'p';
+      const auto sent = std::chrono::steady_clock::now();
+      ikcp_send(fast.kcp, &ping, 1);
+      std::vector<std::vector<char>> fast_out;
+      while (fast_out.empty()) {
+        assert(std::chrono::steady_clock::now() - sent <
+               std::chrono::seconds(5));
+        fast.Pump(NowMs(), fast_out);
+        slow.Pump(NowMs(), slow_out);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      max_rtt_ms = std::max(
+          max_rtt_ms, std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - sent)
+                          .count());
+      ++pings;
+    } else {
+      slow.Pump(NowMs(), slow_out);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (slow_out.size() == 2 && slow_ms == 0.0) {
+      slow_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    }
+  }
+  std::printf("slow request: %.0f ms; other session max rtt %.1f ms\n",
+              slow_ms, max_rtt_ms);
+  assert(slow_out[0] == std::vector<char>{kSlow});
+  assert(slow_out[1] == std::vector<char>{after});
+  assert(slow_ms >= kSlowMs);
+  // With the handler inline every ping issued during the slow request
+  // would wait out the rest of its 1.5 s.
+  assert(max_rtt_ms < 500.0);
+  server.Stop();
+}
+
+// A client that asks for FEC gets it only from a server that has it on.
+// Wrapped datagrams are not valid KCP, so the echo only comes back if the
+// server unwraps them.
+void TestFecNegotiation() {
+  for (const bool server_fec : {false, true}) {
+    KcpOptions options;
+    options.workers = 1;
+    options.fec = server_fec;
+    NetworkServerLimits limits;
+    KcpServer server(
+        [](const std::vector<std::uint8_t>& request,
+           std::vector<std::uint8_t>& response, const std::string&) {
+          response = request;
+          return true;
+        },
+        0, options, limits);
+    std::string err;
+    const bool started = server.Start(err);
+    assert(started);
+    (void)started;
+
+    Client client;
+    const bool connected = client.Connect(server.port(), 7101, true);
+    assert(connected);
+    (void)connected;
+    assert((client.fec != nullptr) == server_fec);
+
+    // Two KCP segments each way.
+    std::vector<char> big(1800, 'x');
+    ikcp_send(client.kcp, big.data(), static_cast<int>(big.size()));
+    std::vector<std::vector<char>> out;
+    const auto start = std::chrono::steady_clock::now();
+    while (out.empty()) {
+      assert(std::chrono::steady_clock::now() - start <
+             std::chrono::seconds(5));
+      client.Pump(NowMs(), out);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    assert(out[0] == big);
+    if (server_fec) {
+      assert(client.fec->stats().data_sent > 1);
+    }
+    server.Stop();
+  }
+}
+
+KcpWorkerStats TotalStats(const KcpServer& server) {
+  KcpWorkerStats total;
+  for (const auto& s : server.GetWorkerStats()) {
+    total.sessions += s.sessions;
+    total.updates += s.updates;
+  }
+  return total;
+}
+
+// Opens |kIdleSessions| sessions that never send a byte after the handshake
+// (one client socket, one conv each) and samples the server's CPU while
+// they sit idle.
+void RunIdle() {
+  KcpOptions options;
+  options.workers = 1;
+  NetworkServerLimits limits;
+  limits.max_connections = kIdleSessions + 16;
+  limits.max_connections_per_ip = kIdleSessions + 16;
+  KcpServer server(
+      [](const std::vector<std::uint8_t>&, std::vector<std::uint8_t>&,
+         const std::string&) { return true; },
+      0, options, limits);
+  std::string err;
+  const bool started = server.Start(err);
+  assert(started);
+  (void)started;
+
+  const Socket sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server.port());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const bool connected =
+      ::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+  assert(connected);
+  (void)connected;
+
+  const std::uint32_t conv_base = 100000;
+  for (std::uint32_t first = 0; first < kIdleSessions;
+       first += kHandshakeChunk) {
+    const std::uint32_t last = std::min<std::uint32_t>(
+        kIdleSessions, first + static_cast<std::uint32_t>(kHandshakeChunk));
+    std::vector<bool> answered(last - first, false);
+    std::size_t pending = answered.size();
+    for (int attempt = 0; attempt < 20 && pending > 0; ++attempt) {
+      for (std::uint32_t i = first; i < last; ++i) {
+        if (answered[i - first]) {
+          continue;
+        }
+        std::array<std::uint8_t, kCookieBytes> hello{};
+        const std::uint32_t conv = conv_base + i;
+        std::memcpy(hello.data(), &conv, 4);
+        hello[4] = 0xFF;
+        hello[5] = 1;
+        send(sock, reinterpret_cast<const char*>(hello.data()),
+             static_cast<int>(hello.size()), 0);
+      }
+      for (;;) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        timeval tv{0, 50000};
+        if (select(static_cast<int>(sock) + 1, &fds, nullptr, nullptr, &tv) <=
+            0) {
+          break;
+        }
+        std::array<std::uint8_t, kCookieBytes> challenge{};
+        if (recv(sock, reinterpret_cast<char*>(challenge.data()),
+                 static_cast<int>(challenge.size()), 0) !=
+                static_cast<int>(challenge.size()) ||
+            challenge[5] != 2) {
+          continue;
+        }
+        std::uint32_t conv = 0;
+        std::memcpy(&conv, challenge.data(), 4);
+        if (conv < conv_base + first || conv >= conv_base + last ||
+            answered[conv - conv_base - first]) {
+          continue;
+        }
+        answered[conv - conv_base - first] = true;
+        --pending;
+        challenge[5] = 3;
+        send(sock, reinterpret_cast<const char*>(challenge.data()),
+             static_cast<int>(challenge.size()), 0);
+        if (pending == 0) {
+          break;
+        }
+      }
+    }
+    assert(pending == 0);
+  }
+  for (int i = 0; i < 100 && TotalStats(server).sessions < kIdleSessions; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  assert(TotalStats(server).sessions == kIdleSessions);
+
+  // Let the first service of every new session pass before sampling.
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  const auto wall_start = std::chrono::steady_clock::now();
+  const double cpu_start = ProcessCpuMs();
+  const std::uint64_t updates_start = TotalStats(server).updates;
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  const double cpu_ms = ProcessCpuMs() - cpu_start;
+  const std::uint64_t updates = TotalStats(server).updates - updates_start;
+  const double wall_ms = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - wall_start)
+                             .count();
+  std::printf(
+      "idle: %u sessions, %llu updates, server cpu %.1f ms over %.0f ms "
+      "(%.1f%%)\n",
+      kIdleSessions, static_cast<unsigned long long>(updates), cpu_ms,
+      wall_ms, 100.0 * cpu_ms / wall_ms);
+  // Sessions with nothing in flight are never walked: a per-tick loop would
+  // have made ~100 updates per session per second here.
+  assert(updates < kIdleSessions);
+  (void)updates;
+  CloseSocket(sock);
+  server.Stop();
+}
+
+}  // namespace
+
+int main() {
+#ifdef _WIN32
+  WSADATA wsa;
+  WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+  TestSlowRequestIsolation();
+  TestFecNegotiation();
+  std::uint32_t conv_base = 1000;
+  for (const std::uint32_t workers : {1u, 2u, 4u}) {
+    const RunResult res = RunLoad(workers, conv_base);
+    conv_base += 1000;
+    assert(res.echoed == kClients * kMessagesPerClient);
+    std::uint64_t sessions = 0;
+    std::size_t busy = 0;
+    for (const auto& s : res.stats) {
+      sessions += s.sessions;
+      busy += s.sessions > 0 ? 1 : 0;
+    }
+    // Every session lives on exactly one worker, and with SO_REUSEPORT the
+    // kernel spreads the 16 peers over more than one.
+    assert(sessions == kClients);
+    assert(res.stats.size() == 1 || busy > 1);
+    (void)busy;
+  }
+  RunIdle();
+  return 0;
+}
@@ -1,12 +1,17 @@
 #include "key_transparency.h"
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <string>
 #include <string_view>
+#include <chrono>
+#include <thread>
 #include <vector>
 
 #include "crypto.h"
@@ -144,6 +149,400 @@ bool EqualHash(const mi::server::Sha256Hash& a, const mi::server::Sha256Hash& b)
   return std::memcmp(a.data(), b.data(), a.size()) == 0;
 }
 
+using SigKey = std::array<std::uint8_t, mi::server::kKtIdentitySigPublicKeyBytes>;
+using DhKey = std::array<std::uint8_t, mi::server::kKtIdentityDhPublicKeyBytes>;
+
+void MakeKeys(std::size_t i, SigKey& id_sig_pk, DhKey& id_dh_pk) {
+  id_sig_pk.fill(static_cast<std::uint8_t>(i & 0xFF));
+  for (std::size_t j = 0; j < id_dh_pk.size(); ++j) {
+    id_dh_pk[j] = static_cast<std::uint8_t>((i + j) & 0xFF);
+  }
+}
+
+bool LoadMatches(const std::filesystem::path& path,
+                 const std::vector<mi::server::Sha256Hash>& leaves,
+                 std::size_t n) {
+  mi::server::KeyTransparencyLog log(path);
+  std::string err;
+  if (!log.Load(err)) {
+    return false;
+  }
+  const auto sth = log.Head();
+  return sth.tree_size == n &&
+         EqualHash(sth.root, MerkleTreeHash(leaves, 0, n));
+}
+
+// A crash mid-write leaves part of a record, or zeros where the file grew
+// before its data landed. Load keeps the whole records and cuts the rest so
+// the next append starts on a record boundary.
+bool TestTornTails(const std::filesystem::path& dir,
+                   const std::filesystem::path& full_log,
+                   const std::vector<mi::server::Sha256Hash>& leaves) {
+  std::error_code ec;
+  const std::uintmax_t full_size = std::filesystem::file_size(full_log, ec);
+  const auto torn = dir / "kt_torn.bin";
+  const std::size_t n = leaves.size();
+  std::string err;
+
+  for (const std::uintmax_t cut : {std::uintmax_t{1}, std::uintmax_t{5},
+                                   std::uintmax_t{200}}) {
+    std::filesystem::copy_file(full_log, torn,
+                               std::filesystem::copy_options::overwrite_existing,
+                               ec);
+    std::filesystem::resize_file(torn, full_size - cut, ec);
+    if (!Check(LoadMatches(torn, leaves, n - 1))) {
+      return false;
+    }
+    {
+      mi::server::KeyTransparencyLog log(torn);
+      if (!log.Load(err)) {
+        return false;
+      }
+      SigKey id_sig_pk{};
+      DhKey id_dh_pk{};
+      MakeKeys(n - 1, id_sig_pk, id_dh_pk);
+      std::uint64_t leaf_index = 0;
+      if (!log.UpdateIdentityKeys("user" + std::to_string(n - 1), id_sig_pk,
+                                  id_dh_pk, leaf_index, err)) {
+        return false;
+      }
+      if (!Check(leaf_index == n - 1)) {
+        return false;
+      }
+    }
+    if (!Check(std::filesystem::file_size(torn, ec) == full_size)) {
+      return false;
+    }
+    if (!Check(LoadMatches(torn, leaves, n))) {
+      return false;
+    }
+  }
+
+  std::filesystem::copy_file(full_log, torn,
+                             std::filesystem::copy_options::overwrite_existing,
+                             ec);
+  {
+    std::ofstream out(torn, std::ios::binary | std::ios::app);
+    const std::vector<char> zeros(300, 0);
+    out.write(zeros.data(), static_cast<std::streamsize>(zeros.size()));
+  }
+  if (!Check(LoadMatches(torn, leaves, n))) {
+    return false;
+  }
+  if (!Check(std::filesystem::file_size(torn, ec) == full_size)) {
+    return false;
+  }
+
+  // Torn inside the magic: nothing was ever acknowledged.
+  {
+    std::ofstream out(torn, std::ios::binary | std::ios::trunc);
+    out.write("MIKT", 4);
+  }
+  if (!Check(LoadMatches(torn, leaves, 0))) {
+    return false;
+  }
+  {
+    mi::server::KeyTransparencyLog log(torn);
+    if (!log.Load(err)) {
+      return false;
+    }
+    SigKey id_sig_pk{};
+    DhKey id_dh_pk{};
+    MakeKeys(0, id_sig_pk, id_dh_pk);
+    if (!log.UpdateIdentityKeys("user0", id_sig_pk, id_dh_pk, err)) {
+      return false;
+    }
+  }
+  return Check(LoadMatches(torn, leaves, 1));
+}
+
+// A bad record with whole records after it is not a torn write; Load
+// refuses the log rather than cutting away acknowledged records.
+bool TestCorruptRecord(const std::filesystem::path& dir,
+                       const std::filesystem::path& full_log) {
+  std::error_code ec;
+  const std::uintmax_t full_size = std::filesystem::file_size(full_log, ec);
+  const auto corrupt = dir / "kt_corrupt.bin";
+  std::filesystem::copy_file(full_log, corrupt,
+                             std::filesystem::copy_options::overwrite_existing,
+                             ec);
+  std::uint64_t offset = 8;
+  for (std::size_t i = 0; i < 3; ++i) {
+    offset += 2 + ("user" + std::to_string(i)).size() +
+              mi::server::kKtIdentitySigPublicKeyBytes +
+              mi::server::kKtIdentityDhPublicKeyBytes;
+  }
+  {
+    std::fstream out(corrupt, std::ios::binary | std::ios::in | std::ios::out);
+    out.seekp(static_cast<std::streamoff>(offset));
+    const char bad_len[2] = {'\xFF', '\xFF'};
+    out.write(bad_len, sizeof(bad_len));
+  }
+  mi::server::KeyTransparencyLog log(corrupt);
+  std::string err;
+  if (!Check(!log.Load(err) && err == "kt log username length invalid")) {
+    return false;
+  }
+  return Check(std::filesystem::file_size(corrupt, ec) == full_size);
+}
+
+std::vector<std::filesystem::path> CheckpointFiles(
+    const std::filesystem::path& dir) {
+  std::vector<std::filesystem::path> out;
+  std::error_code ec;
+  for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+    if (entry.path().extension() == ".ckpt") {
+      out.push_back(entry.path());
+    }
+  }
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+void FlipByte(const std::filesystem::path& path, std::uintmax_t offset) {
+  std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+  f.seekg(static_cast<std::streamoff>(offset));
+  char c = 0;
+  f.read(&c, 1);
+  c = static_cast<char>(c ^ 0x40);
+  f.seekp(static_cast<std::streamoff>(offset));
+  f.write(&c, 1);
+}
+
+bool AppendUser(mi::server::KeyTransparencyLog& log, const std::string& username,
+                std::size_t key_seed,
+                std::vector<mi::server::Sha256Hash>& leaves) {
+  SigKey id_sig_pk{};
+  DhKey id_dh_pk{};
+  MakeKeys(key_seed, id_sig_pk, id_dh_pk);
+  std::string err;
+  if (!log.UpdateIdentityKeys(username, id_sig_pk, id_dh_pk, err)) {
+    return false;
+  }
+  leaves.push_back(HashLeaf(BuildLeafData(username, id_sig_pk, id_dh_pk)));
+  return true;
+}
+
+bool LoadFromCheckpoint(const std::filesystem::path& path,
+                        const std::vector<mi::server::Sha256Hash>& leaves,
+                        std::uint64_t expect_checkpoint) {
+  mi::server::KeyTransparencyLog log(path);
+  std::string err;
+  if (!log.Load(err)) {
+    return false;
+  }
+  const auto sth = log.Head();
+  return log.checkpoint_size() == expect_checkpoint &&
+         sth.tree_size == leaves.size() &&
+         EqualHash(sth.root, MerkleTreeHash(leaves, 0, leaves.size()));
+}
+
+// Startup from a mapped checkpoint plus the log tail, and every way back to
+// an older checkpoint or a full replay when one does not check out.
+bool TestCheckpoints(const std::filesystem::path& full_log,
+                     std::vector<mi::server::Sha256Hash> leaves) {
+  const auto dir = TempDir("mi_e2ee_kt_checkpoint");
+  const auto path = dir / "kt_log.bin";
+  std::error_code ec;
+  std::filesystem::copy_file(full_log, path, ec);
+  std::string err;
+  {
+    mi::server::KeyTransparencyLog log(path);
+    if (!log.Load(err) || !log.WriteCheckpoint(err)) {
+      return false;
+    }
+    if (!Check(log.checkpoint_size() == leaves.size())) {
+      return false;
+    }
+    // The mapped prefix and the in-memory tail keep growing together.
+    for (std::size_t i = 0; i < 3; ++i) {
+      if (!AppendUser(log, "late" + std::to_string(i), 1000 + i, leaves)) {
+        return false;
+      }
+    }
+    if (!AppendUser(log, "user0", 999, leaves)) {
+      return false;
+    }
+    if (!Check(EqualHash(log.Head().root,
+                         MerkleTreeHash(leaves, 0, leaves.size())))) {
+      return false;
+    }
+  }
+  const std::uint64_t first = 256;
+  if (!Check(LoadFromCheckpoint(path, leaves, first))) {
+    return false;
+  }
+
+  {
+    mi::server::KeyTransparencyLog log(path);
+    if (!log.Load(err)) {
+      return false;
+    }
+    // user0's newer key is in the tail, user5's only in the checkpoint.
+    mi::server::KeyTransparencyProof proof;
+    if (!log.BuildProofForLatestKey("user0", 0, proof, err) ||
+        !Check(proof.leaf_index == leaves.size() - 1)) {
+      return false;
+    }
+    if (!log.BuildProofForLatestKey("user5", 200, proof, err) ||
+        !Check(proof.leaf_index == 5 &&
+               proof.audit_path == MerkleAuditPath(5, leaves, 0, leaves.size()) &&
+               proof.consistency_path ==
+                   MerkleConsistencyProof(200, leaves, 0, leaves.size()))) {
+      return false;
+    }
+    if (!log.WriteCheckpoint(err) || !AppendUser(log, "late3", 1003, leaves) ||
+        !log.WriteCheckpoint(err)) {
+      return false;
+    }
+  }
+  // Only the newest and the one before it are kept.
+  auto files = CheckpointFiles(dir);
+  if (!Check(files.size() == 2)) {
+    return false;
+  }
+  const std::uint64_t second = leaves.size() - 1;
+  if (!Check(LoadFromCheckpoint(path, leaves, leaves.size()))) {
+    return false;
+  }
+
+  // A bad checksum, a node that no longer folds to the root, or a short
+  // file each fall back to the previous checkpoint.
+  const auto newest = files.back();
+  const std::uintmax_t newest_size = std::filesystem::file_size(newest, ec);
+  std::filesystem::copy_file(newest, dir / "good.bak", ec);
+  FlipByte(newest, 60);
+  if (!Check(LoadFromCheckpoint(path, leaves, second))) {
+    return false;
+  }
+  std::filesystem::copy_file(dir / "good.bak", newest,
+                             std::filesystem::copy_options::overwrite_existing,
+                             ec);
+  FlipByte(newest, newest_size - 1);
+  if (!Check(LoadFromCheckpoint(path, leaves, second))) {
+    return false;
+  }
+  // An interior node off the frontier never reaches the root; it is caught
+  // against its children.
+  std::filesystem::copy_file(dir / "good.bak", newest,
+                             std::filesystem::copy_options::overwrite_existing,
+                             ec);
+  const std::uintmax_t nodes_at =
+      newest_size - mi::server::KtMerkleNodeCount(leaves.size()) * 32;
+  FlipByte(newest, nodes_at + leaves.size() * 32 + 5);
+  if (!Check(LoadFromCheckpoint(path, leaves, second))) {
+    return false;
+  }
+  std::filesystem::copy_file(dir / "good.bak", newest,
+                             std::filesystem::copy_options::overwrite_existing,
+                             ec);
+  std::filesystem::resize_file(newest, newest_size - 32, ec);
+  if (!Check(LoadFromCheckpoint(path, leaves, second))) {
+    return false;
+  }
+  // With both unusable, the whole log is replayed.
+  std::filesystem::resize_file(files.front(), 100, ec);
+  if (!Check(LoadFromCheckpoint(path, leaves, 0))) {
+    return false;
+  }
+
+  // A checkpoint that the log no longer backs (the log was cut back or
+  // replaced) is ignored as well.
+  std::filesystem::copy_file(dir / "good.bak", newest,
+                             std::filesystem::copy_options::overwrite_existing,
+                             ec);
+  std::filesystem::copy_file(full_log, path,
+                             std::filesystem::copy_options::overwrite_existing,
+                             ec);
+  leaves.resize(first);
+  if (!Check(LoadFromCheckpoint(path, leaves, 0))) {
+    return false;
+  }
+
+  // Background checkpointer.
+  mi::server::KeyTransparencyLog log(path);
+  if (!log.Load(err)) {
+    return false;
+  }
+  mi::server::KtCheckpointOptions options;
+  options.interval_ms = 20;
+  options.min_leaves = 2;
+  log.StartCheckpointer(options);
+  if (!AppendUser(log, "bg0", 2000, leaves) ||
+      !AppendUser(log, "bg1", 2001, leaves)) {
+    return false;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  while (log.checkpoint_size() != leaves.size()) {
+    if (std::chrono::steady_clock::now() - start > std::chrono::seconds(5)) {
+      return Check(false);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  log.StopCheckpointer();
+  return Check(LoadFromCheckpoint(path, leaves, leaves.size()));
+}
+
+// Concurrent appends share batches; each caller gets its own leaf back.
+bool TestConcurrentAppends(const std::filesystem::path& dir) {
+  constexpr std::size_t kThreads = 8;
+  constexpr std::size_t kPerThread = 32;
+  constexpr std::size_t kTotal = kThreads * kPerThread;
+  const auto path = dir / "kt_concurrent.bin";
+  mi::server::KeyTransparencyLog log(path);
+  std::string err;
+  if (!log.Load(err)) {
+    return false;
+  }
+
+  std::vector<std::uint64_t> indices(kTotal, kTotal);
+  std::vector<mi::server::Sha256Hash> hashes(kTotal);
+  std::vector<char> ok(kTotal, 0);
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (std::size_t k = 0; k < kPerThread; ++k) {
+        const std::size_t i = t * kPerThread + k;
+        const std::string username = "user" + std::to_string(i);
+        SigKey id_sig_pk{};
+        DhKey id_dh_pk{};
+        MakeKeys(i, id_sig_pk, id_dh_pk);
+        std::string thread_err;
+        ok[i] = log.UpdateIdentityKeys(username, id_sig_pk, id_dh_pk,
+                                       indices[i], thread_err)
+                    ? 1
+                    : 0;
+        hashes[i] = HashLeaf(BuildLeafData(username, id_sig_pk, id_dh_pk));
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  std::vector<mi::server::Sha256Hash> leaves(kTotal);
+  std::vector<char> seen(kTotal, 0);
+  for (std::size_t i = 0; i < kTotal; ++i) {
+    if (!Check(ok[i] != 0 && indices[i] < kTotal && !seen[indices[i]])) {
+      return false;
+    }
+    seen[indices[i]] = 1;
+    leaves[indices[i]] = hashes[i];
+  }
+  const auto sth = log.Head();
+  if (!Check(sth.tree_size == kTotal &&
+             EqualHash(sth.root, MerkleTreeHash(leaves, 0, kTotal)))) {
+    return false;
+  }
+  const std::uint64_t batches = log.commit_batches();
+  std::printf("kt group commit: %zu appends in %llu batches\n", kTotal,
+              static_cast<unsigned long long>(batches));
+  if (!Check(batches >= 1 && batches <= kTotal)) {
+    return false;
+  }
+  return Check(LoadMatches(path, leaves, kTotal));
+}
+
 }  // namespace
 
 int main() {
@@ -164,12 +563,9 @@ int main() {
 
   for (std::size_t i = 0; i < 256; ++i) {
     const std::string username = "user" + std::to_string(i);
-    std::array<std::uint8_t, mi::server::kKtIdentitySigPublicKeyBytes> id_sig_pk{};
-    std::array<std::uint8_t, mi::server::kKtIdentityDhPublicKeyBytes> id_dh_pk{};
-    id_sig_pk.fill(static_cast<std::uint8_t>(i & 0xFF));
-    for (std::size_t j = 0; j < id_dh_pk.size(); ++j) {
-      id_dh_pk[j] = static_cast<std::uint8_t>((i + j) & 0xFF);
-    }
+    SigKey id_sig_pk{};
+    DhKey id_dh_pk{};
+    MakeKeys(i, id_sig_pk, id_dh_pk);
 
     if (!log.UpdateIdentityKeys(username, id_sig_pk, id_dh_pk, err)) {
       return 1;
@@ -222,6 +618,14 @@ int main() {
     if (!Check(proof == expected)) {
       return 1;
     }
+    // Served again from the proof cache.
+    std::vector<mi::server::Sha256Hash> again;
+    if (!log.BuildConsistencyProof(128, 256, again, err)) {
+      return 1;
+    }
+    if (!Check(again == expected)) {
+      return 1;
+    }
   }
 
   {
@@ -239,5 +643,18 @@ int main() {
     }
   }
 
+  if (!TestTornTails(dir, log_path, leaves)) {
+    return 1;
+  }
+  if (!TestCorruptRecord(dir, log_path)) {
+    return 1;
+  }
+  if (!TestConcurrentAppends(dir)) {
+    return 1;
+  }
+  if (!TestCheckpoints(log_path, leaves)) {
+    return 1;
+  }
+
   return 0;
 }
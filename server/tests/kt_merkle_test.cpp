@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "crypto.h"
+#include "kt_merkle.h"
+
+using mi::server::KtMerkleBuilder;
+using mi::server::KtMerkleTree;
+using mi::server::Sha256Hash;
+
+namespace {
+
+constexpr std::uint64_t kBenchLeaves = 10'000'000;
+constexpr std::uint64_t kRebuildLeaves[] = {1'000'000, 10'000'000};
+
+Sha256Hash HashBytes(const std::uint8_t* data, std::size_t len) {
+  mi::server::crypto::Sha256Digest d;
+  mi::server::crypto::Sha256(data, len, d);
+  return d.bytes;
+}
+
+Sha256Hash HashNode(const Sha256Hash& left, const Sha256Hash& right) {
+  std::uint8_t buf[1 + 32 + 32];
+  buf[0] = 0x01;
+  std::memcpy(buf + 1, left.data(), left.size());
+  std::memcpy(buf + 1 + 32, right.data(), right.size());
+  return HashBytes(buf, sizeof(buf));
+}
+
+Sha256Hash EmptyHash() {
+  static constexpr std::uint8_t kEmpty[1] = {0};
+  return HashBytes(kEmpty, 0);
+}
+
+// Leaf hashes for the tree; any distinct values do.
+Sha256Hash FakeLeaf(std::uint64_t i) {
+  Sha256Hash h{};
+  std::uint64_t x = i * 0x9E3779B97F4A7C15ull + 1;
+  for (std::size_t b = 0; b < h.size(); ++b) {
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ull;
+    h[b] = static_cast<std::uint8_t>(x >> 56);
+  }
+  return h;
+}
+
+std::uint64_t Split(std::uint64_t n) {
+  std::uint64_t k = 1;
+  while ((k << 1) < n) {
+    k <<= 1;
+  }
+  return k;
+}
+
+// RFC 6962 section 2.1, straight from the definitions.
+Sha256Hash RefHash(const std::vector<Sha256Hash>& leaves, std::uint64_t start,
+                   std::uint64_t n) {
+  if (n == 0) {
+    return EmptyHash();
+  }
+  if (n == 1) {
+    return leaves[start];
+  }
+  const std::uint64_t k = Split(n);
+  return HashNode(RefHash(leaves, start, k),
+                  RefHash(leaves, start + k, n - k));
+}
+
+std::vector<Sha256Hash> RefPath(const std::vector<Sha256Hash>& leaves,
+                                std::uint64_t m, std::uint64_t start,
+                                std::uint64_t n) {
+  if (n <= 1) {
+    return {};
+  }
+  const std::uint64_t k = Split(n);
+  if (m < k) {
+    auto path = RefPath(leaves, m, start, k);
+    path.push_back(RefHash(leaves, start + k, n - k));
+    return path;
+  }
+  auto path = RefPath(leaves, m - k, start + k, n - k);
+  path.push_back(RefHash(leaves, start, k));
+  return path;
+}
+
+std::vector<Sha256Hash> RefSubProof(const std::vector<Sha256Hash>& leaves,
+                                    std::uint64_t m, std::uint64_t start,
+                                    std::uint64_t n, bool b) {
+  if (m == n) {
+    if (b) {
+      return {};
+    }
+    return {RefHash(leaves, start, n)};
+  }
+  const std::uint64_t k = Split(n);
+  if (m <= k) {
+    auto proof = RefSubProof(leaves, m, start, k, b);
+    proof.push_back(RefHash(leaves, start + k, n - k));
+    return proof;
+  }
+  auto proof = RefSubProof(leaves, m - k, start + k, n - k, false);
+  proof.push_back(RefHash(leaves, start, k));
+  return proof;
+}
+
+// RFC 9162 section 2.1.3.2.
+bool VerifyInclusion(std::uint64_t index, std::uint64_t size,
+                     const Sha256Hash& leaf,
+                     const std::vector<Sha256Hash>& path,
+                     const Sha256Hash& root) {
+  if (index >= size) {
+    return false;
+  }
+  std::uint64_t fn = index;
+  std::uint64_t sn = size - 1;
+  Sha256Hash r = leaf;
+  for (const auto& p : path) {
+    if (sn == 0) {
+      return false;
+    }
+    if ((fn & 1) || fn == sn) {
+      r = HashNode(p, r);
+      if (!(fn & 1)) {
+        while (fn != 0 && !(fn & 1)) {
+          fn >>= 1;
+          sn >>= 1;
+        }
+      }
+    } else {
+      r = HashNode(r, p);
+    }
+    fn >>= 1;
+    sn >>= 1;
+  }
+  return sn == 0 && r == root;
+}
+
+// RFC 9162 section 2.1.4.2.
+bool VerifyConsistency(std::uint64_t size1, std::uint64_t size2,
+                       const Sha256Hash& root1, const Sha256Hash& root2,
+                       std::vector<Sha256Hash> proof) {
+  if (size1 == 0 || size1 >= size2 || proof.empty()) {
+    return false;
+  }
+  if ((size1 & (size1 - 1)) == 0) {
+    proof.insert(proof.begin(), root1);
+  }
+  std::uint64_t fn = size1 - 1;
+  std::uint64_t sn = size2 - 1;
+  while (fn & 1) {
+    fn >>= 1;
+    sn >>= 1;
+  }
+  Sha256Hash fr = proof[0];
+  Sha256Hash sr = proof[0];
+  for (std::size_t i = 1; i < proof.size(); ++i) {
+    const auto& c = proof[i];
+    if (sn == 0) {
+      return false;
+    }
+    if ((fn & 1) || fn == sn) {
+      fr = HashNode(c, fr);
+      sr = HashNode(c, sr);
+      if (!(fn & 1)) {
+        while (fn != 0 && !(fn & 1)) {
+          fn >>= 1;
+          sn >>= 1;
+        }
+      }
+    } else {
+      sr = HashNode(sr, c);
+    }
+    fn >>= 1;
+    sn >>= 1;
+  }
+  return fr == root1 && sr == root2 && sn == 0;
+}
+
+// Every size, leaf and old size of small trees, at the head and behind it.
+void TestAgainstReference() {
+  constexpr std::uint64_t kMax = 70;
+  std::vector<Sha256Hash> leaves;
+  KtMerkleTree tree;
+  assert(tree.size() == 0 && tree.root() == EmptyHash());
+  for (std::uint64_t n = 1; n <= kMax; ++n) {
+    leaves.push_back(FakeLeaf(n));
+    tree.Append(leaves.back());
+    assert(tree.size() == n);
+    assert(tree.root() == RefHash(leaves, 0, n));
+  }
+  KtMerkleTree bulk;
+  bulk.Assign(leaves);
+  KtMerkleTree batched;
+  batched.Append(std::vector<Sha256Hash>(leaves.begin(), leaves.begin() + 33));
+  batched.Append(std::vector<Sha256Hash>(leaves.begin() + 33, leaves.end()));
+  assert(bulk.root() == tree.root() && batched.root() == tree.root());
+
+  for (std::uint64_t n = 1; n <= kMax; ++n) {
+    const auto root = RefHash(leaves, 0, n);
+    assert(tree.RootAt(n) == root);
+    for (std::uint64_t m = 0; m < n; ++m) {
+      const auto path = tree.AuditPath(m, n);
+      assert(path == RefPath(leaves, m, 0, n));
+      assert(VerifyInclusion(m, n, leaves[m], path, root));
+      if (m == 0) {
+        continue;
+      }
+      const auto proof = tree.ConsistencyProof(m, n);
+      assert(proof == RefSubProof(leaves, m, 0, n, true));
+      assert(VerifyConsistency(m, n, RefHash(leaves, 0, m), root, proof));
+    }
+  }
+  assert(bulk.ConsistencyProof(17, kMax) == tree.ConsistencyProof(17, kMax));
+  tree.Clear();
+  assert(tree.size() == 0 && tree.root() == EmptyHash());
+}
+
+// Every thread count gives the same nodes: bulk builds across block
+// boundaries, appends onto a base, leaf hashes and the levelless root.
+void TestBuilder() {
+  constexpr std::uint64_t kLeaves = KtMerkleBuilder::kBlockNodes * 6 + 5;
+  std::vector<Sha256Hash> leaves;
+  for (std::uint64_t i = 0; i < kLeaves; ++i) {
+    leaves.push_back(FakeLeaf(i));
+  }
+  KtMerkleTree serial;
+  serial.Assign(leaves);
+  std::vector<Sha256Hash> serial_nodes(
+      static_cast<std::size_t>(mi::server::KtMerkleNodeCount(kLeaves)));
+  std::uint64_t offset = 0;
+  for (std::size_t level = 0; (kLeaves >> level) != 0; ++level) {
+    serial.CopyNodes(level, 0, kLeaves >> level,
+                     serial_nodes.data() + offset);
+    offset += kLeaves >> level;
+  }
+
+  std::vector<std::vector<std::uint8_t>> leaf_data;
+  for (std::size_t i = 0; i < 300; ++i) {
+    leaf_data.emplace_back(i * 7, static_cast<std::uint8_t>(i));
+  }
+
+  for (const std::size_t threads : {1, 2, 3, 8}) {
+    KtMerkleBuilder builder(threads);
+    assert(builder.threads() == threads);
+    KtMerkleTree tree;
+    tree.SetBuilder(&builder);
+    tree.Assign(leaves);
+    assert(tree.root() == serial.root());
+    std::vector<Sha256Hash> nodes(serial_nodes.size());
+    offset = 0;
+    for (std::size_t level = 0; (kLeaves >> level) != 0; ++level) {
+      tree.CopyNodes(level, 0, kLeaves >> level, nodes.data() + offset);
+      offset += kLeaves >> level;
+    }
+    assert(nodes == serial_nodes);
+
+    // Odd-sized base: the first new parent on some levels has a child on
+    // either side of it.
+    constexpr std::uint64_t kBase = 1000 * 3 + 1;
+    KtMerkleTree based;
+    based.SetBuilder(&builder);
+    based.Assign(std::vector<Sha256Hash>(leaves.begin(),
+                                         leaves.begin() + kBase));
+    std::vector<Sha256Hash> base_nodes(
+        static_cast<std::size_t>(mi::server::KtMerkleNodeCount(kBase)));
+    offset = 0;
+    for (std::size_t level = 0; (kBase >> level) != 0; ++level) {
+      based.CopyNodes(level, 0, kBase >> level, base_nodes.data() + offset);
+      offset += kBase >> level;
+    }
+    mi::server::KtMerkleBase base;
+    base.nodes = base_nodes.data();
+    base.size = kBase;
+    based.AssignBase(base);
+    based.Append(std::vector<Sha256Hash>(leaves.begin() + kBase,
+                                         leaves.end()));
+    assert(based.root() == serial.root());
+    assert(based.ConsistencyProof(kBase, kLeaves) ==
+           serial.ConsistencyProof(kBase, kLeaves));
+
+    assert(builder.Root(leaves) == serial.root());
+    for (std::uint64_t n = 0; n <= 70; ++n) {
+      const std::vector<Sha256Hash> prefix(leaves.begin(),
+                                           leaves.begin() + n);
+      assert(builder.Root(prefix) == RefHash(leaves, 0, n));
+    }
+
+    std::vector<Sha256Hash> leaf_hashes(leaf_data.size());
+    builder.HashLeaves(leaf_data, leaf_hashes.data());
+    for (std::size_t i = 0; i < leaf_data.size(); ++i) {
+      std::vector<std::uint8_t> buf(1, 0x00);
+      buf.insert(buf.end(), leaf_data[i].begin(), leaf_data[i].end());
+      assert(leaf_hashes[i] == HashBytes(buf.data(), buf.size()));
+    }
+  }
+}
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+void Bench(std::uint64_t total) {
+  KtMerkleTree tree;
+  constexpr std::uint64_t kBatch = 256;  // one epoch's worth
+  auto start = std::chrono::steady_clock::now();
+  std::vector<Sha256Hash> batch;
+  for (std::uint64_t i = 0; i < total; i += kBatch) {
+    batch.clear();
+    for (std::uint64_t j = i; j < i + kBatch && j < total; ++j) {
+      batch.push_back(FakeLeaf(j));
+    }
+    tree.Append(batch);
+  }
+  const double build = Seconds(start);
+  assert(tree.size() == total);
+
+  // Incremental appends past the bulk: one leaf, one right-edge update.
+  constexpr std::uint64_t kAppends = 10000;
+  start = std::chrono::steady_clock::now();
+  for (std::uint64_t i = 0; i < kAppends; ++i) {
+    tree.Append(FakeLeaf(total + i));
+  }
+  const double append_s = Seconds(start);
+  const std::uint64_t n = tree.size();
+  const Sha256Hash root = tree.root();
+
+  constexpr std::uint64_t kProofs = 20000;
+  std::uint64_t rng = 12345;
+  const auto next = [&rng](std::uint64_t bound) {
+    rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+    return (rng >> 11) % bound;
+  };
+  start = std::chrono::steady_clock::now();
+  for (std::uint64_t i = 0; i < kProofs; ++i) {
+    const std::uint64_t index = next(n);
+    const auto path = tree.AuditPath(index, n);
+    if (i % 1000 == 0) {
+      assert(VerifyInclusion(index, n, FakeLeaf(index), path, root));
+    }
+  }
+  const double audit_s = Seconds(start);
+
+  start = std::chrono::steady_clock::now();
+  for (std::uint64_t i = 0; i < kProofs; ++i) {
+    const std::uint64_t old_size = 1 + next(n - 1);
+    const auto proof = tree.ConsistencyProof(old_size, n);
+    if (i % 1000 == 0) {
+      assert(VerifyConsistency(old_size, n, tree.RootAt(old_size), root,
+                               proof));
+    }
+  }
+  const double consistency_s = Seconds(start);
+
+  // Against a size behind the head (a signed epoch): the right edge is
+  // rebuilt per call.
+  start = std::chrono::steady_clock::now();
+  for (std::uint64_t i = 0; i < kProofs; ++i) {
+    const std::uint64_t old_size = 1 + next(n - 2);
+    const auto proof = tree.ConsistencyProof(old_size, n - 1);
+    (void)proof;
+  }
+  const double behind_s = Seconds(start);
+
+  std::printf(
+      "kt merkle %llu leaves: build %.1f s, append %.0f/s, audit %.0f/s, "
+      "consistency %.0f/s (head), %.0f/s (head - 1)\n",
+      static_cast<unsigned long long>(total), build, kAppends / append_s,
+      kProofs / audit_s, kProofs / consistency_s, kProofs / behind_s);
+  (void)root;
+}
+
+// Bulk rebuild of |total| leaves against the builder's thread count.
+void BenchRebuild(std::uint64_t total) {
+  std::vector<Sha256Hash> leaves;
+  leaves.reserve(static_cast<std::size_t>(total));
+  for (std::uint64_t i = 0; i < total; ++i) {
+    leaves.push_back(FakeLeaf(i));
+  }
+  const std::size_t hardware =
+      std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  std::vector<std::size_t> counts = {1, 2, 4, 8};
+  if (hardware > 8) {
+    counts.push_back(hardware);
+  }
+  Sha256Hash root{};
+  double base_s = 0;
+  for (const std::size_t threads : counts) {
+    KtMerkleBuilder builder(threads);
+    KtMerkleTree tree;
+    tree.SetBuilder(&builder);
+    const auto start = std::chrono::steady_clock::now();
+    tree.Assign(leaves);
+    const double s = Seconds(start);
+    if (threads == 1) {
+      root = tree.root();
+      base_s = s;
+    }
+    assert(tree.root() == root);
+    std::printf("kt rebuild %llu leaves, %zu threads: %.2f s (%.1fx)%s\n",
+                static_cast<unsigned long long>(total), threads, s,
+                base_s / s, threads > hardware ? " [oversubscribed]" : "");
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  TestAgainstReference();
+  TestBuilder();
+  if (argc > 1) {
+    const std::uint64_t leaves = std::strtoull(argv[1], nullptr, 10);
+    if (leaves >= 2) {
+      Bench(leaves);
+      BenchRebuild(leaves);
+    }
+    return 0;
+  }
+  Bench(kBenchLeaves);
+  for (const std::uint64_t leaves : kRebuildLeaves) {
+    BenchRebuild(leaves);
+  }
+  return 0;
+}
@@ -0,0 +1,257 @@
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "api_service.h"
+#include "auth_provider.h"
+#include "group_call_manager.h"
+#include "key_transparency.h"
+#include "kt_sth_signer.h"
+#include "offline_storage.h"
+#include "session_manager.h"
+
+extern "C" {
+int PQCLEAN_MLDSA65_CLEAN_crypto_sign_keypair(std::uint8_t* pk,
+                                             std::uint8_t* sk);
+int PQCLEAN_MLDSA65_CLEAN_crypto_sign_signature(std::uint8_t* sig,
+                                               std::size_t* siglen,
+                                               const std::uint8_t* m,
+                                               std::size_t mlen,
+                                               const std::uint8_t* sk);
+}
+
+using mi::server::ApiService;
+using mi::server::DemoAuthProvider;
+using mi::server::DemoUser;
+using mi::server::DemoUserTable;
+using mi::server::GroupCallManager;
+using mi::server::GroupManager;
+using mi::server::KeyTransparencyLog;
+using mi::server::KeyTransparencyProof;
+using mi::server::KeyTransparencySth;
+using mi::server::KtEpochOptions;
+using mi::server::KtSthSigner;
+using mi::server::OfflineQueue;
+using mi::server::Session;
+using mi::server::SessionManager;
+using mi::server::TransportKind;
+
+namespace {
+
+constexpr std::size_t kFetchers = 16;
+constexpr std::size_t kFetchesPerUser = 150;  // under the per-user burst
+
+std::filesystem::path TempDir(const std::string& name) {
+  auto dir = std::filesystem::temp_directory_path() / name;
+  std::error_code ec;
+  std::filesystem::remove_all(dir, ec);
+  std::filesystem::create_directories(dir, ec);
+  return dir;
+}
+
+void AppendKey(KeyTransparencyLog& log, const std::string& username,
+               std::uint8_t fill) {
+  std::array<std::uint8_t, mi::server::kKtIdentitySigPublicKeyBytes> sig_pk{};
+  std::array<std::uint8_t, mi::server::kKtIdentityDhPublicKeyBytes> dh_pk{};
+  sig_pk.fill(fill);
+  dh_pk.fill(fill);
+  std::string err;
+  const bool ok = log.UpdateIdentityKeys(username, sig_pk, dh_pk, err);
+  assert(ok);
+  (void)ok;
+}
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Epoch batching with a counting fake signer.
+void TestEpochs() {
+  const auto dir = TempDir("mi_e2ee_kt_sth_signer");
+  KeyTransparencyLog log(dir / "kt_log.bin");
+  std::string err;
+  bool ok = log.Load(err);
+  assert(ok);
+  AppendKey(log, "alice", 1);
+
+  std::atomic<int> signs{0};
+  KtEpochOptions options;
+  options.interval_ms = 300;
+  options.max_leaves = 8;
+  KtSthSigner signer(
+      &log,
+      [&signs](KeyTransparencySth& sth, std::string&) {
+        signs.fetch_add(1);
+        sth.signature.assign(4, static_cast<std::uint8_t>(sth.tree_size));
+        return true;
+      },
+      options);
+  signer.Start();
+
+  KeyTransparencySth sth;
+  ok = signer.SignedHead(0, sth, err);
+  assert(ok && sth.tree_size == 1 && sth.signature.size() == 4);
+  assert(sth.root == log.Head().root);
+
+  // Readers of an unchanged head share one signature, and epochs that
+  // close over the same (tree_size, root) do not sign it again.
+  for (int i = 0; i < 1000; ++i) {
+    ok = signer.SignedHead(1, sth, err);
+    assert(ok);
+  }
+  for (int i = 0; i < 20; ++i) {
+    signer.NotifyAppend();
+  }
+  // Past the interval, so any remainder of those closes too.
+  std::this_thread::sleep_for(std::chrono::milliseconds(400));
+  assert(signs.load() == 1);
+
+  // Appends wait for the epoch; readers keep the signed head meanwhile.
+  for (int i = 0; i < 5; ++i) {
+    AppendKey(log, "user" + std::to_string(i), static_cast<std::uint8_t>(i + 2));
+    signer.NotifyAppend();
+  }
+  ok = signer.SignedHead(0, sth, err);
+  assert(ok && sth.tree_size == 1);
+  const auto wait_start = std::chrono::steady_clock::now();
+  while (signer.signatures() < 2) {
+    assert(Seconds(wait_start) < 5.0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  ok = signer.SignedHead(0, sth, err);
+  assert(ok && sth.tree_size == 6);
+
+  // A reader that needs a newer leaf closes the epoch at once.
+  AppendKey(log, "bob", 42);
+  signer.NotifyAppend();
+  const auto demand_start = std::chrono::steady_clock::now();
+  ok = signer.SignedHead(7, sth, err);
+  assert(ok && sth.tree_size == 7);
+  assert(Seconds(demand_start) < 0.25);
+  assert(signer.signatures() == 3);
+
+  KeyTransparencyProof proof;
+  ok = log.BuildProofForLatestKey("bob", 0, 6, proof, err);
+  assert(!ok && err == "kt entry pending");
+  ok = log.BuildProofForLatestKey("alice", 0, 6, proof, err);
+  assert(ok && proof.sth.tree_size == 6 && proof.leaf_index == 0);
+
+  signer.Stop();
+  ok = signer.SignedHead(8, sth, err);
+  assert(!ok);
+  (void)ok;
+}
+
+DemoUser MakeDemoUser(const std::string& username,
+                      const std::string& password) {
+  DemoUser user;
+  user.username.set(username);
+  user.password.set(password);
+  user.username_plain = username;
+  user.password_plain = password;
+  return user;
+}
+
+// PreKeyFetch with KT on: before, each fetch built the proof and signed
+// the head; now it proves against the pre-signed epoch head.
+void BenchPreKeyFetch() {
+  const auto dir = TempDir("mi_e2ee_kt_sth_bench");
+  std::vector<std::uint8_t> pk(mi::server::kKtSthSigPublicKeyBytes);
+  std::vector<std::uint8_t> sk(mi::server::kKtSthSigSecretKeyBytes);
+  int rc = PQCLEAN_MLDSA65_CLEAN_crypto_sign_keypair(pk.data(), sk.data());
+  assert(rc == 0);
+  const auto key_path = dir / "kt_signing_key.bin";
+  {
+    std::ofstream out(key_path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(sk.data()),
+              static_cast<std::streamsize>(sk.size()));
+  }
+
+  DemoUserTable users;
+  users.emplace("alice", MakeDemoUser("alice", "alice123"));
+  for (std::size_t i = 0; i < kFetchers; ++i) {
+    const std::string name = "fetcher" + std::to_string(i);
+    users.emplace(name, MakeDemoUser(name, "pwd"));
+  }
+  SessionManager sessions(std::make_unique<DemoAuthProvider>(std::move(users)));
+  GroupManager groups;
+  GroupCallManager calls;
+  OfflineQueue queue;
+  ApiService api(&sessions, &groups, &calls, nullptr, nullptr, &queue, nullptr,
+                 10000, std::nullopt, dir, key_path);
+
+  std::string err;
+  Session alice;
+  bool ok = sessions.Login("alice", "alice123", TransportKind::kLocal, alice,
+                           err);
+  assert(ok);
+  std::vector<Session> fetchers(kFetchers);
+  for (std::size_t i = 0; i < kFetchers; ++i) {
+    ok = sessions.Login("fetcher" + std::to_string(i), "pwd",
+                        TransportKind::kLocal, fetchers[i], err);
+    assert(ok);
+    ok = api.AddFriend(fetchers[i].token, "alice").success;
+    assert(ok);
+  }
+  std::vector<std::uint8_t> bundle(
+      1 + mi::server::kKtIdentitySigPublicKeyBytes +
+          mi::server::kKtIdentityDhPublicKeyBytes + 64,
+      7);
+  ok = api.PublishPreKeyBundle(alice.token, bundle).success;
+  assert(ok);
+
+  // The path this replaces: a fresh proof and ML-DSA-65 signature per fetch.
+  KeyTransparencyLog log(dir / "kt_log.bin");
+  ok = log.Load(err);
+  assert(ok);
+  constexpr std::size_t kBeforeFetches = 200;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < kBeforeFetches; ++i) {
+    KeyTransparencyProof proof;
+    ok = log.BuildProofForLatestKey("alice", 0, proof, err);
+    assert(ok);
+    const auto msg = mi::server::BuildKtSthSignatureMessage(proof.sth);
+    std::vector<std::uint8_t> sig(mi::server::kKtSthSigBytes);
+    std::size_t sig_len = 0;
+    rc = PQCLEAN_MLDSA65_CLEAN_crypto_sign_signature(
+        sig.data(), &sig_len, msg.data(), msg.size(), sk.data());
+    assert(rc == 0);
+  }
+  const double before = kBeforeFetches / Seconds(start);
+
+  start = std::chrono::steady_clock::now();
+  std::size_t fetched = 0;
+  for (std::size_t round = 0; round < kFetchesPerUser; ++round) {
+    for (const auto& fetcher : fetchers) {
+      const auto resp = api.FetchPreKeyBundle(fetcher.token, "alice");
+      assert(resp.success && resp.kt_tree_size == 1);
+      assert(resp.kt_signature.size() == mi::server::kKtSthSigBytes);
+      ++fetched;
+    }
+  }
+  const double after = fetched / Seconds(start);
+  std::printf("prekey fetch: %.0f/s signing per fetch, %.0f/s cached (%.1fx)\n",
+              before, after, after / before);
+  assert(after > before * 5);
+  (void)rc;
+  (void)ok;
+}
+
+}  // namespace
+
+int main() {
+  TestEpochs();
+  BenchPreKeyFetch();
+  return 0;
+}
@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX 1
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "api_service.h"
+#include "auth_provider.h"
+#include "frame.h"
+#include "frame_router.h"
+#include "group_call_manager.h"
+#include "group_directory.h"
+#include "media_relay.h"
+#include "media_udp_server.h"
+#include "protocol.h"
+#include "session_manager.h"
+
+using mi::server::ApiService;
+using mi::server::DemoAuthProvider;
+using mi::server::DemoUser;
+using mi::server::DemoUserTable;
+using mi::server::Frame;
+using mi::server::FrameRouter;
+using mi::server::FrameType;
+using mi::server::GroupCallConfig;
+using mi::server::GroupCallManager;
+using mi::server::GroupDirectory;
+using mi::server::GroupManager;
+using mi::server::MediaDatagram;
+using mi::server::MediaDatagramDirection;
+using mi::server::MediaDatagramType;
+using mi::server::MediaRelay;
+using mi::server::MediaRelayPacket;
+using mi::server::MediaUdpOptions;
+using mi::server::MediaUdpServer;
+using mi::server::SessionManager;
+using mi::server::proto::ReadString;
+using mi::server::proto::ReadUint32;
+using mi::server::proto::ReadUint64;
+using mi::server::proto::WriteString;
+
+namespace {
+
+#ifdef _WIN32
+using Socket = SOCKET;
+void CloseSocket(Socket s) { closesocket(s); }
+#else
+using Socket = int;
+void CloseSocket(Socket s) { close(s); }
+#endif
+
+constexpr int kPackets = 50;
+
+struct Client {
+  Socket sock{};
+  sockaddr_in server{};
+  std::uint64_t flow_id{0};
+  std::array<std::uint8_t, 32> key{};
+  std::uint64_t counter{0};
+};
+
+DemoUser MakeUser(const std::string& name) {
+  DemoUser user;
+  user.username.set(name);
+  user.password.set("pwd");
+  user.username_plain = name;
+  user.password_plain = "pwd";
+  return user;
+}
+
+std::string Login(FrameRouter& router, const std::string& user) {
+  Frame req;
+  req.type = FrameType::kLogin;
+  WriteString(user, req.payload);
+  WriteString("pwd", req.payload);
+  Frame resp;
+  const bool ok =
+      router.Handle(req, resp, "", mi::server::TransportKind::kLocal);
+  assert(ok);
+  std::size_t off = 1;
+  std::string token;
+  const bool read = ReadString(resp.payload, off, token);
+  assert(read);
+  (void)read;
+  (void)ok;
+  return token;
+}
+
+std::int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// v2 audio media packet carrying |tag| and the send time.
+std::vector<std::uint8_t> MakeMediaPayload(std::uint32_t tag) {
+  std::vector<std::uint8_t> payload(30, 0);
+  payload[0] = 2;
+  payload[1] = 1;
+  const std::int64_t now = NowNs();
+  std::memcpy(payload.data() + 2, &tag, sizeof(tag));
+  std::memcpy(payload.data() + 6, &now, sizeof(now));
+  return payload;
+}
+
+Client OpenClient(std::uint16_t port, std::uint64_t flow_id,
+                  const std::array<std::uint8_t, 32>& key) {
+  Client c;
+  c.flow_id = flow_id;
+  c.key = key;
+  c.sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  sockaddr_in local{};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const int rc = ::bind(c.sock, reinterpret_cast<sockaddr*>(&local),
+                        sizeof(local));
+  assert(rc == 0);
+  (void)rc;
+  c.server.sin_family = AF_INET;
+  c.server.sin_port = htons(port);
+  c.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return c;
+}
+
+void SendRaw(const Client& c, const std::vector<std::uint8_t>& wire) {
+  ::sendto(c.sock, reinterpret_cast<const char*>(wire.data()),
+           static_cast<int>(wire.size()), 0,
+           reinterpret_cast<const sockaddr*>(&c.server), sizeof(c.server));
+}
+
+std::vector<std::uint8_t> Encode(Client& c, MediaDatagramType type,
+                                 std::vector<std::uint8_t> body) {
+  MediaDatagram dgram;
+  dgram.type = type;
+  dgram.flow_id = c.flow_id;
+  dgram.counter = ++c.counter;
+  dgram.body = std::move(body);
+  std::vector<std::uint8_t> wire;
+  const bool ok = mi::server::EncodeMediaDatagram(
+      dgram, MediaDatagramDirection::kToServer, c.key, wire);
+  assert(ok);
+  (void)ok;
+  return wire;
+}
+
+bool Receive(const Client& c, int timeout_ms, MediaDatagram& out) {
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(c.sock, &readfds);
+  timeval tv{};
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  if (select(static_cast<int>(c.sock) + 1, &readfds, nullptr, nullptr, &tv) <=
+      0) {
+    return false;
+  }
+  std::uint8_t buf[2048];
+  const auto n = ::recv(c.sock, reinterpret_cast<char*>(buf), sizeof(buf), 0);
+  if (n <= 0) {
+    return false;
+  }
+  // Relayed bodies are sealed; the sender never shows on the wire.
+  const char* sender = "alice";
+  assert(std::search(buf, buf + n, sender, sender + 5) == buf + n);
+  return mi::server::DecodeMediaDatagram(buf, static_cast<std::size_t>(n),
+                                         MediaDatagramDirection::kToClient,
+                                         c.key, out);
+}
+
+void Bind(Client& c) {
+  SendRaw(c, Encode(c, MediaDatagramType::kBind, {}));
+  MediaDatagram ack;
+  const bool ok = Receive(c, 2000, ack);
+  assert(ok);
+  assert(ack.type == MediaDatagramType::kBindAck);
+  assert(ack.flow_id == c.flow_id);
+  (void)ok;
+}
+
+// Returns the relayed packet's tag, checking that it came from alice.
+std::uint32_t ReadRelayed(const MediaDatagram& dgram, std::int64_t& sent_ns) {
+  assert(dgram.type == MediaDatagramType::kMedia);
+  std::size_t off = 0;
+  std::string sender;
+  const bool ok = ReadString(dgram.body, off, sender);
+  assert(ok);
+  (void)ok;
+  assert(sender == "alice");
+  assert(dgram.body.size() == off + 30);
+  std::uint32_t tag = 0;
+  std::memcpy(&tag, dgram.body.data() + off + 2, sizeof(tag));
+  std::memcpy(&sent_ns, dgram.body.data() + off + 6, sizeof(sent_ns));
+  return tag;
+}
+
+}  // namespace
+
+int main() {
+#ifdef _WIN32
+  WSADATA wsa;
+  WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+  DemoUserTable table;
+  table.emplace("alice", MakeUser("alice"));
+  table.emplace("bob", MakeUser("bob"));
+  table.emplace("carol", MakeUser("carol"));
+
+  auto auth = std::make_unique<DemoAuthProvider>(std::move(table));
+  SessionManager sessions(std::move(auth));
+  GroupManager groups;
+  GroupDirectory directory;
+  directory.AddGroup("g1", "alice");
+  directory.AddMember("g1", "bob");
+  directory.AddMember("g1", "carol");
+
+  GroupCallConfig call_cfg;
+  call_cfg.enable_group_call = true;
+  GroupCallManager calls(call_cfg);
+  MediaRelay relay(256, std::chrono::milliseconds(2000));
+
+  ApiService api(&sessions, &groups, &calls, &directory, nullptr, nullptr,
+                 &relay);
+  FrameRouter router(&api);
+
+  const std::string token_alice = Login(router, "alice");
+  const std::string token_bob = Login(router, "bob");
+  const std::string token_carol = Login(router, "carol");
+
+  std::array<std::uint8_t, 16> no_call{};
+  auto created =
+      api.GroupCallSignal(token_alice, 1, "g1", no_call, 1, 0, 0, 0, {});
+  assert(created.success);
+  const auto call_id = created.call_id;
+  bool ok =
+      api.GroupCallSignal(token_bob, 2, "g1", call_id, 1, 0, 0, 0, {}).success;
+  assert(ok);
+  ok = api.GroupCallSignal(token_carol, 2, "g1", call_id, 1, 0, 0, 0, {})
+           .success;
+  assert(ok);
+
+  // Disabled until a UDP server is attached.
+  assert(!api.OpenMediaFlow(token_bob, "g1", call_id, "").success);
+
+  MediaUdpOptions opts;
+  MediaUdpServer udp(&relay, 0, opts);
+  api.SetMediaUdp(&udp);
+  std::string error;
+  ok = udp.Start(error);
+  assert(ok);
+  assert(udp.port() != 0);
+
+  // Alice's flow goes through the frame router.
+  Frame open;
+  open.type = FrameType::kMediaFlowOpen;
+  WriteString("g1", open.payload);
+  open.payload.insert(open.payload.end(), call_id.begin(), call_id.end());
+  WriteString("", open.payload);
+  Frame open_resp;
+  ok = router.Handle(open, open_resp, token_alice,
+                     mi::server::TransportKind::kLocal);
+  assert(ok);
+  assert(open_resp.payload.size() == 1 + 8 + 32 + 4);
+  assert(open_resp.payload[0] == 1);
+  std::size_t off = 1;
+  std::uint64_t alice_flow = 0;
+  ok = ReadUint64(open_resp.payload, off, alice_flow);
+  assert(ok);
+  std::array<std::uint8_t, 32> alice_key{};
+  std::memcpy(alice_key.data(), open_resp.payload.data() + off,
+              alice_key.size());
+  off += alice_key.size();
+  std::uint32_t port = 0;
+  ok = ReadUint32(open_resp.payload, off, port);
+  assert(ok);
+  assert(port == udp.port());
+
+  auto bob_grant = api.OpenMediaFlow(token_bob, "g1", call_id, "");
+  assert(bob_grant.success);
+  assert(!api.OpenMediaFlow(token_bob, "g2", call_id, "").success);
+  assert(!api.OpenMediaFlow(token_bob, "", call_id, "bob").success);
+  assert(udp.FlowCount() == 2);
+
+  Client alice = OpenClient(udp.port(), alice_flow, alice_key);
+  Client bob = OpenClient(udp.port(), bob_grant.flow_id, bob_grant.key);
+  Bind(alice);
+  Bind(bob);
+
+  // A datagram under the wrong key is ignored, as is one for an unknown flow.
+  Client forged = alice;
+  forged.key = bob_grant.key;
+  SendRaw(forged, Encode(forged, MediaDatagramType::kMedia,
+                         MakeMediaPayload(1000)));
+  Client stranger = alice;
+  stranger.flow_id ^= 1;
+  SendRaw(stranger, Encode(stranger, MediaDatagramType::kMedia,
+                           MakeMediaPayload(1001)));
+
+  std::vector<std::uint8_t> first_wire;
+  for (int i = 0; i < kPackets; ++i) {
+    auto wire = Encode(alice, MediaDatagramType::kMedia,
+                       MakeMediaPayload(static_cast<std::uint32_t>(i)));
+    if (i == 0) {
+      first_wire = wire;
+    }
+    SendRaw(alice, wire);
+  }
+  // Replayed and tampered datagrams are dropped.
+  SendRaw(alice, first_wire);
+  auto tampered = Encode(alice, MediaDatagramType::kMedia,
+                         MakeMediaPayload(2000));
+  tampered[mi::server::kMediaDatagramHeaderBytes + 3] ^= 0x40;
+  SendRaw(alice, tampered);
+  SendRaw(alice, Encode(alice, MediaDatagramType::kMedia,
+                        MakeMediaPayload(kPackets)));
+
+  std::vector<bool> seen(kPackets + 1, false);
+  double total_us = 0.0;
+  double max_us = 0.0;
+  int received = 0;
+  MediaDatagram dgram;
+  while (received < kPackets + 1 && Receive(bob, 2000, dgram)) {
+    std::int64_t sent_ns = 0;
+    const std::uint32_t tag = ReadRelayed(dgram, sent_ns);
+    assert(tag <= static_cast<std::uint32_t>(kPackets));
+    assert(!seen[tag]);
+    seen[tag] = true;
+    const double us = static_cast<double>(NowNs() - sent_ns) / 1000.0;
+    total_us += us;
+    max_us = us > max_us ? us : max_us;
+    ++received;
+  }
+  assert(received == kPackets + 1);
+  assert(!Receive(bob, 100, dgram));
+
+  // Bob's packets went out on UDP, not into his pull queue.
+  std::vector<MediaRelayPacket> bob_queue;
+  relay.Pull("bob", call_id, 256, std::chrono::milliseconds(0), bob_queue);
+  assert(bob_queue.empty());
+
+  // Carol has no flow and still gets everything by pulling.
+  std::size_t carol_packets = 0;
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (carol_packets < kPackets + 1u &&
+         std::chrono::steady_clock::now() < deadline) {
+    auto pulled = api.PullGroupMedia(token_carol, call_id, 256, 100);
+    assert(pulled.success);
+    for (const auto& pkt : pulled.packets) {
+      assert(pkt.sender == "alice");
+    }
+    carol_packets += pulled.packets.size();
+  }
+  assert(carol_packets == kPackets + 1u);
+
+  std::printf("media udp: %d packets, avg %.1f us, max %.1f us one-way\n",
+              received, total_us / received, max_us);
+
+  udp.Stop();
+  assert(udp.FlowCount() == 0);
+  CloseSocket(alice.sock);
+  CloseSocket(bob.sock);
+#ifdef _WIN32
+  WSACleanup();
+#endif
+  return 0;
+}
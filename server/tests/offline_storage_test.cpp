@@ -7,6 +7,7 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <thread>
 #include <vector>
 #include <random>
@@ -42,6 +43,12 @@ bool WaitForGone(const std::filesystem::path& path) {
   return gone;
 }
 
+// Mirrors OfflineStorage's <id[0:2]>/<id[2:4]>/ fan-out.
+std::filesystem::path StoredPath(const std::filesystem::path& dir,
+                                 const std::string& id, const char* ext) {
+  return dir / id.substr(0, 2) / id.substr(2, 2) / (id + ext);
+}
+
 std::filesystem::path TempDir(const std::string& name) {
   auto dir = std::filesystem::temp_directory_path() / name;
   std::error_code ec;
@@ -63,7 +70,7 @@ int main() {
       FAIL();
     }
     {
-      const auto path = dir / (put.file_id + ".bin");
+      const auto path = StoredPath(dir, put.file_id, ".bin");
       std::ifstream ifs(path, std::ios::binary);
       if (!ifs) {
         FAIL();
@@ -84,7 +91,7 @@ int main() {
       }
     }
     {
-      const auto key_path = dir / (put.file_id + ".key");
+      const auto key_path = StoredPath(dir, put.file_id, ".key");
       std::error_code ec;
       if (!std::filesystem::exists(key_path, ec) || ec) {
         FAIL();
@@ -99,10 +106,10 @@ int main() {
     if (!fetched.has_value() || payload != fetched.value()) {
       FAIL();
     }
-    if (!WaitForGone(dir / (put.file_id + ".bin"))) {
+    if (!WaitForGone(StoredPath(dir, put.file_id, ".bin"))) {
       FAIL();
     }
-    if (!WaitForGone(dir / (put.file_id + ".key"))) {
+    if (!WaitForGone(StoredPath(dir, put.file_id, ".key"))) {
       FAIL();
     }
     if (storage.Meta(put.file_id).has_value()) {
@@ -120,7 +127,7 @@ int main() {
       FAIL();
     }
     std::error_code ec;
-    std::filesystem::remove(dir / (put.file_id + ".key"), ec);
+    std::filesystem::remove(StoredPath(dir, put.file_id, ".key"), ec);
     std::string err;
     auto fetched = storage.Fetch(put.file_id, put.file_key, false, err);
     if (fetched.has_value()) {
@@ -149,10 +156,10 @@ int main() {
       if (!fetched.has_value() || fetched.value() != payload) {
         FAIL();
       }
-      if (!WaitForGone(dir / (put.file_id + ".bin"))) {
+      if (!WaitForGone(StoredPath(dir, put.file_id, ".bin"))) {
         FAIL();
       }
-      if (!WaitForGone(dir / (put.file_id + ".key"))) {
+      if (!WaitForGone(StoredPath(dir, put.file_id, ".key"))) {
         FAIL();
       }
     }
@@ -220,7 +227,8 @@ int main() {
     mi::server::crypto::HmacSha256(kKey.data(), kKey.size(), mac_buf.data(),
                                    mac_buf.size(), digest);
 
-    const auto path = dir / (file_id + ".bin");
+    const auto path = StoredPath(dir, file_id, ".bin");
+    std::filesystem::create_directories(path.parent_path());
     std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
     if (!ofs) {
       FAIL();
@@ -282,7 +290,7 @@ int main() {
     if (!finished.success || finished.meta.size != chunk1.size() + chunk2.size()) {
       FAIL();
     }
-    if (!std::filesystem::exists(dir / (started.file_id + ".bin"))) {
+    if (!std::filesystem::exists(StoredPath(dir, started.file_id, ".bin"))) {
       FAIL();
     }
 
@@ -305,7 +313,7 @@ int main() {
       FAIL();
     }
 
-    if (!WaitForGone(dir / (started.file_id + ".bin"))) {
+    if (!WaitForGone(StoredPath(dir, started.file_id, ".bin"))) {
       FAIL();
     }
     if (storage.Meta(started.file_id).has_value()) {
@@ -313,20 +321,242 @@ int main() {
     }
   }
 
+  {
+    const auto dir = TempDir("mi_e2ee_offline_blob_window");
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60));
+    auto up = storage.BeginBlobUpload("alice", 12);
+    if (!up.success) {
+      FAIL();
+    }
+    const std::vector<std::uint8_t> c0 = {0, 1, 2, 3};
+    const std::vector<std::uint8_t> c1 = {4, 5, 6, 7};
+    const std::vector<std::uint8_t> c2 = {8, 9, 10, 11};
+    auto r2 = storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id,
+                                            8, c2);
+    if (!r2.success || r2.bytes_received != 0) {
+      FAIL();
+    }
+    auto status = storage.QueryBlobUpload("alice", up.file_id, up.upload_id);
+    if (!status.success || status.missing.size() != 1u ||
+        status.missing[0] != std::make_pair<std::uint64_t, std::uint64_t>(0, 8)) {
+      FAIL();
+    }
+    if (storage.FinishBlobUpload("alice", up.file_id, up.upload_id, 12)
+            .success) {
+      FAIL();
+    }
+    // An offset near the top of the range must not wrap past the checks.
+    const std::vector<std::uint8_t> wrap(16, 0xEE);
+    if (storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id,
+                                      std::numeric_limits<std::uint64_t>::max() -
+                                          10,
+                                      wrap).success) {
+      FAIL();
+    }
+    auto r0 = storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id,
+                                            0, c0);
+    if (!r0.success || r0.bytes_received != 4) {
+      FAIL();
+    }
+    // Partial overlap with received data is rejected, a full resend is not.
+    if (storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id, 2,
+                                      c1).success) {
+      FAIL();
+    }
+    if (!storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id, 8,
+                                       c2).success) {
+      FAIL();
+    }
+    status = storage.QueryBlobUpload("alice", up.file_id, up.upload_id);
+    if (!status.success || status.missing.size() != 1u ||
+        status.missing[0].first != 4 || status.missing[0].second != 4) {
+      FAIL();
+    }
+    auto r1 = storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id,
+                                            4, c1);
+    if (!r1.success || r1.bytes_received != 12) {
+      FAIL();
+    }
+    status = storage.QueryBlobUpload("alice", up.file_id, up.upload_id);
+    if (!status.success || !status.missing.empty()) {
+      FAIL();
+    }
+    if (!storage.FinishBlobUpload("alice", up.file_id, up.upload_id, 12)
+             .success) {
+      FAIL();
+    }
+    auto dl = storage.BeginBlobDownload("alice", up.file_id, false);
+    auto got = storage.ReadBlobDownloadChunk("alice", up.file_id,
+                                             dl.download_id, 0, 64);
+    if (!got.success || !got.eof ||
+        got.chunk != std::vector<std::uint8_t>(
+                          {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11})) {
+      FAIL();
+    }
+  }
+
+  {
+    // Piecewise chunks keep their range reserved until committed; an
+    // aborted chunk leaves nothing received behind.
+    const auto dir = TempDir("mi_e2ee_offline_blob_chunk_stream");
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60));
+    auto up = storage.BeginBlobUpload("alice", 8);
+    if (!up.success) {
+      FAIL();
+    }
+    const std::vector<std::uint8_t> bytes = {1, 2, 3, 4, 5, 6, 7, 8};
+    mi::server::OfflineStorage::BlobChunkStream aborted;
+    if (!storage.BeginBlobUploadChunk("alice", up.file_id, up.upload_id, 0,
+                                      8, aborted).success ||
+        !storage.WriteBlobUploadChunk(aborted, bytes.data(), 3)) {
+      FAIL();
+    }
+    if (storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id, 4,
+                                      bytes.data(), 4).success ||
+        storage.FinishBlobUpload("alice", up.file_id, up.upload_id, 8)
+            .success) {
+      FAIL();
+    }
+    if (storage.EndBlobUploadChunk(aborted, false).success) {
+      FAIL();
+    }
+    {
+      // What the aborted chunk wrote is zeroed.
+      std::ifstream part(StoredPath(dir, up.file_id, ".part"),
+                         std::ios::binary);
+      char head[3] = {1, 1, 1};
+      if (!part.read(head, sizeof(head)) || head[0] != 0 || head[1] != 0 ||
+          head[2] != 0) {
+        FAIL();
+      }
+    }
+    mi::server::OfflineStorage::BlobChunkStream chunk;
+    if (!storage.BeginBlobUploadChunk("alice", up.file_id, up.upload_id, 0,
+                                      8, chunk).success ||
+        !storage.WriteBlobUploadChunk(chunk, bytes.data(), 5) ||
+        !storage.WriteBlobUploadChunk(chunk, bytes.data() + 5, 3) ||
+        storage.WriteBlobUploadChunk(chunk, bytes.data(), 1)) {
+      FAIL();
+    }
+    if (storage.EndBlobUploadChunk(chunk, true).success) {
+      FAIL();  // the overrun above poisons the chunk
+    }
+    if (!storage.BeginBlobUploadChunk("alice", up.file_id, up.upload_id, 0,
+                                      8, chunk).success ||
+        !storage.WriteBlobUploadChunk(chunk, bytes.data(), 8)) {
+      FAIL();
+    }
+    auto done = storage.EndBlobUploadChunk(chunk, true);
+    if (!done.success || done.bytes_received != 8 ||
+        !storage.FinishBlobUpload("alice", up.file_id, up.upload_id, 8)
+             .success) {
+      FAIL();
+    }
+    std::string err;
+    auto blob = storage.FetchBlob(up.file_id, false, err);
+    if (!blob.has_value() || *blob != bytes) {
+      FAIL();
+    }
+  }
+
+  {
+    // An aborted upload drops its session and its .part file right away.
+    const auto dir = TempDir("mi_e2ee_offline_blob_abort");
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60));
+    auto up = storage.BeginBlobUpload("alice", 8);
+    if (!up.success) {
+      FAIL();
+    }
+    const std::vector<std::uint8_t> bytes = {1, 2, 3, 4};
+    if (!storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id, 0,
+                                       bytes).success) {
+      FAIL();
+    }
+    const auto part = StoredPath(dir, up.file_id, ".part");
+    if (!std::filesystem::exists(part)) {
+      FAIL();
+    }
+    std::string err;
+    if (storage.AbortBlobUpload("bob", up.file_id, up.upload_id, err) ||
+        err != "unauthorized") {
+      FAIL();
+    }
+    if (!storage.AbortBlobUpload("alice", up.file_id, up.upload_id, err) ||
+        !WaitForGone(part)) {
+      FAIL();
+    }
+    if (storage.AppendBlobUploadChunk("alice", up.file_id, up.upload_id, 4,
+                                      bytes).success ||
+        storage.AbortBlobUpload("alice", up.file_id, up.upload_id, err)) {
+      FAIL();
+    }
+  }
+
+  {
+    // One cached handle shared by two interleaved uploads forces the
+    // sessions to evict and reopen each other's file.
+    const auto dir = TempDir("mi_e2ee_offline_blob_fd_cache");
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60), {}, 1);
+    auto up1 = storage.BeginBlobUpload("alice", 8);
+    auto up2 = storage.BeginBlobUpload("alice", 8);
+    if (!up1.success || !up2.success) {
+      FAIL();
+    }
+    for (std::uint8_t i = 0; i < 4; ++i) {
+      const std::vector<std::uint8_t> c1 = {i, i};
+      const std::vector<std::uint8_t> c2 = {static_cast<std::uint8_t>(i + 10),
+                                            static_cast<std::uint8_t>(i + 10)};
+      if (!storage.AppendBlobUploadChunk("alice", up1.file_id, up1.upload_id,
+                                         i * 2u, c1).success ||
+          !storage.AppendBlobUploadChunk("alice", up2.file_id, up2.upload_id,
+                                         i * 2u, c2).success) {
+        FAIL();
+      }
+    }
+    if (!storage.FinishBlobUpload("alice", up1.file_id, up1.upload_id, 8)
+             .success ||
+        !storage.FinishBlobUpload("alice", up2.file_id, up2.upload_id, 8)
+             .success) {
+      FAIL();
+    }
+    auto dl1 = storage.BeginBlobDownload("bob", up1.file_id, false);
+    auto dl2 = storage.BeginBlobDownload("bob", up2.file_id, false);
+    if (!dl1.success || !dl2.success) {
+      FAIL();
+    }
+    std::vector<std::uint8_t> got1;
+    std::vector<std::uint8_t> got2;
+    for (std::uint64_t off = 0; off < 8; off += 4) {
+      auto r1 = storage.ReadBlobDownloadChunk("bob", up1.file_id,
+                                              dl1.download_id, off, 4);
+      auto r2 = storage.ReadBlobDownloadChunk("bob", up2.file_id,
+                                              dl2.download_id, off, 4);
+      if (!r1.success || !r2.success) {
+        FAIL();
+      }
+      got1.insert(got1.end(), r1.chunk.begin(), r1.chunk.end());
+      got2.insert(got2.end(), r2.chunk.begin(), r2.chunk.end());
+    }
+    if (got1 != std::vector<std::uint8_t>({0, 0, 1, 1, 2, 2, 3, 3}) ||
+        got2 != std::vector<std::uint8_t>({10, 10, 11, 11, 12, 12, 13, 13})) {
+      FAIL();
+    }
+  }
+
   {
     const auto dir = TempDir("mi_e2ee_offline_cleanup");
     mi::server::OfflineStorage storage(dir, std::chrono::seconds(1));
     std::vector<std::uint8_t> payload(64, 0xAB);
     auto put = storage.Put("bob", payload);
-    if (!put.success || !std::filesystem::exists(dir / (put.file_id + ".bin"))) {
+    if (!put.success || !std::filesystem::exists(StoredPath(dir, put.file_id, ".bin"))) {
       FAIL();
     }
     std::this_thread::sleep_for(std::chrono::milliseconds(1100));
     storage.CleanupExpired();
-    if (!WaitForGone(dir / (put.file_id + ".bin"))) {
+    if (!WaitForGone(StoredPath(dir, put.file_id, ".bin"))) {
       FAIL();
     }
-    if (!WaitForGone(dir / (put.file_id + ".key"))) {
+    if (!WaitForGone(StoredPath(dir, put.file_id, ".key"))) {
       FAIL();
     }
     if (storage.Meta(put.file_id).has_value()) {
@@ -334,6 +564,240 @@ int main() {
     }
   }
 
+  {
+    // Streaming put/fetch never hands out more than one stream chunk.
+    const auto dir = TempDir("mi_e2ee_offline_stream");
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60));
+    std::vector<std::uint8_t> payload(5u * 1024u * 1024u / 2u + 7u);
+    for (std::size_t i = 0; i < payload.size(); ++i) {
+      payload[i] = static_cast<std::uint8_t>(i * 31u);
+    }
+    std::size_t pos = 0;
+    const auto reader = [&](std::uint8_t* out, std::size_t len) {
+      if (len > payload.size() - pos) {
+        return false;
+      }
+      std::memcpy(out, payload.data() + pos, len);
+      pos += len;
+      return true;
+    };
+    auto put = storage.PutStream("alice", payload.size(), reader);
+    pos = 0;
+    auto put_blob = storage.PutBlobStream("alice", payload.size(), reader);
+    if (!put.success || !put_blob.success ||
+        put.meta.size != payload.size()) {
+      FAIL();
+    }
+    std::vector<std::uint8_t> got;
+    std::size_t max_piece = 0;
+    const auto writer = [&](std::uint64_t total, const std::uint8_t* data,
+                            std::size_t len) {
+      if (total != payload.size()) {
+        return false;
+      }
+      max_piece = std::max(max_piece, len);
+      got.insert(got.end(), data, data + len);
+      return true;
+    };
+    std::string err;
+    if (!storage.FetchStream(put.file_id, put.file_key, false, writer, err) ||
+        got != payload || max_piece > 1024u * 1024u) {
+      FAIL();
+    }
+    got.clear();
+    max_piece = 0;
+    if (!storage.FetchBlobStream(put_blob.file_id, false, writer, err) ||
+        got != payload || max_piece > 1024u * 1024u) {
+      FAIL();
+    }
+    // A failing sink aborts without consuming the file.
+    if (storage.FetchStream(put.file_id, put.file_key, true,
+                            [](std::uint64_t, const std::uint8_t*,
+                               std::size_t) { return false; },
+                            err) ||
+        !std::filesystem::exists(StoredPath(dir, put.file_id, ".bin"))) {
+      FAIL();
+    }
+    auto whole = storage.Fetch(put.file_id, put.file_key, true, err);
+    if (!whole.has_value() || *whole != payload ||
+        !WaitForGone(StoredPath(dir, put.file_id, ".bin"))) {
+      FAIL();
+    }
+  }
+
+  {
+    // A restarted storage rebuilds metadata from the directory and drops
+    // upload leftovers and orphaned erase keys.
+    const auto dir = TempDir("mi_e2ee_offline_rebuild");
+    std::string kept_id;
+    std::string blob_id;
+    std::filesystem::path part_path;
+    {
+      mi::server::OfflineStorage storage(dir, std::chrono::seconds(60));
+      auto put = storage.Put("alice", std::vector<std::uint8_t>(100, 0x11));
+      auto blob = storage.PutBlob("alice", std::vector<std::uint8_t>(40, 0x22));
+      auto up = storage.BeginBlobUpload("alice", 8);
+      if (!put.success || !blob.success || !up.success) {
+        FAIL();
+      }
+      kept_id = put.file_id;
+      blob_id = blob.file_id;
+      part_path = StoredPath(dir, up.file_id, ".part");
+    }
+    const auto orphan_key = dir / "0123456789abcdef0123456789abcdef.key";
+    {
+      std::ofstream ofs(orphan_key, std::ios::binary);
+      ofs << "k";
+    }
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(1));
+    const auto meta = storage.Meta(kept_id);
+    if (!meta.has_value() || meta->size == 0 ||
+        !storage.Meta(blob_id).has_value() ||
+        storage.Meta(blob_id)->size != 40) {
+      FAIL();
+    }
+    const auto stats = storage.GetStats();
+    if (stats.files != 2u) {
+      FAIL();
+    }
+    if (!WaitForGone(part_path) || !WaitForGone(orphan_key) ||
+        !std::filesystem::exists(StoredPath(dir, kept_id, ".key"))) {
+      FAIL();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    storage.CleanupExpired();
+    if (!WaitForGone(StoredPath(dir, kept_id, ".bin")) ||
+        !WaitForGone(StoredPath(dir, blob_id, ".bin")) ||
+        storage.GetStats().files != 0u) {
+      FAIL();
+    }
+  }
+
+  {
+    // Flat stores from before the fan-out stay readable and are moved into
+    // the two-level layout in the background.
+    const auto dir = TempDir("mi_e2ee_offline_fanout_migrate");
+    const std::vector<std::uint8_t> payload(300, 0x44);
+    mi::server::PutResult put;
+    {
+      mi::server::OfflineStorage storage(dir, std::chrono::seconds(60));
+      put = storage.Put("alice", payload);
+      if (!put.success) {
+        FAIL();
+      }
+    }
+    std::filesystem::rename(StoredPath(dir, put.file_id, ".bin"),
+                            dir / (put.file_id + ".bin"));
+    std::filesystem::rename(StoredPath(dir, put.file_id, ".key"),
+                            dir / (put.file_id + ".key"));
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60));
+    if (!storage.Meta(put.file_id).has_value()) {
+      FAIL();
+    }
+    std::string err;
+    auto first = storage.Fetch(put.file_id, put.file_key, false, err);
+    if (!first.has_value() || *first != payload) {
+      FAIL();
+    }
+    if (!WaitForGone(dir / (put.file_id + ".bin")) ||
+        !WaitForGone(dir / (put.file_id + ".key")) ||
+        !std::filesystem::exists(StoredPath(dir, put.file_id, ".bin")) ||
+        !std::filesystem::exists(StoredPath(dir, put.file_id, ".key"))) {
+      FAIL();
+    }
+    auto second = storage.Fetch(put.file_id, put.file_key, true, err);
+    if (!second.has_value() || *second != payload) {
+      FAIL();
+    }
+  }
+
+  {
+    // Wipes run on the background worker; files left in pending_wipe/ by a
+    // previous process are resumed.
+    const auto dir = TempDir("mi_e2ee_offline_pending_wipe");
+    const auto pending = dir / "pending_wipe";
+    std::filesystem::create_directories(pending);
+    const auto leftover = pending / "fedcba9876543210fedcba9876543210.bin";
+    {
+      std::ofstream ofs(leftover, std::ios::binary);
+      ofs << std::string(4096, 'x');
+    }
+    mi::server::SecureDeleteConfig sd;
+    sd.max_bytes_per_sec = 64u * 1024u * 1024u;
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60), sd);
+    auto put = storage.Put("alice", std::vector<std::uint8_t>(256, 0x33));
+    if (!put.success) {
+      FAIL();
+    }
+    std::string err;
+    if (!storage.Fetch(put.file_id, put.file_key, true, err).has_value()) {
+      FAIL();
+    }
+    if (std::filesystem::exists(StoredPath(dir, put.file_id, ".bin")) ||
+        std::filesystem::exists(StoredPath(dir, put.file_id, ".key"))) {
+      FAIL();
+    }
+    bool drained = false;
+    for (int i = 0; i < 200 && !drained; ++i) {
+      std::error_code ec;
+      drained = std::filesystem::is_empty(pending, ec) &&
+                storage.GetStats().pending_wipes == 0;
+      if (!drained) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    if (!drained || std::filesystem::exists(leftover)) {
+      FAIL();
+    }
+  }
+
+  {
+    // The wipe rate limit is charged the bytes a wipe overwrites, so a large
+    // file does not hold back the wipes queued behind it.
+    const auto dir = TempDir("mi_e2ee_offline_wipe_rate");
+    const auto pending = dir / "pending_wipe";
+    std::filesystem::create_directories(pending);
+    const auto first = pending / "00000000000000000000000000000001.bin";
+    const auto second = pending / "00000000000000000000000000000002.bin";
+    for (const auto& path : {first, second}) {
+      std::ofstream(path, std::ios::binary).put('x');
+      std::filesystem::resize_file(path, 64u * 1024u * 1024u);
+    }
+    mi::server::SecureDeleteConfig sd;
+    sd.max_bytes_per_sec = 64u * 1024u;
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60), sd);
+    bool drained = false;
+    for (int i = 0; i < 200 && !drained; ++i) {
+      drained = !std::filesystem::exists(first) &&
+                !std::filesystem::exists(second) &&
+                storage.GetStats().pending_wipes == 0;
+      if (!drained) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    if (!drained) {
+      FAIL();
+    }
+  }
+
+  {
+    // Without wipe workers, leftovers in pending_wipe/ are wiped at startup.
+    const auto dir = TempDir("mi_e2ee_offline_pending_wipe_inline");
+    const auto pending = dir / "pending_wipe";
+    std::filesystem::create_directories(pending);
+    const auto leftover = pending / "0123456789abcdef0123456789abcdef.bin";
+    {
+      std::ofstream ofs(leftover, std::ios::binary);
+      ofs << std::string(4096, 'x');
+    }
+    mi::server::SecureDeleteConfig sd;
+    sd.workers = 0;
+    mi::server::OfflineStorage storage(dir, std::chrono::seconds(60), sd);
+    if (std::filesystem::exists(leftover)) {
+      FAIL();
+    }
+  }
+
   {
     mi::server::OfflineQueue queue(std::chrono::seconds(1));
     queue.Enqueue("alice", {1, 2, 3});
@@ -351,5 +815,199 @@ int main() {
     }
   }
 
+  {
+    mi::server::OfflineQueue queue;
+    for (std::uint8_t i = 0; i < 5; ++i) {
+      queue.EnqueuePrivate("carol", "dave", {i, i, i, i});
+    }
+    queue.Enqueue("carol", {42});
+
+    mi::server::OfflinePageRequest req;
+    req.max_messages = 2;
+    auto page = queue.FetchPage("carol", mi::server::QueueMessageKind::kPrivate,
+                                req);
+    if (page.messages.size() != 2u || !page.has_more ||
+        page.messages[0].payload != std::vector<std::uint8_t>({0, 0, 0, 0})) {
+      FAIL();
+    }
+    // Without an ack the same page is served again.
+    auto again = queue.FetchPage("carol",
+                                 mi::server::QueueMessageKind::kPrivate, req);
+    if (again.cursor != page.cursor || again.messages.size() != 2u ||
+        again.messages[1].payload != page.messages[1].payload) {
+      FAIL();
+    }
+
+    req.ack_cursor = page.cursor;
+    req.max_messages = 0;
+    req.max_bytes = 6;
+    page = queue.FetchPage("carol", mi::server::QueueMessageKind::kPrivate,
+                           req);
+    if (page.messages.size() != 1u || !page.has_more ||
+        page.messages[0].payload != std::vector<std::uint8_t>({2, 2, 2, 2})) {
+      FAIL();
+    }
+
+    req.ack_cursor = page.cursor;
+    req.max_bytes = 0;
+    page = queue.FetchPage("carol", mi::server::QueueMessageKind::kPrivate,
+                           req);
+    if (page.messages.size() != 2u || page.has_more) {
+      FAIL();
+    }
+    req.ack_cursor = page.cursor;
+    page = queue.FetchPage("carol", mi::server::QueueMessageKind::kPrivate,
+                           req);
+    if (!page.messages.empty() || page.has_more || page.cursor != req.ack_cursor) {
+      FAIL();
+    }
+    const auto stats = queue.GetStats();
+    if (stats.private_messages != 0u || stats.generic_messages != 1u) {
+      FAIL();
+    }
+    if (queue.Drain("carol").size() != 1u) {
+      FAIL();
+    }
+  }
+
+  {
+    const auto dir = TempDir("mi_e2ee_offline_queue_spill");
+    mi::server::OfflineQueueLimits limits;
+    limits.max_resident_bytes = 1024;
+    limits.max_recipient_resident_bytes = 256;
+    limits.spill_dir = dir;
+    mi::server::OfflineQueue queue(std::chrono::hours(1), limits);
+    for (std::uint8_t i = 0; i < 8; ++i) {
+      queue.EnqueuePrivate("erin", "frank", std::vector<std::uint8_t>(100, i));
+    }
+    for (std::uint8_t i = 0; i < 12; ++i) {
+      queue.Enqueue("gina", std::vector<std::uint8_t>(100, i));
+    }
+    auto stats = queue.GetStats();
+    if (stats.bytes != 2000u || stats.resident_bytes > 1024u ||
+        stats.resident_bytes + stats.spilled_bytes != stats.bytes ||
+        stats.spill_count == 0 || stats.spilled_messages == 0) {
+      FAIL();
+    }
+
+    mi::server::OfflinePageRequest req;
+    req.max_messages = 3;
+    const auto page = queue.FetchPage(
+        "erin", mi::server::QueueMessageKind::kPrivate, req);
+    if (page.messages.size() != 3u ||
+        page.messages[0].payload != std::vector<std::uint8_t>(100, 0) ||
+        page.messages[2].payload != std::vector<std::uint8_t>(100, 2) ||
+        page.messages[0].sender != "frank") {
+      FAIL();
+    }
+    const auto erin = queue.DrainPrivate("erin");
+    if (erin.size() != 8u) {
+      FAIL();
+    }
+    for (std::uint8_t i = 0; i < 8; ++i) {
+      if (erin[i].payload != std::vector<std::uint8_t>(100, i)) {
+        FAIL();
+      }
+    }
+    const auto gina = queue.Drain("gina");
+    if (gina.size() != 12u || gina[0] != std::vector<std::uint8_t>(100, 0) ||
+        gina[11] != std::vector<std::uint8_t>(100, 11)) {
+      FAIL();
+    }
+    stats = queue.GetStats();
+    if (stats.messages != 0u || stats.resident_bytes != 0u ||
+        stats.spilled_bytes != 0u || stats.restore_count == 0) {
+      FAIL();
+    }
+    std::error_code ec;
+    if (!std::filesystem::is_empty(dir, ec)) {
+      FAIL();
+    }
+  }
+
+  {
+    // Past the total cap the largest queue is spilled, not the small one
+    // that happened to push it over.
+    const auto dir = TempDir("mi_e2ee_offline_queue_spill_largest");
+    mi::server::OfflineQueueLimits limits;
+    limits.max_resident_bytes = 1000;
+    limits.spill_dir = dir;
+    mi::server::OfflineQueue queue(std::chrono::hours(1), limits);
+    for (std::uint8_t i = 0; i < 10; ++i) {
+      queue.Enqueue("hank", std::vector<std::uint8_t>(100, i));
+    }
+    queue.Enqueue("ivy", std::vector<std::uint8_t>(100, 0xAB));
+    auto stats = queue.GetStats();
+    if (stats.resident_bytes > 1000u || stats.spilled_messages == 0) {
+      FAIL();
+    }
+    const auto restored = stats.restore_count;
+    const auto ivy = queue.Drain("ivy");
+    if (ivy.size() != 1u || ivy[0] != std::vector<std::uint8_t>(100, 0xAB) ||
+        queue.GetStats().restore_count != restored) {
+      FAIL();
+    }
+    const auto hank = queue.Drain("hank");
+    if (hank.size() != 10u || hank[9] != std::vector<std::uint8_t>(100, 9)) {
+      FAIL();
+    }
+  }
+
+  {
+    // Acked spilled records leave dead bytes; the next spill rewrites a
+    // mostly dead file with only the live ones.
+    const auto dir = TempDir("mi_e2ee_offline_queue_spill_compact");
+    mi::server::OfflineQueueLimits limits;
+    limits.max_recipient_resident_bytes = 4000;
+    limits.spill_dir = dir;
+    mi::server::OfflineQueue queue(std::chrono::hours(1), limits);
+    for (std::uint8_t i = 0; i < 100; ++i) {
+      queue.EnqueuePrivate("kim", "lee", std::vector<std::uint8_t>(1000, i));
+    }
+    const auto spill_bytes = [&dir] {
+      std::uintmax_t total = 0;
+      std::error_code ec;
+      for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        total += entry.file_size(ec);
+      }
+      return total;
+    };
+    if (spill_bytes() < 90000u) {
+      FAIL();
+    }
+    mi::server::OfflinePageRequest req;
+    req.max_messages = 90;
+    auto page =
+        queue.FetchPage("kim", mi::server::QueueMessageKind::kPrivate, req);
+    if (page.messages.size() != 90u) {
+      FAIL();
+    }
+    req.ack_cursor = page.cursor;
+    req.max_messages = 1;
+    page = queue.FetchPage("kim", mi::server::QueueMessageKind::kPrivate, req);
+    if (page.messages.size() != 1u ||
+        page.messages[0].payload != std::vector<std::uint8_t>(1000, 90)) {
+      FAIL();
+    }
+    queue.EnqueuePrivate("kim", "lee", std::vector<std::uint8_t>(1000, 100));
+    if (spill_bytes() > 20000u) {
+      FAIL();
+    }
+    const auto kim = queue.DrainPrivate("kim");
+    if (kim.size() != 11u) {
+      FAIL();
+    }
+    for (std::size_t i = 0; i < kim.size(); ++i) {
+      if (kim[i].payload !=
+          std::vector<std::uint8_t>(1000, static_cast<std::uint8_t>(90 + i))) {
+        FAIL();
+      }
+    }
+    std::error_code ec;
+    if (!std::filesystem::is_empty(dir, ec)) {
+      FAIL();
+    }
+  }
+
   return 0;
 }
@@ -95,6 +95,31 @@ int main() {
     return 1;
   }
 
+  // Paged pulls keep messages queued until the cursor is acked.
+  for (std::uint8_t i = 0; i < 3; ++i) {
+    if (!api.SendPrivate(bob.token, "alice", {i}).success) {
+      return 1;
+    }
+  }
+  mi::server::OfflinePageRequest page;
+  page.max_messages = 2;
+  const auto page1 = api.PullPrivate(alice.token, page);
+  if (!page1.success || !page1.paged || !page1.has_more ||
+      page1.messages.size() != 2 || page1.messages[0].payload[0] != 0) {
+    return 1;
+  }
+  page.ack_cursor = page1.cursor;
+  const auto page2 = api.PullPrivate(alice.token, page);
+  if (!page2.success || page2.has_more || page2.messages.size() != 1 ||
+      page2.messages[0].payload[0] != 2) {
+    return 1;
+  }
+  page.ack_cursor = page2.cursor;
+  const auto page3 = api.PullPrivate(alice.token, page);
+  if (!page3.success || !page3.messages.empty() || page3.has_more) {
+    return 1;
+  }
+
   // Private send must require friend relationship.
   const auto private_denied = api.SendPrivate(charlie.token, "alice", {1});
   if (private_denied.success) {
@@ -8,6 +8,7 @@
 #include "group_call_manager.h"
 #include "protocol.h"
 #include "group_directory.h"
+#include "offline_storage.h"
 #include "session_manager.h"
 
 using mi::server::ApiService;
@@ -21,7 +22,9 @@ using mi::server::GroupCallManager;
 using mi::server::GroupDirectory;
 using mi::server::GroupManager;
 using mi::server::LoginRequest;
+using mi::server::OfflineQueue;
 using mi::server::SessionManager;
+using mi::server::proto::ReadBytes;
 using mi::server::proto::ReadString;
 using mi::server::proto::ReadUint32;
 using mi::server::proto::WriteString;
@@ -64,7 +67,8 @@ int main() {
   GroupManager groups;
   GroupCallManager calls;
   GroupDirectory dir;
-  ApiService api(&sessions, &groups, &calls, &dir);
+  OfflineQueue queue;
+  ApiService api(&sessions, &groups, &calls, &dir, nullptr, &queue);
   FrameRouter router(&api);
 
   Frame login = MakeLoginFrame("bob", "pwd");
@@ -110,6 +114,28 @@ int main() {
     return 1;
   }
 
+  // Legacy pulls ignored trailing bytes; one that is not a page request
+  // still drains the queue, with no page trailer in the reply.
+  queue.Enqueue("bob", {7, 8, 9});
+  Frame pull;
+  pull.type = FrameType::kOfflinePull;
+  pull.payload = {0xAA, 0xBB, 0xCC};
+  Frame pull_resp;
+  ok = router.Handle(pull, pull_resp, token,
+                     mi::server::TransportKind::kLocal);
+  if (!ok || pull_resp.payload.empty() || pull_resp.payload[0] != 1) {
+    return 1;
+  }
+  off = 1;
+  std::uint32_t count = 0;
+  std::vector<std::uint8_t> pulled;
+  if (!ReadUint32(pull_resp.payload, off, count) || count != 1 ||
+      !ReadBytes(pull_resp.payload, off, pulled) ||
+      pulled != std::vector<std::uint8_t>({7, 8, 9}) ||
+      off != pull_resp.payload.size()) {
+    return 1;
+  }
+
   Frame logout;
   logout.type = FrameType::kLogout;
   Frame logout_resp;
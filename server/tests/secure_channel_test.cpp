@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <string>
@@ -85,5 +86,49 @@ int main() {
     assert(dec == msg);
   }
 
+  // Incremental decryption matches Decrypt for any split of the input.
+  {
+    std::vector<std::uint8_t> msg(70000);
+    for (std::size_t i = 0; i < msg.size(); ++i) {
+      msg[i] = static_cast<std::uint8_t>(i * 7u);
+    }
+    std::vector<std::uint8_t> enc;
+    ok = client.Encrypt(1000, FrameType::kE2eeFileUploadChunk, msg, enc);
+    assert(ok);
+    const std::size_t cipher_len = enc.size() - 8 - 16;
+    const std::size_t steps[] = {1, 63, 64, 65, 4096, 70000};
+    for (const std::size_t step : steps) {
+      SecureChannel rx(keys, SecureChannelRole::kServer);
+      SecureChannel::DecryptStream stream;
+      ok = rx.BeginDecrypt(enc.data(), cipher_len,
+                           FrameType::kE2eeFileUploadChunk, stream);
+      assert(ok);
+      std::vector<std::uint8_t> dec(cipher_len);
+      for (std::size_t pos = 0; pos < cipher_len;) {
+        const std::size_t n = std::min(step, cipher_len - pos);
+        ok = stream.Update(enc.data() + 8 + pos, n, dec.data() + pos);
+        assert(ok);
+        pos += n;
+      }
+      assert(dec == msg);
+      ok = rx.FinishDecrypt(stream, enc.data() + 8 + cipher_len);
+      assert(ok);
+      // The sequence is now consumed.
+      SecureChannel::DecryptStream again;
+      ok = rx.BeginDecrypt(enc.data(), cipher_len,
+                           FrameType::kE2eeFileUploadChunk, again);
+      assert(!ok);
+    }
+    SecureChannel rx(keys, SecureChannelRole::kServer);
+    SecureChannel::DecryptStream stream;
+    ok = rx.BeginDecrypt(enc.data(), cipher_len, FrameType::kMessage, stream);
+    assert(ok);
+    std::vector<std::uint8_t> dec(cipher_len);
+    ok = stream.Update(enc.data() + 8, cipher_len, dec.data());
+    assert(ok);
+    ok = rx.FinishDecrypt(stream, enc.data() + 8 + cipher_len);
+    assert(!ok);  // frame type is authenticated
+  }
+
   return 0;
 }
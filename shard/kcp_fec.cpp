@@ -0,0 +1,557 @@
+#include "kcp_fec.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#include <tmmintrin.h>
+#define MI_FEC_SSSE3 1
+#define MI_FEC_SSSE3_TARGET __attribute__((target("ssse3")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <tmmintrin.h>
+#define MI_FEC_SSSE3 1
+#define MI_FEC_SSSE3_TARGET
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define MI_FEC_NEON 1
+#endif
+
+namespace mi::shard {
+
+namespace {
+
+struct GfTables {
+  std::array<std::uint8_t, 512> exp{};
+  std::array<std::uint8_t, 256> log{};
+
+  GfTables() {
+    // x^8 + x^4 + x^3 + x^2 + 1, generator 2.
+    unsigned x = 1;
+    for (unsigned i = 0; i < 255; ++i) {
+      exp[i] = static_cast<std::uint8_t>(x);
+      log[x] = static_cast<std::uint8_t>(i);
+      x <<= 1;
+      if (x & 0x100) {
+        x ^= 0x11D;
+      }
+    }
+    for (unsigned i = 255; i < exp.size(); ++i) {
+      exp[i] = exp[i - 255];
+    }
+  }
+};
+
+const GfTables& Tables() {
+  static const GfTables tables;
+  return tables;
+}
+
+#ifdef MI_FEC_SSSE3
+bool HasSsse3() {
+#ifdef _MSC_VER
+  int info[4] = {};
+  __cpuid(info, 1);
+  return (info[2] & (1 << 9)) != 0;
+#else
+  return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+// Both halves of every byte index a 16-entry product table: one PSHUFB each.
+MI_FEC_SSSE3_TARGET std::size_t MulAddSsse3(const std::uint8_t* lo,
+                                            const std::uint8_t* hi,
+                                            const std::uint8_t* src,
+                                            std::uint8_t* dst,
+                                            std::size_t len) {
+  const __m128i tlo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo));
+  const __m128i thi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hi));
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  std::size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    const __m128i s =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    const __m128i l = _mm_and_si128(s, mask);
+    const __m128i h = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+    const __m128i p =
+        _mm_xor_si128(_mm_shuffle_epi8(tlo, l), _mm_shuffle_epi8(thi, h));
+    __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+    _mm_storeu_si128(d, _mm_xor_si128(_mm_loadu_si128(d), p));
+  }
+  return i;
+}
+#endif
+
+#ifdef MI_FEC_NEON
+std::size_t MulAddNeon(const std::uint8_t* lo, const std::uint8_t* hi,
+                       const std::uint8_t* src, std::uint8_t* dst,
+                       std::size_t len) {
+  const uint8x16_t tlo = vld1q_u8(lo);
+  const uint8x16_t thi = vld1q_u8(hi);
+  const uint8x16_t mask = vdupq_n_u8(0x0F);
+  std::size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    const uint8x16_t s = vld1q_u8(src + i);
+    const uint8x16_t p = veorq_u8(vqtbl1q_u8(tlo, vandq_u8(s, mask)),
+                                  vqtbl1q_u8(thi, vshrq_n_u8(s, 4)));
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
+  }
+  return i;
+}
+#endif
+
+std::uint16_t ReadLe16(const std::uint8_t* in) {
+  return static_cast<std::uint16_t>(in[0] | (in[1] << 8));
+}
+
+std::uint32_t ReadLe32(const std::uint8_t* in) {
+  return static_cast<std::uint32_t>(in[0]) |
+         (static_cast<std::uint32_t>(in[1]) << 8) |
+         (static_cast<std::uint32_t>(in[2]) << 16) |
+         (static_cast<std::uint32_t>(in[3]) << 24);
+}
+
+void WriteLe16(std::uint16_t v, std::uint8_t* out) {
+  out[0] = static_cast<std::uint8_t>(v & 0xFF);
+  out[1] = static_cast<std::uint8_t>(v >> 8);
+}
+
+void WriteLe32(std::uint32_t v, std::uint8_t* out) {
+  out[0] = static_cast<std::uint8_t>(v & 0xFF);
+  out[1] = static_cast<std::uint8_t>((v >> 8) & 0xFF);
+  out[2] = static_cast<std::uint8_t>((v >> 16) & 0xFF);
+  out[3] = static_cast<std::uint8_t>((v >> 24) & 0xFF);
+}
+
+// Parity row |p|, data column |j| of the Cauchy matrix 1 / (x_p + y_j) with
+// x_p = data + p and y_j = j, all distinct.
+std::uint8_t CauchyCoef(std::size_t data, std::size_t p, std::size_t j) {
+  return gf256::Inv(static_cast<std::uint8_t>((data + p) ^ j));
+}
+
+// Gauss-Jordan over GF(256); |m| is n x n, row-major.
+bool InvertMatrix(std::vector<std::uint8_t>& m, std::size_t n,
+                  std::vector<std::uint8_t>& inv) {
+  inv.assign(n * n, 0);
+  for (std::size_t i = 0; i < n; ++i) {
+    inv[i * n + i] = 1;
+  }
+  for (std::size_t col = 0; col < n; ++col) {
+    std::size_t pivot = col;
+    while (pivot < n && m[pivot * n + col] == 0) {
+      ++pivot;
+    }
+    if (pivot == n) {
+      return false;
+    }
+    if (pivot != col) {
+      for (std::size_t k = 0; k < n; ++k) {
+        std::swap(m[pivot * n + k], m[col * n + k]);
+        std::swap(inv[pivot * n + k], inv[col * n + k]);
+      }
+    }
+    const std::uint8_t scale = gf256::Inv(m[col * n + col]);
+    for (std::size_t k = 0; k < n; ++k) {
+      m[col * n + k] = gf256::Mul(m[col * n + k], scale);
+      inv[col * n + k] = gf256::Mul(inv[col * n + k], scale);
+    }
+    for (std::size_t row = 0; row < n; ++row) {
+      const std::uint8_t f = m[row * n + col];
+      if (row == col || f == 0) {
+        continue;
+      }
+      for (std::size_t k = 0; k < n; ++k) {
+        m[row * n + k] ^= gf256::Mul(f, m[col * n + k]);
+        inv[row * n + k] ^= gf256::Mul(f, inv[col * n + k]);
+      }
+    }
+  }
+  return true;
+}
+
+constexpr std::size_t kFecSlots = kFecMaxDataShards + kFecMaxParityShards;
+// Sequence numbers per receive-loss sample.
+constexpr std::uint32_t kLossWindow = 64;
+
+}  // namespace
+
+namespace gf256 {
+
+std::uint8_t Mul(std::uint8_t a, std::uint8_t b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  const GfTables& t = Tables();
+  return t.exp[static_cast<std::size_t>(t.log[a]) + t.log[b]];
+}
+
+std::uint8_t Inv(std::uint8_t a) {
+  if (a == 0) {
+    return 0;
+  }
+  const GfTables& t = Tables();
+  return t.exp[255 - t.log[a]];
+}
+
+void MulAddRegion(std::uint8_t c, const std::uint8_t* src, std::uint8_t* dst,
+                  std::size_t len) {
+  if (c == 0 || len == 0) {
+    return;
+  }
+  std::uint8_t lo[16];
+  std::uint8_t hi[16];
+  for (std::uint8_t i = 0; i < 16; ++i) {
+    lo[i] = Mul(c, i);
+    hi[i] = Mul(c, static_cast<std::uint8_t>(i << 4));
+  }
+  std::size_t i = 0;
+#ifdef MI_FEC_SSSE3
+  static const bool kSsse3 = HasSsse3();
+  if (kSsse3) {
+    i = MulAddSsse3(lo, hi, src, dst, len);
+  }
+#elif defined(MI_FEC_NEON)
+  i = MulAddNeon(lo, hi, src, dst, len);
+#endif
+  for (; i < len; ++i) {
+    dst[i] ^= static_cast<std::uint8_t>(lo[src[i] & 0x0F] ^ hi[src[i] >> 4]);
+  }
+}
+
+}  // namespace gf256
+
+void RsEncode(std::size_t data, std::size_t parity,
+              const std::vector<const std::uint8_t*>& data_shards,
+              const std::vector<std::uint8_t*>& parity_shards,
+              std::size_t len) {
+  for (std::size_t p = 0; p < parity; ++p) {
+    std::memset(parity_shards[p], 0, len);
+    for (std::size_t j = 0; j < data; ++j) {
+      gf256::MulAddRegion(CauchyCoef(data, p, j), data_shards[j],
+                          parity_shards[p], len);
+    }
+  }
+}
+
+bool RsReconstruct(std::size_t data, std::size_t parity,
+                   std::vector<std::vector<std::uint8_t>>& shards,
+                   std::vector<bool>& present, std::size_t len) {
+  std::vector<std::size_t> rows;
+  std::vector<std::size_t> missing;
+  for (std::size_t i = 0; i < data + parity && rows.size() < data; ++i) {
+    if (present[i]) {
+      rows.push_back(i);
+    }
+  }
+  for (std::size_t j = 0; j < data; ++j) {
+    if (!present[j]) {
+      missing.push_back(j);
+    }
+  }
+  if (missing.empty()) {
+    return true;
+  }
+  if (rows.size() < data) {
+    return false;
+  }
+  std::vector<std::uint8_t> m(data * data, 0);
+  for (std::size_t r = 0; r < data; ++r) {
+    const std::size_t s = rows[r];
+    for (std::size_t j = 0; j < data; ++j) {
+      m[r * data + j] = s < data ? static_cast<std::uint8_t>(s == j ? 1 : 0)
+                                 : CauchyCoef(data, s - data, j);
+    }
+  }
+  std::vector<std::uint8_t> inv;
+  if (!InvertMatrix(m, data, inv)) {
+    return false;
+  }
+  for (const std::size_t j : missing) {
+    std::vector<std::uint8_t> out(len, 0);
+    for (std::size_t r = 0; r < data; ++r) {
+      gf256::MulAddRegion(inv[j * data + r], shards[rows[r]].data(),
+                          out.data(), len);
+    }
+    shards[j] = std::move(out);
+    present[j] = true;
+  }
+  return true;
+}
+
+std::uint32_t FecParityForLoss(std::uint32_t data, std::uint32_t max_parity,
+                               double loss) {
+  if (loss <= 0.0) {
+    return 0;
+  }
+  loss = std::min(loss, 0.99);
+  for (std::uint32_t m = 0; m < max_parity; ++m) {
+    // P(at most m of the data + m shards lost).
+    const std::uint32_t n = data + m;
+    double ok = 0.0;
+    double binom = 1.0;
+    for (std::uint32_t i = 0; i <= m; ++i) {
+      ok += binom * std::pow(loss, i) * std::pow(1.0 - loss, n - i);
+      binom = binom * (n - i) / (i + 1);
+    }
+    if (1.0 - ok <= 0.01) {
+      return m;
+    }
+  }
+  return max_parity;
+}
+
+KcpFec::KcpFec(std::uint32_t conv, const FecConfig& config, Callback output,
+               Callback input, void* user)
+    : conv_(conv),
+      config_(config),
+      output_(output),
+      input_(input),
+      user_(user) {
+  config_.data_shards = std::max<std::uint32_t>(
+      1, std::min<std::uint32_t>(config_.data_shards, kFecMaxDataShards));
+  config_.parity_shards =
+      std::min<std::uint32_t>(config_.parity_shards, kFecMaxParityShards);
+  pending_.resize(config_.data_shards);
+  for (auto& group : groups_) {
+    group.shards.resize(kFecSlots);
+    group.present.assign(kFecSlots, false);
+  }
+}
+
+std::uint32_t KcpFec::parity_shards() const {
+  if (!config_.adaptive || !peer_loss_known_) {
+    return config_.parity_shards;
+  }
+  return FecParityForLoss(config_.data_shards, config_.parity_shards,
+                          peer_loss_);
+}
+
+void KcpFec::WriteHeader(std::uint8_t type, std::uint8_t index,
+                         std::uint8_t data, std::uint8_t parity,
+                         std::uint8_t* out) {
+  WriteLe32(conv_, out);
+  out[4] = kFecMarker;
+  out[5] = type;
+  out[6] = loss_known_ ? static_cast<std::uint8_t>(std::min<long>(
+                            std::lround(loss_ * 255.0), kFecLossUnknown - 1))
+                      : kFecLossUnknown;
+  out[7] = index;
+  WriteLe32(group_id_, out + 8);
+  out[12] = data;
+  out[13] = parity;
+  WriteLe16(seq_++, out + 14);
+}
+
+void KcpFec::Send(const std::uint8_t* data, std::size_t len,
+                  std::uint32_t now_ms) {
+  if (!data || len == 0 || len > 0xFFFF) {
+    return;
+  }
+  if (count_ == 0) {
+    group_start_ms_ = now_ms;
+  }
+  packet_.resize(kFecOverhead + len);
+  WriteHeader(kFecTypeData, static_cast<std::uint8_t>(count_), 0, 0,
+              packet_.data());
+  WriteLe16(static_cast<std::uint16_t>(len), packet_.data() + kFecHeaderBytes);
+  std::memcpy(packet_.data() + kFecOverhead, data, len);
+  output_(packet_.data(), packet_.size(), user_);
+  stats_.data_sent++;
+
+  pending_[count_].assign(packet_.begin() + kFecHeaderBytes, packet_.end());
+  max_len_ = std::max(max_len_, pending_[count_].size());
+  if (++count_ >= config_.data_shards) {
+    CloseGroup();
+  }
+}
+
+void KcpFec::Poll(std::uint32_t now_ms) {
+  if (count_ > 0 && static_cast<std::int32_t>(now_ms - deadline()) >= 0) {
+    CloseGroup();
+  }
+}
+
+void KcpFec::CloseGroup() {
+  const std::uint32_t parity =
+      config_.adaptive && peer_loss_known_
+          ? FecParityForLoss(count_, config_.parity_shards, peer_loss_)
+          : config_.parity_shards;
+  if (parity > 0) {
+    std::vector<const std::uint8_t*> data_ptrs(count_);
+    for (std::uint32_t i = 0; i < count_; ++i) {
+      pending_[i].resize(max_len_, 0);
+      data_ptrs[i] = pending_[i].data();
+    }
+    std::vector<std::vector<std::uint8_t>> parity_bufs(
+        parity, std::vector<std::uint8_t>(max_len_));
+    std::vector<std::uint8_t*> parity_ptrs(parity);
+    for (std::uint32_t p = 0; p < parity; ++p) {
+      parity_ptrs[p] = parity_bufs[p].data();
+    }
+    RsEncode(count_, parity, data_ptrs, parity_ptrs, max_len_);
+    for (std::uint32_t p = 0; p < parity; ++p) {
+      packet_.resize(kFecHeaderBytes + max_len_);
+      WriteHeader(kFecTypeParity, static_cast<std::uint8_t>(count_ + p),
+                  static_cast<std::uint8_t>(count_),
+                  static_cast<std::uint8_t>(parity), packet_.data());
+      std::memcpy(packet_.data() + kFecHeaderBytes, parity_bufs[p].data(),
+                  max_len_);
+      output_(packet_.data(), packet_.size(), user_);
+      stats_.parity_sent++;
+    }
+  }
+  ++group_id_;
+  count_ = 0;
+  max_len_ = 0;
+}
+
+void KcpFec::TrackSeq(std::uint16_t seq) {
+  if (!seq_started_) {
+    seq_started_ = true;
+    seq_high_ = seq;
+    window_start_ = seq;
+    window_received_ = 1;
+    return;
+  }
+  if (static_cast<std::int16_t>(seq - seq_high_) > 0) {
+    seq_high_ = seq;
+  }
+  ++window_received_;
+  const std::uint32_t span =
+      static_cast<std::uint16_t>(seq_high_ - window_start_) + 1u;
+  if (span < kLossWindow) {
+    return;
+  }
+  const double sample =
+      std::max(0.0, 1.0 - static_cast<double>(window_received_) / span);
+  loss_ = loss_known_ ? loss_ * 0.75 + sample * 0.25 : sample;
+  loss_known_ = true;
+  window_start_ = static_cast<std::uint16_t>(seq_high_ + 1);
+  window_received_ = 0;
+}
+
+bool KcpFec::Receive(const std::uint8_t* data, std::size_t len) {
+  if (!data || len < kFecHeaderBytes || data[4] != kFecMarker ||
+      ReadLe32(data) != conv_) {
+    return false;
+  }
+  const std::uint8_t type = data[5];
+  if (type != kFecTypeData && type != kFecTypeParity) {
+    return true;
+  }
+  if (data[6] != kFecLossUnknown) {
+    peer_loss_ = data[6] / 255.0;
+    peer_loss_known_ = true;
+  }
+  const std::uint8_t index = data[7];
+  const std::uint32_t group_id = ReadLe32(data + 8);
+  const std::uint8_t k = data[12];
+  const std::uint8_t m = data[13];
+  TrackSeq(ReadLe16(data + 14));
+
+  const std::uint8_t* payload = data + kFecHeaderBytes;
+  const std::size_t payload_len = len - kFecHeaderBytes;
+  if (type == kFecTypeData) {
+    if (payload_len < 2) {
+      return true;
+    }
+    const std::size_t inner = ReadLe16(payload);
+    if (inner == 0 || inner > payload_len - 2) {
+      return true;
+    }
+    input_(payload + 2, inner, user_);
+  }
+
+  Group& group = groups_[group_id % groups_.size()];
+  if (!group.used || group.id != group_id) {
+    if (group.used && static_cast<std::int32_t>(group_id - group.id) < 0) {
+      return true;  // too old to repair
+    }
+    group.id = group_id;
+    group.used = true;
+    group.done = false;
+    group.data = 0;
+    group.parity = 0;
+    group.len = 0;
+    std::fill(group.present.begin(), group.present.end(), false);
+  }
+  if (group.done) {
+    return true;
+  }
+  if (type == kFecTypeData) {
+    if (index >= kFecMaxDataShards) {
+      return true;
+    }
+    const std::size_t shard_len = 2 + ReadLe16(payload);
+    group.shards[index].assign(payload, payload + shard_len);
+    group.present[index] = true;
+  } else {
+    if (k == 0 || k > kFecMaxDataShards || m == 0 ||
+        m > kFecMaxParityShards || index < k || index >= k + m ||
+        (group.data != 0 && (group.data != k || group.len != payload_len))) {
+      return true;
+    }
+    group.data = k;
+    group.parity = m;
+    group.len = payload_len;
+    group.shards[index].assign(payload, payload + payload_len);
+    group.present[index] = true;
+  }
+  TryRecover(group);
+  return true;
+}
+
+void KcpFec::TryRecover(Group& group) {
+  if (group.data == 0) {
+    return;
+  }
+  const std::size_t k = group.data;
+  const std::size_t total = k + group.parity;
+  std::size_t have_data = 0;
+  std::size_t have = 0;
+  for (std::size_t i = 0; i < total; ++i) {
+    if (group.present[i]) {
+      ++have;
+      have_data += i < k ? 1 : 0;
+    }
+  }
+  if (have_data == k) {
+    group.done = true;
+    return;
+  }
+  if (have < k) {
+    return;
+  }
+  std::array<bool, kFecMaxDataShards> missing{};
+  for (std::size_t i = 0; i < k; ++i) {
+    missing[i] = !group.present[i];
+    if (group.present[i]) {
+      if (group.shards[i].size() > group.len) {
+        group.done = true;  // inconsistent with the parity: give up
+        return;
+      }
+      group.shards[i].resize(group.len, 0);
+    }
+  }
+  group.done = true;
+  if (!RsReconstruct(k, group.parity, group.shards, group.present,
+                     group.len)) {
+    return;
+  }
+  for (std::size_t i = 0; i < k; ++i) {
+    if (!missing[i]) {
+      continue;
+    }
+    const std::vector<std::uint8_t>& shard = group.shards[i];
+    const std::size_t inner = ReadLe16(shard.data());
+    if (inner == 0 || inner + 2 > shard.size()) {
+      continue;
+    }
+    input_(shard.data() + 2, inner, user_);
+    stats_.recovered++;
+  }
+}
+
+}  // namespace mi::shard
@@ -0,0 +1,155 @@
+#ifndef MI_E2EE_SHARD_KCP_FEC_H
+#define MI_E2EE_SHARD_KCP_FEC_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mi::shard {
+
+// Forward error correction between KCP and the UDP socket. Every KCP
+// datagram still goes out as is (a data shard, behind a small header) and
+// every group of data shards is followed by Reed-Solomon parity, so a lost
+// datagram can be rebuilt without waiting a retransmit timeout.
+//
+// Wire format, little-endian, conv first so peers route it like KCP:
+//   conv u32 | 0xFE | type u8 | loss u8 | index u8 | group u32 |
+//   data_shards u8 | parity_shards u8 | seq u16 | payload
+// Data payload is len u16 + the KCP datagram; parity covers the data
+// payloads zero-padded to the longest. |loss| is what the sender sees on
+// the reverse path (1/255 units, 255 = no estimate yet); it drives the
+// peer's adaptive parity.
+constexpr std::uint8_t kFecMarker = 0xFE;
+constexpr std::uint8_t kFecTypeData = 1;
+constexpr std::uint8_t kFecTypeParity = 2;
+constexpr std::size_t kFecHeaderBytes = 16;
+// MTU to take off KCP when a session uses FEC.
+constexpr std::size_t kFecOverhead = kFecHeaderBytes + 2;
+constexpr std::size_t kFecMaxDataShards = 32;
+constexpr std::size_t kFecMaxParityShards = 16;
+constexpr std::uint8_t kFecLossUnknown = 0xFF;
+
+struct FecConfig {
+  std::uint32_t data_shards{8};
+  // Fixed parity per group, or the ceiling when adaptive.
+  std::uint32_t parity_shards{3};
+  // Pick parity from the loss the peer reports, aiming at under 1% of
+  // groups the code cannot repair.
+  bool adaptive{true};
+  // A partial group is closed (and its parity sent) after this long, so
+  // sparse traffic such as voice is still protected promptly.
+  std::uint32_t max_group_delay_ms{20};
+};
+
+struct FecStats {
+  std::uint64_t data_sent{0};
+  std::uint64_t parity_sent{0};
+  std::uint64_t recovered{0};
+};
+
+namespace gf256 {
+
+std::uint8_t Mul(std::uint8_t a, std::uint8_t b);
+std::uint8_t Inv(std::uint8_t a);
+// dst[i] ^= c * src[i]. Vectorised (SSSE3 / NEON table lookups) where the
+// CPU has it.
+void MulAddRegion(std::uint8_t c, const std::uint8_t* src, std::uint8_t* dst,
+                  std::size_t len);
+
+}  // namespace gf256
+
+// Systematic Reed-Solomon over GF(256) with a Cauchy parity matrix: any
+// |data| of the |data| + |parity| equal-length shards rebuild the rest.
+void RsEncode(std::size_t data, std::size_t parity,
+              const std::vector<const std::uint8_t*>& data_shards,
+              const std::vector<std::uint8_t*>& parity_shards,
+              std::size_t len);
+// |shards| holds data then parity, |present| marks the received ones;
+// missing data shards are rebuilt in place (parity is left alone).
+bool RsReconstruct(std::size_t data, std::size_t parity,
+                   std::vector<std::vector<std::uint8_t>>& shards,
+                   std::vector<bool>& present, std::size_t len);
+
+// Smallest parity count in [0, max_parity] that repairs a group of |data|
+// shards with probability >= 99% under independent loss |loss|.
+std::uint32_t FecParityForLoss(std::uint32_t data, std::uint32_t max_parity,
+                               double loss);
+
+// One session's FEC state, both directions. Like ikcp, it writes through
+// |output| and hands recovered and unwrapped KCP datagrams to |input|.
+class KcpFec {
+ public:
+  using Callback = void (*)(const std::uint8_t* data, std::size_t len,
+                            void* user);
+
+  KcpFec(std::uint32_t conv, const FecConfig& config, Callback output,
+         Callback input, void* user);
+
+  // Wraps one KCP datagram; sends the group's parity when it fills.
+  void Send(const std::uint8_t* data, std::size_t len, std::uint32_t now_ms);
+  // Closes a partial group that has waited max_group_delay_ms.
+  void Poll(std::uint32_t now_ms);
+  bool pending() const { return count_ > 0; }
+  std::uint32_t deadline() const {
+    return group_start_ms_ + config_.max_group_delay_ms;
+  }
+
+  // Returns false if |data| is not an FEC packet of this session.
+  bool Receive(const std::uint8_t* data, std::size_t len);
+
+  // Receive-side loss estimate and the peer's report, 0..1.
+  double loss() const { return loss_; }
+  double peer_loss() const { return peer_loss_; }
+  std::uint32_t parity_shards() const;
+  const FecStats& stats() const { return stats_; }
+
+ private:
+  struct Group {
+    std::uint32_t id{0};
+    bool used{false};
+    bool done{false};
+    std::uint8_t data{0};  // 0 until a parity packet says
+    std::uint8_t parity{0};
+    std::size_t len{0};
+    std::vector<std::vector<std::uint8_t>> shards;
+    std::vector<bool> present;
+  };
+
+  void CloseGroup();
+  void WriteHeader(std::uint8_t type, std::uint8_t index, std::uint8_t data,
+                   std::uint8_t parity, std::uint8_t* out);
+  void TrackSeq(std::uint16_t seq);
+  void TryRecover(Group& group);
+
+  std::uint32_t conv_;
+  FecConfig config_;
+  Callback output_;
+  Callback input_;
+  void* user_;
+
+  // Send side.
+  std::uint32_t group_id_{0};
+  std::uint32_t count_{0};
+  std::uint32_t group_start_ms_{0};
+  std::uint16_t seq_{0};
+  std::size_t max_len_{0};
+  std::vector<std::vector<std::uint8_t>> pending_;
+  std::vector<std::uint8_t> packet_;
+
+  // Receive side.
+  std::array<Group, 16> groups_{};
+  bool seq_started_{false};
+  std::uint16_t seq_high_{0};
+  std::uint16_t window_start_{0};
+  std::uint32_t window_received_{0};
+  bool loss_known_{false};
+  double loss_{0.0};
+  double peer_loss_{0.0};
+  bool peer_loss_known_{false};
+  FecStats stats_{};
+};
+
+}  // namespace mi::shard
+
+#endif  // MI_E2EE_SHARD_KCP_FEC_H
@@ -12,6 +12,8 @@ constexpr std::uint8_t kMediaFrameVersion = 1;
 enum class StreamKind : std::uint8_t {
   kAudio = 1,
   kVideo = 2,
+  // Receiver congestion feedback for the sender's bandwidth estimator.
+  kFeedback = 3,
 };
 
 enum MediaFrameFlags : std::uint8_t {
@@ -19,6 +21,12 @@ enum MediaFrameFlags : std::uint8_t {
   kFrameEnd = 0x02,
 };
 
+// Cleartext simulcast tag of v4 media packets, so relays can pick a layer
+// without seeing the encrypted frame.
+constexpr std::uint8_t kMediaLayerMask = 0x03;
+constexpr std::uint8_t kMediaLayerKeyframe = 0x80;
+constexpr std::uint8_t kMediaMaxLayers = 3;
+
 struct MediaFrame {
   std::array<std::uint8_t, 16> call_id{};
   StreamKind kind{StreamKind::kAudio};
@@ -236,6 +236,11 @@ struct HealthReport {
   std::uint64_t queue_group_notice{0};
   std::uint64_t storage_files{0};
   std::uint64_t storage_bytes{0};
+  std::uint64_t storage_pending_wipes{0};
+  std::uint64_t storage_pending_wipe_bytes{0};
+  std::uint64_t call_active{0};
+  std::uint64_t call_participants{0};
+  std::uint64_t relay_packets{0};
   std::vector<PerfSample> samples;
 };
 
@@ -295,6 +300,19 @@ bool ParseHealthPayload(const std::vector<std::uint8_t>& payload,
     error = "payload truncated";
     return false;
   }
+  if (out.version >= 5 &&
+      (!ReadU64(payload, offset, out.storage_pending_wipes) ||
+       !ReadU64(payload, offset, out.storage_pending_wipe_bytes))) {
+    error = "payload truncated";
+    return false;
+  }
+  if (out.version >= 4 &&
+      (!ReadU64(payload, offset, out.call_active) ||
+       !ReadU64(payload, offset, out.call_participants) ||
+       !ReadU64(payload, offset, out.relay_packets))) {
+    error = "payload truncated";
+    return false;
+  }
   std::uint32_t sample_count = 0;
   if (!mi::server::proto::ReadUint32(payload, offset, sample_count)) {
     error = "missing samples";
@@ -409,7 +427,12 @@ void PrintReport(const HealthReport& report, std::size_t width) {
             << report.queue_device_sync << ", group_notice "
             << report.queue_group_notice << "\n";
   std::cout << "storage: files " << report.storage_files << ", bytes "
-            << FormatBytes(report.storage_bytes) << "\n";
+            << FormatBytes(report.storage_bytes) << ", pending_wipes "
+            << report.storage_pending_wipes << " ("
+            << FormatBytes(report.storage_pending_wipe_bytes) << ")\n";
+  std::cout << "calls: active " << report.call_active << ", participants "
+            << report.call_participants << ", relay_packets "
+            << report.relay_packets << "\n";
 
   if (report.samples.empty()) {
     std::cout << "perf: no samples\n";
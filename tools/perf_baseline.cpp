@@ -1,11 +1,16 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <filesystem>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "../server/include/frame.h"
+#include "../server/include/media_relay.h"
 #include "../server/include/offline_storage.h"
 
 namespace {
@@ -14,8 +19,12 @@ struct BenchConfig {
   bool quick{false};
   std::size_t frame_payload{1024};
   std::size_t offline_bytes{8u * 1024u * 1024u};
+  std::size_t blob_bytes{64u * 1024u * 1024u};
+  std::uint32_t blob_chunk{1024u * 1024u};
+  std::uint32_t layout_files{1000000};
   std::uint32_t frame_iters{60000};
   std::uint32_t decode_iters{60000};
+  std::uint32_t relay_packets{200000};
 };
 
 struct Metric {
@@ -158,6 +167,235 @@ bool BenchOfflineStorage(const BenchConfig& cfg,
   return true;
 }
 
+bool BenchBlobChunked(const BenchConfig& cfg,
+                      Metric& upload_mbps,
+                      Metric& download_mbps,
+                      std::string& error) {
+  error.clear();
+  const auto base =
+      std::filesystem::temp_directory_path() / "mi_e2ee_perf_blob";
+  std::error_code ec;
+  std::filesystem::remove_all(base, ec);
+  std::filesystem::create_directories(base, ec);
+  if (ec) {
+    error = "blob temp dir failed";
+    return false;
+  }
+
+  mi::server::OfflineStorage storage(base, std::chrono::seconds(60));
+  std::vector<std::uint8_t> chunk(cfg.blob_chunk, 0x3C);
+
+  const auto start_up = std::chrono::steady_clock::now();
+  auto begin = storage.BeginBlobUpload("bench", cfg.blob_bytes);
+  if (!begin.success) {
+    error = begin.error.empty() ? "blob upload start failed" : begin.error;
+    return false;
+  }
+  std::uint64_t offset = 0;
+  while (offset < cfg.blob_bytes) {
+    const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(
+        cfg.blob_bytes - offset, cfg.blob_chunk));
+    chunk.resize(n);
+    auto appended = storage.AppendBlobUploadChunk(
+        "bench", begin.file_id, begin.upload_id, offset, chunk);
+    if (!appended.success) {
+      error = appended.error.empty() ? "blob upload chunk failed"
+                                     : appended.error;
+      return false;
+    }
+    offset = appended.bytes_received;
+  }
+  auto finished = storage.FinishBlobUpload("bench", begin.file_id,
+                                           begin.upload_id, cfg.blob_bytes);
+  const auto end_up = std::chrono::steady_clock::now();
+  if (!finished.success) {
+    error = finished.error.empty() ? "blob upload finish failed"
+                                   : finished.error;
+    return false;
+  }
+
+  const auto start_down = std::chrono::steady_clock::now();
+  auto dl = storage.BeginBlobDownload("bench", begin.file_id, true);
+  if (!dl.success) {
+    error = dl.error.empty() ? "blob download start failed" : dl.error;
+    return false;
+  }
+  std::uint64_t read = 0;
+  std::uint64_t checksum = 0;
+  bool eof = false;
+  while (!eof) {
+    auto got = storage.ReadBlobDownloadChunk("bench", begin.file_id,
+                                             dl.download_id, read,
+                                             cfg.blob_chunk);
+    if (!got.success || got.chunk.empty()) {
+      error = got.error.empty() ? "blob download chunk failed" : got.error;
+      return false;
+    }
+    checksum += got.chunk[0];
+    read += got.chunk.size();
+    eof = got.eof;
+  }
+  const auto end_down = std::chrono::steady_clock::now();
+  if (read != cfg.blob_bytes || checksum == 0) {
+    error = "blob download size mismatch";
+    return false;
+  }
+
+  const double up_sec = ElapsedSeconds(start_up, end_up);
+  const double down_sec = ElapsedSeconds(start_down, end_down);
+  if (up_sec <= 0.0 || down_sec <= 0.0) {
+    error = "blob timing invalid";
+    return false;
+  }
+  upload_mbps = {"blob_chunked_upload_mbps",
+                 (cfg.blob_bytes / (1024.0 * 1024.0)) / up_sec, "MB/s"};
+  download_mbps = {"blob_chunked_download_mbps",
+                   (cfg.blob_bytes / (1024.0 * 1024.0)) / down_sec, "MB/s"};
+
+  std::filesystem::remove_all(base, ec);
+  return true;
+}
+
+// Create/lookup/delete rates for many small stored files, i.e. the cost of
+// the offline_dir layout rather than of the payload I/O.
+bool BenchOfflineLayout(const BenchConfig& cfg,
+                        Metric& create_ops,
+                        Metric& lookup_ops,
+                        Metric& delete_ops,
+                        std::string& error) {
+  error.clear();
+  const auto base =
+      std::filesystem::temp_directory_path() / "mi_e2ee_perf_layout";
+  std::error_code ec;
+  std::filesystem::remove_all(base, ec);
+  std::filesystem::create_directories(base, ec);
+  if (ec) {
+    error = "layout temp dir failed";
+    return false;
+  }
+
+  std::vector<std::string> ids;
+  ids.reserve(cfg.layout_files);
+  {
+    mi::server::SecureDeleteConfig sd;
+    sd.workers = 0;
+    mi::server::OfflineStorage storage(base, std::chrono::hours(1), sd);
+    const std::vector<std::uint8_t> blob(16, 0x6B);
+    const auto sink = [](std::uint64_t, const std::uint8_t*, std::size_t) {
+      return true;
+    };
+
+    const auto start_create = std::chrono::steady_clock::now();
+    for (std::uint32_t i = 0; i < cfg.layout_files; ++i) {
+      auto put = storage.PutBlob("bench", blob);
+      if (!put.success) {
+        error = put.error.empty() ? "layout create failed" : put.error;
+        return false;
+      }
+      ids.push_back(std::move(put.file_id));
+    }
+    const auto end_create = std::chrono::steady_clock::now();
+
+    std::string err;
+    const auto start_lookup = std::chrono::steady_clock::now();
+    for (const auto& id : ids) {
+      if (!storage.FetchBlobStream(id, false, sink, err)) {
+        error = err.empty() ? "layout lookup failed" : err;
+        return false;
+      }
+    }
+    const auto end_lookup = std::chrono::steady_clock::now();
+
+    const auto start_delete = std::chrono::steady_clock::now();
+    for (const auto& id : ids) {
+      if (!storage.FetchBlobStream(id, true, sink, err)) {
+        error = err.empty() ? "layout delete failed" : err;
+        return false;
+      }
+    }
+    const auto end_delete = std::chrono::steady_clock::now();
+
+    const double create_sec = ElapsedSeconds(start_create, end_create);
+    const double lookup_sec = ElapsedSeconds(start_lookup, end_lookup);
+    const double delete_sec = ElapsedSeconds(start_delete, end_delete);
+    if (create_sec <= 0.0 || lookup_sec <= 0.0 || delete_sec <= 0.0) {
+      error = "layout timing invalid";
+      return false;
+    }
+    create_ops = {"layout_create_ops", cfg.layout_files / create_sec, "ops/s"};
+    lookup_ops = {"layout_lookup_ops", cfg.layout_files / lookup_sec, "ops/s"};
+    delete_ops = {"layout_delete_ops", cfg.layout_files / delete_sec, "ops/s"};
+  }
+
+  std::filesystem::remove_all(base, ec);
+  return true;
+}
+
+// One producer fans packets out to |subscribers| queues of the same call while
+// a consumer drains them; the rate counts per-subscriber deliveries.
+bool BenchMediaRelay(const BenchConfig& cfg,
+                     std::size_t subscribers,
+                     Metric& pps,
+                     std::string& error) {
+  error.clear();
+  mi::server::MediaRelay relay(2048, std::chrono::seconds(5));
+  std::array<std::uint8_t, 16> call_id{};
+  call_id[0] = 0x4D;
+  std::vector<std::string> recipients;
+  recipients.reserve(subscribers);
+  for (std::size_t i = 0; i < subscribers; ++i) {
+    recipients.push_back("sub" + std::to_string(i));
+  }
+  mi::server::MediaRelayPacket packet;
+  packet.sender = "bench";
+  packet.payload.assign(1200, 0x5A);
+
+  const std::uint32_t packets =
+      std::max<std::uint32_t>(1, cfg.relay_packets /
+                                     static_cast<std::uint32_t>(subscribers));
+  const std::uint64_t expected =
+      static_cast<std::uint64_t>(packets) * subscribers;
+  std::atomic<bool> produced{false};
+  std::uint64_t delivered = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  std::thread producer([&]() {
+    for (std::uint32_t i = 0; i < packets; ++i) {
+      relay.EnqueueMany(recipients, call_id, packet);
+    }
+    produced.store(true, std::memory_order_release);
+  });
+  std::vector<mi::server::MediaRelayPacketRef> pulled;
+  for (;;) {
+    const bool done = produced.load(std::memory_order_acquire);
+    std::size_t got = 0;
+    for (const auto& r : recipients) {
+      relay.Pull(r, call_id, 256, std::chrono::milliseconds(0), pulled);
+      got += pulled.size();
+    }
+    delivered += got;
+    if (done && got == 0) {
+      break;
+    }
+  }
+  producer.join();
+  const auto end = std::chrono::steady_clock::now();
+
+  const std::uint64_t dropped = relay.GetStats().dropped;
+  if (delivered + dropped != expected) {
+    error = "relay packet count mismatch";
+    return false;
+  }
+  const double sec = ElapsedSeconds(start, end);
+  if (sec <= 0.0) {
+    error = "relay timing invalid";
+    return false;
+  }
+  pps = {"media_relay_" + std::to_string(subscribers) + "_pps",
+         static_cast<double>(delivered) / sec, "pkt/s"};
+  return true;
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -168,12 +406,17 @@ int main(int argc, char** argv) {
       cfg.quick = true;
     } else if (arg == "--payload" && i + 1 < argc) {
       cfg.frame_payload = static_cast<std::size_t>(std::stoul(argv[++i]));
+    } else if (arg == "--layout-files" && i + 1 < argc) {
+      cfg.layout_files = static_cast<std::uint32_t>(std::stoul(argv[++i]));
     }
   }
   if (cfg.quick) {
     cfg.frame_iters = 15000;
     cfg.decode_iters = 15000;
     cfg.offline_bytes = 2u * 1024u * 1024u;
+    cfg.blob_bytes = 16u * 1024u * 1024u;
+    cfg.layout_files = 20000;
+    cfg.relay_packets = 50000;
   }
 
   std::cout << "mi_e2ee perf baseline\n";
@@ -206,5 +449,35 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  Metric blob_up_mbps, blob_down_mbps;
+  if (BenchBlobChunked(cfg, blob_up_mbps, blob_down_mbps, err)) {
+    PrintMetric(blob_up_mbps);
+    PrintMetric(blob_down_mbps);
+  } else {
+    std::cerr << "blob chunked bench failed: " << err << "\n";
+    return 1;
+  }
+
+  Metric layout_create, layout_lookup, layout_delete;
+  if (BenchOfflineLayout(cfg, layout_create, layout_lookup, layout_delete,
+                         err)) {
+    PrintMetric(layout_create);
+    PrintMetric(layout_lookup);
+    PrintMetric(layout_delete);
+  } else {
+    std::cerr << "offline layout bench failed: " << err << "\n";
+    return 1;
+  }
+
+  for (const std::size_t subs : {1u, 10u, 100u}) {
+    Metric relay_pps;
+    if (BenchMediaRelay(cfg, subs, relay_pps, err)) {
+      PrintMetric(relay_pps);
+    } else {
+      std::cerr << "media relay bench failed: " << err << "\n";
+      return 1;
+    }
+  }
+
   return 0;
 }